@@ -0,0 +1,75 @@
+#pragma once
+// ホスト実行用の Adafruit TinyUSB 代替
+// 送信されたレポートは時刻付きで sim::usb_reports() に記録され、
+// ポーリング間隔ごとのホストの IN トークンで送信完了となる
+#include <Arduino.h>
+#include <class/hid/hid.h>
+#include <cstdint>
+
+extern "C" {
+// TinyUSB と同様、ファームウェア側で定義されていればレポート送信完了時に呼ばれる
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint16_t len) __attribute__((weak));
+// ホストが SET_PROTOCOL で設定したプロトコル(HID_PROTOCOL_BOOT/HID_PROTOCOL_REPORT)
+uint8_t tud_hid_get_protocol(void);
+// 有効にすると、1ms のフレームの始まり(SOF)ごとに tud_sof_cb が呼ばれる
+void tud_sof_cb_enable(bool en);
+void tud_sof_cb(uint32_t frame_count) __attribute__((weak));
+}
+
+class Adafruit_USBD_HID {
+ public:
+	typedef uint16_t (*get_report_callback_t)(uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen);
+	typedef void (*set_report_callback_t)(uint8_t report_id,
+	                                      hid_report_type_t report_type,
+	                                      uint8_t const* buffer,
+	                                      uint16_t bufsize);
+
+	Adafruit_USBD_HID() = default;
+
+	void setPollInterval(uint8_t interval_ms) { interval = interval_ms ? interval_ms : 1; }
+	void setBootProtocol(uint8_t protocol) { boot_protocol = protocol; }
+	void enableOutEndpoint(bool enable) { out_endpoint = enable; }
+	void setReportDescriptor(uint8_t const* desc_report, uint16_t len) {
+		desc = desc_report;
+		desc_len = len;
+	}
+	void setReportCallback(get_report_callback_t get_report, set_report_callback_t set_report) {
+		get_report_cb = get_report;
+		set_report_cb = set_report;
+	}
+	bool begin();
+	bool ready();
+	bool sendReport(uint8_t report_id, void const* report, uint8_t len);
+	bool sendReport8(uint8_t report_id, uint8_t num) { return sendReport(report_id, &num, sizeof(num)); }
+	bool sendReport16(uint8_t report_id, uint16_t num) { return sendReport(report_id, &num, sizeof(num)); }
+	bool sendReport32(uint8_t report_id, uint32_t num) { return sendReport(report_id, &num, sizeof(num)); }
+	bool keyboardReport(uint8_t report_id, uint8_t modifier, uint8_t keycode[6]);
+
+	/* シミュレーション用 */
+	uint8_t pollInterval() const { return interval; }
+	uint8_t bootProtocol() const { return boot_protocol; }
+	uint16_t descriptorLength() const { return desc_len; }
+	uint8_t const* descriptor() const { return desc; }
+	get_report_callback_t reportGetter() const { return get_report_cb; }
+	set_report_callback_t reportSetter() const { return set_report_cb; }
+
+ private:
+	uint8_t interval = 1;
+	uint8_t boot_protocol = HID_ITF_PROTOCOL_NONE;
+	bool out_endpoint = true;
+	uint8_t const* desc = nullptr;
+	uint16_t desc_len = 0;
+	get_report_callback_t get_report_cb = nullptr;
+	set_report_callback_t set_report_cb = nullptr;
+};
+
+class Adafruit_USBD_Device {
+ public:
+	bool mounted();
+	bool suspended();
+	bool ready() { return mounted() && !suspended(); }
+	bool remoteWakeup();
+	void task() {}
+};
+
+extern Adafruit_USBD_Device TinyUSBDevice;
@@ -0,0 +1,71 @@
+#pragma once
+// ホスト実行用の Arduino.h 代替
+// millis()/micros()/delay() は sim の仮想時計を参照する
+#include <algorithm>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+inline void
+yield() {}
+
+constexpr inline uint8_t LOW = 0;
+constexpr inline uint8_t HIGH = 1;
+constexpr inline uint8_t INPUT = 0;
+constexpr inline uint8_t OUTPUT = 1;
+
+inline void
+pinMode(uint8_t, uint8_t) {}
+inline void
+digitalWrite(uint8_t, uint8_t) {}
+
+class Print {
+ public:
+	virtual ~Print() = default;
+	virtual size_t write(uint8_t c) = 0;
+	virtual int availableForWrite() { return 0; }
+	size_t write(const uint8_t* buffer, size_t size) {
+		size_t n = 0;
+		while (size--) {
+			n += write(*buffer++);
+		}
+		return n;
+	}
+	size_t print(const char* str) { return write(reinterpret_cast<const uint8_t*>(str), strlen(str)); }
+	size_t println(const char* str) { return print(str) + println(); }
+	size_t println() { return print("\r\n"); }
+	size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3))) {
+		char buf[256];
+		va_list arg;
+		va_start(arg, format);
+		int len = vsnprintf(buf, sizeof(buf), format, arg);
+		va_end(arg);
+		if (len < 0) {
+			return 0;
+		}
+		return write(reinterpret_cast<const uint8_t*>(buf), std::min<size_t>(len, sizeof(buf) - 1));
+	}
+};
+
+class Stream : public Print {
+ public:
+	virtual int available() { return 0; }
+	virtual int read() { return -1; }
+};
+
+class HardwareSerial : public Stream {
+ public:
+	void begin(unsigned long) {}
+	size_t write(uint8_t c) override;
+	int availableForWrite() override { return 32; }
+	operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+extern HardwareSerial Serial1;
@@ -0,0 +1,359 @@
+#pragma once
+// ホスト実行用の TinyUSB class/hid/hid.h 代替
+// ファームウェアが参照する定数・記述子マクロのみを TinyUSB と同じ値で定義する
+#include <cstdint>
+
+typedef enum {
+	HID_REPORT_TYPE_INVALID = 0,
+	HID_REPORT_TYPE_INPUT,
+	HID_REPORT_TYPE_OUTPUT,
+	HID_REPORT_TYPE_FEATURE,
+} hid_report_type_t;
+
+enum {
+	HID_ITF_PROTOCOL_NONE = 0,
+	HID_ITF_PROTOCOL_KEYBOARD = 1,
+	HID_ITF_PROTOCOL_MOUSE = 2,
+};
+
+enum {
+	HID_PROTOCOL_BOOT = 0,
+	HID_PROTOCOL_REPORT = 1,
+};
+
+//--------------------------------------------------------------------+
+// Keyboard usage (HID Usage Tables 1.4, Keyboard/Keypad page 0x07)
+//--------------------------------------------------------------------+
+#define HID_KEY_NONE 0x00
+#define HID_KEY_A 0x04
+#define HID_KEY_B 0x05
+#define HID_KEY_C 0x06
+#define HID_KEY_D 0x07
+#define HID_KEY_E 0x08
+#define HID_KEY_F 0x09
+#define HID_KEY_G 0x0A
+#define HID_KEY_H 0x0B
+#define HID_KEY_I 0x0C
+#define HID_KEY_J 0x0D
+#define HID_KEY_K 0x0E
+#define HID_KEY_L 0x0F
+#define HID_KEY_M 0x10
+#define HID_KEY_N 0x11
+#define HID_KEY_O 0x12
+#define HID_KEY_P 0x13
+#define HID_KEY_Q 0x14
+#define HID_KEY_R 0x15
+#define HID_KEY_S 0x16
+#define HID_KEY_T 0x17
+#define HID_KEY_U 0x18
+#define HID_KEY_V 0x19
+#define HID_KEY_W 0x1A
+#define HID_KEY_X 0x1B
+#define HID_KEY_Y 0x1C
+#define HID_KEY_Z 0x1D
+#define HID_KEY_1 0x1E
+#define HID_KEY_2 0x1F
+#define HID_KEY_3 0x20
+#define HID_KEY_4 0x21
+#define HID_KEY_5 0x22
+#define HID_KEY_6 0x23
+#define HID_KEY_7 0x24
+#define HID_KEY_8 0x25
+#define HID_KEY_9 0x26
+#define HID_KEY_0 0x27
+#define HID_KEY_ENTER 0x28
+#define HID_KEY_ESCAPE 0x29
+#define HID_KEY_BACKSPACE 0x2A
+#define HID_KEY_TAB 0x2B
+#define HID_KEY_SPACE 0x2C
+#define HID_KEY_MINUS 0x2D
+#define HID_KEY_EQUAL 0x2E
+#define HID_KEY_BRACKET_LEFT 0x2F
+#define HID_KEY_BRACKET_RIGHT 0x30
+#define HID_KEY_BACKSLASH 0x31
+#define HID_KEY_EUROPE_1 0x32
+#define HID_KEY_SEMICOLON 0x33
+#define HID_KEY_APOSTROPHE 0x34
+#define HID_KEY_GRAVE 0x35
+#define HID_KEY_COMMA 0x36
+#define HID_KEY_PERIOD 0x37
+#define HID_KEY_SLASH 0x38
+#define HID_KEY_CAPS_LOCK 0x39
+#define HID_KEY_F1 0x3A
+#define HID_KEY_F2 0x3B
+#define HID_KEY_F3 0x3C
+#define HID_KEY_F4 0x3D
+#define HID_KEY_F5 0x3E
+#define HID_KEY_F6 0x3F
+#define HID_KEY_F7 0x40
+#define HID_KEY_F8 0x41
+#define HID_KEY_F9 0x42
+#define HID_KEY_F10 0x43
+#define HID_KEY_F11 0x44
+#define HID_KEY_F12 0x45
+#define HID_KEY_PRINT_SCREEN 0x46
+#define HID_KEY_SCROLL_LOCK 0x47
+#define HID_KEY_PAUSE 0x48
+#define HID_KEY_INSERT 0x49
+#define HID_KEY_HOME 0x4A
+#define HID_KEY_PAGE_UP 0x4B
+#define HID_KEY_DELETE 0x4C
+#define HID_KEY_END 0x4D
+#define HID_KEY_PAGE_DOWN 0x4E
+#define HID_KEY_ARROW_RIGHT 0x4F
+#define HID_KEY_ARROW_LEFT 0x50
+#define HID_KEY_ARROW_DOWN 0x51
+#define HID_KEY_ARROW_UP 0x52
+#define HID_KEY_NUM_LOCK 0x53
+#define HID_KEY_KEYPAD_DIVIDE 0x54
+#define HID_KEY_KEYPAD_MULTIPLY 0x55
+#define HID_KEY_KEYPAD_SUBTRACT 0x56
+#define HID_KEY_KEYPAD_ADD 0x57
+#define HID_KEY_KEYPAD_ENTER 0x58
+#define HID_KEY_KEYPAD_1 0x59
+#define HID_KEY_KEYPAD_2 0x5A
+#define HID_KEY_KEYPAD_3 0x5B
+#define HID_KEY_KEYPAD_4 0x5C
+#define HID_KEY_KEYPAD_5 0x5D
+#define HID_KEY_KEYPAD_6 0x5E
+#define HID_KEY_KEYPAD_7 0x5F
+#define HID_KEY_KEYPAD_8 0x60
+#define HID_KEY_KEYPAD_9 0x61
+#define HID_KEY_KEYPAD_0 0x62
+#define HID_KEY_KEYPAD_DECIMAL 0x63
+#define HID_KEY_EUROPE_2 0x64
+#define HID_KEY_APPLICATION 0x65
+#define HID_KEY_POWER 0x66
+#define HID_KEY_KEYPAD_EQUAL 0x67
+#define HID_KEY_F13 0x68
+#define HID_KEY_F14 0x69
+#define HID_KEY_F15 0x6A
+#define HID_KEY_F16 0x6B
+#define HID_KEY_F17 0x6C
+#define HID_KEY_F18 0x6D
+#define HID_KEY_F19 0x6E
+#define HID_KEY_F20 0x6F
+#define HID_KEY_F21 0x70
+#define HID_KEY_F22 0x71
+#define HID_KEY_F23 0x72
+#define HID_KEY_F24 0x73
+#define HID_KEY_KANJI1 0x87
+#define HID_KEY_KANJI2 0x88
+#define HID_KEY_KANJI3 0x89
+#define HID_KEY_KANJI4 0x8A
+#define HID_KEY_KANJI5 0x8B
+#define HID_KEY_KANJI6 0x8C
+#define HID_KEY_KANJI7 0x8D
+#define HID_KEY_KANJI8 0x8E
+#define HID_KEY_KANJI9 0x8F
+#define HID_KEY_LANG1 0x90
+#define HID_KEY_LANG2 0x91
+#define HID_KEY_LANG3 0x92
+#define HID_KEY_LANG4 0x93
+#define HID_KEY_LANG5 0x94
+#define HID_KEY_CONTROL_LEFT 0xE0
+#define HID_KEY_SHIFT_LEFT 0xE1
+#define HID_KEY_ALT_LEFT 0xE2
+#define HID_KEY_GUI_LEFT 0xE3
+#define HID_KEY_CONTROL_RIGHT 0xE4
+#define HID_KEY_SHIFT_RIGHT 0xE5
+#define HID_KEY_ALT_RIGHT 0xE6
+#define HID_KEY_GUI_RIGHT 0xE7
+
+//--------------------------------------------------------------------+
+// Report descriptor items
+//--------------------------------------------------------------------+
+#define U16_TO_U8S_LE(_u16) (uint8_t)((_u16)&0xff), (uint8_t)(((_u16) >> 8) & 0xff)
+#define U32_TO_U8S_LE(_u32) \
+	(uint8_t)((_u32)&0xff), (uint8_t)(((_u32) >> 8) & 0xff), (uint8_t)(((_u32) >> 16) & 0xff), (uint8_t)(((_u32) >> 24) & 0xff)
+
+#define HID_REPORT_DATA_0(data)
+#define HID_REPORT_DATA_1(data) , data
+#define HID_REPORT_DATA_2(data) , U16_TO_U8S_LE(data)
+#define HID_REPORT_DATA_3(data) , U32_TO_U8S_LE(data)
+
+#define HID_REPORT_ITEM(data, tag, type, size) (((tag) << 4) | ((type) << 2) | (size)) HID_REPORT_DATA_##size(data)
+
+#define RI_TYPE_MAIN 0
+#define RI_TYPE_GLOBAL 1
+#define RI_TYPE_LOCAL 2
+
+#define HID_DATA (0 << 0)
+#define HID_CONSTANT (1 << 0)
+#define HID_ARRAY (0 << 1)
+#define HID_VARIABLE (1 << 1)
+#define HID_ABSOLUTE (0 << 2)
+#define HID_RELATIVE (1 << 2)
+
+#define HID_INPUT(x) HID_REPORT_ITEM(x, 8, RI_TYPE_MAIN, 1)
+#define HID_OUTPUT(x) HID_REPORT_ITEM(x, 9, RI_TYPE_MAIN, 1)
+#define HID_COLLECTION(x) HID_REPORT_ITEM(x, 10, RI_TYPE_MAIN, 1)
+#define HID_FEATURE(x) HID_REPORT_ITEM(x, 11, RI_TYPE_MAIN, 1)
+#define HID_COLLECTION_END HID_REPORT_ITEM(x, 12, RI_TYPE_MAIN, 0)
+
+#define HID_COLLECTION_PHYSICAL 0
+#define HID_COLLECTION_APPLICATION 1
+#define HID_COLLECTION_LOGICAL 2
+
+#define HID_USAGE_PAGE(x) HID_REPORT_ITEM(x, 0, RI_TYPE_GLOBAL, 1)
+#define HID_USAGE_PAGE_N(x, n) HID_REPORT_ITEM(x, 0, RI_TYPE_GLOBAL, n)
+#define HID_LOGICAL_MIN(x) HID_REPORT_ITEM(x, 1, RI_TYPE_GLOBAL, 1)
+#define HID_LOGICAL_MIN_N(x, n) HID_REPORT_ITEM(x, 1, RI_TYPE_GLOBAL, n)
+#define HID_LOGICAL_MAX(x) HID_REPORT_ITEM(x, 2, RI_TYPE_GLOBAL, 1)
+#define HID_LOGICAL_MAX_N(x, n) HID_REPORT_ITEM(x, 2, RI_TYPE_GLOBAL, n)
+#define HID_REPORT_SIZE(x) HID_REPORT_ITEM(x, 7, RI_TYPE_GLOBAL, 1)
+#define HID_REPORT_ID(x) HID_REPORT_ITEM(x, 8, RI_TYPE_GLOBAL, 1),
+#define HID_REPORT_COUNT(x) HID_REPORT_ITEM(x, 9, RI_TYPE_GLOBAL, 1)
+#define HID_REPORT_COUNT_N(x, n) HID_REPORT_ITEM(x, 9, RI_TYPE_GLOBAL, n)
+
+#define HID_USAGE(x) HID_REPORT_ITEM(x, 0, RI_TYPE_LOCAL, 1)
+#define HID_USAGE_N(x, n) HID_REPORT_ITEM(x, 0, RI_TYPE_LOCAL, n)
+#define HID_USAGE_MIN(x) HID_REPORT_ITEM(x, 1, RI_TYPE_LOCAL, 1)
+#define HID_USAGE_MIN_N(x, n) HID_REPORT_ITEM(x, 1, RI_TYPE_LOCAL, n)
+#define HID_USAGE_MAX(x) HID_REPORT_ITEM(x, 2, RI_TYPE_LOCAL, 1)
+#define HID_USAGE_MAX_N(x, n) HID_REPORT_ITEM(x, 2, RI_TYPE_LOCAL, n)
+
+#define HID_USAGE_PAGE_DESKTOP 0x01
+#define HID_USAGE_PAGE_KEYBOARD 0x07
+#define HID_USAGE_PAGE_LED 0x08
+#define HID_USAGE_PAGE_BUTTON 0x09
+#define HID_USAGE_PAGE_CONSUMER 0x0c
+#define HID_USAGE_PAGE_VENDOR 0xFF00
+
+#define HID_USAGE_DESKTOP_POINTER 0x01
+#define HID_USAGE_DESKTOP_MOUSE 0x02
+#define HID_USAGE_DESKTOP_KEYBOARD 0x06
+#define HID_USAGE_DESKTOP_X 0x30
+#define HID_USAGE_DESKTOP_Y 0x31
+#define HID_USAGE_DESKTOP_WHEEL 0x38
+#define HID_USAGE_DESKTOP_SYSTEM_CONTROL 0x80
+#define HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN 0x81
+#define HID_USAGE_DESKTOP_SYSTEM_WAKE_UP 0x83
+#define HID_USAGE_CONSUMER_CONTROL 0x01
+#define HID_USAGE_CONSUMER_AC_PAN 0x0238
+
+typedef struct __attribute__((packed)) {
+	uint8_t buttons;
+	int8_t x;
+	int8_t y;
+	int8_t wheel;
+	int8_t pan;
+} hid_mouse_report_t;
+
+typedef enum {
+	MOUSE_BUTTON_LEFT = 1 << 0,
+	MOUSE_BUTTON_RIGHT = 1 << 1,
+	MOUSE_BUTTON_MIDDLE = 1 << 2,
+	MOUSE_BUTTON_BACKWARD = 1 << 3,
+	MOUSE_BUTTON_FORWARD = 1 << 4,
+} hid_mouse_button_bm_t;
+
+// clang-format off
+#define TUD_HID_REPORT_DESC_KEYBOARD(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+	HID_USAGE ( HID_USAGE_DESKTOP_KEYBOARD ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_USAGE_PAGE ( HID_USAGE_PAGE_KEYBOARD ), \
+			HID_USAGE_MIN ( 224 ), \
+			HID_USAGE_MAX ( 231 ), \
+			HID_LOGICAL_MIN ( 0 ), \
+			HID_LOGICAL_MAX ( 1 ), \
+			HID_REPORT_COUNT ( 8 ), \
+			HID_REPORT_SIZE ( 1 ), \
+			HID_INPUT ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+			HID_REPORT_COUNT ( 1 ), \
+			HID_REPORT_SIZE ( 8 ), \
+			HID_INPUT ( HID_CONSTANT ), \
+		HID_USAGE_PAGE ( HID_USAGE_PAGE_LED ), \
+			HID_USAGE_MIN ( 1 ), \
+			HID_USAGE_MAX ( 5 ), \
+			HID_REPORT_COUNT ( 5 ), \
+			HID_REPORT_SIZE ( 1 ), \
+			HID_OUTPUT ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+			HID_REPORT_COUNT ( 1 ), \
+			HID_REPORT_SIZE ( 3 ), \
+			HID_OUTPUT ( HID_CONSTANT ), \
+		HID_USAGE_PAGE ( HID_USAGE_PAGE_KEYBOARD ), \
+			HID_USAGE_MIN ( 0 ), \
+			HID_USAGE_MAX_N ( 255, 2 ), \
+			HID_LOGICAL_MIN ( 0 ), \
+			HID_LOGICAL_MAX_N( 255, 2 ), \
+			HID_REPORT_COUNT ( 6 ), \
+			HID_REPORT_SIZE ( 8 ), \
+			HID_INPUT ( HID_DATA | HID_ARRAY | HID_ABSOLUTE ), \
+	HID_COLLECTION_END
+
+#define TUD_HID_REPORT_DESC_MOUSE(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+	HID_USAGE ( HID_USAGE_DESKTOP_MOUSE ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_USAGE ( HID_USAGE_DESKTOP_POINTER ), \
+		HID_COLLECTION ( HID_COLLECTION_PHYSICAL ), \
+			HID_USAGE_PAGE ( HID_USAGE_PAGE_BUTTON ), \
+				HID_USAGE_MIN ( 1 ), \
+				HID_USAGE_MAX ( 5 ), \
+				HID_LOGICAL_MIN ( 0 ), \
+				HID_LOGICAL_MAX ( 1 ), \
+				HID_REPORT_COUNT ( 5 ), \
+				HID_REPORT_SIZE ( 1 ), \
+				HID_INPUT ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+				HID_REPORT_COUNT ( 1 ), \
+				HID_REPORT_SIZE ( 3 ), \
+				HID_INPUT ( HID_CONSTANT ), \
+			HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+				HID_USAGE ( HID_USAGE_DESKTOP_X ), \
+				HID_USAGE ( HID_USAGE_DESKTOP_Y ), \
+				HID_LOGICAL_MIN ( 0x81 ), \
+				HID_LOGICAL_MAX ( 0x7f ), \
+				HID_REPORT_COUNT ( 2 ), \
+				HID_REPORT_SIZE ( 8 ), \
+				HID_INPUT ( HID_DATA | HID_VARIABLE | HID_RELATIVE ), \
+				HID_USAGE ( HID_USAGE_DESKTOP_WHEEL ), \
+				HID_LOGICAL_MIN ( 0x81 ), \
+				HID_LOGICAL_MAX ( 0x7f ), \
+				HID_REPORT_COUNT ( 1 ), \
+				HID_REPORT_SIZE ( 8 ), \
+				HID_INPUT ( HID_DATA | HID_VARIABLE | HID_RELATIVE ), \
+			HID_USAGE_PAGE ( HID_USAGE_PAGE_CONSUMER ), \
+				HID_USAGE_N ( HID_USAGE_CONSUMER_AC_PAN, 2 ), \
+				HID_LOGICAL_MIN ( 0x81 ), \
+				HID_LOGICAL_MAX ( 0x7f ), \
+				HID_REPORT_COUNT ( 1 ), \
+				HID_REPORT_SIZE ( 8 ), \
+				HID_INPUT ( HID_DATA | HID_VARIABLE | HID_RELATIVE ), \
+		HID_COLLECTION_END, \
+	HID_COLLECTION_END
+
+#define TUD_HID_REPORT_DESC_CONSUMER(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_CONSUMER ), \
+	HID_USAGE ( HID_USAGE_CONSUMER_CONTROL ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_LOGICAL_MIN ( 0x00 ), \
+		HID_LOGICAL_MAX_N( 0x03FF, 2 ), \
+		HID_USAGE_MIN ( 0x00 ), \
+		HID_USAGE_MAX_N ( 0x03FF, 2 ), \
+		HID_REPORT_COUNT ( 1 ), \
+		HID_REPORT_SIZE ( 16 ), \
+		HID_INPUT ( HID_DATA | HID_ARRAY | HID_ABSOLUTE ), \
+	HID_COLLECTION_END
+
+#define TUD_HID_REPORT_DESC_SYSTEM_CONTROL(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+	HID_USAGE ( HID_USAGE_DESKTOP_SYSTEM_CONTROL ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_LOGICAL_MIN ( 1 ), \
+		HID_LOGICAL_MAX ( 3 ), \
+		HID_REPORT_COUNT ( 1 ), \
+		HID_REPORT_SIZE ( 2 ), \
+		HID_USAGE_MIN ( HID_USAGE_DESKTOP_SYSTEM_POWER_DOWN ), \
+		HID_USAGE_MAX ( HID_USAGE_DESKTOP_SYSTEM_WAKE_UP ), \
+		HID_INPUT ( HID_DATA | HID_ARRAY | HID_ABSOLUTE ), \
+		HID_REPORT_COUNT ( 1 ), \
+		HID_REPORT_SIZE ( 6 ), \
+		HID_INPUT ( HID_CONSTANT ), \
+	HID_COLLECTION_END
+// clang-format on
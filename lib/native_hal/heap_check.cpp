@@ -0,0 +1,92 @@
+// ファームウェアのヒープ確保を数える(sim::heap_check_arm())
+// glibc の malloc を置き換え、数えてから本来の実装を呼ぶ。operator new も malloc を通る
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "sim.h"
+
+namespace sim {
+
+namespace {
+
+std::atomic<bool> armed{ false };
+std::atomic<uint64_t> allocations{ 0 };
+// 0 ならファームウェアのコード。割り込み相当のイベントも同じスレッドで実行する
+thread_local int sim_depth = 0;
+
+}  // namespace
+
+void
+heap_check_arm(bool arm) {
+	if (arm) {
+		allocations.store(0, std::memory_order_relaxed);
+	}
+	armed.store(arm, std::memory_order_relaxed);
+}
+
+uint64_t
+heap_allocations() {
+	return allocations.load(std::memory_order_relaxed);
+}
+
+SimScope::SimScope() {
+	sim_depth++;
+}
+
+SimScope::~SimScope() {
+	sim_depth--;
+}
+
+FirmwareScope::FirmwareScope() : saved(sim_depth) {
+	sim_depth = 0;
+}
+
+FirmwareScope::~FirmwareScope() {
+	sim_depth = saved;
+}
+
+namespace {
+
+inline void
+note_allocation() {
+	if (armed.load(std::memory_order_relaxed) && sim_depth == 0) {
+		allocations.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+}  // namespace
+
+}  // namespace sim
+
+#ifdef __GLIBC__
+extern "C" {
+
+void* __libc_malloc(size_t size) noexcept;
+void* __libc_calloc(size_t n, size_t size) noexcept;
+void* __libc_realloc(void* p, size_t size) noexcept;
+void __libc_free(void* p) noexcept;
+
+void*
+malloc(size_t size) noexcept {
+	sim::note_allocation();
+	return __libc_malloc(size);
+}
+
+void*
+calloc(size_t n, size_t size) noexcept {
+	sim::note_allocation();
+	return __libc_calloc(n, size);
+}
+
+void*
+realloc(void* p, size_t size) noexcept {
+	sim::note_allocation();
+	return __libc_realloc(p, size);
+}
+
+void
+free(void* p) noexcept {
+	__libc_free(p);
+}
+}
+#endif
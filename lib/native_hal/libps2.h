@@ -0,0 +1,44 @@
+#pragma once
+// ホスト実行用の libps2 代替
+// 受信バイトは sim::Keyboard からイベント(割り込み相当)として届く
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include "sim.h"
+
+namespace libps2 {
+
+class PS2 {
+ public:
+	using recv_callback_t = std::function<void(uint8_t)>;
+
+	PS2() = default;
+	~PS2();
+	PS2(const PS2&) = delete;
+	PS2& operator=(const PS2&) = delete;
+
+	void set_recv_callback(recv_callback_t cb) { recv_cb = cb; }
+	bool begin(uint8_t data_pin, uint8_t clock_pin);
+	void send(uint8_t code);
+
+	/* シミュレーション用 */
+
+	/**
+	 * @brief デバイスからのバイト受信(受信割り込み相当)
+	 */
+	void sim_receive(uint8_t code) {
+		if (recv_cb) {
+			sim::FirmwareScope scope;
+			recv_cb(code);
+		}
+	}
+	/**
+	 * @brief begin() 順に登録されたポート
+	 */
+	static PS2* sim_port(size_t index);
+
+ private:
+	recv_callback_t recv_cb;
+};
+
+}  // namespace libps2
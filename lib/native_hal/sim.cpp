@@ -0,0 +1,698 @@
+#include "sim.h"
+#include <Adafruit_TinyUSB.h>
+#include <Arduino.h>
+#include <libps2.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <numeric>
+#include <thread>
+#include <utility>
+
+namespace sim {
+
+namespace {
+
+constexpr uint64_t NEVER = UINT64_MAX;
+constexpr uint32_t USB_RESUME_US = 20000;
+
+uint64_t clock_us = 0;
+bool realtime = false;
+std::chrono::steady_clock::time_point realtime_base;
+std::multimap<uint64_t, std::function<void()>> events;
+std::function<void(uint8_t)> serial_sink;
+
+bool usb_mounted = true;
+bool usb_suspended = false;
+bool usb_busy = false;
+uint8_t usb_protocol = 1;  // HID_PROTOCOL_REPORT
+uint64_t usb_wakeup_at = NEVER;
+uint32_t usb_poll_offset_us = 0;
+uint32_t usb_sof_delay_us = 0;
+bool sof_enabled = false;
+uint32_t sof_generation = 0;  // 無効にしたら予定済みの SOF を捨てる
+Adafruit_USBD_HID* hid = nullptr;
+std::vector<Report> reports;
+
+std::vector<libps2::PS2*> ps2_ports;
+std::vector<Device*> devices;
+
+}  // namespace
+
+uint64_t
+now_us() {
+	if (realtime) {
+		auto elapsed = std::chrono::steady_clock::now() - realtime_base;
+		return clock_us + std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+	}
+	return clock_us;
+}
+
+void
+advance_to(uint64_t t_us) {
+	if (realtime) {
+		for (;;) {
+			uint64_t now = now_us();
+			while (!events.empty() && events.begin()->first <= std::min(t_us, now)) {
+				auto it = events.begin();
+				auto fn = std::move(it->second);
+				events.erase(it);
+				SimScope scope;
+				fn();
+			}
+			if (now >= t_us) {
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(std::min(t_us, next_event_us()) - now));
+		}
+	}
+	while (!events.empty() && events.begin()->first <= t_us) {
+		auto it = events.begin();
+		auto fn = std::move(it->second);
+		clock_us = std::max(clock_us, it->first);
+		events.erase(it);
+		SimScope scope;
+		fn();
+	}
+	clock_us = std::max(clock_us, t_us);
+}
+
+void
+advance_us(uint64_t us) {
+	advance_to(now_us() + us);
+}
+
+void
+schedule_at(uint64_t t_us, std::function<void()> fn) {
+	SimScope scope;
+	events.emplace(std::max(t_us, now_us()), std::move(fn));
+}
+
+uint64_t
+next_event_us() {
+	return events.empty() ? NEVER : events.begin()->first;
+}
+
+void
+wait_for_event(uint32_t timeout_us) {
+	advance_to(std::min(next_event_us(), now_us() + timeout_us));
+}
+
+void
+set_realtime(bool enable) {
+	if (enable == realtime) {
+		return;
+	}
+	clock_us = now_us();
+	realtime_base = std::chrono::steady_clock::now();
+	realtime = enable;
+}
+
+void
+reset() {
+	realtime = false;
+	clock_us = 0;
+	events.clear();
+	usb_mounted = true;
+	usb_suspended = false;
+	usb_busy = false;
+	usb_protocol = HID_PROTOCOL_REPORT;
+	usb_wakeup_at = NEVER;
+	usb_poll_offset_us = 0;
+	usb_sof_delay_us = 0;
+	sof_enabled = false;
+	sof_generation++;
+	reports.clear();
+}
+
+void
+set_serial_sink(std::function<void(uint8_t)> sink) {
+	serial_sink = std::move(sink);
+}
+
+/* USB ホスト */
+
+std::vector<Report>&
+usb_reports() {
+	return reports;
+}
+
+void
+usb_set_mounted(bool mounted) {
+	usb_mounted = mounted;
+}
+
+void
+usb_set_poll_offset_us(uint32_t offset_us) {
+	usb_poll_offset_us = offset_us % 1000;
+}
+
+void
+usb_set_sof_delay_us(uint32_t max_us) {
+	usb_sof_delay_us = max_us;
+}
+
+void
+usb_set_protocol(uint8_t protocol) {
+	usb_protocol = protocol;
+}
+
+void
+usb_set_suspended(bool suspended) {
+	usb_suspended = suspended;
+}
+
+uint64_t
+usb_remote_wakeup_us() {
+	return usb_wakeup_at;
+}
+
+void
+usb_host_set_led(uint8_t report_id, uint8_t leds) {
+	if (hid && hid->reportSetter()) {
+		FirmwareScope scope;
+		hid->reportSetter()(report_id, HID_REPORT_TYPE_OUTPUT, &leds, 1);
+	}
+}
+
+uint16_t
+usb_host_get_feature(uint8_t report_id, uint8_t* buffer, uint16_t len) {
+	if (!hid || !hid->reportGetter()) {
+		return 0;
+	}
+	FirmwareScope scope;
+	return hid->reportGetter()(report_id, HID_REPORT_TYPE_FEATURE, buffer, len);
+}
+
+bool
+report_has_key(const Report& r, uint8_t usb) {
+	constexpr size_t BOOT_REPORT_LEN = 8;
+	if (r.len > BOOT_REPORT_LEN) {
+		size_t byte = 1 + usb / 8;
+		return byte < r.len && (r.data[byte] & (1 << (usb % 8)));
+	}
+	for (size_t i = 2; i < r.len; i++) {
+		if (r.data[i] == usb) {
+			return true;
+		}
+	}
+	return false;
+}
+
+uint8_t
+report_modifier(const Report& r) {
+	return r.len > 0 ? r.data[0] : 0;
+}
+
+/* PS/2 デバイス */
+
+Device::Device(size_t port) : port(port) {
+	if (devices.size() <= port) {
+		devices.resize(port + 1);
+	}
+	devices[port] = this;
+}
+
+Device::~Device() {
+	if (port < devices.size() && devices[port] == this) {
+		devices[port] = nullptr;
+	}
+}
+
+uint64_t
+Device::send_at(uint64_t t_us, const uint8_t* bytes, size_t len) {
+	uint64_t t = std::max({ t_us, now_us(), busy_until });
+	for (size_t i = 0; i < len; i++) {
+		t += byte_us;
+		uint8_t b = bytes[i];
+		size_t p = port;
+		schedule_at(t, [p, b]() {
+			if (auto* ps2 = libps2::PS2::sim_port(p)) {
+				ps2->sim_receive(b);
+			}
+		});
+		last_sent = b;
+	}
+	sent += len;
+	busy_until = t;
+	return t;
+}
+
+void
+host_send(size_t port, uint8_t cmd) {
+	SimScope scope;
+	if (port >= devices.size() || !devices[port]) {
+		return;
+	}
+	Device* dev = devices[port];
+	// ホスト→デバイスの転送時間の後にデバイスが受け取る
+	schedule_at(now_us() + dev->byte_us, [port, cmd]() {
+		if (port < devices.size() && devices[port]) {
+			devices[port]->commands.push_back(cmd);
+			devices[port]->on_host_send(cmd);
+		}
+	});
+}
+
+// セット2のキー(E0付きは Keyboard::E0 | code) → セット3のコード
+constexpr std::pair<uint16_t, uint8_t> SET3_CODES[] = {
+	{ 0x76, 0x08 }, { 0x05, 0x07 }, { 0x06, 0x0f }, { 0x04, 0x17 }, { 0x0c, 0x1f }, { 0x03, 0x27 }, { 0x0b, 0x2f },
+	{ 0x83, 0x37 }, { 0x0a, 0x3f }, { 0x01, 0x47 }, { 0x09, 0x4f }, { 0x78, 0x56 }, { 0x07, 0x5e }, { 0x0e, 0x0e },
+	{ 0x16, 0x16 }, { 0x1e, 0x1e }, { 0x26, 0x26 }, { 0x25, 0x25 }, { 0x2e, 0x2e }, { 0x36, 0x36 }, { 0x3d, 0x3d },
+	{ 0x3e, 0x3e }, { 0x46, 0x46 }, { 0x45, 0x45 }, { 0x4e, 0x4e }, { 0x55, 0x55 }, { 0x6a, 0x5d }, { 0x66, 0x66 },
+	{ 0x0d, 0x0d }, { 0x15, 0x15 }, { 0x1d, 0x1d }, { 0x24, 0x24 }, { 0x2d, 0x2d }, { 0x2c, 0x2c }, { 0x35, 0x35 },
+	{ 0x3c, 0x3c }, { 0x43, 0x43 }, { 0x44, 0x44 }, { 0x4d, 0x4d }, { 0x54, 0x54 }, { 0x5b, 0x5b }, { 0x5d, 0x5c },
+	{ 0x58, 0x14 }, { 0x1c, 0x1c }, { 0x1b, 0x1b }, { 0x23, 0x23 }, { 0x2b, 0x2b }, { 0x34, 0x34 }, { 0x33, 0x33 },
+	{ 0x3b, 0x3b }, { 0x42, 0x42 }, { 0x4b, 0x4b }, { 0x4c, 0x4c }, { 0x52, 0x52 }, { 0x5a, 0x5a }, { 0x12, 0x12 },
+	{ 0x1a, 0x1a }, { 0x22, 0x22 }, { 0x21, 0x21 }, { 0x2a, 0x2a }, { 0x32, 0x32 }, { 0x31, 0x31 }, { 0x3a, 0x3a },
+	{ 0x41, 0x41 }, { 0x49, 0x49 }, { 0x4a, 0x4a }, { 0x51, 0x51 }, { 0x59, 0x59 }, { 0x14, 0x11 }, { 0x11, 0x19 },
+	{ 0x29, 0x29 }, { 0x7e, 0x5f }, { 0x77, 0x76 }, { 0x7c, 0x7e }, { 0x7b, 0x84 }, { 0x79, 0x7c }, { 0x6c, 0x6c },
+	{ 0x75, 0x75 }, { 0x7d, 0x7d }, { 0x6b, 0x6b }, { 0x73, 0x73 }, { 0x74, 0x74 }, { 0x69, 0x69 }, { 0x72, 0x72 },
+	{ 0x7a, 0x7a }, { 0x70, 0x70 }, { 0x71, 0x71 }, { 0x67, 0x85 }, { 0x64, 0x86 }, { 0x13, 0x87 }, { 0x61, 0x13 },
+	{ Keyboard::E0 | 0x11, 0x39 }, { Keyboard::E0 | 0x14, 0x58 }, { Keyboard::E0 | 0x1f, 0x8b },
+	{ Keyboard::E0 | 0x27, 0x8c }, { Keyboard::E0 | 0x2f, 0x8d }, { Keyboard::E0 | 0x70, 0x67 },
+	{ Keyboard::E0 | 0x6c, 0x6e }, { Keyboard::E0 | 0x7d, 0x6f }, { Keyboard::E0 | 0x71, 0x64 },
+	{ Keyboard::E0 | 0x69, 0x65 }, { Keyboard::E0 | 0x7a, 0x6d }, { Keyboard::E0 | 0x75, 0x63 },
+	{ Keyboard::E0 | 0x6b, 0x61 }, { Keyboard::E0 | 0x72, 0x60 }, { Keyboard::E0 | 0x74, 0x6a },
+	{ Keyboard::E0 | 0x4a, 0x77 }, { Keyboard::E0 | 0x5a, 0x79 }, { Keyboard::E0 | 0x7c, 0x57 },
+};
+
+uint8_t
+Keyboard::set3_code(uint16_t key) {
+	for (auto& [set2, set3] : SET3_CODES) {
+		if (set2 == key) {
+			return set3;
+		}
+	}
+	return 0;
+}
+
+uint64_t
+Keyboard::press(uint16_t key, uint64_t t_us) {
+	uint8_t buf[2];
+	size_t len = 0;
+	if (set == 3) {
+		buf[len++] = set3_code(key);
+		return buf[0] ? send_at(t_us, buf, len) : now_us();
+	}
+	if (key & E0) {
+		buf[len++] = 0xe0;
+	}
+	buf[len++] = key & 0xff;
+	return send_at(t_us, buf, len);
+}
+
+uint64_t
+Keyboard::release(uint16_t key, uint64_t t_us) {
+	uint8_t buf[3];
+	size_t len = 0;
+	if (set == 3) {
+		uint8_t code = set3_code(key);
+		if (!code || make_only[code]) {
+			return now_us();
+		}
+		buf[len++] = 0xf0;
+		buf[len++] = code;
+		return send_at(t_us, buf, len);
+	}
+	if (key & E0) {
+		buf[len++] = 0xe0;
+	}
+	buf[len++] = 0xf0;
+	buf[len++] = key & 0xff;
+	return send_at(t_us, buf, len);
+}
+
+void
+Keyboard::on_host_send(uint8_t cmd) {
+	constexpr uint8_t ACK = 0xfa;
+	if (ignore_commands > 0) {
+		ignore_commands--;
+		return;
+	}
+	if (garble_commands > 0) {
+		constexpr uint8_t RESEND = 0xfe;
+		garble_commands--;
+		reply(RESEND);
+		return;
+	}
+	if (key_list && cmd < 0xed) {
+		make_only[cmd] = true;
+		reply(ACK);
+		return;
+	}
+	key_list = false;
+	if (pending_command) {
+		uint8_t prev = pending_command;
+		pending_command = 0;
+		if (prev == 0xed) {
+			led_value = cmd;
+		} else if (prev == 0xf3) {
+			typematic_value = cmd;
+		}
+		reply(ACK);
+		if (prev == 0xf0 && cmd == 0) {
+			reply(set);
+		} else if (prev == 0xf0 && (cmd == 2 || (cmd == 3 && set3_capable))) {
+			set = cmd;
+		}
+		return;
+	}
+	switch (cmd) {
+		case 0xed:  // set LEDs
+		case 0xf3:  // set typematic
+		case 0xf0:  // select code set
+			reply(ACK);
+			pending_command = cmd;
+			break;
+		case 0xee:  // echo
+			reply(0xee);
+			break;
+		case 0xf2:  // read ID
+			reply(ACK);
+			reply(0xab);
+			reply(0x83);
+			break;
+		case 0xfd:  // set key type make (set 3)
+			reply(ACK);
+			key_list = set == 3;
+			break;
+		case 0xfe:  // resend
+			reply(last_sent);
+			break;
+		case 0xff: {  // reset
+			constexpr uint8_t BAT_COMPLETED = 0xaa;
+			reply(ACK);
+			set = 2;
+			typematic_value = DEFAULT_TYPEMATIC;
+			std::fill(std::begin(make_only), std::end(make_only), false);
+			send_at(now_us() + bat_us, &BAT_COMPLETED, 1);
+			break;
+		}
+		default:
+			reply(ACK);
+			break;
+	}
+}
+
+uint64_t
+Mouse::move(int dx, int dy, int wheel_delta, uint64_t t_us) {
+	if (!stream) {
+		return now_us();
+	}
+	// PS/2 は上が正、ホイールは下へのスクロールが正
+	dy = -dy;
+	uint8_t packet[4] = { static_cast<uint8_t>(0x08 | (buttons & 0x07) | (dx < 0 ? 0x10 : 0) | (dy < 0 ? 0x20 : 0)),
+		                  static_cast<uint8_t>(dx), static_cast<uint8_t>(dy), static_cast<uint8_t>(-wheel_delta) };
+	return send_at(t_us, packet, device_id == 3 ? 4 : 3);
+}
+
+uint64_t
+Mouse::press(uint8_t button, uint64_t t_us) {
+	buttons |= button;
+	return move(0, 0, 0, t_us);
+}
+
+uint64_t
+Mouse::release(uint8_t button, uint64_t t_us) {
+	buttons &= ~button;
+	return move(0, 0, 0, t_us);
+}
+
+void
+Mouse::on_host_send(uint8_t cmd) {
+	constexpr uint8_t ACK = 0xfa;
+	if (pending_command) {
+		uint8_t prev = pending_command;
+		pending_command = 0;
+		if (prev == 0xf3) {
+			rate = cmd;
+			rates[0] = rates[1];
+			rates[1] = rates[2];
+			rates[2] = cmd;
+		}
+		reply(ACK);
+		return;
+	}
+	switch (cmd) {
+		case 0xe8:  // set resolution
+		case 0xf3:  // set sample rate
+			reply(ACK);
+			pending_command = cmd;
+			break;
+		case 0xf2:  // read ID
+			if (wheel && rates[0] == 200 && rates[1] == 100 && rates[2] == 80) {
+				device_id = 3;
+			}
+			reply(ACK);
+			reply(device_id);
+			break;
+		case 0xf4:  // enable data reporting
+			stream = true;
+			reply(ACK);
+			break;
+		case 0xf5:  // disable data reporting
+			stream = false;
+			reply(ACK);
+			break;
+		case 0xfe:  // resend
+			reply(last_sent);
+			break;
+		case 0xff: {  // reset
+			constexpr uint8_t BAT[] = { 0xaa, 0x00 };
+			reply(ACK);
+			stream = false;
+			device_id = 0;
+			rate = 100;
+			std::fill(std::begin(rates), std::end(rates), 0);
+			send_at(now_us() + bat_us, BAT, sizeof(BAT));
+			break;
+		}
+		default:
+			reply(ACK);
+			break;
+	}
+}
+
+/* 統計 */
+
+LatencyStats
+summarize(std::vector<uint64_t> samples) {
+	LatencyStats s;
+	if (samples.empty()) {
+		return s;
+	}
+	std::sort(samples.begin(), samples.end());
+	s.count = samples.size();
+	s.min = samples.front();
+	s.max = samples.back();
+	s.avg = static_cast<double>(std::accumulate(samples.begin(), samples.end(), uint64_t{ 0 })) / samples.size();
+	s.p50 = samples[samples.size() / 2];
+	s.p99 = samples[std::min(samples.size() - 1, samples.size() * 99 / 100)];
+	return s;
+}
+
+}  // namespace sim
+
+/* Arduino 代替 */
+
+HardwareSerial Serial;
+HardwareSerial Serial1;
+
+size_t
+HardwareSerial::write(uint8_t c) {
+	if (sim::serial_sink) {
+		sim::SimScope scope;
+		sim::serial_sink(c);
+	}
+	return 1;
+}
+
+uint32_t
+millis() {
+	return static_cast<uint32_t>(sim::now_us() / 1000);
+}
+
+uint32_t
+micros() {
+	return static_cast<uint32_t>(sim::now_us());
+}
+
+void
+delay(uint32_t ms) {
+	sim::advance_us(uint64_t{ ms } * 1000);
+}
+
+void
+delayMicroseconds(uint32_t us) {
+	sim::advance_us(us);
+}
+
+/* Adafruit TinyUSB 代替 */
+
+uint8_t
+tud_hid_get_protocol(void) {
+	return sim::usb_protocol;
+}
+
+namespace {
+
+void
+schedule_sof(uint32_t generation) {
+	uint64_t frame = sim::now_us() / 1000 + 1;
+	sim::schedule_at(frame * 1000, [generation, frame]() {
+		if (generation != sim::sof_generation) {
+			return;
+		}
+		// 次の SOF を先に登録する(同じ時刻の IN トークンより前に実行される)
+		schedule_sof(generation);
+		auto callback = [generation, frame]() {
+			if (generation == sim::sof_generation && sim::usb_mounted && !sim::usb_suspended && tud_sof_cb) {
+				sim::FirmwareScope scope;
+				tud_sof_cb(frame & 0x7ff);
+			}
+		};
+		// 遅れは決まった列にして、同じ設定なら同じ結果にする
+		uint32_t delay = frame % 8 == 0 ? 0 : (frame * 7919) % (sim::usb_sof_delay_us + 1);
+		if (delay == 0) {
+			callback();
+		} else {
+			sim::schedule_at(frame * 1000 + delay, callback);
+		}
+	});
+}
+
+}  // namespace
+
+void
+tud_sof_cb_enable(bool en) {
+	sim::SimScope scope;
+	if (en == sim::sof_enabled) {
+		return;
+	}
+	sim::sof_enabled = en;
+	sim::sof_generation++;
+	if (en) {
+		schedule_sof(sim::sof_generation);
+	}
+}
+
+Adafruit_USBD_Device TinyUSBDevice;
+
+bool
+Adafruit_USBD_Device::mounted() {
+	return sim::usb_mounted;
+}
+
+bool
+Adafruit_USBD_Device::suspended() {
+	return sim::usb_suspended;
+}
+
+bool
+Adafruit_USBD_Device::remoteWakeup() {
+	if (!sim::usb_suspended) {
+		return false;
+	}
+	if (sim::usb_wakeup_at == sim::NEVER || sim::usb_wakeup_at < sim::now_us()) {
+		sim::usb_wakeup_at = sim::now_us();
+		sim::schedule_at(sim::now_us() + sim::USB_RESUME_US, []() { sim::usb_suspended = false; });
+	}
+	return true;
+}
+
+bool
+Adafruit_USBD_HID::begin() {
+	sim::hid = this;
+	return true;
+}
+
+bool
+Adafruit_USBD_HID::ready() {
+	return sim::usb_mounted && !sim::usb_suspended && !sim::usb_busy;
+}
+
+bool
+Adafruit_USBD_HID::sendReport(uint8_t report_id, void const* report, uint8_t len) {
+	if (!ready()) {
+		return false;
+	}
+	sim::SimScope scope;
+	sim::Report r{};
+	r.queued_us = sim::now_us();
+	r.sent_us = sim::NEVER;
+	r.report_id = report_id;
+	r.len = std::min<size_t>(len, sizeof(r.data));
+	memcpy(r.data, report, r.len);
+	sim::reports.push_back(r);
+	sim::usb_busy = true;
+
+	// 次のポーリング(bInterval ms ごとの IN トークン)で送信完了
+	uint64_t interval_us = uint64_t{ interval } * 1000;
+	uint64_t offset = sim::usb_poll_offset_us;
+	uint64_t poll_at = (sim::now_us() + interval_us - offset) / interval_us * interval_us + offset;
+	size_t index = sim::reports.size() - 1;
+	sim::schedule_at(poll_at, [index]() {
+		auto& sent = sim::reports[index];
+		sent.sent_us = sim::now_us();
+		sim::usb_busy = false;
+		if (tud_hid_report_complete_cb) {
+			uint8_t buf[sizeof(sent.data) + 1];
+			buf[0] = sent.report_id;
+			memcpy(&buf[1], sent.data, sent.len);
+			sim::FirmwareScope scope;
+			tud_hid_report_complete_cb(0, buf, sent.len + 1);
+		}
+	});
+	return true;
+}
+
+bool
+Adafruit_USBD_HID::keyboardReport(uint8_t report_id, uint8_t modifier, uint8_t keycode[6]) {
+	uint8_t buf[8] = { modifier, 0 };
+	if (keycode) {
+		memcpy(&buf[2], keycode, 6);
+	}
+	return sendReport(report_id, buf, sizeof(buf));
+}
+
+/* libps2 代替 */
+
+namespace libps2 {
+
+PS2::~PS2() {
+	for (auto& p : sim::ps2_ports) {
+		if (p == this) {
+			p = nullptr;
+		}
+	}
+}
+
+bool
+PS2::begin(uint8_t, uint8_t) {
+	if (std::find(sim::ps2_ports.begin(), sim::ps2_ports.end(), this) != sim::ps2_ports.end()) {
+		return true;
+	}
+	if (auto it = std::find(sim::ps2_ports.begin(), sim::ps2_ports.end(), nullptr); it != sim::ps2_ports.end()) {
+		*it = this;
+	} else {
+		sim::ps2_ports.push_back(this);
+	}
+	return true;
+}
+
+void
+PS2::send(uint8_t code) {
+	auto it = std::find(sim::ps2_ports.begin(), sim::ps2_ports.end(), this);
+	if (it != sim::ps2_ports.end()) {
+		sim::host_send(it - sim::ps2_ports.begin(), code);
+	}
+}
+
+PS2*
+PS2::sim_port(size_t index) {
+	return index < sim::ps2_ports.size() ? sim::ps2_ports[index] : nullptr;
+}
+
+}  // namespace libps2
@@ -0,0 +1,319 @@
+#pragma once
+// ホスト実行用シミュレーション環境
+// 仮想時計、スクリプト化した PS/2 キーボード、USB ホスト(レポート記録)を提供する
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+namespace sim {
+
+/* 仮想時計 */
+
+/**
+ * @brief 仮想時刻(マイクロ秒)
+ */
+uint64_t now_us();
+/**
+ * @brief 仮想時計を進める。期限の来たイベントは時刻順に実行される
+ *
+ * @param us 進める時間(マイクロ秒)
+ */
+void advance_us(uint64_t us);
+/**
+ * @brief 指定時刻まで仮想時計を進める
+ */
+void advance_to(uint64_t t_us);
+/**
+ * @brief 指定時刻に実行するイベントを登録する(割り込みハンドラ相当)
+ */
+void schedule_at(uint64_t t_us, std::function<void()> fn);
+/**
+ * @brief 次のイベント時刻。イベントが無ければ UINT64_MAX
+ */
+uint64_t next_event_us();
+/**
+ * @brief 時計を実時間に切り替える(true)/仮想時計に戻す(false)
+ *
+ * 実時間では now_us() は前回の時刻から実際の経過時間で進み、advance_*() は指定時刻まで実際に待つ。
+ * now_us()/micros() はどのスレッドから呼んでもよいが、イベントを実行する advance_*() と
+ * イベントを登録する処理(USB 送信・PS/2 送信)は1つのスレッドに限ること。
+ */
+void set_realtime(bool enable);
+/**
+ * @brief 時計・イベント・USB・PS/2 の状態を初期化する
+ */
+void reset();
+/**
+ * @brief Serial/Serial1 へ書かれたバイトを受け取る関数を設定する(nullptr なら捨てる)
+ */
+void set_serial_sink(std::function<void(uint8_t)> sink);
+
+/**
+ * @brief 次のイベント(割り込み相当)か timeout_us 経過まで時計を進める(WFE 相当)
+ */
+void wait_for_event(uint32_t timeout_us);
+
+/* ヒープ確保の検査 */
+
+/**
+ * @brief ファームウェアのヒープ確保(malloc・operator new)を数え始める(true、回数を 0 に戻す)/やめる(false)
+ *
+ * sim 自身の確保(イベントの登録・レポートやコマンドの記録)は数えない。イベントから呼ぶファームウェアの
+ * コールバック(PS/2 受信・送信完了・SOF・LED 出力レポート)の中の確保は数える。glibc のみ。
+ */
+void heap_check_arm(bool armed);
+/**
+ * @brief 数えたヒープ確保の回数
+ */
+uint64_t heap_allocations();
+
+/**
+ * @brief このスコープの中の確保は sim のものとして数えない
+ */
+class SimScope {
+ public:
+	SimScope();
+	~SimScope();
+	SimScope(const SimScope&) = delete;
+	SimScope& operator=(const SimScope&) = delete;
+};
+
+/**
+ * @brief sim からファームウェアのコールバックを呼ぶ間、確保をファームウェアのものとして数える
+ */
+class FirmwareScope {
+ public:
+	FirmwareScope();
+	~FirmwareScope();
+	FirmwareScope(const FirmwareScope&) = delete;
+	FirmwareScope& operator=(const FirmwareScope&) = delete;
+
+ private:
+	int saved;
+};
+
+/* USB ホスト */
+
+struct Report {
+	uint64_t queued_us;  // ファームウェアが送信要求した時刻
+	uint64_t sent_us;    // ホストが IN トークンで受け取った時刻
+	uint8_t report_id;
+	uint8_t len;
+	uint8_t data[64];
+};
+
+/**
+ * @brief ホストが受け取った(または送信待ちの)全レポート
+ */
+std::vector<Report>& usb_reports();
+void usb_set_mounted(bool mounted);
+/**
+ * @brief ホストからの SET_PROTOCOL(HID_PROTOCOL_BOOT/HID_PROTOCOL_REPORT)
+ */
+void usb_set_protocol(uint8_t protocol);
+void usb_set_suspended(bool suspended);
+/**
+ * @brief フレーム(1ms)の始まり(SOF)からホストが IN トークンを送るまでの時間(既定: 0)
+ *
+ * ポーリングはフレーム番号がポーリング間隔の倍数のフレームで行う。SOF の後・IN トークンの前に
+ * 送信要求したレポートはそのフレームで送られる。
+ */
+void usb_set_poll_offset_us(uint32_t offset_us);
+/**
+ * @brief SOF のコールバック(tud_sof_cb)を SOF から遅らせる時間の上限(既定: 0)
+ *
+ * 実機の TinyUSB はコールバックを割り込みではなく tud_task() から呼ぶので、SOF より遅れる。
+ * 遅れはフレームごとに 0〜max_us で変わり、8フレームに1回は遅れない。TinyUSB と同じく送信完了のコールバックより
+ * 先に呼ばれるように、usb_set_poll_offset_us() より短くすること。
+ */
+void usb_set_sof_delay_us(uint32_t max_us);
+/**
+ * @brief 最後に remoteWakeup() が呼ばれた時刻。呼ばれていなければ UINT64_MAX
+ */
+uint64_t usb_remote_wakeup_us();
+/**
+ * @brief ホストから出力レポート(LED 状態)を送る
+ */
+void usb_host_set_led(uint8_t report_id, uint8_t leds);
+/**
+ * @brief ホストからフィーチャーレポートを読む(GET_REPORT)
+ *
+ * @return buffer に書かれたバイト数(レポートIDを除く)。0 はファームウェアが応答しなかった(STALL)
+ */
+uint16_t usb_host_get_feature(uint8_t report_id, uint8_t* buffer, uint16_t len);
+/**
+ * @brief キーボードレポートにキーが含まれるか
+ *
+ * 8バイトならブートプロトコル形式(キーコード配列)、それより長ければ NKRO 形式(ビットマップ)として解釈する。
+ */
+bool report_has_key(const Report& r, uint8_t usb);
+/**
+ * @brief キーボードレポートのモディファイアバイト
+ */
+uint8_t report_modifier(const Report& r);
+
+/* PS/2 デバイス */
+
+/**
+ * @brief PS/2 ポートに接続されたデバイス
+ *
+ * 1バイトの転送には byte_us かかるものとし、送信予約したバイトは順番に受信割り込みとして届く。
+ */
+class Device {
+ public:
+	explicit Device(size_t port);
+	virtual ~Device();
+	Device(const Device&) = delete;
+	Device& operator=(const Device&) = delete;
+
+	/**
+	 * @brief バイト列を送信予約する(直前の送信予約の後に続ける)
+	 *
+	 * @return uint64_t 最後のバイトがファームウェアに届く時刻
+	 */
+	uint64_t send(std::initializer_list<uint8_t> bytes) { return send_at(0, bytes.begin(), bytes.size()); }
+	/**
+	 * @brief バイト列を t_us 以降に送信予約する
+	 *
+	 * @return uint64_t 最後のバイトがファームウェアに届く時刻
+	 */
+	uint64_t send_at(uint64_t t_us, const uint8_t* bytes, size_t len);
+	/**
+	 * @brief ホストから受け取ったコマンドバイト列
+	 */
+	const std::vector<uint8_t>& received_commands() const { return commands; }
+	/**
+	 * @brief これまでに送信予約したバイト数
+	 */
+	size_t bytes_sent() const { return sent; }
+
+	uint32_t byte_us = 1000;
+
+ protected:
+	virtual void on_host_send(uint8_t cmd) = 0;
+	void reply(uint8_t b) { send_at(0, &b, 1); }
+	uint8_t last_sent = 0;
+
+ private:
+	friend void host_send(size_t port, uint8_t cmd);
+	size_t port;
+	uint64_t busy_until = 0;
+	size_t sent = 0;
+	std::vector<uint8_t> commands;
+};
+
+/**
+ * @brief ファームウェアから PS/2 ポートへの送信(libps2 代替から呼ばれる)
+ */
+void host_send(size_t port, uint8_t cmd);
+
+/**
+ * @brief スクリプト化した PS/2 キーボード
+ *
+ * ホストからのコマンドに ACK/ECHO/BAT で応答し、キー入力をスキャンコードセット2のバイト列として送る。
+ * set3_capable ならホストの要求でスキャンコードセット3に切り替え、全キー make/break(F8)と
+ * キーごとの make のみ(FD)に従う。リセットするとセット2に戻る。
+ */
+class Keyboard : public Device {
+ public:
+	static inline constexpr uint16_t E0 = 0xe000;
+	static inline constexpr uint8_t DEFAULT_TYPEMATIC = 0x2b;  // 500ms 後に 10.9cps
+
+	explicit Keyboard(size_t port = 0) : Device(port) {}
+
+	/**
+	 * @brief キーを押す(セット2のコードで指定する。E0付きキーは Keyboard::E0 | code)
+	 *
+	 * セット3ではセット3のコードに変換して送る(対応するコードが無いキーは送らない)。
+	 *
+	 * @return uint64_t 最後のバイトがファームウェアに届く時刻
+	 */
+	uint64_t press(uint16_t key, uint64_t t_us = 0);
+	uint64_t release(uint16_t key, uint64_t t_us = 0);
+
+	uint32_t bat_us = 300000;
+	// false ならセット3の要求に ACK するがセット2のまま(読み戻すと2)
+	bool set3_capable = false;
+	// 次の n 個のコマンドバイトに応答しない・再送要求(FE)で応答する(化けて届いた場合)
+	int ignore_commands = 0;
+	int garble_commands = 0;
+	uint8_t leds() const { return led_value; }
+	uint8_t code_set() const { return set; }
+	/**
+	 * @brief F3 で設定されたタイプマティックの値(リセットで既定値 0x2b に戻る)
+	 */
+	uint8_t typematic() const { return typematic_value; }
+	/**
+	 * @brief セット2のキーに対応するセット3のコード(無ければ 0)
+	 */
+	static uint8_t set3_code(uint16_t key);
+
+ protected:
+	void on_host_send(uint8_t cmd) override;
+
+ private:
+	uint8_t pending_command = 0;
+	uint8_t led_value = 0;
+	uint8_t typematic_value = DEFAULT_TYPEMATIC;
+	uint8_t set = 2;
+	bool make_only[256] = {};
+	bool key_list = false;  // FD の後のキーの列を受け取っている
+};
+
+/**
+ * @brief スクリプト化した PS/2 マウス
+ *
+ * リセットに ACK・BAT 完了(AA)・ID(00)で応答する。wheel ならサンプルレートを 200,100,80 と設定した後の
+ * ID の読み出しに 03 を返し(IntelliMouse)、以後は4バイトのパケットを送る。ストリームモードを有効に(F4)されるまで
+ * 動きは送らない。
+ */
+class Mouse : public Device {
+ public:
+	explicit Mouse(size_t port = 1) : Device(port) {}
+
+	/**
+	 * @brief 動きとボタンの状態を1パケットで送る(USB と同じ向き: 右・下・上へのスクロールが正)
+	 *
+	 * @return uint64_t 最後のバイトがファームウェアに届く時刻。ストリームモードでなければ送らずに現在時刻
+	 */
+	uint64_t move(int dx, int dy, int wheel_delta = 0, uint64_t t_us = 0);
+	/**
+	 * @brief ボタン(USB と同じビット)を押す・離す(動きのないパケットを送る)
+	 */
+	uint64_t press(uint8_t button, uint64_t t_us = 0);
+	uint64_t release(uint8_t button, uint64_t t_us = 0);
+
+	uint32_t bat_us = 300000;
+	bool wheel = true;
+	bool streaming() const { return stream; }
+	uint8_t id() const { return device_id; }
+	uint8_t sample_rate() const { return rate; }
+
+ protected:
+	void on_host_send(uint8_t cmd) override;
+
+ private:
+	uint8_t pending_command = 0;
+	uint8_t rate = 100;
+	uint8_t rates[3] = {};  // 最近設定されたサンプルレート(IntelliMouse の判定)
+	uint8_t device_id = 0;
+	uint8_t buttons = 0;
+	bool stream = false;
+};
+
+/* 統計 */
+
+struct LatencyStats {
+	size_t count = 0;
+	uint64_t min = 0;
+	uint64_t max = 0;
+	double avg = 0;
+	uint64_t p50 = 0;
+	uint64_t p99 = 0;
+};
+
+LatencyStats summarize(std::vector<uint64_t> samples);
+
+}  // namespace sim
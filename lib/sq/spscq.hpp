@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace ax2usb {
+
+/**
+ * @brief 単一生産者・単一消費者のロックフリーリングバッファ
+ *
+ * put() は生産者(受信割り込み)だけ、get()/peek() は消費者(メインループ)だけが呼ぶこと。
+ * 各インデックスは片側だけが書き込むので RMW 命令が不要で、Cortex-M0+ でも割り込みを禁止せずに使える。
+ *
+ * @tparam T 要素の型
+ * @tparam N 容量(2のべき乗)
+ */
+template <typename T, size_t N>
+class SPSCQ {
+	static_assert(N > 0 && (N & (N - 1)) == 0, "SPSCQ capacity must be a power of two");
+
+ public:
+	SPSCQ() {}
+	bool put(T v) {
+		size_t w = wi.load(std::memory_order_relaxed);
+		size_t r = ri.load(std::memory_order_acquire);
+		if (w - r == N) {
+			overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return false;
+		}
+		buffer[w & MASK] = v;
+		wi.store(w + 1, std::memory_order_release);
+		if (w + 1 - r > hwm.load(std::memory_order_relaxed)) {
+			hwm.store(w + 1 - r, std::memory_order_relaxed);
+		}
+		return true;
+	}
+	bool get(T& v) { return get(&v, 1) == 1; }
+	/**
+	 * @brief 最大 max 個をまとめて取り出す
+	 *
+	 * @return size_t 取り出した個数
+	 */
+	size_t get(T* out, size_t max) {
+		size_t n = peek(out, max);
+		if (n > 0) {
+			ri.store(ri.load(std::memory_order_relaxed) + n, std::memory_order_release);
+		}
+		return n;
+	}
+	bool peek(T& v) const { return peek(&v, 1) == 1; }
+	/**
+	 * @brief 最大 max 個を取り出さずに読む
+	 *
+	 * @return size_t 読んだ個数
+	 */
+	size_t peek(T* out, size_t max) const {
+		size_t r = ri.load(std::memory_order_relaxed);
+		size_t w = wi.load(std::memory_order_acquire);
+		size_t n = w - r < max ? w - r : max;
+		for (size_t i = 0; i < n; i++) {
+			out[i] = buffer[(r + i) & MASK];
+		}
+		return n;
+	}
+	size_t count() const {
+		size_t r = ri.load(std::memory_order_acquire);
+		return wi.load(std::memory_order_acquire) - r;
+	}
+	size_t capacity() const { return N; }
+	/**
+	 * @brief 満杯のため put() できなかった回数
+	 */
+	uint32_t overflow_count() const { return overflows.load(std::memory_order_relaxed); }
+	/**
+	 * @brief これまでの最大格納数
+	 */
+	size_t high_watermark() const { return hwm.load(std::memory_order_relaxed); }
+
+ private:
+	static constexpr size_t MASK = N - 1;
+	T buffer[N] = {};
+	std::atomic<size_t> ri{ 0 };  // 消費者のみ書き込む
+	std::atomic<size_t> wi{ 0 };  // 生産者のみ書き込む
+	std::atomic<uint32_t> overflows{ 0 };
+	std::atomic<size_t> hwm{ 0 };
+};
+
+}  // namespace ax2usb
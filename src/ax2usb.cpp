@@ -1,14 +1,10 @@
 #include "ax2usb.h"
 #include <Arduino.h>
-#include <mutex>
-#include <string>
 #include "ax2usbmap.hpp"
+#include "log.hpp"
 #include "ps2code.hpp"
 #include "util.h"
 
-#define AX2USB_DEBUG 1
-#include "debug.h"
-
 namespace ax2usb {
 
 namespace {
@@ -16,449 +12,1045 @@ namespace {
 constexpr uint8_t REPORT_ID_SYS = 2;
 constexpr uint8_t REPORT_ID_CONSUMER = 3;
 constexpr const uint8_t desc_hid_report[] = { TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(AX2USB::REPORT_ID_KBD)),
+#if AX2USB_NKRO
+	                                            AX2USB_HID_REPORT_DESC_NKRO_KEYBOARD(HID_REPORT_ID(AX2USB::REPORT_ID_NKRO)),
+#endif
 	                                            TUD_HID_REPORT_DESC_SYSTEM_CONTROL(HID_REPORT_ID(REPORT_ID_SYS)),
-	                                            TUD_HID_REPORT_DESC_CONSUMER(HID_REPORT_ID(REPORT_ID_CONSUMER)) };
-
-constexpr uint8_t SYSTEM_CONTROL_POWER_OFF = 0x01;
-constexpr uint8_t SYSTEM_CONTROL_STANDBY = 0x02;
-constexpr uint8_t SYSTEM_CONTROL_WAKE_HOST = 0x03;
+#if AX2USB_MOUSE
+	                                            TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(AX2USB::REPORT_ID_MOUSE)),
+#endif
+	                                            TUD_HID_REPORT_DESC_CONSUMER(HID_REPORT_ID(REPORT_ID_CONSUMER)),
+	                                            AX2USB_HID_REPORT_DESC_HEALTH(HID_REPORT_ID(AX2USB::REPORT_ID_HEALTH)) };
 
 constexpr uint16_t DO_NOTHING = 0x00;
-constexpr uint16_t TRANSPORT_CONTROL_PLAY = 0xb0;
-constexpr uint16_t TRANSPORT_CONTROL_PAUSE = 0xb1;
-constexpr uint16_t TRANSPORT_CONTROL_SCAN_NEXT_TRACK = 0xb5;
-constexpr uint16_t TRANSPORT_CONTROL_SCAN_PREVIOUS_TRACK = 0xb6;
-constexpr uint16_t TRANSPORT_CONTROL_PLAY_PAUSE = 0xcd;
 
-constexpr uint16_t AUDIO_CONTROL_MUTE = 0xe2;
-constexpr uint16_t AUDIO_CONTROL_VOLUME_INCREMENT = 0xe9;
-constexpr uint16_t AUDIO_CONTROL_VOLUME_DECREMENT = 0xea;
+static_assert(AX2USB_POLL_INTERVAL_MS >= 1 && AX2USB_POLL_INTERVAL_MS <= 8 &&
+                  (AX2USB_POLL_INTERVAL_MS & (AX2USB_POLL_INTERVAL_MS - 1)) == 0,
+              "AX2USB_POLL_INTERVAL_MS must be 1, 2, 4 or 8");
+static_assert(AX2USB_REPORT_TIMING == 0 || AX2USB_HAS_SOF,
+              "AX2USB_REPORT_TIMING 1 and 2 need the SOF callback (Adafruit TinyUSB Library 3.x)");
+
+// キーボードはコマンドに 20ms 以内に応答する。届かなければ送り直す
+constexpr uint32_t COMMAND_TIMEOUT_USEC = 25000;
+constexpr uint8_t COMMAND_TRIES_MAX = 3;
+// プレフィクスの後のバイトが届くまでの時間の上限(1バイトの転送は約1ms)
+constexpr uint32_t PREFIX_TIMEOUT_USEC = 10000;
+// BAT 失敗・診断エラーでキーボードをリセットする回数の上限(BAT 完了で数え直す)
+constexpr uint8_t RESET_TRIES_MAX = 3;
+// 起動直後に ECHO を送り、キーボードから何も届かなければこの間隔で送り直す
+constexpr uint32_t ECHO_INTERVAL_USEC = 500000;
+// 1バイトの受信で積む可能性のあるレポートの最大数(Fn+キーの make/break、タップのキーの make/break など)
+constexpr size_t REPORTS_PER_CODE_MAX = 2;
+// 仕事がないときの最長休止時間(タイマーの期限が近ければそこで起きる)
+constexpr uint32_t IDLE_SLEEP_USEC = 10000;
+// 送信キューが空くのを待つタイマーを設定し直す間隔
+constexpr uint32_t BUSY_RETRY_USEC = 1000;
+// すべて離した後、キーボードのタイプマティックの make を押し続けていたキーとして受け取る期限
+// (セット2のタイプマティックは最も遅くして1000ms 後から)
+constexpr uint32_t RESUME_WINDOW_USEC = 1100000;
+// サスペンド中の最長休止時間(PS/2 受信で即座に起きる)
+constexpr uint32_t SUSPENDED_SLEEP_USEC = 100000;
+// ログの書き出し途中の休止時間(115200bps で約11バイト分)
+constexpr uint32_t LOG_DRAIN_SLEEP_USEC = 1000;
 
-constexpr uint32_t STATE_TIMEOUT_MSEC = 300;
-constexpr uint32_t INITIAL_RESPONSE_TIMEOUT = 500;
-constexpr int USB_SEND_RETRY_COUNT = 3;
+// スキャンコードセット3に切り替え、読み戻して確かめ、全キー make/break・タイプマティックなしにし、
+// make だけを送らせるキーを設定する
+constexpr size_t SET3_STEP_COUNT = 8 + std::size(set3::make_only_codes);
+// この手順まで進んだらキーボードはセット3になっているかもしれない
+constexpr size_t SET3_SWITCHED_STEP = 2;
+
+constexpr std::array<ps2_step_t, SET3_STEP_COUNT>
+make_set3_steps() {
+	std::array<ps2_step_t, SET3_STEP_COUNT> t{};
+	size_t n = 0;
+	t[n++] = { ps2cmd::SELECT_CODE_SET, ps2ind::ACK };
+	t[n++] = { 0x03, ps2ind::ACK };
+	t[n++] = { ps2cmd::SELECT_CODE_SET, ps2ind::ACK };
+	t[n++] = { 0x00, ps2ind::ACK };
+	t[n++] = { -1, 0x03 };
+	t[n++] = { ps2cmd::SET_ALL_MAKE_BREAK, ps2ind::ACK };
+	t[n++] = { ps2cmd::SET_KEY_MAKE, ps2ind::ACK };
+	for (auto code : set3::make_only_codes) {
+		t[n++] = { code, ps2ind::ACK };
+	}
+	// キーの列を終わらせてキー入力を再開する
+	t[n++] = { ps2cmd::ENABLE, ps2ind::ACK };
+	return t;
+}
+
+constexpr auto SET3_STEPS = make_set3_steps();
+// セット2のタイプマティックは止められないので、最も遅く(1000ms 後に 2cps)する。リピートはホストかファームウェアで行う
+constexpr uint8_t TYPEMATIC_SLOWEST = 0x7f;
+constexpr ps2_step_t TYPEMATIC_STEPS[] = { { ps2cmd::SET_TYPEMATIC, ps2ind::ACK }, { TYPEMATIC_SLOWEST, ps2ind::ACK } };
+// セット3への切り替えが途中で失敗したときにセット2に戻す
+constexpr ps2_step_t SET2_STEPS[] = { { ps2cmd::SELECT_CODE_SET, ps2ind::ACK },
+	                                  { 0x02, ps2ind::ACK },
+	                                  { ps2cmd::SET_TYPEMATIC, ps2ind::ACK },
+	                                  { TYPEMATIC_SLOWEST, ps2ind::ACK } };
+// LED の値は送る時点の最新の値にする
+constexpr int16_t SEND_LED_VALUE = 0x100;
+constexpr ps2_step_t LED_STEPS[] = { { ps2cmd::MODE_IND, ps2ind::ACK }, { SEND_LED_VALUE, ps2ind::ACK } };
+constexpr ps2_step_t RESET_STEPS[] = { { ps2cmd::RESET, ps2ind::ACK } };
 
 }  // namespace
 
-#if AX2USB_DEBUG
-char
-AX2USB::usb_mod_char(uint8_t mod_key) {
-	switch (mod_key) {
-		case HID_KEY_CONTROL_LEFT:
-			return 'C';
-		case HID_KEY_SHIFT_LEFT:
-			return 'S';
-		case HID_KEY_ALT_LEFT:
-			return 'A';
-		case HID_KEY_GUI_LEFT:
-			return 'W';
-		case HID_KEY_CONTROL_RIGHT:
-			return 'c';
-		case HID_KEY_SHIFT_RIGHT:
-			return 's';
-		case HID_KEY_ALT_RIGHT:
-			return 'a';
-		case HID_KEY_GUI_RIGHT:
-			return 'w';
-		default:
-			return '*';
+bool
+AX2USB::begin(uint8_t ps2_data_pin, uint8_t ps2_clock_pin) {
+	if (!init_usb()) {
+		return false;
 	}
+	begin_ps2(ps2_data_pin, ps2_clock_pin);
+	return true;
+}
+
+bool
+AX2USB::begin_split() {
+	split = true;
+	return init_usb();
 }
 
-std::string
-AX2USB::usb_led_str() const {
-	std::string ret;
+void
+AX2USB::begin_ps2(uint8_t ps2_data_pin, uint8_t ps2_clock_pin) {
+	ps2.set_recv_callback([this](auto code) {
+		rx_bytes.add();
+		uint32_t now = micros();
+		if (rx.put({ code, now, rx_dropping })) {
+			rx_dropping = false;
+		} else {
+			// 次に入れたバイトの lost_before と overflow_count() で PS/2 側に伝える
+			rx_dropping = true;
+			rx_lost_us.store(now, std::memory_order_relaxed);
+		}
+		rx_wake().signal();
+	});
+	ps2.begin(ps2_data_pin, ps2_clock_pin);
+	// USB の列挙を待たずに最初の poll_ps2() で ECHO を送り、応答で LED とタイプマティックを設定する
+	ps2_timers.arm(ps2_timer_t::echo, micros());
+}
 
-	ret += usb_led.num ? 'N' : 'n';
-	ret += usb_led.caps ? 'C' : 'c';
-	ret += usb_led.scroll ? 'S' : 's';
-	ret += usb_led.compose ? 'M' : 'm';
-	ret += usb_led.kana ? 'K' : 'k';
+#if AX2USB_MOUSE
+void
+AX2USB::begin_mouse(uint8_t mouse_data_pin, uint8_t mouse_clock_pin, uint8_t sample_rate) {
+	mouse_port.set_recv_callback([this](auto code) {
+		if (mouse_rx.put({ code, micros(), mouse_rx_dropping })) {
+			mouse_rx_dropping = false;
+		} else {
+			// 次に入れたバイトの lost_before で PS/2 側に伝え、組み立て中のパケットを捨てさせる
+			mouse_rx_dropping = true;
+		}
+		rx_wake().signal();
+	});
+	mouse_port.begin(mouse_data_pin, mouse_clock_pin);
+	mouse.set_sample_rate(sample_rate);
+	mouse_enabled = true;
+	apply_mouse(mouse.start());
+}
 
-	return ret;
+AX2USB::mouse_stats_t
+AX2USB::mouse_stats() const {
+	return { mouse.state() == Ps2Mouse::state_t::streaming,
+		     mouse.has_wheel(),
+		     mouse.restarts(),
+		     mouse.dropped_packets(),
+		     mouse_motion.packets(),
+		     mouse_motion.reports() };
 }
 
-static char
-mod_mark(bool make_break) {
-	return make_break ? '#' : '~';
+void
+AX2USB::apply_mouse(const Ps2Mouse::result_t& r) {
+	if (r.send >= 0) {
+		mouse_port.send(r.send);
+	}
+	if (r.packet) {
+		mouse_motion.add(mouse.packet());
+		// 2コア時は core 0 を起こす
+		wake.signal();
+	}
+	if (uint32_t t = mouse.timeout_us(); t) {
+		ps2_timers.arm(ps2_timer_t::mouse, micros() + t);
+	} else {
+		ps2_timers.cancel(ps2_timer_t::mouse);
+	}
 }
 
-static char
-key_mark(bool make_break) {
-	return make_break ? '+' : '-';
+bool
+AX2USB::poll_mouse() {
+	if (!mouse_enabled || mouse_rx.count() == 0) {
+		return false;
+	}
+	bool was_streaming = mouse.state() == Ps2Mouse::state_t::streaming;
+	rx_code_t rc;
+	while (mouse_rx.get(rc)) {
+		if (rc.lost_before && mouse.state() == Ps2Mouse::state_t::streaming) {
+			// 捨てたバイトの分だけパケットの区切りがずれるので、パケットの途中なら期限切れと同じく捨てる
+			apply_mouse(mouse.expire());
+		}
+		apply_mouse(mouse.feed(rc.code));
+	}
+	if (!was_streaming && mouse.state() == Ps2Mouse::state_t::streaming) {
+		LOG_INFO(MOUSE_READY, mouse.has_wheel());
+	}
+	return true;
 }
 
-static const char*
-mb_str(bool make_break) {
-	return make_break ? "make" : "break";
-};
+void
+AX2USB::send_mouse_report() {
+	// キーボードレポートを優先する。動きは送れるようになるまで mouse_motion に足しておく
+	if (mouse_motion.empty() || !kutil.idle()) {
+		return;
+	}
+	hid_mouse_report_t report;
+	if (!mouse_motion.take(report)) {
+		return;
+	}
+	// ブートプロトコル(キーボード)ではマウスのレポートは送れないので捨てる
+	if (tud_hid_get_protocol() != HID_PROTOCOL_BOOT) {
+		kutil.send_report(REPORT_ID_MOUSE, &report, sizeof(report));
+	}
+}
 #endif
 
 bool
-AX2USB::begin(uint8_t ps2_data_pin, uint8_t ps2_clock_pin) {
+AX2USB::set_keymap(const keymap::layer_t* layers, size_t count) {
+	return keymap.load(layers, count);
+}
+
+bool
+AX2USB::init_usb() {
 	usb_hid.setBootProtocol(HID_ITF_PROTOCOL_KEYBOARD);
 	usb_hid.setReportDescriptor(desc_hid_report, sizeof(desc_hid_report));
-	usb_hid.setPollInterval(2);
+	usb_hid.setPollInterval(poll_interval_ms);
 	usb_hid.enableOutEndpoint(false);
-	usb_hid.setReportCallback(nullptr, hid_report_callback);
+	usb_hid.setReportCallback(hid_get_report_callback, hid_report_callback);
 
 #if defined(ARDUINO_ARCH_MBED) && defined(ARDUINO_ARCH_RP2040)
 	// Manual begin() is required on core without built-in support for TinyUSB
-	// such as mbed rp2040
 	TinyUSB_Device_Init(0);
 #endif
 
 	if (!usb_hid.begin()) {
 		return false;
 	}
+	kutil.set_timing(report_timing, poll_interval_ms);
+	return true;
+}
 
-	ps2.set_recv_callback([this](auto code) {
-		std::lock_guard lock(rx_mux);
-		rx.put(code);
-	});
-	ps2.begin(ps2_data_pin, ps2_clock_pin);
-
-	while (!TinyUSBDevice.mounted()) {
-		delay(1);
+bool
+AX2USB::set_poll_interval(uint8_t interval_ms) {
+	// sof では位相をフレーム番号の下位ビットで判定するので2のべき乗に限る
+	if (interval_ms == 0 || interval_ms > 8 || (interval_ms & (interval_ms - 1))) {
+		return false;
 	}
+	poll_interval_ms = interval_ms;
+	return true;
+}
 
-#if AX2USB_DEBUG
-	for (size_t i = 0; i < std::size(map::ax2_usb); i++) {
-		auto v = map::ax2_usb[i];
-		if (v == 0)
-			continue;
-		for (size_t j = i + 1; j < std::size(map::ax2_usb); j++) {
-			if (map::ax2_usb[j] == v) {
-				DEBUG_PRINTLN("map[%u] and map[%u] are same", i, j);
-			}
-		}
+void
+AX2USB::check_mounted() {
+	if (boot.usb_mounted_us || !TinyUSBDevice.mounted()) {
+		return;
 	}
-#endif
+	boot.usb_mounted_us = micros();
+	LOG_INFO(USB_MOUNTED, boot.usb_mounted_us);
+}
 
-	return true;
+AX2USB::ps2_errors_t
+AX2USB::ps2_errors() const {
+	return { errors.overrun.get(),     errors.self_test.get(),      errors.resend.get(),
+		     errors.ack_timeout.get(), errors.prefix_timeout.get(), errors.resync.get(),
+		     errors.led_timeout.get(), errors.unexpected.get(),     errors.set3_unmapped.get() };
+}
+
+health::health_report_t
+AX2USB::health() {
+	uptime.update(micros());
+	auto e = ps2_errors();
+	auto q = kutil.queue_stats();
+	health::health_report_t h = {};
+	h.version = health::VERSION;
+	h.scan_code_set = active_set;
+	h.rx_high_watermark = rx.high_watermark();
+	h.tx_high_watermark = q.high_watermark;
+	h.uptime_s = uptime.seconds();
+	h.rx_bytes = rx_bytes.get();
+	h.rx_dropped = rx.overflow_count();
+	h.overrun = e.overrun;
+	h.self_test = e.self_test;
+	h.resend = e.resend;
+	h.unexpected = e.unexpected;
+	h.prefix_timeout = e.prefix_timeout;
+	h.resync = e.resync;
+	h.ack_timeout = e.ack_timeout;
+	h.led_timeout = e.led_timeout;
+	h.usb_reports = q.pushed;
+	h.usb_dropped = q.dropped;
+	h.usb_retries = q.retries;
+	h.set3_unmapped = static_cast<uint16_t>(e.set3_unmapped);
+	return h;
+}
+
+AX2USB::boot_times_t
+AX2USB::boot_times() const {
+	boot_times_t t = boot;
+	t.ps2_ready_us = ps2_ready_us.load(std::memory_order_relaxed);
+	return t;
 }
 
 bool
 AX2USB::ps2_available() const {
-	std::lock_guard lock(rx_mux);
 	return rx.count() > 0;
 }
 
-int
-AX2USB::ps2_read() {
-	std::lock_guard lock(rx_mux);
-	uint8_t v;
-	if (rx.get(v)) {
-		return v;
-	}
-	return -1;
+bool
+AX2USB::ps2_read(rx_code_t& rc) {
+	return rx.get(rc);
 }
 
 void
-AX2USB::handle_code(uint8_t code, bool make_break) {
-	if (code == ps2key::ALT_PRINT_SCREEN) {
-		kutil.send_usb_key_mod(HID_KEY_PRINT_SCREEN, HID_KEY_ALT_LEFT, make_break);
-	} else if (code < std::size(map::ax2_usb)) {
-		if (auto usb = map::ax2_usb[code]; usb) {
-			if (!handle_special_key(usb, make_break)) {
-				kutil.send_usb_key(usb, make_break);
+AX2USB::handle_action(const rx_code_t& rc, uint32_t dequeued_us, const set2::action_t& act) {
+	switch (act.op) {
+		case set2::op_t::key:
+			emit({ act.key, act.make_break, rc.rx_us, dequeued_us });
+			break;
+		case set2::op_t::key_tap:
+			emit({ act.key, true, rc.rx_us, dequeued_us, true });
+			break;
+		case set2::op_t::led_sync:
+			if (rc.code == ps2ind::BAT_COMPLETED) {
+				// キーボードがリセットされてセット2に戻った
+				active_set = 2;
+				reset_tries = 0;
 			}
-		} else {
-			DEBUG_PRINTLN("%s %02x is not mapped to usb_key", mb_str(make_break), code);
-		}
-	} else {
-		DEBUG_PRINTLN("%s %02x not handled", mb_str(make_break), code);
+			// 起動時(ECHO の応答)とリセット後にキーボードを設定する
+			commands.push(command_t::init);
+			should_send_led.store(true, std::memory_order_relaxed);
+			break;
+		case set2::op_t::fake_shift:
+			LOG_DEBUG(FAKE_SHIFT, act.make_break);
+			break;
+		case set2::op_t::unmapped:
+			errors.unexpected.add();
+			if (active_set == 3 && act.make_break) {
+				errors.set3_unmapped.add();
+			}
+			LOG_DEBUG(UNMAPPED, act.make_break, act.key);
+			break;
+		case set2::op_t::error:
+			handle_error(rc, dequeued_us);
+			break;
+		default:
+			break;
 	}
 }
 
-AX2USB::state_t
-AX2USB::state_base(uint8_t code) {
-	if (code == ps2ind::BREAK) {
-		return state_t::brk_received;
-	} else if (code == ps2ind::E0) {
-		return state_t::e0_received;
-	} else if (code == ps2ind::E1) {
-		return state_t::e1_received;
-	} else if (code == ps2ind::BAT_COMPLETED || code == ps2ind::ECHO_RESPONSE) {
-		should_send_led = true;
-	} else {
-		handle_code(code, true);
+void
+AX2USB::handle_error(const rx_code_t& rc, uint32_t dequeued_us) {
+	LOG_WARN(PS2_ERROR, rc.code);
+	if (rc.code == ps2ind::RESEND) {
+		// 待っている応答が無いときの再送要求は送り直すものが無い
+		errors.resend.add();
+		return;
+	}
+	// 取りこぼした break があるかもしれない
+	errors.resync.add();
+	emit({ key_event_t::RELEASE_ALL, false, rc.rx_us, dequeued_us });
+	if (rc.code == ps2ind::OVERRUN) {
+		errors.overrun.add();
+		return;
+	}
+	errors.self_test.add();
+	if (reset_tries < RESET_TRIES_MAX) {
+		// リセットして BAT をやり直させる。BAT 完了(AA)で初期化コマンド列から送り直す
+		reset_tries++;
+		commands.push(command_t::reset);
 	}
-	return state_t::base;
 }
 
-AX2USB::state_t
-AX2USB::state_brk_received(uint8_t code) {
-	handle_code(code, false);
-	return state_t::base;
+void
+AX2USB::resync_decoder(uint32_t rx_us, uint32_t dequeued_us) {
+	auto prefix = active_set == 3 ? decoder3.state() : decoder.state();
+	LOG_WARN(PREFIX_TIMEOUT, static_cast<unsigned>(prefix));
+	errors.prefix_timeout.add();
+	decoder.reset();
+	decoder3.reset();
+	if (prefix == set2::prefix_t::brk || prefix == set2::prefix_t::e0_brk || prefix == set2::prefix_t::e1_brk) {
+		// break の途中で途切れた。離したはずのキーが押されたままになる
+		errors.resync.add();
+		emit({ key_event_t::RELEASE_ALL, false, rx_us, dequeued_us });
+	}
+}
+
+void
+AX2USB::begin_rx_resync(uint32_t dequeued_us) {
+	rx_overflows_seen = rx.overflow_count();
+	ps2_timers.cancel(ps2_timer_t::prefix);
+	ps2_timers.arm(ps2_timer_t::rx_resync, dequeued_us + PREFIX_TIMEOUT_USEC);
+	if (rx_resyncing) {
+		return;
+	}
+	LOG_WARN(RX_OVERFLOW, rx_overflows_seen);
+	rx_resyncing = true;
+	decoder.reset();
+	decoder3.reset();
+	// 取りこぼした break があるかもしれない。押し続けているキーは、キーボードが make を送り直せば(セット2の
+	// タイプマティック、最も遅くして約1秒後)押し直す。セット3はタイプマティックが無いので、押し直すまで離れたまま
+	errors.resync.add();
+	emit({ key_event_t::RELEASE_ALL, false, last_rx_us, dequeued_us });
+}
+
+void
+AX2USB::finish_rx_resync(uint32_t now) {
+	// 最後に受信したか捨てたバイトから数える
+	uint32_t last = last_rx_us;
+	uint32_t lost = rx_lost_us.load(std::memory_order_relaxed);
+	if (static_cast<int32_t>(lost - last) > 0) {
+		last = lost;
+	}
+	if (ps2_available() || now - last < PREFIX_TIMEOUT_USEC) {
+		// 受信済みのバイトは handle_ps2_code() が捨てて期限を延ばす
+		uint32_t at = last + PREFIX_TIMEOUT_USEC;
+		ps2_timers.arm(ps2_timer_t::rx_resync, static_cast<int32_t>(at - now) > 0 ? at : now + BUSY_RETRY_USEC);
+		return;
+	}
+	rx_resyncing = false;
+}
+
+bool
+AX2USB::can_emit() const {
+	if (split) {
+		return !has_pending_event;
+	}
+	return can_handle_event();
+}
+
+bool
+AX2USB::can_handle_event() const {
+	return kutil.queue_space() >= REPORTS_PER_CODE_MAX && !tap_hold.full();
+}
+
+void
+AX2USB::emit(const key_event_t& ev) {
+	if (!split) {
+		handle_key_event(ev);
+		return;
+	}
+	if (!channel.push(ev)) {
+		// 受け取られるまで次のバイトをデコードしない(バイトは rx に残る)
+		pending_event = ev;
+		has_pending_event = true;
+	}
+	wake.signal();
+}
+
+void
+AX2USB::handle_key_event(const key_event_t& ev) {
+	if (!tap_hold.active()) {
+		process_key_event(ev);
+		return;
+	}
+	// 判定中・取り出し待ちのイベントの後に並べる。タップのキーはこのイベントの遅延として計測する
+	kutil.set_event_time(ev.rx_us, ev.dequeued_us);
+	tap_hold.push(ev);
+	run_tap_hold();
+	kutil.clear_event_time();
 }
 
 void
-AX2USB::handle_e0_code(uint8_t code, bool make_break) {
-	if (code == ps2key::L_SHIFT || code == ps2key::R_SHIFT) {
-		DEBUG_PRINTLN("simply ignore %cshift after E0", key_mark(make_break));
-	} else if (code == ps2key::BREAK) {  // [Pause/Break] key
-		if (!handle_special_key(HID_KEY_PAUSE, make_break)) {
-			kutil.send_usb_key_mod(HID_KEY_PAUSE, HID_KEY_CONTROL_LEFT, make_break);
+AX2USB::process_key_event(const key_event_t& ev) {
+	kutil.set_event_time(ev.rx_us, ev.dequeued_us);
+	if (ev.key == key_event_t::RELEASE_ALL) {
+		release_all(ev.rx_us);
+		kutil.clear_event_time();
+		return;
+	}
+	if (ev.make_break) {
+		if (!boot.first_key_us) {
+			boot.first_key_us = micros();
+			LOG_INFO(FIRST_KEY, boot.first_key_us, ps2_ready_us.load(std::memory_order_relaxed), boot.usb_mounted_us);
 		}
-	} else {
-		if (auto* ent = find_e0_map(code); ent) {
-			if (!handle_special_key(ent->usb, make_break)) {
-				kutil.send_usb_key(ent->usb, make_break);
+		press_key(ev.key, ev.rx_us, resume_key(ev.key, ev.rx_us));
+	}
+	if (!ev.make_break || ev.tap) {
+		resume_bits[ev.key / 32] &= ~(1u << (ev.key % 32));
+		release_key(ev.key);
+	}
+	kutil.clear_event_time();
+}
+
+void
+AX2USB::release_all(uint32_t rx_us) {
+	LOG_WARN(RELEASE_ALL);
+	for (size_t key = 0; key < keymap::KEY_COUNT; key++) {
+		if (keymap.is_pressed(key)) {
+			resume_bits[key / 32] |= 1u << (key % 32);
+		}
+	}
+	resume_from_us = rx_us;
+	keymap.release_all();
+	repeater.stop();
+	arm_repeat();
+	kutil.release_all_keys();
+	if (consumer_control_active) {
+		kutil.send_report16(REPORT_ID_CONSUMER, DO_NOTHING);
+		consumer_control_active = false;
+	}
+}
+
+bool
+AX2USB::resume_key(keymap::key_t key, uint32_t rx_us) {
+	bool resumed = (resume_bits[key / 32] & (1u << (key % 32))) && rx_us - resume_from_us < RESUME_WINDOW_USEC;
+	for (auto& b : resume_bits) {
+		b = 0;
+	}
+	return resumed;
+}
+
+void
+AX2USB::run_tap_hold() {
+	key_event_t ev;
+	for (;;) {
+		if (tap_hold.undecided()) {
+			auto d = tap_hold.decide();
+			if (d == TapHold::decision_t::undecided) {
+				return;
 			}
+			resolve_tap_hold(d);
+		} else if (kutil.queue_space() < REPORTS_PER_CODE_MAX || !tap_hold.pop(ev)) {
+			return;
 		} else {
-			DEBUG_PRINTLN("%02x: Unexpected code after E0 %s", code, mb_str(make_break));
+			// 押したキーがタップ・ホールドなら、残りのイベントはその判定に使う
+			process_key_event(ev);
 		}
 	}
 }
 
-AX2USB::state_t
-AX2USB::state_e0_received(uint8_t code) {
-	if (code == ps2ind::BREAK) {  // key release
-		return e0_break_received;
+void
+AX2USB::resolve_tap_hold(TapHold::decision_t d) {
+	usb_timers.cancel(usb_timer_t::tap_hold);
+	const auto& act = tap_hold.action();
+	if (d == TapHold::decision_t::tap) {
+		// キーを離したイベントは取り除かれているので、ここで離したことにする
+		keymap.release(tap_hold.key());
+		LOG_DEBUG(TAP, tap_hold.key());
+		kutil.send_usb_key_oneshot(act.usage);
+	} else {
+		keymap.set_layer(act.arg, true);
+		LOG_DEBUG(LAYER, true, act.arg);
 	}
-	handle_e0_code(code, true);
-	return state_t::base;
 }
 
-AX2USB::state_t
-AX2USB::state_e0_break_received(uint8_t code) {
-	handle_e0_code(code, false);
-	return state_t::base;
+void
+AX2USB::poll_tap_hold() {
+	if (!tap_hold.active()) {
+		return;
+	}
+	if (coalescing) {
+		kutil.begin_batch();
+	}
+	run_tap_hold();
+	if (coalescing) {
+		kutil.end_batch();
+	}
 }
 
-AX2USB::state_t
-AX2USB::state_e1_received(uint8_t code) {
-	if (code == ps2ind::BREAK) {
-		return state_t::e1_break_received;
-	} else if (code == ps2key::L_CTRL) {
-		// wait for pause, keep state
-		return state_t::e1_received;
-	} else if (code == ps2key::PAUSE) {
-		if (!handle_special_key(HID_KEY_PAUSE, true)) {
-			kutil.send_usb_key(HID_KEY_PAUSE, true);
-		}
-	} else {
-		DEBUG_PRINTLN("%02x: Unexpected code after E1 make", code);
+void
+AX2USB::expire_tap_hold(uint32_t now) {
+	if (tap_hold.expire(now) == TapHold::decision_t::hold) {
+		resolve_tap_hold(TapHold::decision_t::hold);
 	}
-	return state_t::base;
 }
 
-AX2USB::state_t
-AX2USB::state_e1_break_received(uint8_t code) {
-	if (code == ps2key::L_CTRL) {
-		// wait for pause, keep state
-		return state_t::e1_received;
-	} else if (code == ps2key::PAUSE) {
-		if (!handle_special_key(HID_KEY_PAUSE, false)) {
-			kutil.send_usb_key(HID_KEY_PAUSE, false);
-		}
-	} else {
-		DEBUG_PRINTLN("%02x: Unexpected code after E1 break", code);
+void
+AX2USB::fire_repeat(uint32_t now) {
+	if (kutil.queue_space() < REPORTS_PER_CODE_MAX) {
+		usb_timers.arm(usb_timer_t::repeat, now + BUSY_RETRY_USEC);
+		return;
 	}
-	return state_t::base;
+	// 離して押し直す2つのレポートを続けて積む(まとめるとホストには押したままに見える)
+	if (repeater.due(now)) {
+		kutil.send_usb_key(repeater.usb(), false);
+		kutil.send_usb_key(repeater.usb(), true);
+	}
+	arm_repeat();
 }
 
-AX2USB::state_t
-AX2USB::state_led_wait_ack(uint8_t code) {
-	if (code == ps2ind::ACK) {
-		ps2.send(ps2_led.value);
-		should_send_led = false;
-		timeout_state_started = millis();
-		return state_t::wait_ack;
+void
+AX2USB::arm_repeat() {
+	if (repeater.repeating()) {
+		usb_timers.arm(usb_timer_t::repeat, repeater.next_due_us());
+	} else {
+		usb_timers.cancel(usb_timer_t::repeat);
 	}
-	return state_t::led_wait_ack;
 }
 
-AX2USB::state_t
-AX2USB::state_wait_ack(uint8_t code) {
-	if (code == ps2ind::ACK) {
-		return state_t::base;
+void
+AX2USB::poll_timers() {
+	uint32_t now = micros();
+	usb_timer_t t;
+	while (usb_timers.pop_expired(now, t)) {
+		if (t == usb_timer_t::tap_hold) {
+			expire_tap_hold(now);
+		} else {
+			fire_repeat(now);
+		}
 	}
-	return state_t::wait_ack;
+	poll_tap_hold();
 }
 
 void
-AX2USB::handle_fn_key(uint8_t usb, bool make_break) {
-	if (make_break) {
-		switch (usb) {
-			case HID_KEY_PAUSE:
-				usb_hid.sendReport8(REPORT_ID_SYS, SYSTEM_CONTROL_STANDBY);
+AX2USB::run_ps2_timers() {
+	uint32_t now = micros();
+	ps2_timer_t t;
+	while (ps2_timers.pop_expired(now, t)) {
+		switch (t) {
+			case ps2_timer_t::command:
+				errors.ack_timeout.add();
+				if (current_command == command_t::led) {
+					errors.led_timeout.add();
+				}
+				state = retry_command();
 				break;
-			case HID_KEY_KANJI6:  // AX
-				usb_hid.sendReport8(REPORT_ID_SYS, SYSTEM_CONTROL_POWER_OFF);
+			case ps2_timer_t::echo:
+				LOG_INFO(ECHO_SENT);
+				ps2.send(ps2cmd::ECHO);
+				ps2_timers.arm(ps2_timer_t::echo, now + ECHO_INTERVAL_USEC);
 				break;
-			case HID_KEY_KEYPAD_0:
-				kutil.send_report16_oneshot(REPORT_ID_CONSUMER, AUDIO_CONTROL_MUTE);
+			case ps2_timer_t::rx_resync:
+				finish_rx_resync(now);
 				break;
-			case HID_KEY_ARROW_DOWN:
-			case HID_KEY_KEYPAD_2:
-				if (!consumer_control_active) {
-					kutil.send_report16(REPORT_ID_CONSUMER, AUDIO_CONTROL_VOLUME_DECREMENT);
-					consumer_control_active = true;
+			case ps2_timer_t::prefix:
+				// 受信済みのバイトがあれば、その受信時刻で handle_ps2_code() が判定する
+				if (decoder_idle() || ps2_available()) {
+					break;
 				}
-				break;
-			case HID_KEY_ARROW_UP:
-			case HID_KEY_KEYPAD_8:
-				if (!consumer_control_active) {
-					kutil.send_report16(REPORT_ID_CONSUMER, AUDIO_CONTROL_VOLUME_INCREMENT);
-					consumer_control_active = true;
+				if (!can_emit()) {
+					ps2_timers.arm(ps2_timer_t::prefix, now + BUSY_RETRY_USEC);
+					break;
 				}
+				resync_decoder(last_rx_us, now);
 				break;
-			case HID_KEY_ARROW_LEFT:
-			case HID_KEY_KEYPAD_4:
-			case HID_KEY_PAGE_UP:
-				kutil.send_report16_oneshot(REPORT_ID_CONSUMER, TRANSPORT_CONTROL_SCAN_PREVIOUS_TRACK);
-				break;
-			case HID_KEY_ARROW_RIGHT:
-			case HID_KEY_KEYPAD_6:
-			case HID_KEY_PAGE_DOWN:
-				kutil.send_report16_oneshot(REPORT_ID_CONSUMER, TRANSPORT_CONTROL_SCAN_NEXT_TRACK);
-				break;
-			case HID_KEY_SPACE:
-			case HID_KEY_KEYPAD_5:
-				kutil.send_report16_oneshot(REPORT_ID_CONSUMER, TRANSPORT_CONTROL_PLAY_PAUSE);
-				break;
-			case HID_KEY_HOME:
-			case HID_KEY_KEYPAD_7:
-				kutil.send_report16_oneshot(REPORT_ID_CONSUMER, TRANSPORT_CONTROL_PLAY);
-				break;
-			case HID_KEY_END:
-			case HID_KEY_KEYPAD_1:
-				kutil.send_report16_oneshot(REPORT_ID_CONSUMER, TRANSPORT_CONTROL_PAUSE);
+#if AX2USB_MOUSE
+			case ps2_timer_t::mouse:
+				apply_mouse(mouse.expire());
 				break;
+#endif
 			default:
-				// NOOP
 				break;
 		}
+	}
+}
+
+uint32_t
+AX2USB::idle_timeout_us() const {
+	uint32_t now = micros();
+	uint32_t t = std::min(IDLE_SLEEP_USEC, usb_timers.remaining_us(now));
+	// 1コア時は PS/2 側のタイマーもこのループで実行する
+	return split ? t : std::min(t, ps2_timers.remaining_us(now));
+}
+
+AX2USB::state_t
+AX2USB::start_command(command_t c) {
+	current_command = c;
+	switch (c) {
+		case command_t::reset:
+			return start_steps(RESET_STEPS, std::size(RESET_STEPS));
+		case command_t::init:
+			return prefer_set3 ? start_steps(SET3_STEPS.data(), SET3_STEPS.size())
+			                   : start_steps(TYPEMATIC_STEPS, std::size(TYPEMATIC_STEPS));
+		default:
+			return start_steps(LED_STEPS, std::size(LED_STEPS));
+	}
+}
+
+AX2USB::state_t
+AX2USB::start_steps(const ps2_step_t* seq, size_t count) {
+	steps = seq;
+	step_count = count;
+	step_pos = 0;
+	send_step();
+	return state_t::command_wait;
+}
+
+void
+AX2USB::send_step() {
+	int16_t send = steps[step_pos].send;
+	if (send == SEND_LED_VALUE) {
+		// ここまでの LED の変更をこの1回にまとめる(これより後の変更はもう1回送る)
+		should_send_led.exchange(false, std::memory_order_acq_rel);
+		send_command(ps2_led.value);
+	} else if (send >= 0) {
+		send_command(send);
 	} else {
-		switch (usb) {
-			case HID_KEY_ARROW_DOWN:
-			case HID_KEY_KEYPAD_2:
-			case HID_KEY_ARROW_UP:
-			case HID_KEY_KEYPAD_8:
-				if (consumer_control_active) {
-					kutil.send_report16(REPORT_ID_CONSUMER, DO_NOTHING);
-					consumer_control_active = false;
-				}
-				break;
-			default:
-				// NOOP
-				break;
-		}
+		// 読み戻しの応答を待つ。送り直すものは無い
+		ps2_timers.arm(ps2_timer_t::command, micros() + COMMAND_TIMEOUT_USEC);
+		command_tries = COMMAND_TRIES_MAX;
+	}
+}
+
+void
+AX2USB::send_command(uint8_t cmd) {
+	last_command = cmd;
+	command_tries = 1;
+	ps2_timers.arm(ps2_timer_t::command, micros() + COMMAND_TIMEOUT_USEC);
+	ps2.send(cmd);
+}
+
+AX2USB::state_t
+AX2USB::retry_command() {
+	if (command_tries < COMMAND_TRIES_MAX) {
+		LOG_INFO(CMD_RESEND, last_command, command_tries);
+		command_tries++;
+		ps2_timers.arm(ps2_timer_t::command, micros() + COMMAND_TIMEOUT_USEC);
+		ps2.send(last_command);
+		return state;
 	}
+	LOG_WARN(ACK_TIMEOUT);
+	return steps_failed();
 }
 
 bool
-AX2USB::handle_special_key(uint8_t usb, bool make_break) {
-	if (usb == HID_KEY_CAPS_LOCK) {
-		if (make_break) {
-			if (kutil.usb_mod.l_shift || kutil.usb_mod.r_shift) {
-				kutil.send_usb_key(HID_KEY_CAPS_LOCK, true);
-				kutil.send_usb_key(HID_KEY_CAPS_LOCK, false);
-				// send_usb_key_oneshot(HID_KEY_CAPS_LOCK);
-				return true;
-			} else {
-				fn_flags.fn_left = true;
-			}
+AX2USB::handle_reply(uint8_t code) {
+	const auto& step = steps[step_pos];
+	if (code == step.expect) {
+		if (++step_pos < step_count) {
+			send_step();
 		} else {
-			if (fn_flags.fn_left) {
-				fn_flags.fn_left = false;
-			}
+			state = steps_done();
 		}
-		DEBUG_PRINTLN("%cLFn", mod_mark(make_break));
 		return true;
-	} else if (usb == HID_KEY_CONTROL_RIGHT) {
-		DEBUG_PRINTLN("%cRFn", mod_mark(make_break));
-		fn_flags.fn_right = make_break;
+	}
+	if (code == ps2ind::RESEND) {
+		// コマンドが化けて届いた
+		errors.resend.add();
+		state = retry_command();
 		return true;
-	} else if (fn_flags.fn_left || fn_flags.fn_right) {
-		handle_fn_key(usb, make_break);
-		if (make_break) {
-			return true;
+	}
+	if (step.expect != ps2ind::ACK) {
+		// 読み戻した値が違う
+		LOG_WARN(CODE_SET_FAIL, step_pos, code);
+		state = steps_failed();
+		return true;
+	}
+	// コマンドを受け取る前にキーボードが送っていたスキャンコード
+	return false;
+}
+
+AX2USB::state_t
+AX2USB::steps_done() {
+	ps2_timers.cancel(ps2_timer_t::command);
+	if (current_command == command_t::reset) {
+		// BAT 完了(AA)で初期化から送り直すので、待っているコマンドは捨てる
+		commands.clear();
+	} else if (current_command == command_t::init) {
+		bool set3 = steps == SET3_STEPS.data();
+		active_set = set3 ? 3 : 2;
+		LOG_INFO(CODE_SET, active_set);
+		if (set3 || steps == SET2_STEPS) {
+			decoder.reset();
+			decoder3.reset();
 		}
-		// break 時は常に通常キーの break も処理する
-		// 通常キー(make) → Fn(make) →通常キー(break) となった場合に通常キーのbreakを処理しないと通常キーが押されっぱなしになってしまう
-		return false;
-	} else if (!make_break) {
-		// Fn(make) → ↑キー(make:ボリューム+) → Fn(break) → ↑キー(break) となった場合に備えて、Fnが押されてなくてもFnキーのbreak処理をする
-		handle_fn_key(usb, make_break);
+		// 切り替えでLEDが消えるキーボードもあるので送り直す
+		should_send_led.store(true, std::memory_order_relaxed);
 	}
+	return state_t::base;
+}
 
-	return false;
+AX2USB::state_t
+AX2USB::steps_failed() {
+	ps2_timers.cancel(ps2_timer_t::command);
+	if (current_command != command_t::init) {
+		return state_t::base;
+	}
+	bool set3 = steps == SET3_STEPS.data();
+	active_set = 2;
+	if (set3 && step_pos >= SET3_SWITCHED_STEP) {
+		return start_steps(SET2_STEPS, std::size(SET2_STEPS));
+	} else if (set3) {
+		return start_steps(TYPEMATIC_STEPS, std::size(TYPEMATIC_STEPS));
+	}
+	LOG_INFO(CODE_SET, active_set);
+	should_send_led.store(true, std::memory_order_relaxed);
+	return state_t::base;
+}
+
+void
+AX2USB::press_key(keymap::key_t key, uint32_t rx_us, bool resumed) {
+	// タイプマティックの make は押したときのレイヤーの動作を繰り返す。レイヤー操作は最初の make だけ
+	bool repeat = keymap.is_pressed(key);
+	const auto& act = keymap.press(key);
+	switch (act.kind) {
+		case keymap::kind_t::usb_key:
+			if (repeat) {
+				// 押したままのキーはホストかファームウェア(repeater)がリピートする
+				break;
+			}
+			if (act.arg) {
+				kutil.send_usb_key_mod(act.usage, act.arg, true);
+			} else {
+				kutil.send_usb_key(act.usage, true);
+				repeater.press(key, act.usage, rx_us);
+				arm_repeat();
+			}
+			break;
+		case keymap::kind_t::consumer:
+			if (!consumer_control_active) {
+				kutil.send_report16(REPORT_ID_CONSUMER, act.usage);
+				consumer_control_active = true;
+			}
+			break;
+		case keymap::kind_t::consumer_tap:
+			kutil.send_report16_oneshot(REPORT_ID_CONSUMER, act.usage);
+			break;
+		case keymap::kind_t::system:
+			kutil.send_report8(REPORT_ID_SYS, act.usage);
+			break;
+		case keymap::kind_t::momentary:
+			if (!repeat) {
+				keymap.set_layer(act.arg, true);
+				LOG_DEBUG(LAYER, true, act.arg);
+			}
+			break;
+		case keymap::kind_t::tap_hold:
+			if (resumed) {
+				// すべて離したときにホールドと決めていた(RELEASE_ALL は判定中のキーをホールドにする)
+				keymap.set_layer(act.arg, true);
+				LOG_DEBUG(LAYER, true, act.arg);
+			} else if (!repeat) {
+				tap_hold.begin(key, act, rx_us);
+				usb_timers.arm(usb_timer_t::tap_hold, rx_us + tap_hold.config().timeout_us);
+			}
+			break;
+		default:
+			LOG_DEBUG(UNMAPPED, true, key);
+			break;
+	}
+}
+
+void
+AX2USB::release_key(keymap::key_t key) {
+	// 押したときのレイヤーの動作を離す。Fn+↑(ボリューム+) → Fn(break) → ↑(break) でもボリュームを離せる
+	const auto& act = keymap.release(key);
+	switch (act.kind) {
+		case keymap::kind_t::usb_key:
+			repeater.release(key);
+			arm_repeat();
+			if (act.arg) {
+				kutil.send_usb_key_mod(act.usage, act.arg, false);
+			} else {
+				kutil.send_usb_key(act.usage, false);
+			}
+			break;
+		case keymap::kind_t::consumer:
+			if (consumer_control_active) {
+				kutil.send_report16(REPORT_ID_CONSUMER, DO_NOTHING);
+				consumer_control_active = false;
+			}
+			break;
+		case keymap::kind_t::momentary:
+		case keymap::kind_t::tap_hold:
+			// tap_hold はホールドと決まった後に離したとき(タップならここには来ない)
+			keymap.set_layer(act.arg, false);
+			LOG_DEBUG(LAYER, false, act.arg);
+			break;
+		default:
+			break;
+	}
+}
+
+void
+AX2USB::idle(uint32_t timeout_us) {
+	// ログはUARTの送信バッファに入る分だけ書き出し、残りがあれば早めに起きて続きを書く
+	if (log::drain()) {
+		timeout_us = std::min(timeout_us, LOG_DRAIN_SLEEP_USEC);
+	}
+	wake.sleep(timeout_us);
+}
+
+bool
+AX2USB::check_suspended() {
+	if (!TinyUSBDevice.suspended()) {
+		return false;
+	}
+	if (split ? channel.available() : ps2_available()) {
+		TinyUSBDevice.remoteWakeup();
+	}
+	return true;
 }
 
 void
 AX2USB::loop() {
-	if (TinyUSBDevice.suspended()) {
-		if (ps2_available()) {
-			TinyUSBDevice.remoteWakeup();
-		} else {
-			delay(1000);
-		}
+	uptime.update(micros());
+	check_mounted();
+	if (check_suspended()) {
+		// 最初のバイト受信で起きて remoteWakeup() する。レジュームはUSB割り込みで起きる
+		idle(SUSPENDED_SLEEP_USEC);
 		return;
 	}
-	// sending
-	if (!usb_hid.ready()) {
+	// 送信は完了コールバックから続けて行われる。取りこぼしに備えてここでも送信する
+	kutil.send_pending();
+	poll_timers();
+#if AX2USB_MOUSE
+	send_mouse_report();
+#endif
+	if (!poll_ps2()) {
+		// PS/2 受信・USBの割り込み・タイマーの期限で起きる
+		idle(idle_timeout_us());
+	}
+}
+
+void
+AX2USB::loop_usb() {
+	uptime.update(micros());
+	check_mounted();
+	if (check_suspended()) {
+		// core 1 からの最初のイベントで起きて remoteWakeup() する
+		idle(SUSPENDED_SLEEP_USEC);
 		return;
 	}
-	if (state == state_t::base && should_send_led) {
-		ps2.send(ps2cmd::MODE_IND);
-		state = state_t::led_wait_ack;
-		timeout_state_started = millis();
+	if (!poll_usb()) {
+		// core 1 からのイベント・USBの割り込み・タイマーの期限で起きる
+		idle(idle_timeout_us());
 	}
-	if (state == state_t::no_data_received) {
-		if (timeout_state_started == 0) {
-			timeout_state_started = millis();
-		} else if (millis() - timeout_state_started > INITIAL_RESPONSE_TIMEOUT) {
-			DEBUG_PRINTLN("echo request sent");
-			ps2.send(ps2cmd::ECHO);
-			timeout_state_started = millis();
-		}
+}
+
+void
+AX2USB::loop_ps2() {
+	if (!poll_ps2()) {
+		// PS/2 受信・LED 変更・core 0 がイベントを取り出したとき・タイマーの期限で起きる
+		ps2_wake.sleep(std::min(IDLE_SLEEP_USEC, ps2_timers.remaining_us(micros())));
 	}
-	if (auto code = ps2_read(); code >= 0) {
-		if (state == state_t::no_data_received) {
-			DEBUG_PRINTLN("First msg received");
-			state = state_t::base;
+}
+
+bool
+AX2USB::poll_ps2() {
+	run_ps2_timers();
+#if AX2USB_MOUSE
+	bool mouse_work = poll_mouse();
+#else
+	constexpr bool mouse_work = false;
+#endif
+	// コマンドはスキャンコードの途中では送らない
+	if (state == state_t::base && decoder_idle()) {
+		if (should_send_led.load(std::memory_order_acquire)) {
+			commands.push(command_t::led);
 		}
-		uint8_t k = code;
-		DEBUG_PRINTLN("<%02x", k);
-		state_t next_state;
-		switch (state) {
-			case state_t::led_wait_ack:
-				next_state = state_led_wait_ack(k);
-				break;
-			case state_t::base:
-				next_state = state_base(k);
-				break;
-			case state_t::brk_received:
-				next_state = state_brk_received(k);
-				break;
-			case state_t::e0_received:
-				next_state = state_e0_received(k);
-				break;
-			case state_t::e0_break_received:
-				next_state = state_e0_break_received(k);
-				break;
-			case state_t::e1_received:
-				next_state = state_e1_received(k);
-				break;
-			case state_t::e1_break_received:
-				next_state = state_e1_break_received(k);
-				break;
-			case state_t::wait_ack:
-				next_state = state_wait_ack(k);
-				break;
-			default:
-				DEBUG_PRINTLN("%u: unhandled state, reverted to base", static_cast<uint8_t>(state));
-				next_state = state_t::base;
-				break;
+		command_t c;
+		if (commands.pop(c)) {
+			state = start_command(c);
 		}
-		state = next_state;
-		if (is_timeout_state() && millis() - timeout_state_started > STATE_TIMEOUT_MSEC) {
-			DEBUG_PRINTLN("ACK receive timeout, reverted to base");
-			state = state_t::base;
+	}
+	if (has_pending_event) {
+		if (!channel.push(pending_event)) {
+			return mouse_work;
 		}
+		has_pending_event = false;
+		wake.signal();
+	}
+	if (!ps2_available() && rx.overflow_count() != rx_overflows_seen && can_emit()) {
+		// 最後に受信したバイトの後を取りこぼし、まだ次のバイトが届いていない
+		begin_rx_resync(micros());
+		return true;
+	}
+	if (!ps2_available() || !can_emit()) {
+		return mouse_work;
+	}
+	// 受信済みのバイトをすべて反映してからレポートを送る。送信中に届いたバイトは送信待ちのレポートにまとめられ、
+	// 次のポーリングで送られる(2コア時のまとめは core 0 が行う)
+	bool batch = coalescing && !split;
+	if (batch) {
+		kutil.begin_batch();
+	}
+	rx_code_t rc;
+	for (size_t n = coalescing ? rx.count() : 1; n > 0 && can_emit() && ps2_read(rc); n--) {
+		handle_ps2_code(rc);
+	}
+	if (batch) {
+		kutil.end_batch();
+	}
+	return true;
+}
+
+bool
+AX2USB::poll_usb() {
+	// 送信は完了コールバックから続けて行われる。取りこぼしに備えてここでも送信する
+	kutil.send_pending();
+	poll_timers();
+#if AX2USB_MOUSE
+	send_mouse_report();
+#endif
+	if (!channel.available() || !can_handle_event()) {
+		return false;
+	}
+	if (coalescing) {
+		kutil.begin_batch();
+	}
+	key_event_t ev;
+	for (size_t n = coalescing ? KeyEventChannel::DEPTH : 1; n > 0 && can_handle_event() && channel.pop(ev); n--) {
+		handle_key_event(ev);
+	}
+	if (coalescing) {
+		kutil.end_batch();
+	}
+	// channel が満杯で待っていた core 1 を起こす
+	ps2_wake.signal();
+	return true;
+}
+
+void
+AX2USB::handle_ps2_code(const rx_code_t& rc) {
+	uint8_t code = rc.code;
+	if (state == state_t::no_data_received) {
+		LOG_INFO(FIRST_RECEIVED);
+		ps2_ready_us.store(rc.rx_us, std::memory_order_relaxed);
+		state = state_t::base;
+		ps2_timers.cancel(ps2_timer_t::echo);
+	}
+	// 受信割り込みの時刻で記録する(ログからトレースを取り出して再生できる)
+	LOG_DEBUG_AT(rc.rx_us, PS2_RECEIVED, code);
+	uint32_t now = micros();
+	if (rc.lost_before && rx.overflow_count() != rx_overflows_seen) {
+		// 受信が途切れたときに末尾の取りこぼしとして処理済みなら、同じ取りこぼしでまたバイトを捨てない
+		begin_rx_resync(now);
+	}
+	// コマンドの応答は捨てている間も受け取る(取りこぼしたら応答待ちのタイムアウトで送り直す)
+	if (state == state_t::command_wait && handle_reply(code)) {
+		return;
+	}
+	if (rx_resyncing) {
+		// シーケンスの途中かもしれないので捨て、受信が途切れるのを待つ
+		last_rx_us = rc.rx_us;
+		ps2_timers.arm(ps2_timer_t::rx_resync, rc.rx_us + PREFIX_TIMEOUT_USEC);
+		return;
+	}
+	if (!decoder_idle() && rc.rx_us - last_rx_us > PREFIX_TIMEOUT_USEC) {
+		// プレフィクスの後のバイトを取りこぼした。このバイトは新しいコードとして読む
+		resync_decoder(last_rx_us, now);
+	}
+	last_rx_us = rc.rx_us;
+	handle_action(rc, now, active_set == 3 ? decoder3.feed(code) : decoder.feed(code));
+	if (decoder_idle()) {
+		ps2_timers.cancel(ps2_timer_t::prefix);
+	} else {
+		ps2_timers.arm(ps2_timer_t::prefix, rc.rx_us + PREFIX_TIMEOUT_USEC);
+	}
+}
+
+void
+AX2USB::print_latency(Print& out) const {
+	for (int p = 0; p < KeyLatency::phase_count; p++) {
+		auto phase = static_cast<KeyLatency::phase_t>(p);
+		auto s = latency(phase);
+		out.printf("%-6s n=%lu min=%lu avg=%lu p50=%lu p99=%lu max=%lu [us]", KeyLatency::phase_name(phase),
+		           static_cast<unsigned long>(s.count), static_cast<unsigned long>(s.min), static_cast<unsigned long>(s.avg),
+		           static_cast<unsigned long>(s.p50), static_cast<unsigned long>(s.p99), static_cast<unsigned long>(s.max));
+		out.println();
+	}
+	if (auto s = ready_to_sof(); s.count) {
+		// レポートを積んでから、送信されたフレームの SOF まで
+		out.printf("sof    n=%lu min=%lu avg=%lu p50=%lu p99=%lu max=%lu [us]", static_cast<unsigned long>(s.count),
+		           static_cast<unsigned long>(s.min), static_cast<unsigned long>(s.avg), static_cast<unsigned long>(s.p50),
+		           static_cast<unsigned long>(s.p99), static_cast<unsigned long>(s.max));
+		out.println();
 	}
 }
 
@@ -468,9 +1060,10 @@ AX2USB::handle_hid_report(uint8_t report_id, hid_report_type_t report_type, uint
 		return;
 	}
 	usb_led.value = buffer[0];
-	DEBUG_PRINTLN("USB< %s", usb_led_str().c_str());
+	LOG_INFO(USB_LED, usb_led.value);
 	if (update_ps2_led()) {
-		should_send_led = true;
+		should_send_led.store(true, std::memory_order_release);
+		rx_wake().signal();
 	}
 }
 
@@ -485,14 +1078,16 @@ AX2USB::update_ps2_led() {
 	return ps2_led.value != prev;
 }
 
-const map::ax2usb_e0_ent_t*
-AX2USB::find_e0_map(uint8_t scan_code) {
-	for (size_t i = 0; i < std::size(map::ax2e0_usb); i++) {
-		if (scan_code == map::ax2e0_usb[i].ps2) {
-			return &map::ax2e0_usb[i];
-		}
+uint16_t
+AX2USB::handle_get_report(uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen) {
+	if (report_id != REPORT_ID_HEALTH || report_type != HID_REPORT_TYPE_FEATURE) {
+		// 0 を返すと STALL になる
+		return 0;
 	}
-	return nullptr;
+	auto h = health();
+	uint16_t len = std::min<uint16_t>(reqlen, sizeof(h));
+	memcpy(buffer, &h, len);
+	return len;
 }
 
 void
@@ -500,4 +1095,9 @@ AX2USB::hid_report_callback(uint8_t report_id, hid_report_type_t report_type, ui
 	AX2USB::theInstance->handle_hid_report(report_id, report_type, buffer, bufsize);
 }
 
+uint16_t
+AX2USB::hid_get_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen) {
+	return AX2USB::theInstance->handle_get_report(report_id, report_type, buffer, reqlen);
+}
+
 }  // namespace ax2usb
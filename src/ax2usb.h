@@ -1,11 +1,52 @@
 #pragma once
 #include <Adafruit_TinyUSB.h>
 #include <libps2.h>
-#include <sq.hpp>
-#include <string>
+#include <atomic>
+#include <spscq.hpp>
 #include "ax2usbmap.hpp"
+#include "command_queue.hpp"
+#include "deadlines.hpp"
+#include "health.hpp"
 #include "hid_util.h"
-#include "mutex.hpp"
+#include "key_event.hpp"
+#include "keymap.hpp"
+#include "latency.hpp"
+#include "ps2_mouse.hpp"
+#include "repeater.hpp"
+#include "set2_decoder.hpp"
+#include "set3_decoder.hpp"
+#include "tap_hold.hpp"
+#include "wake_event.hpp"
+
+#ifndef AX2USB_NKRO
+#define AX2USB_NKRO 1
+#endif
+
+// 1: 起動時にキーボードをスキャンコードセット3に切り替える(できなければセット2のまま)
+// AXキーボードでは使わない: セット3のコード表に AX・無変換・変換が無く、これらのキーが効かなくなる(set3_unmapped で数える)
+#ifndef AX2USB_SCAN_CODE_SET3
+#define AX2USB_SCAN_CODE_SET3 0
+#endif
+
+// USB のポーリング間隔(1,2,4,8ms)
+#ifndef AX2USB_POLL_INTERVAL_MS
+#define AX2USB_POLL_INTERVAL_MS 2
+#endif
+
+// レポートを送信するタイミング(0: すぐに送信 1: すぐに送信し、SOF までの時間を計測 2: ポーリングされるフレームの SOF で送信)
+#ifndef AX2USB_REPORT_TIMING
+#define AX2USB_REPORT_TIMING 0
+#endif
+
+// PS/2 受信キューの深さ(2のべき乗)。テストでは小さくしてあふれたときの処理を確かめる
+#ifndef AX2USB_RX_QUEUE_DEPTH
+#define AX2USB_RX_QUEUE_DEPTH 16
+#endif
+
+// 1: 2つ目の PS/2 ポートのマウスを USB マウスとして送る(begin_mouse() で使い始める)
+#ifndef AX2USB_MOUSE
+#define AX2USB_MOUSE 0
+#endif
 
 namespace ax2usb {
 
@@ -13,22 +54,210 @@ using namespace libps2;
 
 class AX2USB {
  public:
-	AX2USB() { theInstance = this; }
+	AX2USB() {
+		theInstance = this;
+		keymap.load(map::default_layers, std::size(map::default_layers));
+	}
+	/**
+	 * @brief 1コアで PS/2 と USB の両方を処理する場合の初期化。以後 loop() を呼ぶ
+	 *
+	 * USB の列挙を待たずに戻る。列挙の間もキーボードの応答確認と LED 設定を進め、
+	 * それまでに押されたキーは列挙が終わってから送る。
+	 */
 	bool begin(uint8_t ps2_data_pin, uint8_t ps2_clock_pin);
 	void loop();
+
+	/*
+	 * 2コアに分ける場合: core 0 は begin_split() → loop_usb() で TinyUSB とレポート組み立てを、
+	 * core 1 は begin_ps2() → loop_ps2() で PS/2 の受信・デコードを受け持ち、
+	 * デコード済みのキーイベント(key_event_t)をコア間 FIFO で core 0 へ渡す。
+	 */
+	/**
+	 * @brief core 0 の初期化(USB のみ)。core 1 の begin_ps2() より先に呼ぶ。USB の列挙は待たない
+	 */
+	bool begin_split();
+	/**
+	 * @brief PS/2 の初期化。受信割り込みは呼び出したコアで受ける
+	 */
+	void begin_ps2(uint8_t ps2_data_pin, uint8_t ps2_clock_pin);
+	void loop_usb();
+	void loop_ps2();
+#if AX2USB_MOUSE
+	/**
+	 * @brief 2つ目の PS/2 ポートでマウスを使い始める。begin()・begin_ps2() の後に、PS/2 側のコアで呼ぶ
+	 *
+	 * マウスはリセットしてホイールの有無を調べ、ストリームモードにする。つながっていなければ定期的にやり直す。
+	 * 動きは USB のポーリング周期ごとに1レポートにまとめ、キーボードレポートの送信待ちが無いときだけ送る。
+	 *
+	 * @param sample_rate マウスのサンプルレート(回/秒)
+	 */
+	void begin_mouse(uint8_t mouse_data_pin, uint8_t mouse_clock_pin, uint8_t sample_rate = 100);
+#endif
+	/**
+	 * @brief 眠らずに1回だけ PS/2 側の仕事をする(ホストでスレッドから回す用)
+	 *
+	 * @return false 仕事がなかった(または USB 側の空きを待っている)
+	 */
+	bool poll_ps2();
+	/**
+	 * @brief 眠らずに1回だけ USB 側の仕事をする(2コア時のみ)
+	 *
+	 * @return false 仕事がなかった(または送信キューの空きを待っている)
+	 */
+	bool poll_usb();
+	/**
+	 * @brief PS/2 側で処理待ちのバイト・イベントの数
+	 */
+	size_t ps2_backlog() const { return rx.count() + (has_pending_event ? 1 : 0); }
+	/**
+	 * @brief PS/2 の通信エラーの回数(PS/2 側で数える)
+	 */
+	struct ps2_errors_t {
+		uint32_t overrun;         // キーボードのバッファあふれ(00)
+		uint32_t self_test;       // BAT 失敗・診断エラー(FC/FD)
+		uint32_t resend;          // キーボードからの再送要求(FE)
+		uint32_t ack_timeout;     // コマンドの応答が期限内に届かなかった
+		uint32_t prefix_timeout;  // プレフィクスの後のバイトが届かなかった
+		uint32_t resync;          // 押しているキーをすべて離した
+		uint32_t led_timeout;     // ack_timeout のうち LED 設定コマンドのもの
+		uint32_t unexpected;      // プレフィクスの後に来ないはずのコード・キーの位置に対応しないコード
+		uint32_t set3_unmapped;   // unexpected のうち、セット3でキーの位置に対応しないコードの make(AXキーボード独自のキーなど)
+	};
+	ps2_errors_t ps2_errors() const;
+	/**
+	 * @brief 稼働状況の集計(ホストがフィーチャーレポートで読み出すものと同じ)。USB 側で呼ぶ
+	 *
+	 * 回数は数える側(受信割り込み・PS/2 側・USB 側)だけが書くので、2コア時も読むだけなら止めずに済む。
+	 */
+	health::health_report_t health();
+#if AX2USB_MOUSE
+	/**
+	 * @brief マウスの状態と回数(PS/2 側・USB 側で数える)
+	 */
+	struct mouse_stats_t {
+		bool streaming;      // 初期化が終わり、動きを受け取っている
+		bool wheel;          // ホイールあり(IntelliMouse)
+		uint32_t restarts;   // 初期化をやり直した回数
+		uint32_t dropped;    // 同期が外れて捨てたパケット
+		uint32_t packets;    // 受け取ったパケット
+		uint32_t reports;    // 送ったマウスレポート
+	};
+	mouse_stats_t mouse_stats() const;
+#endif
+
+	/**
+	 * @brief 起動からの時刻(micros())。0 はまだ
+	 */
+	struct boot_times_t {
+		uint32_t ps2_ready_us;    // キーボードから最初のバイト(ECHO の応答・BAT 完了)を受信した
+		uint32_t usb_mounted_us;  // USB の列挙が終わった
+		uint32_t first_key_us;    // 最初のキーを押した(USB 側で処理した)
+	};
+	boot_times_t boot_times() const;
+
+	/**
+	 * @brief キーボードの起動時(ECHO の応答)とリセット後にスキャンコードセット3への切り替えを試みるか。begin_ps2() の前に呼ぶ
+	 *
+	 * セット3のコード表は101/106キーボードのもので、AXキーボード独自のキー(AX、AX配列の無変換・変換)は
+	 * キーの位置に対応しないコードとして捨てる(ps2_errors().set3_unmapped で数える)。AXキーボードでは有効にしない。
+	 */
+	void set_prefer_set3(bool enable) { prefer_set3 = enable; }
+	/**
+	 * @brief 使用中のスキャンコードセット(2 か 3)
+	 */
+	uint8_t scan_code_set() const { return active_set; }
+
+	/**
+	 * @brief メインループ(2コア時は core 0)の休止状況(アイドル時間・起床回数)
+	 */
+	WakeEvent::stats_t wake_stats() const { return wake.stats(); }
+	/**
+	 * @brief 受信済みのバイトをまとめて処理し、キーボードレポートをポーリング周期ごとに1回にまとめるか(既定: する)
+	 *
+	 * false にすると1回の loop() で1バイトずつ処理し、キーが変化するたびにレポートを積む(比較計測用)
+	 */
+	void set_coalescing(bool enable) {
+		coalescing = enable;
+		kutil.set_coalescing(enable);
+	}
+	/**
+	 * @brief USB のポーリング間隔(1,2,4,8ms)。begin()・begin_split() の前に呼ぶ
+	 *
+	 * @return false 対応していない間隔(変わらない)
+	 */
+	bool set_poll_interval(uint8_t interval_ms);
+	uint8_t poll_interval() const { return poll_interval_ms; }
+	/**
+	 * @brief レポートを送信するタイミング(hid_util::HidUtil::timing_t)
+	 *
+	 * sof では、ホストがポーリングするフレームの始まり(SOF)まで送信を待ち、それまでのキー変化を1レポートにまとめる。
+	 * 送信済みのレポートの後に変化があっても次のポーリングまで待たずに済むので、最悪の遅延とばらつきが小さくなる。
+	 *
+	 * @return false SOF のコールバックを使えない TinyUSB で measured・sof を指定した(immediate のまま)
+	 */
+	bool set_report_timing(hid_util::HidUtil::timing_t timing) {
+		bool ok = kutil.set_timing(timing, poll_interval_ms);
+		report_timing = kutil.report_timing();
+		return ok;
+	}
+	/**
+	 * @brief レポートを積んでから、送信されたフレームの SOF までの時間(measured・sof のとき)
+	 */
+	LatencyHistogram::summary_t ready_to_sof() const { return kutil.ready_to_sof(); }
+	/**
+	 * @brief キー入力からキーボードレポート送信完了までの遅延(区間別)
+	 */
+	LatencyHistogram::summary_t latency(KeyLatency::phase_t phase) const { return kutil.latency(phase); }
+	void reset_latency() { kutil.reset_latency(); }
+	/**
+	 * @brief 遅延の集計を表示する
+	 */
+	void print_latency(Print& out) const;
+	/**
+	 * @brief キーマップを差し替える(既定は map::default_layers)
+	 *
+	 * begin()・begin_split() の前か、その後はキーが押されていないときに USB 側で呼ぶこと。
+	 *
+	 * @return false レイヤー定義が不正(キーマップは変わらない)
+	 */
+	bool set_keymap(const keymap::layer_t* layers, size_t count);
+	/**
+	 * @brief タップ・ホールドキーの判定方法(期限、他のキーを押したらすぐホールドにするか)
+	 */
+	void set_tap_hold(const TapHold::config_t& config) { tap_hold.configure(config); }
+	/**
+	 * @brief ファームウェアで生成するキーリピートの対象キー・開始までの時間・間隔。USB 側で呼ぶこと
+	 */
+	void set_repeat(const Repeater::config_t& config) {
+		repeater.configure(config);
+		usb_timers.cancel(usb_timer_t::repeat);
+	}
 	static inline constexpr uint8_t REPORT_ID_KBD = 1;
+	static inline constexpr uint8_t REPORT_ID_NKRO = 4;
+	static inline constexpr uint8_t REPORT_ID_MOUSE = 5;
+	static inline constexpr uint8_t REPORT_ID_HEALTH = health::REPORT_ID;
 
  private:
-	enum state_t {
-		base,
-		brk_received,
-		e0_received,
-		e1_received,
-		led_wait_ack,
-		e0_break_received,
-		e1_break_received,
-		wait_ack,
-		no_data_received
+	enum state_t { base, command_wait, no_data_received };
+	// PS/2 側のタイマー
+	enum class ps2_timer_t : uint8_t {
+		command,    // コマンドの応答待ち
+		echo,       // 最初のバイトが届くまで ECHO を送る
+		prefix,     // プレフィクスの後のバイト待ち
+		rx_resync,  // 受信キューがあふれた後、受信が途切れるまで待つ
+		mouse,      // マウスの応答・パケットの続き待ち、初期化のやり直し
+		count,
+	};
+	// USB 側のタイマー
+	enum class usb_timer_t : uint8_t {
+		tap_hold,  // タップ・ホールドの期限
+		repeat,    // 次のキーリピート
+		count,
+	};
+	struct rx_code_t {
+		uint8_t code;
+		uint32_t rx_us;            // 受信割り込みの時刻
+		bool lost_before = false;  // この前のバイトを受信キューが満杯で捨てた
 	};
 	union __attribute__((packed)) usb_led_t {
 		struct __attribute__((packed)) {
@@ -49,68 +278,262 @@ class AX2USB {
 		};
 		uint8_t value;
 	} ps2_led = {};
-	union __attribute__((packed)) fn_flags_t {
-		struct __attribute__((packed)) {
-			bool fn_left;
-			bool fn_right;
-		};
-		uint8_t value;
-	} fn_flags = {};
-
 	PS2 ps2;
 	Adafruit_USBD_HID usb_hid;
-	uint32_t timeout_state_started = 0;
+	Deadlines<ps2_timer_t> ps2_timers;
+	// 応答を待っているコマンド(再送用)
+	uint8_t last_command = 0;
+	uint8_t command_tries = 0;
+	uint8_t reset_tries = 0;
+	uint32_t last_rx_us = 0;  // 最後にデコードしたバイトの受信時刻
+	// PS/2 側で数え、USB 側でも読む
+	struct ps2_counters_t {
+		health::Counter overrun, self_test, resend, ack_timeout, prefix_timeout, resync, led_timeout, unexpected, set3_unmapped;
+	} errors;
+	health::Counter rx_bytes;  // 受信割り込みで数える
+	health::Uptime uptime;     // USB 側
+	std::atomic<uint32_t> ps2_ready_us{ 0 };  // PS/2 側で書き、USB 側で読む
 	state_t state = state_t::no_data_received;
-	bool should_send_led = false;
+	set2::Decoder decoder;
+	set3::Decoder decoder3;
+	bool prefer_set3 = AX2USB_SCAN_CODE_SET3;
+	CommandQueue commands;
+	command_t current_command = command_t::init;
+	uint8_t active_set = 2;
+	// 実行中のコマンド列
+	const ps2_step_t* steps = nullptr;
+	uint8_t step_count = 0;
+	uint8_t step_pos = 0;
+	// USB 側で ps2_led を書いてから立て、PS/2 側で読む(release/acquire)
+	std::atomic<bool> should_send_led{ false };
 	bool caps_sent = false;
-	mutable Mutex rx_mux;
-	SQ<uint8_t, 10> rx;
+	SPSCQ<rx_code_t, AX2USB_RX_QUEUE_DEPTH> rx;  // 受信割り込み → loop()
+	// 受信キューがあふれたら、受信が途切れるまでバイトを捨ててからデコードし直す
+	bool rx_dropping = false;               // 受信割り込みだけが使う
+	std::atomic<uint32_t> rx_lost_us{ 0 };  // 最後に捨てた時刻(受信割り込みで書き、PS/2 側で読む)
+	uint32_t rx_overflows_seen = 0;         // 以下 PS/2 側
+	bool rx_resyncing = false;
+	WakeEvent wake;
+#if AX2USB_MOUSE
+	PS2 mouse_port;
+	Ps2Mouse mouse;
+	SPSCQ<rx_code_t, 32> mouse_rx;   // 受信割り込み → PS/2 側
+	bool mouse_rx_dropping = false;  // 受信割り込みだけが使う
+	MouseMotion mouse_motion;        // PS/2 側 → USB 側
+	bool mouse_enabled = false;
+#endif
+	// 2コア時
+	bool split = false;
+	WakeEvent ps2_wake;       // core 1 を起こす
+	KeyEventChannel channel;  // core 1 → core 0
+	key_event_t pending_event = {};
+	bool has_pending_event = false;  // channel が満杯で渡せなかったイベントがある
 	bool consumer_control_active = false;
+	bool coalescing = true;
+	keymap::Keymap keymap;
+	TapHold tap_hold;
+	Repeater repeater;
+	// すべて離したときに押していたキー。キーボードが送り直した make は押し続けていたものとして扱う
+	uint32_t resume_bits[keymap::KEY_COUNT / 32]{};
+	uint32_t resume_from_us = 0;
+	Deadlines<usb_timer_t> usb_timers;
+	boot_times_t boot = {};  // ps2_ready_us 以外(USB 側)
+	uint8_t poll_interval_ms = AX2USB_POLL_INTERVAL_MS;
+	hid_util::HidUtil::timing_t report_timing = static_cast<hid_util::HidUtil::timing_t>(AX2USB_REPORT_TIMING);
+#if AX2USB_NKRO
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD, REPORT_ID_NKRO };
+#else
 	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD };
+#endif
 
 	// PS/2 読み出し
 	bool ps2_available() const;
-	int ps2_read();
+	bool ps2_read(rx_code_t& rc);
+	WakeEvent& rx_wake() { return split ? ps2_wake : wake; }
+
+	bool init_usb();
+	/**
+	 * @brief USB の列挙が終わった時刻を記録する
+	 */
+	void check_mounted();
+	/**
+	 * @brief USB がサスペンド中なら、キー入力があればリモートウェイクアップを要求する
+	 *
+	 * @return true サスペンド中
+	 */
+	bool check_suspended();
+	/**
+	 * @brief PS/2 側が新たにキーイベントを出せるか
+	 */
+	bool can_emit() const;
+	/**
+	 * @brief USB 側が新たにキーイベントを受け取れるか(送信キュー・タップ・ホールドの待ち行列に空きがあるか)
+	 */
+	bool can_handle_event() const;
+	/**
+	 * @brief デコードしたキーイベントを USB 側へ渡す(1コア時は直接処理する)
+	 */
+	void emit(const key_event_t& ev);
+	/**
+	 * @brief USB 側でキーイベントを処理する(キーマップ・レポート組み立て)。タップ・ホールドの判定中なら溜める
+	 */
+	void handle_key_event(const key_event_t& ev);
+	/**
+	 * @brief キーイベントをキーマップで処理する
+	 */
+	void process_key_event(const key_event_t& ev);
+	/**
+	 * @brief タップ・ホールドの判定を進め、判定が決まったら溜めたイベントを送信キューの空く限り処理する
+	 */
+	void run_tap_hold();
+	/**
+	 * @brief タップ・ホールドの判定結果を実行する
+	 */
+	void resolve_tap_hold(TapHold::decision_t d);
+	/**
+	 * @brief 溜めたイベントの残りを処理する
+	 */
+	void poll_tap_hold();
+	/**
+	 * @brief タップ・ホールドの期限が来た。ホールドに決める
+	 */
+	void expire_tap_hold(uint32_t now);
+	/**
+	 * @brief キーリピートの時刻が来た。キーを離して押し直すレポートを積む
+	 */
+	void fire_repeat(uint32_t now);
+	/**
+	 * @brief リピートのタイマーを repeater の状態に合わせる
+	 */
+	void arm_repeat();
+	/**
+	 * @brief 期限が来た USB 側のタイマーを実行し、溜めたイベントの残りを処理する
+	 */
+	void poll_timers();
+	/**
+	 * @brief 期限が来た PS/2 側のタイマー(応答待ち・ECHO・プレフィクス)を実行する
+	 */
+	void run_ps2_timers();
+#if AX2USB_MOUSE
+	/**
+	 * @brief マウスの受信済みのバイトを処理し、組み立てたパケットを mouse_motion に足す(PS/2 側)
+	 *
+	 * @return false 仕事がなかった
+	 */
+	bool poll_mouse();
+	/**
+	 * @brief マウスのプロトコルの結果を実行する(バイトの送信・期限の設定・パケットの受け渡し)
+	 */
+	void apply_mouse(const Ps2Mouse::result_t& r);
+	/**
+	 * @brief まとめたマウスの動きを1レポート送る(USB 側)。キーボードレポートの送信待ちがあれば送らない
+	 */
+	void send_mouse_report();
+#endif
+	/**
+	 * @brief 仕事がないときに眠ってよい時間(次のタイマーの期限まで)
+	 */
+	uint32_t idle_timeout_us() const;
 
 	void handle_hid_report(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
-	bool update_usb_codes(uint8_t code, bool make_break);
-	bool update_usb_modifier(uint8_t mask, bool make_break);
+	uint16_t handle_get_report(uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen);
 	bool update_ps2_led();
-	std::string usb_led_str() const;
 
-	/* 入力処理状態関数群 */
-	state_t state_base(uint8_t ps2);
-	state_t state_brk_received(uint8_t ps2);
-	state_t state_e0_received(uint8_t ps2);
-	state_t state_e1_received(uint8_t ps2);
-	state_t state_led_wait_ack(uint8_t ps2);
-	state_t state_e0_break_received(uint8_t ps2);
-	state_t state_e1_break_received(uint8_t ps2);
-	state_t state_wait_ack(uint8_t ps2);
-	bool is_timeout_state() { return state == state_t::led_wait_ack || state == state_t::wait_ack; }
-	void handle_code(uint8_t code, bool make_break);
-	void handle_e0_code(uint8_t code, bool make_break);
+	/* コマンドの送信と応答の照合 */
+	state_t start_command(command_t c);
+	state_t start_steps(const ps2_step_t* seq, size_t count);
+	void send_step();
+	/**
+	 * @brief コマンドの応答を待っている間に受信したバイトを照合する
+	 *
+	 * @return false 応答ではない(コマンドの前にキーボードが送っていたスキャンコードなのでデコードする)
+	 */
+	bool handle_reply(uint8_t code);
+	state_t steps_done();
+	/**
+	 * @brief コマンド列が失敗した(拒否・タイムアウト)。初期化なら、必要に応じてセット2に戻す・タイプマティックを設定するコマンド列を始める
+	 */
+	state_t steps_failed();
+	/**
+	 * @brief スキャンコードのプレフィクスの途中でないか
+	 */
+	bool decoder_idle() const {
+		return (active_set == 3 ? decoder3.state() : decoder.state()) == set2::prefix_t::none;
+	}
+	/**
+	 * @brief 仕事がないときに呼ぶ。ログを書き出してから眠る
+	 */
+	void idle(uint32_t timeout_us);
+	/**
+	 * @brief 応答を待つコマンドを送る
+	 */
+	void send_command(uint8_t cmd);
+	/**
+	 * @brief 応答が無い・再送を求められたコマンドを送り直す。回数を超えたら諦める
+	 *
+	 * @return 次の状態
+	 */
+	state_t retry_command();
+	/**
+	 * @brief 受信した1バイトを処理する
+	 */
+	void handle_ps2_code(const rx_code_t& rc);
+	/**
+	 * @brief デコーダが決めた動作を実行する
+	 *
+	 * @param rc 受信したスキャンコード
+	 * @param dequeued_us rc を rx から取り出した時刻
+	 * @param act 遷移表の動作
+	 */
+	void handle_action(const rx_code_t& rc, uint32_t dequeued_us, const set2::action_t& act);
+	/**
+	 * @brief キーボードからのエラー: キーをすべて離し、BAT 失敗ならリセットする
+	 */
+	void handle_error(const rx_code_t& rc, uint32_t dequeued_us);
+	/**
+	 * @brief プレフィクスの途中で途切れたデコーダを戻す。break の途中ならキーをすべて離す
+	 */
+	void resync_decoder(uint32_t rx_us, uint32_t dequeued_us);
+	/**
+	 * @brief 受信キューがあふれてバイトを取りこぼした。デコーダを戻してキーをすべて離し、受信が途切れるまでバイトを捨てる
+	 *
+	 * 取りこぼした後のバイトはシーケンスの途中(F0 の後のコードなど)かもしれないので、キーとして読まない。
+	 * すでに捨てている間なら、待つ期限を延ばすだけ。
+	 */
+	void begin_rx_resync(uint32_t dequeued_us);
+	/**
+	 * @brief 受信(と取りこぼし)が10ms途切れていたら、次のバイトからデコードを再開する
+	 */
+	void finish_rx_resync(uint32_t now);
 
 	/**
-	 * @brief Fn+キーを処理する
+	 * @brief キーを押した: 有効なレイヤーで動作を引いて実行する
+	 *
+	 * @param rx_us 受信割り込みの時刻(タップ・ホールドの判定に使う)
+	 * @param resumed すべて離す前から押し続けていたキー(タップ・ホールドキーなら判定せずにホールドにする)
+	 */
+	void press_key(keymap::key_t key, uint32_t rx_us, bool resumed = false);
+	/**
+	 * @brief キーを離した: 押したときに引いた動作を終える
+	 */
+	void release_key(keymap::key_t key);
+	/**
+	 * @brief 押しているキーをすべて離す(キーボードとの同期が崩れたとき)
 	 *
-	 * @param usb Fnと同時に押されたキーのUSB_HIDキーコード
-	 * @param make_break
+	 * 押していたキーは覚えておく。キーボードが押し続けているキーとして make を送り直したら(セット2の
+	 * タイプマティック)、resume_key() でそのキーを押し続けていたものとして押し直す。セット3(タイプマティックなし)や
+	 * 最後に押したキーではないキーは送り直されないので、もう一度押すまで離れたままになる。
 	 */
-	void handle_fn_key(uint8_t usb, bool make_break);
+	void release_all(uint32_t rx_us);
 	/**
-	 * @brief 特殊キー(Caps/英数カナ Fn+キー)の処理を行う
+	 * @brief make を受け取ったキーが、すべて離す前から押し続けていたものか
 	 *
-	 * @param usb USB_HIDキーコード
-	 * @param make_break make処理ならtrue、break処理ならfalse
-	 * @return true 処理完了。
-	 * @return false 処理しなかった or 通常キーとして処理する必要あり
+	 * キーボードは最後に押したキーだけを送り直すので、ほかのキーの make を受け取ったら覚えていたキーを忘れる。
 	 */
-	bool handle_special_key(uint8_t usb, bool make_break);
+	bool resume_key(keymap::key_t key, uint32_t rx_us);
 
-	static const map::ax2usb_e0_ent_t* find_e0_map(uint8_t scan_code);
 	static void hid_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize);
-	static char usb_mod_char(uint8_t mod_key);
+	static uint16_t hid_get_report_callback(uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen);
 	static inline AX2USB* theInstance;
 };
 
@@ -1,6 +1,9 @@
 #pragma once
 #include <class/hid/hid.h>  // from Adafruit TinyUSB
+#include <array>
 #include <cstdint>
+#include "keymap.hpp"
+#include "ps2code.hpp"
 
 namespace ax2usb::map {
 
@@ -60,8 +63,146 @@ constexpr inline ax2usb_e0_ent_t ax2e0_usb[] = {
 	{ 0x4a, HID_KEY_KEYPAD_DIVIDE }, { 0x7c, HID_KEY_PRINT_SCREEN }
 };
 
+namespace detail {
+
+// 0 以外の USB_HIDキーコードが2か所に現れるか
+constexpr bool
+has_duplicate_usb() {
+	for (size_t i = 0; i < std::size(ax2_usb); i++) {
+		for (size_t j = i + 1; j < std::size(ax2_usb); j++) {
+			if (ax2_usb[i] != 0 && ax2_usb[i] == ax2_usb[j]) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// 同じ PS/2 コードが2回現れるか(後のものは引かれない)
+constexpr bool
+has_duplicate_e0() {
+	for (size_t i = 0; i < std::size(ax2e0_usb); i++) {
+		for (size_t j = i + 1; j < std::size(ax2e0_usb); j++) {
+			if (ax2e0_usb[i].ps2 == ax2e0_usb[j].ps2) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+}  // namespace detail
+
+// 変換表の誤りは起動時ではなくコンパイル時に検出する
+static_assert(!detail::has_duplicate_usb(), "ax2_usb maps two PS/2 codes to the same USB key");
+static_assert(!detail::has_duplicate_e0(), "ax2e0_usb has the same PS/2 code twice");
+
 // E1 で始まるのは PAUSE
 
 // https://bsakatu.net/doc/scancode/ の *1,*2,*3,*4 を参照
 
+constexpr inline uint8_t SYSTEM_CONTROL_POWER_OFF = 0x01;
+constexpr inline uint8_t SYSTEM_CONTROL_STANDBY = 0x02;
+constexpr inline uint8_t SYSTEM_CONTROL_WAKE_HOST = 0x03;
+
+constexpr inline uint16_t TRANSPORT_CONTROL_PLAY = 0xb0;
+constexpr inline uint16_t TRANSPORT_CONTROL_PAUSE = 0xb1;
+constexpr inline uint16_t TRANSPORT_CONTROL_SCAN_NEXT_TRACK = 0xb5;
+constexpr inline uint16_t TRANSPORT_CONTROL_SCAN_PREVIOUS_TRACK = 0xb6;
+constexpr inline uint16_t TRANSPORT_CONTROL_PLAY_PAUSE = 0xcd;
+
+constexpr inline uint16_t AUDIO_CONTROL_MUTE = 0xe2;
+constexpr inline uint16_t AUDIO_CONTROL_VOLUME_INCREMENT = 0xe9;
+constexpr inline uint16_t AUDIO_CONTROL_VOLUME_DECREMENT = 0xea;
+
+/* 既定のレイヤー: 0 基本、1 Fn */
+
+constexpr inline uint8_t LAYER_BASE = 0;
+constexpr inline uint8_t LAYER_FN = 1;
+
+// Caps を単独で押して離したときのキー(押し続けるか他のキーと使えば Fn)
+#ifndef AX2USB_CAPS_TAP_KEY
+#define AX2USB_CAPS_TAP_KEY HID_KEY_CAPS_LOCK
+#endif
+constexpr inline keymap::action_t CAPS_FN = keymap::tap_hold(LAYER_FN, AX2USB_CAPS_TAP_KEY);
+
+namespace detail {
+
+// ax2_usb/ax2e0_usb に、Caps/英数カナ(右Ctrlの位置) = Fn などの特殊キーを上書きする
+constexpr keymap::entry_t base_specials[] = {
+	{ keymap::key_id(ps2key::ALT_PRINT_SCREEN), keymap::usb_key(HID_KEY_PRINT_SCREEN, HID_KEY_ALT_LEFT) },
+	{ keymap::key_id_e0(ps2key::BREAK), keymap::usb_key(HID_KEY_PAUSE, HID_KEY_CONTROL_LEFT) },  // Ctrl+Pause
+	{ keymap::KEY_PAUSE, keymap::usb_key(HID_KEY_PAUSE) },
+	{ keymap::key_id(ps2key::CAPS), CAPS_FN },
+	{ keymap::key_id_e0(ps2key::L_CTRL), keymap::momentary(LAYER_FN) },
+};
+
+constexpr size_t
+base_entry_count() {
+	size_t n = std::size(ax2e0_usb) + std::size(base_specials);
+	for (auto usb : ax2_usb) {
+		n += usb != 0;
+	}
+	return n;
+}
+
+constexpr std::array<keymap::entry_t, base_entry_count()>
+make_base_layer() {
+	std::array<keymap::entry_t, base_entry_count()> t{};
+	size_t n = 0;
+	for (size_t code = 0; code < std::size(ax2_usb); code++) {
+		if (ax2_usb[code]) {
+			t[n++] = { keymap::key_id(code), keymap::usb_key(ax2_usb[code]) };
+		}
+	}
+	for (auto& ent : ax2e0_usb) {
+		t[n++] = { keymap::key_id_e0(ent.ps2), keymap::usb_key(ent.usb) };
+	}
+	for (auto& ent : base_specials) {
+		t[n++] = ent;
+	}
+	return t;
+}
+
+}  // namespace detail
+
+constexpr inline auto base_layer = detail::make_base_layer();
+
+// Fn+キー。ここに無いキーは Fn を押している間は無効
+// clang-format off
+constexpr inline keymap::entry_t fn_layer[] = {
+	{ keymap::KEY_PAUSE,                     keymap::system(SYSTEM_CONTROL_STANDBY) },
+	{ keymap::key_id_e0(ps2key::BREAK),      keymap::system(SYSTEM_CONTROL_STANDBY) },
+	{ keymap::key_id(ps2key::AX),            keymap::system(SYSTEM_CONTROL_POWER_OFF) },
+	{ keymap::key_id(0x70),                  keymap::consumer_tap(AUDIO_CONTROL_MUTE) },                     // テンキー0
+	{ keymap::key_id_e0(0x72),               keymap::consumer(AUDIO_CONTROL_VOLUME_DECREMENT) },             // ↓
+	{ keymap::key_id(0x72),                  keymap::consumer(AUDIO_CONTROL_VOLUME_DECREMENT) },             // テンキー2
+	{ keymap::key_id_e0(0x75),               keymap::consumer(AUDIO_CONTROL_VOLUME_INCREMENT) },             // ↑
+	{ keymap::key_id(0x75),                  keymap::consumer(AUDIO_CONTROL_VOLUME_INCREMENT) },             // テンキー8
+	{ keymap::key_id_e0(0x6b),               keymap::consumer_tap(TRANSPORT_CONTROL_SCAN_PREVIOUS_TRACK) },  // ←
+	{ keymap::key_id(0x6b),                  keymap::consumer_tap(TRANSPORT_CONTROL_SCAN_PREVIOUS_TRACK) },  // テンキー4
+	{ keymap::key_id_e0(0x7d),               keymap::consumer_tap(TRANSPORT_CONTROL_SCAN_PREVIOUS_TRACK) },  // PgUp
+	{ keymap::key_id_e0(0x74),               keymap::consumer_tap(TRANSPORT_CONTROL_SCAN_NEXT_TRACK) },      // →
+	{ keymap::key_id(0x74),                  keymap::consumer_tap(TRANSPORT_CONTROL_SCAN_NEXT_TRACK) },      // テンキー6
+	{ keymap::key_id_e0(0x7a),               keymap::consumer_tap(TRANSPORT_CONTROL_SCAN_NEXT_TRACK) },      // PgDn
+	{ keymap::key_id(0x29),                  keymap::consumer_tap(TRANSPORT_CONTROL_PLAY_PAUSE) },           // Space
+	{ keymap::key_id(0x73),                  keymap::consumer_tap(TRANSPORT_CONTROL_PLAY_PAUSE) },           // テンキー5
+	{ keymap::key_id_e0(0x6c),               keymap::consumer_tap(TRANSPORT_CONTROL_PLAY) },                 // Home
+	{ keymap::key_id(0x6c),                  keymap::consumer_tap(TRANSPORT_CONTROL_PLAY) },                 // テンキー7
+	{ keymap::key_id_e0(0x69),               keymap::consumer_tap(TRANSPORT_CONTROL_PAUSE) },                // End
+	{ keymap::key_id(0x69),                  keymap::consumer_tap(TRANSPORT_CONTROL_PAUSE) },                // テンキー1
+	// Fn どうし(もう一方の Fn を離したときにレイヤーを戻せるように)
+	{ keymap::key_id(ps2key::CAPS),          CAPS_FN },
+	{ keymap::key_id_e0(ps2key::L_CTRL),     keymap::momentary(LAYER_FN) },
+};
+// clang-format on
+
+/**
+ * @brief 既定のレイヤー(AXキーボード: 無変換/変換 = Win、Caps(押し続けたとき)/英数カナ = Fn)
+ */
+constexpr inline keymap::layer_t default_layers[] = {
+	{ base_layer.data(), base_layer.size(), keymap::NONE },
+	{ fn_layer, std::size(fn_layer), keymap::NONE },
+};
+
 }  // namespace ax2usb::map
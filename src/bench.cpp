@@ -0,0 +1,280 @@
+#include "bench.hpp"
+#if defined(AX2USB_NATIVE) || AX2USB_BENCH
+#include <spscq.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+#include "ax2usb.h"
+#include "ax2usbmap.hpp"
+#include "hid_util.h"
+#include "keymap.hpp"
+#include "set2_decoder.hpp"
+#ifdef AX2USB_NATIVE
+#include <sim.h>
+#include <chrono>
+#elif defined(ARDUINO_ARCH_RP2040)
+#include <hardware/regs/m0plus.h>
+#include <hardware/structs/systick.h>
+#endif
+
+#ifdef AX2USB_NATIVE
+namespace {
+
+// ホストでは native_hal が malloc を数える(sim 自身の確保は除く)
+uint32_t
+allocation_count() {
+	return static_cast<uint32_t>(sim::heap_allocations());
+}
+
+}  // namespace
+#else
+namespace {
+
+std::atomic<uint32_t> allocations{ 0 };
+
+void*
+counted_alloc(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+#if __cpp_exceptions
+	throw std::bad_alloc();
+#else
+	abort();
+#endif
+}
+
+uint32_t
+allocation_count() {
+	return allocations.load(std::memory_order_relaxed);
+}
+
+}  // namespace
+
+// 計測中のヒープ確保を数える(キー処理の経路では 0 のはず)
+void*
+operator new(size_t size) {
+	return counted_alloc(size);
+}
+void*
+operator new[](size_t size) {
+	return counted_alloc(size);
+}
+void
+operator delete(void* p) noexcept {
+	std::free(p);
+}
+void
+operator delete[](void* p) noexcept {
+	std::free(p);
+}
+void
+operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+void
+operator delete[](void* p, size_t) noexcept {
+	std::free(p);
+}
+#endif
+
+namespace ax2usb::bench {
+
+namespace {
+
+#ifdef AX2USB_NATIVE
+constexpr uint32_t OPS = 1000000;
+constexpr uint32_t LOOP_OPS = 20000;
+#else
+constexpr uint32_t OPS = 20000;
+#endif
+
+// 最適化で計測対象が消えないように結果を書き込む
+volatile uint32_t sink;
+
+struct result_t {
+	uint64_t ns;
+	uint64_t cycles;  // 0: 数えていない(ホスト)
+	uint32_t allocs;
+};
+
+#if defined(ARDUINO_ARCH_RP2040) && !defined(AX2USB_NATIVE)
+// SysTick は24ビットの減算カウンタなので、あふれない回数ごとに区切って数える
+constexpr uint32_t SYSTICK_MASK = 0xffffff;
+constexpr uint32_t CHUNK = 64;
+
+void
+start_systick() {
+	systick_hw->csr = 0;
+	systick_hw->rvr = SYSTICK_MASK;
+	systick_hw->cvr = 0;
+	systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+}
+#endif
+
+template <typename F>
+result_t
+measure(uint32_t ops, F&& op) {
+	for (uint32_t i = 0; i < ops / 16; i++) {
+		op(i);
+	}
+	result_t r{};
+	uint32_t allocs = allocation_count();
+#if defined(ARDUINO_ARCH_RP2040) && !defined(AX2USB_NATIVE)
+	start_systick();
+	for (uint32_t i = 0; i < ops;) {
+		uint32_t end = std::min(ops, i + CHUNK);
+		uint32_t start = systick_hw->cvr;
+		for (; i < end; i++) {
+			op(i);
+		}
+		r.cycles += (start - systick_hw->cvr) & SYSTICK_MASK;
+	}
+	r.ns = r.cycles * 1000000000 / rp2040.f_cpu();
+#else
+	auto t0 = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < ops; i++) {
+		op(i);
+	}
+	r.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+#endif
+	r.allocs = allocation_count() - allocs;
+	return r;
+}
+
+// 1操作あたりの値を小数1桁(allocs は2桁)で出す
+void
+print_result(Print& out, const char* name, uint32_t ops, const result_t& r) {
+	auto tenths = [ops](uint64_t v) { return static_cast<unsigned long>(v * 10 / ops); };
+	out.printf("%-28s %6lu.%lu ns/op", name, tenths(r.ns) / 10, tenths(r.ns) % 10);
+	if (r.cycles) {
+		out.printf(" %6lu.%lu cycles/op", tenths(r.cycles) / 10, tenths(r.cycles) % 10);
+	}
+	unsigned long hundredths = static_cast<unsigned long>(uint64_t{ r.allocs } * 100 / ops);
+	out.printf(" %lu.%02lu allocs/op\r\n", hundredths / 100, hundredths % 100);
+}
+
+template <typename F>
+void
+run(Print& out, const char* name, uint32_t ops, F&& op) {
+	print_result(out, name, ops, measure(ops, op));
+}
+
+void
+bench_queues(Print& out) {
+	static SPSCQ<uint32_t, 16> spscq;
+	run(out, "SPSCQ put+get", OPS, [](uint32_t i) {
+		uint32_t v = 0;
+		spscq.put(i);
+		spscq.get(v);
+		sink = v;
+	});
+}
+
+template <size_t N>
+void
+bench_decode(Print& out, const char* name, const uint8_t (&bytes)[N]) {
+	static set2::Decoder decoder;
+	decoder.reset();
+	run(out, name, OPS, [&bytes](uint32_t) {
+		uint32_t keys = 0;
+		for (uint8_t b : bytes) {
+			keys += decoder.feed(b).key;
+		}
+		sink = keys;
+	});
+}
+
+void
+bench_keymap(Print& out) {
+	static keymap::Keymap km;
+	km.load(map::default_layers, std::size(map::default_layers));
+	const keymap::key_t key = keymap::key_id_e0(0x75);  // Up
+	run(out, "keymap press+release E0", OPS, [&key](uint32_t) { sink = km.press(key).usage + km.release(key).usage; });
+}
+
+void
+bench_hid(Print& out) {
+	static Adafruit_USBD_HID usb_hid;
+	static hid_util::HidUtil hid{ usb_hid, AX2USB::REPORT_ID_KBD };
+	// 先に N キー押しておき、6KRO の N 番目に入るキーを押して離す
+	constexpr uint8_t KEY = HID_KEY_Z;
+	for (uint8_t held = 0; held < 6; held++) {
+		for (uint8_t k = 0; k < held; k++) {
+			hid.update_usb_codes(HID_KEY_A + k, true);
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "hid update_usb_codes [%u]", held);
+		run(out, name, OPS, [held](uint32_t) {
+			uint8_t codes[6];
+			hid.update_usb_codes(KEY, true);
+			hid.fill_6kro(codes);
+			hid.update_usb_codes(KEY, false);
+			sink = codes[held];
+		});
+		for (uint8_t k = 0; k < held; k++) {
+			hid.update_usb_codes(HID_KEY_A + k, false);
+		}
+	}
+	constexpr uint8_t L_SHIFT = 0x02;  // モディファイアのビット
+	run(out, "hid update_usb_modifier", OPS, [](uint32_t) {
+		bool changed = hid.update_usb_modifier(L_SHIFT, true);
+		sink = changed + hid.update_usb_modifier(L_SHIFT, false);
+	});
+}
+
+#ifdef AX2USB_NATIVE
+// PS/2 受信割り込みから USB レポート送信完了まで(make と break で loop() 2回と USB のポーリング2回)
+void
+bench_loop(Print& out) {
+	sim::reset();
+	sim::Keyboard kbd;
+	AX2USB a2u;
+	if (!a2u.begin(9, 10)) {
+		out.println("loop: failed to init ax2usb");
+		return;
+	}
+	// 起動時の ECHO と初期化コマンド列が終わるまで進める
+	while (sim::now_us() < 1000000) {
+		a2u.loop();
+		sim::advance_us(100);
+	}
+	auto* ps2 = libps2::PS2::sim_port(0);
+	run(out, "loop() make+break", LOOP_OPS, [ps2, &a2u](uint32_t) {
+		ps2->sim_receive(0x1c);
+		a2u.loop();
+		sim::advance_us(1000);
+		ps2->sim_receive(0xf0);
+		ps2->sim_receive(0x1c);
+		a2u.loop();
+		sim::advance_us(1000);
+		sim::usb_reports().clear();
+	});
+}
+#endif
+
+}  // namespace
+
+void
+run_all(Print& out) {
+#ifdef AX2USB_NATIVE
+	sim::heap_check_arm(true);
+#endif
+	bench_queues(out);
+	constexpr uint8_t KEY[] = { 0x1c, 0xf0, 0x1c };
+	constexpr uint8_t E0_KEY[] = { 0xe0, 0x75, 0xe0, 0xf0, 0x75 };
+	bench_decode(out, "set2 decode make+break", KEY);
+	bench_decode(out, "set2 decode E0 make+break", E0_KEY);
+	bench_keymap(out);
+	bench_hid(out);
+#ifdef AX2USB_NATIVE
+	bench_loop(out);
+	sim::heap_check_arm(false);
+#endif
+}
+
+}  // namespace ax2usb::bench
+#endif
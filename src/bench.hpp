@@ -0,0 +1,23 @@
+#pragma once
+// デコードとレポート組み立てのホットパスのマイクロベンチマーク
+#include <Arduino.h>
+
+// 1: 実機でベンチマークだけを実行するビルド(seeed_xiao_rp2040_bench 環境)
+#ifndef AX2USB_BENCH
+#define AX2USB_BENCH 0
+#endif
+
+namespace ax2usb::bench {
+
+/**
+ * @brief すべてのベンチマークを実行し、1行1項目で結果を出力する
+ *
+ *   名前  ns/op  cycles/op(実機のみ)  allocs/op
+ *
+ * 実機では SysTick(CPU クロックで数える24ビットのカウンタ)でサイクル数を数え、クロック周波数で ns にする。
+ * ホストでは steady_clock の ns だけを出す。allocs/op は計測中のヒープ確保の回数(実機は operator new、ホストは native_hal が数える malloc)。
+ * loop() 1回分の計測は PS/2・USB の代替実装が要るのでホストのみ。
+ */
+void run_all(Print& out);
+
+}  // namespace ax2usb::bench
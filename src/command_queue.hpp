@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace ax2usb {
+
+/**
+ * @brief キーボードへ送るコマンド(それぞれ ps2_step_t の列として送る)
+ */
+enum class command_t : uint8_t {
+	reset,  // リセットして BAT をやり直させる
+	init,   // スキャンコードセット・タイプマティックの設定
+	led,    // LED の設定(送るときの最新の値を送る)
+};
+
+/**
+ * @brief 送信待ちのコマンドの列(PS/2 側だけで使う)
+ *
+ * 同じコマンドが待っていれば1つにまとめる。LED の変更が何回あっても、送るのは最新の値の1回だけになる。
+ */
+class CommandQueue {
+ public:
+	static inline constexpr size_t DEPTH = 3;  // command_t の種類の数(まとめるので溢れない)
+
+	void push(command_t c) {
+		for (size_t i = 0; i < n; i++) {
+			if (buf[i] == c) {
+				return;
+			}
+		}
+		if (n < DEPTH) {
+			buf[n++] = c;
+		}
+	}
+	bool pop(command_t& c) {
+		if (n == 0) {
+			return false;
+		}
+		c = buf[0];
+		for (size_t i = 1; i < n; i++) {
+			buf[i - 1] = buf[i];
+		}
+		n--;
+		return true;
+	}
+	bool empty() const { return n == 0; }
+	void clear() { n = 0; }
+
+ private:
+	command_t buf[DEPTH] = {};
+	uint8_t n = 0;
+};
+
+}  // namespace ax2usb
@@ -0,0 +1,69 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace ax2usb {
+
+/**
+ * @brief 固定個数のタイマー(期限)の集合
+ *
+ * タイマーは enum class Id の値で指し(Id::count が個数)、設定・解除は配列の1要素を書くだけ(O(1))。
+ * 次の期限と期限切れの取り出しは設定中のタイマーだけを調べる(32個まで。使うのは数個)。
+ * 時刻は micros() の値で、差を符号付きで比べるので約35分以内の期限なら桁あふれしても正しく動く。
+ * 1つのスレッド(コア)だけで使うこと。
+ */
+template <typename Id>
+class Deadlines {
+	static inline constexpr size_t N = static_cast<size_t>(Id::count);
+	static_assert(N <= 32);
+
+ public:
+	/**
+	 * @brief タイマーを at_us に設定する(設定中なら設定し直す)
+	 */
+	void arm(Id id, uint32_t at_us) {
+		at[index(id)] = at_us;
+		armed_bits |= bit(id);
+	}
+	void cancel(Id id) { armed_bits &= ~bit(id); }
+	bool armed(Id id) const { return armed_bits & bit(id); }
+	/**
+	 * @brief 最も近い期限までの時間(過ぎていれば 0)。設定中のタイマーが無ければ UINT32_MAX
+	 */
+	uint32_t remaining_us(uint32_t now_us) const {
+		uint32_t r = UINT32_MAX;
+		for (uint32_t bits = armed_bits; bits; bits &= bits - 1) {
+			int32_t left = at[__builtin_ctz(bits)] - now_us;
+			if (left <= 0) {
+				return 0;
+			}
+			r = static_cast<uint32_t>(left) < r ? left : r;
+		}
+		return r;
+	}
+	/**
+	 * @brief 期限が来たタイマーを1つ解除して返す(期限の早い順とは限らない)
+	 *
+	 * @return false 期限が来たタイマーは無い
+	 */
+	bool pop_expired(uint32_t now_us, Id& id) {
+		for (uint32_t bits = armed_bits; bits; bits &= bits - 1) {
+			size_t i = __builtin_ctz(bits);
+			if (static_cast<int32_t>(now_us - at[i]) >= 0) {
+				armed_bits &= ~(1u << i);
+				id = static_cast<Id>(i);
+				return true;
+			}
+		}
+		return false;
+	}
+
+ private:
+	static constexpr size_t index(Id id) { return static_cast<size_t>(id); }
+	static constexpr uint32_t bit(Id id) { return 1u << index(id); }
+
+	uint32_t at[N] = {};
+	uint32_t armed_bits = 0;
+};
+
+}  // namespace ax2usb
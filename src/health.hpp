@@ -0,0 +1,100 @@
+#pragma once
+// 稼働状況の集計と、ホストがフィーチャーレポートで読み出す形式(tools/ax2usb_health.cpp と共有する)
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// clang-format off
+/**
+ * @brief 稼働状況のフィーチャーレポートの記述子(ベンダー定義のページ、health_report_t のバイト列)
+ */
+#define AX2USB_HID_REPORT_DESC_HEALTH(...) \
+	HID_USAGE_PAGE_N ( ax2usb::health::USAGE_PAGE, 2 ), \
+	HID_USAGE ( ax2usb::health::USAGE ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_USAGE ( ax2usb::health::USAGE ), \
+		HID_LOGICAL_MIN ( 0 ), \
+		HID_LOGICAL_MAX_N ( 255, 2 ), \
+		HID_REPORT_SIZE ( 8 ), \
+		HID_REPORT_COUNT ( sizeof(ax2usb::health::health_report_t) ), \
+		HID_FEATURE ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+	HID_COLLECTION_END
+// clang-format on
+
+namespace ax2usb::health {
+
+constexpr inline uint16_t USAGE_PAGE = 0xff41;  // ベンダー定義
+constexpr inline uint8_t USAGE = 0x01;
+constexpr inline uint8_t REPORT_ID = 6;
+/**
+ * @brief health_report_t の形式の版。フィールドを変えたら上げる
+ */
+constexpr inline uint8_t VERSION = 2;
+
+/**
+ * @brief 稼働状況のフィーチャーレポート(レポートIDの後ろ、リトルエンディアン)
+ *
+ * 回数は起動からの累計で、2^32(16ビットのものは 2^16)で一周する。フィールドは末尾に足す。
+ */
+struct __attribute__((packed)) health_report_t {
+	uint8_t version;            // VERSION
+	uint8_t scan_code_set;      // 使用中のスキャンコードセット(2 か 3)
+	uint8_t rx_high_watermark;  // PS/2 受信キューの最大の深さ
+	uint8_t tx_high_watermark;  // USB 送信キューの最大の深さ
+	uint32_t uptime_s;          // 起動からの秒数
+	uint32_t rx_bytes;          // PS/2 で受信したバイト数(キーボード)
+	uint32_t rx_dropped;        // 受信キューが満杯で捨てたバイト数
+	uint32_t overrun;           // キーボードのバッファあふれ(00)
+	uint32_t self_test;         // BAT 失敗・診断エラー(FC/FD)
+	uint32_t resend;            // キーボードからの再送要求(FE)
+	uint32_t unexpected;        // プレフィクスの後に来ないはずのコード・キーの位置に対応しないコード
+	uint32_t prefix_timeout;    // プレフィクスの後のバイトが届かなかった
+	uint32_t resync;            // 同期が崩れて押しているキーをすべて離した
+	uint32_t ack_timeout;       // コマンドの応答が期限内に届かなかった
+	uint32_t led_timeout;       // そのうち LED 設定コマンドのもの
+	uint32_t usb_reports;       // 送信キューに積んだレポート数
+	uint32_t usb_dropped;       // 送信キューが満杯で捨てた(途中の状態を上書きした)レポート数
+	uint32_t usb_retries;       // 送信できる状態なのに TinyUSB が受け付けず、送り直したレポート数
+	// 以下 VERSION 2
+	uint16_t set3_unmapped;     // unexpected のうち、セット3でキーの位置に対応しないコードの make(AXキーボード独自のキーなど)
+};
+// 制御転送のバッファ(64バイト)にレポートIDと一緒に収める
+static_assert(sizeof(health_report_t) <= 63);
+
+/**
+ * @brief 書き込むのは1つのコンテキスト(割り込みハンドラかメインループの片方)だけの回数
+ *
+ * RMW 命令の無い Cortex-M0+ でも割り込みを禁止せずに足せる。ほかのコアからはいつでも読める。
+ */
+class Counter {
+ public:
+	void add(uint32_t n = 1) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	uint32_t get() const { return v.load(std::memory_order_relaxed); }
+
+ private:
+	std::atomic<uint32_t> v{ 0 };
+};
+
+/**
+ * @brief micros()(約71分で一周する)を伸ばして起動からの時間を数える
+ */
+class Uptime {
+ public:
+	/**
+	 * @brief micros() が一周するより短い間隔で呼ぶ(USB 側のメインループから)
+	 */
+	void update(uint32_t now_us) {
+		if (now_us < last_us) {
+			wraps++;
+		}
+		last_us = now_us;
+	}
+	uint32_t seconds() const { return static_cast<uint32_t>(((uint64_t{ wraps } << 32) | last_us) / 1000000); }
+
+ private:
+	uint32_t wraps = 0;
+	uint32_t last_us = 0;
+};
+
+}  // namespace ax2usb::health
@@ -1,17 +1,22 @@
 #include "hid_util.h"
 #include <Arduino.h>
+#include <algorithm>
+#include <cstring>
 #include <iterator>
-#include "util.h"
-
-#define AX2USB_DEBUG 1
-#include "debug.h"
+#include <mutex>
+#include "log.hpp"
 
 namespace hid_util {
 
 namespace {
 
-constexpr int USB_SEND_RETRY_COUNT = 3;
 constexpr uint16_t DO_NOTHING = 0x00;
+constexpr uint8_t KEY_ERROR_ROLL_OVER = 0x01;
+// フレーム(SOF の間隔)と、TinyUSB が渡すフレーム番号(11ビット)
+constexpr uint32_t FRAME_US = 1000;
+constexpr uint32_t SOF_FRAME_MASK = 0x7ff;
+// SOF の推定時刻を1フレームあたりに遅らせる上限(1000ppm)
+constexpr int32_t SOF_DRIFT_US = 1;
 
 }  // namespace
 
@@ -23,206 +28,387 @@ usb_key_to_mod_mask(uint8_t usb_key) {
 	return (1 << (usb_key - HID_KEY_CONTROL_LEFT));
 }
 
-#if AX2USB_DEBUG
-static std::string
-usb_key_str(uint8_t key) {
-	if (key >= HID_KEY_0 && key <= HID_KEY_9) {
-		return std::string{ static_cast<char>('0' + key - HID_KEY_0) };
-	} else if (key >= HID_KEY_A && key <= HID_KEY_Z) {
-		return std::string{ static_cast<char>('A' + key - HID_KEY_A) };
-	} else if (key == HID_KEY_PRINT_SCREEN) {
-		return "Prt";
-	} else if (key == HID_KEY_PAUSE) {
-		return "Pause";
+bool
+HidUtil::update_usb_codes(uint8_t code, bool make_break) {
+	uint32_t& word = key_bits[code >> 5];
+	const uint32_t bit = 1u << (code & 31);
+	if (make_break == ((word & bit) != 0)) {
+		return false;
+	}
+	word ^= bit;
+	n_pressed += make_break ? 1 : -1;
+	return true;
+}
+
+uint64_t
+HidUtil::packed_6kro() const {
+	uint8_t codes[6];
+	fill_6kro(codes);
+	uint64_t v = 0;
+	for (size_t i = 0; i < std::size(codes); i++) {
+		v |= uint64_t{ codes[i] } << (i * 8);
+	}
+	return v;
+}
+
+void
+HidUtil::fill_6kro(uint8_t (&codes)[6]) const {
+	if (n_pressed > std::size(codes)) {
+		std::fill(std::begin(codes), std::end(codes), KEY_ERROR_ROLL_OVER);
+		return;
+	}
+	size_t n = 0;
+	for (size_t w = 0; w < std::size(key_bits); w++) {
+		for (uint32_t bits = key_bits[w]; bits; bits &= bits - 1) {
+			codes[n++] = w * 32 + __builtin_ctz(bits);
+		}
+	}
+	std::fill(&codes[n], std::end(codes), 0);
+}
+
+bool
+HidUtil::update_usb_modifier(uint8_t mask, bool make_break) {
+	auto prev = usb_mod.value;
+	if (make_break) {
+		usb_mod.value |= mask;
 	} else {
-		return std::string{ util::hexchar((key & 0xf0) >> 4), util::hexchar(key & 0x0f) };
+		usb_mod.value &= ~mask;
 	}
+	return usb_mod.value != prev;
 }
 
-std::string
-HidUtil::usb_codes_str() const {
-	std::string ret;
-	ret.reserve(24);
-	for (size_t i = 0; i < std::size(usb_codes); i++) {
-		ret += '[';
-		ret += usb_key_str(usb_codes[i]);
-		ret += ']';
+bool
+ReportQueue::push(uint8_t report_id, const void* data, uint8_t len, bool merge, const ax2usb::LatencyStamp& stamp) {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	len = std::min(len, MAX_LEN);
+	bool tail_match = n > 0 && entries[(head + n - 1) % DEPTH].report_id == report_id;
+	bool ok = true;
+	entry_t* e;
+	if (merge && tail_match) {
+		e = &entries[(head + n - 1) % DEPTH];
+		st.merged++;
+	} else if (n < DEPTH) {
+		e = &entries[(head + n) % DEPTH];
+		e->stamp = {};
+		e->ready_us = micros();
+		n++;
+		st.high_watermark = std::max<uint8_t>(st.high_watermark, n);
+	} else if (tail_match) {
+		// 満杯: 途中の状態を失っても最新の状態は送る
+		e = &entries[(head + n - 1) % DEPTH];
+		st.dropped++;
+		ok = false;
+	} else {
+		st.dropped++;
+		return false;
+	}
+	e->report_id = report_id;
+	e->len = len;
+	memcpy(e->data, data, len);
+	if (!e->stamp.valid) {
+		e->stamp = stamp;
 	}
+	st.pushed++;
+	return ok;
+}
 
-	return ret;
+bool
+ReportQueue::can_merge(uint8_t report_id) const {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	return n > 0 && entries[(head + n - 1) % DEPTH].report_id == report_id;
 }
 
-static char
-usb_mod_char(uint8_t mod_key) {
-	switch (mod_key) {
-		case HID_KEY_CONTROL_LEFT:
-			return 'C';
-		case HID_KEY_SHIFT_LEFT:
-			return 'S';
-		case HID_KEY_ALT_LEFT:
-			return 'A';
-		case HID_KEY_GUI_LEFT:
-			return 'W';
-		case HID_KEY_CONTROL_RIGHT:
-			return 'c';
-		case HID_KEY_SHIFT_RIGHT:
-			return 's';
-		case HID_KEY_ALT_RIGHT:
-			return 'a';
-		case HID_KEY_GUI_RIGHT:
-			return 'w';
-		default:
-			return '*';
+void
+ReportQueue::send_next(Adafruit_USBD_HID& usb_hid) {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	if (n == 0 || !usb_hid.ready()) {
+		return;
+	}
+	// TinyUSB は送信バッファにコピーするので、受け付けられたらすぐに取り除ける
+	auto& e = entries[head];
+	if (usb_hid.sendReport(e.report_id, e.data, e.len)) {
+		inflight = e.stamp;
+		inflight_ready_us = e.ready_us;
+		head = (head + 1) % DEPTH;
+		n--;
+	} else {
+		// 次の send_next() で送り直す
+		st.retries++;
 	}
 }
 
-static char
-key_mark(bool make_break) {
-	return make_break ? '+' : '-';
+void
+ReportQueue::complete(uint32_t now_us) {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	key_latency.record(inflight, now_us);
+	inflight.valid = false;
 }
 
-static char
-mod_mark(bool make_break) {
-	return make_break ? '#' : '~';
+void
+ReportQueue::record_sof(uint32_t sof_us) {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	// SOF の後に積んで同じフレームで送られたレポートは待ち 0
+	int32_t wait = static_cast<int32_t>(sof_us - inflight_ready_us);
+	sof_wait.add(wait > 0 ? wait : 0);
 }
 
-static std::string
-usb_mods_str(const HidUtil::usb_mod_t& mod) {
-	std::string ret;
+size_t
+ReportQueue::count() const {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	return n;
+}
 
-	ret += mod.l_ctrl ? 'C' : 'c';
-	ret += mod.l_shift ? 'S' : 's';
-	ret += mod.l_alt ? 'A' : 'a';
-	ret += mod.l_gui ? 'W' : 'w';
-	ret += '|';
-	ret += mod.r_ctrl ? 'C' : 'c';
-	ret += mod.r_shift ? 'S' : 's';
-	ret += mod.r_alt ? 'A' : 'a';
-	ret += mod.r_gui ? 'W' : 'w';
+ReportQueue::stats_t
+ReportQueue::stats() const {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	return st;
+}
 
-	return ret;
+ax2usb::LatencyHistogram::summary_t
+ReportQueue::latency(ax2usb::KeyLatency::phase_t phase) const {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	return key_latency.summary(phase);
 }
-#endif
 
-bool
-HidUtil::update_usb_codes(uint8_t code, bool make_break) {
-	bool modified = false;
-	if (make_break) {
-		for (size_t i = 0; i < std::size(usb_codes); i++) {
-			if (usb_codes[i] == code) {
-				break;
-			} else if (usb_codes[i] == 0) {
-				usb_codes[i] = code;
-				modified = true;
-				break;
-			}
-		}
-	} else {
-		for (size_t i = 0; i < std::size(usb_codes); i++) {
-			if (usb_codes[i] == code) {
-				if (i == std::size(usb_codes) - 1 || usb_codes[i + 1] == 0) {
-					usb_codes[i] = 0;
-				} else {
-					std::copy(&usb_codes[i + 1], std::end(usb_codes), &usb_codes[i]);
-					usb_codes[std::size(usb_codes) - 1] = 0;
-				}
-				modified = true;
-				break;
-			}
-		}
+ax2usb::LatencyHistogram::summary_t
+ReportQueue::ready_to_sof() const {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	return sof_wait.summary();
+}
+
+void
+ReportQueue::reset_latency() {
+	std::lock_guard<ax2usb::Mutex> lock(lck);
+	key_latency.reset();
+	sof_wait.reset();
+}
+
+uint8_t
+HidUtil::keyboard_report_id() const {
+	if (tud_hid_get_protocol() == HID_PROTOCOL_BOOT) {
+		// ブートプロトコルではレポートIDを付けない
+		return 0;
+	}
+	return report_id_nkro ? report_id_nkro : report_id_kbd;
+}
+
+void
+HidUtil::queue_keyboard_report(bool merge) {
+	uint8_t report_id = keyboard_report_id();
+	if (report_id && report_id == report_id_nkro) {
+		nkro_report_t report;
+		report.modifier = usb_mod.value;
+		// リトルエンディアンなので key_bits のバイト列がそのままビットマップになる
+		memcpy(report.bits, key_bits, sizeof(report.bits));
+		txq.push(report_id, &report, sizeof(report), merge, stamp_now());
+		return;
 	}
-	return modified;
+	// modifier, reserved, keycode[6]
+	uint8_t report[8] = { usb_mod.value, 0 };
+	fill_6kro(reinterpret_cast<uint8_t(&)[6]>(report[2]));
+	txq.push(report_id, report, sizeof(report), merge, stamp_now());
+}
+
+void
+HidUtil::send_report8(uint8_t report_id, uint8_t usage) {
+	txq.push(report_id, &usage, sizeof(usage), false);
+	send_pending();
+}
+
+void
+HidUtil::send_report16(uint8_t report_id, uint16_t usage) {
+	txq.push(report_id, &usage, sizeof(usage), false);
+	send_pending();
+}
+
+void
+HidUtil::send_report(uint8_t report_id, const void* data, uint8_t len) {
+	txq.push(report_id, data, len, false);
+	send_pending();
+}
+
+ax2usb::LatencyStamp
+HidUtil::stamp_now() const {
+	ax2usb::LatencyStamp s = event_stamp;
+	s.queued_us = micros();
+	return s;
 }
 
 bool
-HidUtil::update_usb_modifier(uint8_t mask, bool make_break) {
-	auto prev = usb_mod.value;
-	if (make_break) {
-		usb_mod.value |= mask;
-	} else {
-		usb_mod.value &= ~mask;
+HidUtil::set_timing(timing_t t, uint8_t interval_ms) {
+	bool supported = AX2USB_HAS_SOF || t == timing_t::immediate;
+	timing = supported ? t : timing_t::immediate;
+	poll_interval_ms = interval_ms;
+	poll_phase_known = false;
+	sof_seen = false;
+	hold_until_sof = false;
+#if AX2USB_HAS_SOF
+	tud_sof_cb_enable(timing != timing_t::immediate);
+#endif
+	return supported;
+}
+
+void
+HidUtil::report_complete_callback() {
+	if (!theInstance) {
+		return;
 	}
-	return usb_mod.value != prev;
+	auto& self = *theInstance;
+	if (self.timing != timing_t::immediate && self.sof_seen) {
+		// 送信はこのフレームのポーリングで行われた
+		self.txq.record_sof(self.sof_us);
+		self.poll_frame = self.sof_frame;
+		self.poll_phase_known = true;
+		self.hold_until_sof = self.timing == timing_t::sof;
+	}
+	self.txq.complete(micros());
+	self.send_pending();
 }
 
 void
-HidUtil::wait_usb_ready() {
-	while (!usb_hid.ready()) {
-		delay(1);
+HidUtil::sof_callback(uint32_t frame_count) {
+	if (!theInstance) {
+		return;
+	}
+	auto& self = *theInstance;
+	uint32_t now = micros();
+	if (self.sof_seen) {
+		self.sof_frame += (frame_count - self.sof_frame) & SOF_FRAME_MASK;
+	} else {
+		self.sof_frame = frame_count;
+		self.sof_base_us = now - frame_count * FRAME_US;
+		self.sof_seen = true;
+	}
+	self.sof_us = self.estimate_sof_us(now);
+	if (!self.hold_until_sof) {
+		return;
+	}
+	// ポーリング間隔は2のべき乗なので、11ビットのフレーム番号が一周しても位相は変わらない
+	if (((frame_count - self.poll_frame) & (self.poll_interval_ms - 1)) == 0) {
+		self.hold_until_sof = false;
+		self.txq.send_next(self.usb_hid);
 	}
 }
 
+uint32_t
+HidUtil::estimate_sof_us(uint32_t now_us) {
+	int32_t late = now_us - (sof_base_us + sof_frame * FRAME_US);
+	sof_base_us += std::min(late, SOF_DRIFT_US);
+	return sof_base_us + sof_frame * FRAME_US;
+}
+
 void
-HidUtil::send_keyboard_report() {
-	for (int i = 0; i < USB_SEND_RETRY_COUNT; i++) {
-		if (usb_hid.keyboardReport(report_id_kbd, usb_mod.value, usb_codes)) {
-			break;
-		}
-		wait_usb_ready();
-		if (i == USB_SEND_RETRY_COUNT) {
-			DEBUG_PRINTLN("Failed to send keyboard to USB");
-		}
+HidUtil::before_change(uint8_t code, uint8_t mod_mask) {
+	if (!batch_dirty) {
+		return;
+	}
+	bool twice = (code && (batch_bits[code >> 5] & (1u << (code & 31)))) || (mod_mask & batch_mod);
+	// キーの make とその後のモディファイア変化を1レポートにまとめると、ホストは変化後のモディファイアでキーを解釈してしまう
+	bool reorder = mod_mask && batch_make;
+	// 末尾のレポートが送信済みなら、次の変化は新しいレポートになる
+	if (twice || reorder || !txq.can_merge(keyboard_report_id())) {
+		clear_batch();
 	}
 }
 
 void
-HidUtil::send_report16(uint8_t report_id, uint16_t usage) {
-	for (int i = 0; i < USB_SEND_RETRY_COUNT; i++) {
-		if (usb_hid.sendReport16(report_id, usage)) {
-			break;
-		}
-		wait_usb_ready();
-		if (i == USB_SEND_RETRY_COUNT) {
-			DEBUG_PRINTLN("Failed to send report to USB");
-		}
+HidUtil::after_change(uint8_t code, uint8_t mod_mask, bool make_break) {
+	bool merge = coalescing && batch_dirty;
+	if (code) {
+		batch_bits[code >> 5] |= 1u << (code & 31);
+		batch_make |= make_break;
+	}
+	batch_mod |= mod_mask;
+	batch_dirty = true;
+	queue_keyboard_report(merge);
+	if (!batching) {
+		send_pending();
 	}
 }
 
+void
+HidUtil::clear_batch() {
+	batch_dirty = false;
+	batch_make = false;
+	batch_mod = 0;
+	std::fill(std::begin(batch_bits), std::end(batch_bits), 0);
+}
+
 void
 HidUtil::send_usb_key(uint8_t usb, bool make_break) {
 	if (auto mask = usb_key_to_mod_mask(usb); mask) {
 		// modifiers
+		before_change(0, mask);
 		if (update_usb_modifier(mask, make_break)) {
-			send_keyboard_report();
-			DEBUG_PRINTLN(">%c%c %s %s", mod_mark(make_break), usb_mod_char(usb), usb_mods_str(usb_mod).c_str(), usb_codes_str().c_str());
+			after_change(0, mask, make_break);
+			LOG_DEBUG(USB_MOD, make_break, usb, usb_mod.value, ax2usb::log::wide{ packed_6kro() });
 		}
 	} else {
 		// normal keys
+		before_change(usb, 0);
 		if (update_usb_codes(usb, make_break)) {
-			send_keyboard_report();
-			DEBUG_PRINTLN(">%c%s %s %s", key_mark(make_break), usb_key_str(usb).c_str(), usb_mods_str(usb_mod).c_str(),
-			              usb_codes_str().c_str());
+			after_change(usb, 0, make_break);
+			LOG_DEBUG(USB_KEY, make_break, usb, usb_mod.value, ax2usb::log::wide{ packed_6kro() });
 		}
 	}
 }
 
 void
 HidUtil::send_usb_key_mod(uint8_t usb, uint8_t usb_mod_key, bool make_break) {
+	auto mask = usb_key_to_mod_mask(usb_mod_key);
+	before_change(usb, mask);
 	bool cod = update_usb_codes(usb, make_break);
-	bool mod = update_usb_modifier(usb_key_to_mod_mask(usb_mod_key), make_break);
+	bool mod = update_usb_modifier(mask, make_break);
 	if (cod || mod) {
-		send_keyboard_report();
-		DEBUG_PRINTLN(">%c%c%c%s %s %s", mod_mark(make_break), usb_mod_char(usb_mod_key), key_mark(make_break),
-		              usb_key_str(usb).c_str(), usb_mods_str(usb_mod).c_str(), usb_codes_str().c_str());
+		after_change(usb, mask, make_break);
+		LOG_DEBUG(USB_KEY_MOD, make_break, usb_mod_key, make_break, usb, usb_mod.value, ax2usb::log::wide{ packed_6kro() });
 	}
 }
 
 void
 HidUtil::send_usb_key_oneshot(uint8_t usb) {
 	if (update_usb_codes(usb, true)) {
-		send_keyboard_report();
-		wait_usb_ready();
+		queue_keyboard_report(false);
 	}
 	update_usb_codes(usb, false);
 	// send break code even if make code was not sent, to be sure
-	send_keyboard_report();
+	queue_keyboard_report(false);
+	clear_batch();
+	send_pending();
+}
+
+void
+HidUtil::release_all_keys() {
+	if (n_pressed == 0 && usb_mod.value == 0) {
+		return;
+	}
+	std::fill(std::begin(key_bits), std::end(key_bits), 0);
+	n_pressed = 0;
+	usb_mod.value = 0;
+	// 離す順序は問わないので1レポートにまとめる。後の変化は別のレポートにする
+	clear_batch();
+	queue_keyboard_report(false);
+	if (!batching) {
+		send_pending();
+	}
 }
 
 void
 HidUtil::send_report16_oneshot(uint8_t report_id, uint16_t usage) {
-	send_report16(report_id, usage);
-	wait_usb_ready();
+	txq.push(report_id, &usage, sizeof(usage), false);
 	send_report16(report_id, DO_NOTHING);
 }
 
 }  // namespace hid_util
+
+extern "C" void
+tud_hid_report_complete_cb(uint8_t, uint8_t const*, uint16_t) {
+	hid_util::HidUtil::report_complete_callback();
+}
+
+#if AX2USB_HAS_SOF
+extern "C" void
+tud_sof_cb(uint32_t frame_count) {
+	hid_util::HidUtil::sof_callback(frame_count);
+}
+#endif
@@ -1,11 +1,122 @@
 #pragma once
 #include <Adafruit_TinyUSB.h>
-#include <string>
+#include <cstddef>
+#include "latency.hpp"
+#include "mutex.hpp"
+
+// 1: SOF のコールバック(tud_sof_cb_enable())を使える。TinyUSB 0.16(Adafruit TinyUSB Library 3.x)から
+#if defined(AX2USB_NATIVE) || TUSB_VERSION_MAJOR > 0 || TUSB_VERSION_MINOR >= 16
+#define AX2USB_HAS_SOF 1
+#else
+#define AX2USB_HAS_SOF 0
+#endif
+
+// clang-format off
+/**
+ * @brief NKRO キーボードの記述子: モディファイア8ビット + 使用法 0x00〜0xDF のビットマップ
+ */
+#define AX2USB_HID_REPORT_DESC_NKRO_KEYBOARD(...) \
+	HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP ), \
+	HID_USAGE ( HID_USAGE_DESKTOP_KEYBOARD ), \
+	HID_COLLECTION ( HID_COLLECTION_APPLICATION ), \
+		__VA_ARGS__ \
+		HID_USAGE_PAGE ( HID_USAGE_PAGE_KEYBOARD ), \
+			HID_USAGE_MIN ( 224 ), \
+			HID_USAGE_MAX ( 231 ), \
+			HID_LOGICAL_MIN ( 0 ), \
+			HID_LOGICAL_MAX ( 1 ), \
+			HID_REPORT_COUNT ( 8 ), \
+			HID_REPORT_SIZE ( 1 ), \
+			HID_INPUT ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+			HID_USAGE_MIN ( 0 ), \
+			HID_USAGE_MAX_N ( hid_util::HidUtil::NKRO_USAGES - 1, 2 ), \
+			HID_REPORT_COUNT_N ( hid_util::HidUtil::NKRO_USAGES, 2 ), \
+			HID_INPUT ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ), \
+	HID_COLLECTION_END
+// clang-format on
 
 namespace hid_util {
 
+/**
+ * @brief 送信待ちレポートのキュー
+ *
+ * メインループが積み、TinyUSB の送信完了コールバックとメインループの両方から先頭を送信する。
+ * 末尾と同じレポートIDなら末尾に上書きしてまとめられる。深さは DEPTH で固定。
+ */
+class ReportQueue {
+ public:
+	static inline constexpr size_t DEPTH = 8;
+	static inline constexpr uint8_t MAX_LEN = 32;
+
+	struct stats_t {
+		uint32_t pushed;          // 積んだレポート数
+		uint32_t merged;          // 末尾にまとめた数
+		uint32_t dropped;         // 満杯で捨てた(または途中の状態を上書きした)数
+		uint8_t high_watermark;  // 最大の深さ
+		uint32_t retries;        // USB が送信可能なのに受け付けられず、先頭に残した数
+	};
+
+	/**
+	 * @brief レポートを積む
+	 *
+	 * @param merge 末尾が同じレポートIDならそれを上書きする
+	 * @param stamp 遅延計測用の時刻。まとめた場合は古い方を残す
+	 * @return false 満杯で捨てた、または途中の状態を上書きした
+	 */
+	bool push(uint8_t report_id, const void* data, uint8_t len, bool merge, const ax2usb::LatencyStamp& stamp = {});
+	/**
+	 * @brief 末尾が report_id のレポートでまだ送信されていないか
+	 */
+	bool can_merge(uint8_t report_id) const;
+	/**
+	 * @brief USBが送信可能なら先頭を1つ送信する(割り込みハンドラから呼んでよい)
+	 */
+	void send_next(Adafruit_USBD_HID& usb_hid);
+	/**
+	 * @brief 送信完了時に呼ぶ(割り込みハンドラから呼んでよい)。送信したレポートの遅延を記録する
+	 */
+	void complete(uint32_t now_us);
+	/**
+	 * @brief 送信したレポートを積んでから、送信されたフレームの SOF までの時間を記録する。complete() の前に呼ぶ
+	 */
+	void record_sof(uint32_t sof_us);
+	size_t count() const;
+	size_t space() const { return DEPTH - count(); }
+	stats_t stats() const;
+	ax2usb::LatencyHistogram::summary_t latency(ax2usb::KeyLatency::phase_t phase) const;
+	ax2usb::LatencyHistogram::summary_t ready_to_sof() const;
+	void reset_latency();
+
+ private:
+	struct entry_t {
+		uint8_t report_id;
+		uint8_t len;
+		uint8_t data[MAX_LEN];
+		ax2usb::LatencyStamp stamp;
+		uint32_t ready_us;  // 積んだ時刻(まとめた場合は最初に積んだ時刻)
+	};
+
+	entry_t entries[DEPTH];
+	size_t head = 0;
+	size_t n = 0;
+	stats_t st{};
+	ax2usb::LatencyStamp inflight{};
+	uint32_t inflight_ready_us = 0;
+	ax2usb::KeyLatency key_latency;
+	ax2usb::LatencyHistogram sof_wait;
+	mutable ax2usb::Mutex lck;
+};
+
 class HidUtil {
  public:
+	/**
+	 * @brief レポートを送信するタイミング
+	 */
+	enum class timing_t : uint8_t {
+		immediate,  // 積んだらすぐに送信する(既定)
+		measured,   // immediate と同じで、SOF を受け取って ready_to_sof() を計測する
+		sof,        // 送信完了の後は、次にポーリングされるフレームの SOF まで次のレポートを送信せず、変化をまとめる
+	};
 	union __attribute__((packed)) usb_mod_t {
 		struct __attribute__((packed)) {
 			bool l_ctrl : 1;
@@ -21,7 +132,25 @@ class HidUtil {
 	};
 	usb_mod_t usb_mod = {};
 
-	HidUtil(Adafruit_USBD_HID& usb_hid, uint8_t report_id_kbd) : usb_hid(usb_hid), report_id_kbd(report_id_kbd) {}
+	/**
+	 * @brief NKRO レポートのビットマップで扱う使用法の数(0x00〜0xDF)
+	 */
+	static inline constexpr uint16_t NKRO_USAGES = 0xe0;
+
+	/**
+	 * @param usb_hid
+	 * @param report_id_kbd 6KRO(ブートプロトコル互換)キーボードのレポートID
+	 * @param report_id_nkro NKRO キーボードのレポートID。0 なら常に 6KRO で送信する
+	 */
+	HidUtil(Adafruit_USBD_HID& usb_hid, uint8_t report_id_kbd, uint8_t report_id_nkro = 0)
+	    : usb_hid(usb_hid), report_id_kbd(report_id_kbd), report_id_nkro(report_id_nkro) {
+		theInstance = this;
+	}
+	~HidUtil() {
+		if (theInstance == this) {
+			theInstance = nullptr;
+		}
+	}
 
 	/**
 	 * @brief USBへキーを送信する
@@ -44,6 +173,10 @@ class HidUtil {
 	 * @param make_break make or break
 	 */
 	void send_usb_key_mod(uint8_t usb, uint8_t usb_mod_key, bool make_break);
+	/**
+	 * @brief 押しているキーとモディファイアをすべて離したレポートを送信する(押していなければ何もしない)
+	 */
+	void release_all_keys();
 	/**
 	 * @brief トグルスイッチ用のコード送信
 	 *
@@ -52,26 +185,182 @@ class HidUtil {
 	 */
 	void send_report16_oneshot(uint8_t report_id, uint16_t usage);
 	/**
-	 * @brief リトライ付きキーボードコードの送信
+	 * @brief 8ビットレポートの送信
 	 */
-	void send_keyboard_report();
+	void send_report8(uint8_t report_id, uint8_t usage);
 	/**
-	 * @brief リトライ付き16ビットレポートの送信
+	 * @brief 16ビットレポートの送信
 	 */
 	void send_report16(uint8_t report_id, uint16_t usage);
 	/**
-	 * @brief USBが送信可能になるまでビジーウェイトする
+	 * @brief 任意の長さのレポートの送信(まとめない)
+	 */
+	void send_report(uint8_t report_id, const void* data, uint8_t len);
+	/**
+	 * @brief 送信待ちのレポートが無く、USBがすぐに送信できるか
+	 *
+	 * これを確かめてから積んだレポートはすぐに送られ、後から積むキーボードレポートを待たせない。
+	 */
+	bool idle() const { return txq.count() == 0 && usb_hid.ready(); }
+	/**
+	 * @brief レポートを送信するタイミングと、USB 記述子のポーリング間隔(1,2,4,8ms)
+	 *
+	 * measured・sof では SOF のコールバックを有効にする(1ms ごとに USB 割り込みが入る)。
+	 * sof では送信完了したフレームからポーリングの位相を覚え、続きのレポートは次にポーリングされるフレームの SOF で送信する。
+	 * TinyUSB の SOF コールバックは割り込みではなく後で tud_task() から呼ばれるので、送信はその遅れの分だけ SOF より遅れる
+	 * (IN トークンまでに間に合えばそのフレームで送られる)。SOF の時刻はフレーム番号から推定する(sof_callback())。
+	 * 送信完了直後に送信すると、それから次のポーリングまでの変化はさらに次のポーリングを待つが、SOF まで待てば
+	 * それらを送信前のレポートにまとめて次のポーリングで送れる。送信中のレポートが無いときはすぐに送信する。
+	 *
+	 * @return false SOF のコールバックを使えない TinyUSB(AX2USB_HAS_SOF が 0)で measured・sof を指定した(immediate になる)
+	 */
+	bool set_timing(timing_t t, uint8_t poll_interval_ms);
+	timing_t report_timing() const { return timing; }
+	/**
+	 * @brief レポートを積んでから、送信されたフレームの SOF までの時間(measured・sof のときのみ)
+	 */
+	ax2usb::LatencyHistogram::summary_t ready_to_sof() const { return txq.ready_to_sof(); }
+	/**
+	 * @brief 送信待ちのレポートがあり、USBが送信可能なら1つ送信する
+	 *
+	 * 送信完了コールバックからも呼ばれるので、メインループは定期的に呼ぶだけでよい。
+	 */
+	void send_pending() {
+		if (!hold_until_sof) {
+			txq.send_next(usb_hid);
+		}
+	}
+	/**
+	 * @brief 送信キューの空き
+	 */
+	size_t queue_space() const { return txq.space(); }
+	ReportQueue::stats_t queue_stats() const { return txq.stats(); }
+	/**
+	 * @brief これから処理するキー入力の受信時刻を設定する。以降に積むキーボードレポートの遅延を計測する
+	 *
+	 * @param rx_us 受信割り込みの時刻
+	 * @param dequeued_us メインループが取り出した時刻
+	 */
+	void set_event_time(uint32_t rx_us, uint32_t dequeued_us) { event_stamp = { rx_us, dequeued_us, 0, true }; }
+	void clear_event_time() { event_stamp.valid = false; }
+	/**
+	 * @brief キー入力からキーボードレポート送信完了までの遅延
+	 */
+	ax2usb::LatencyHistogram::summary_t latency(ax2usb::KeyLatency::phase_t phase) const { return txq.latency(phase); }
+	void reset_latency() { txq.reset_latency(); }
+	/**
+	 * @brief キーボードレポートの送信をまとめ始める
+	 *
+	 * end_batch() までのキー変化はキューの末尾のキーボードレポートにまとめ、end_batch() で送信を始める。
+	 * 送信前のレポートには end_batch() 後の変化もまとめるので、キーボードレポートはポーリング周期ごとに1回になる。
+	 * ただしホストから見た順序が変わる変化(同じキーの2回目の変化、キーの make 後のモディファイア変化)は
+	 * 別のレポートにする。
 	 */
-	void wait_usb_ready();
+	void begin_batch() { batching = true; }
+	/**
+	 * @brief まとめたレポートの送信を始め、変化ごとに送信を始める動作に戻す
+	 */
+	void end_batch() {
+		batching = false;
+		send_pending();
+	}
+	/**
+	 * @brief 送信前のキーボードレポートに後の変化をまとめるか(既定: まとめる)
+	 */
+	void set_coalescing(bool enable) { coalescing = enable; }
+	/**
+	 * @brief TinyUSB の送信完了コールバックから呼び、次のレポートを送信する
+	 */
+	static void report_complete_callback();
+	/**
+	 * @brief TinyUSB の SOF コールバックから呼ぶ。sof ならポーリングされるフレームで送信する
+	 *
+	 * コールバックは SOF より遅れて呼ばれるので、呼ばれた時刻をそのまま SOF の時刻にはしない。フレームは 1ms ごとなので、
+	 * 最も早く呼ばれたときの「時刻 - フレーム番号 × 1ms」を基準にして SOF の時刻を推定する(estimate_sof_us())。
+	 */
+	static void sof_callback(uint32_t frame_count);
 	bool update_usb_codes(uint8_t code, bool make_break);
 	bool update_usb_modifier(uint8_t mask, bool make_break);
+	/**
+	 * @brief キーが押されているか
+	 */
+	bool is_pressed(uint8_t code) const { return key_bits[code >> 5] & (1u << (code & 31)); }
+	/**
+	 * @brief 押されているキー(モディファイア以外)の数
+	 */
+	uint8_t pressed_count() const { return n_pressed; }
+	/**
+	 * @brief 6KRO レポートのキーコード配列を作る。7キー以上なら ErrorRollOver
+	 */
+	void fill_6kro(uint8_t (&codes)[6]) const;
 
  private:
+	struct __attribute__((packed)) nkro_report_t {
+		uint8_t modifier;
+		uint8_t bits[NKRO_USAGES / 8];
+	};
+	static_assert(sizeof(nkro_report_t) <= ReportQueue::MAX_LEN);
+
 	Adafruit_USBD_HID& usb_hid;
-	uint8_t usb_codes[6]{};
+	uint32_t key_bits[8]{};  // USB_HIDキーコードごとの押下状態
+	uint8_t n_pressed = 0;
 	const uint8_t report_id_kbd;
+	const uint8_t report_id_nkro;
+	ReportQueue txq;
+	bool coalescing = true;
+	ax2usb::LatencyStamp event_stamp{};
+	// キューの末尾のキーボードレポートにまとめた変化
+	bool batching = false;
+	bool batch_dirty = false;
+	bool batch_make = false;
+	uint8_t batch_mod = 0;
+	uint32_t batch_bits[8]{};
+
+	/**
+	 * @brief キーボードレポートをキューに積む
+	 *
+	 * レポートプロトコルかつ NKRO 有効時は NKRO レポート、それ以外は 6KRO レポートを積む。
+	 * ブートプロトコルではレポートIDを付けない。6KRO で7キー以上押されていれば ErrorRollOver を送る。
+	 *
+	 * @param merge 送信前の末尾のキーボードレポートを上書きする
+	 */
+	void queue_keyboard_report(bool merge);
+	uint8_t keyboard_report_id() const;
+	ax2usb::LatencyStamp stamp_now() const;
+	/**
+	 * @brief 変化の前に呼ぶ。末尾のレポートにまとめると順序が変わってしまう場合は新しいレポートにする
+	 */
+	void before_change(uint8_t code, uint8_t mod_mask);
+	/**
+	 * @brief 変化の後に呼ぶ。レポートを積み、まとめていなければ送信を始める
+	 */
+	void after_change(uint8_t code, uint8_t mod_mask, bool make_break);
+	void clear_batch();
+
+	// SOF(コールバックで書き、送信完了コールバックで読む)
+	timing_t timing = timing_t::immediate;
+	uint8_t poll_interval_ms = 1;
+	uint32_t sof_frame = 0;    // 11ビットのフレーム番号が一周した分も数える
+	uint32_t sof_base_us = 0;  // フレーム 0 の SOF の推定時刻
+	uint32_t sof_us = 0;       // 最後の SOF の推定時刻
+	uint32_t poll_frame = 0;        // 最後に送信完了したフレーム
+	bool poll_phase_known = false;  // poll_frame が有効
+	bool sof_seen = false;
+	bool hold_until_sof = false;  // sof: 送信完了から次のポーリングのフレームまで送信しない
 
-	std::string usb_codes_str() const;
+	/**
+	 * @brief sof_frame の SOF の時刻を推定する。基準より早く呼ばれたら基準を早め、遅ければ少しずつ遅らせる
+	 *
+	 * 遅らせるのはホストと RP2040 の時計の差(USB のフレームは ±500ppm まで許される)を追うため。
+	 * 推定は呼ばれた時刻より後にはならない。
+	 */
+	uint32_t estimate_sof_us(uint32_t now_us);
+
+	static inline HidUtil* theInstance;
+	/**
+	 * @brief ログ用: 6KRO のキーコード配列を1つの整数にまとめる
+	 */
+	uint64_t packed_6kro() const;
 };
 
 }  // namespace hid_util
@@ -0,0 +1,94 @@
+#pragma once
+#include <Arduino.h>
+#include <cstdint>
+#include "keymap.hpp"
+#ifndef ARDUINO_ARCH_RP2040
+#include <spscq.hpp>
+#endif
+
+namespace ax2usb {
+
+/**
+ * @brief PS/2 側(受信・デコード)から USB 側(キーマップ・レポート組み立て)へ渡すキーイベント
+ *
+ * コア間では pack() した32ビット1語で渡す。受信時刻は下位 STAMP_BITS ビットだけを送り、
+ * 受け取った側の時刻から復元する(受信から取り出しまで約262ms以内なら正確)。
+ */
+struct key_event_t {
+	keymap::key_t key;     // キーの位置
+	bool make_break;       // make なら true
+	uint32_t rx_us;        // PS/2 受信割り込みの時刻
+	uint32_t dequeued_us;  // USB 側が受け取った時刻(1コアで動かすときは rx から取り出した時刻)
+	bool tap = false;      // make してすぐ break する(make だけを送るキー)
+
+	// key がこれならキーボードとの同期が崩れたので、押しているキーをすべて離す(キーの位置 0 は使わない)
+	static inline constexpr keymap::key_t RELEASE_ALL = 0;
+	static inline constexpr uint32_t STAMP_BITS = 18;
+	static inline constexpr uint32_t STAMP_MASK = (1u << STAMP_BITS) - 1;
+
+	uint32_t pack() const { return key | uint32_t{ make_break } << 8 | uint32_t{ tap } << 9 | (rx_us & STAMP_MASK) << 14; }
+	static key_event_t unpack(uint32_t w, uint32_t now_us) {
+		key_event_t ev;
+		ev.key = w & 0xff;
+		ev.make_break = w & 0x100;
+		ev.tap = w & 0x200;
+		ev.rx_us = now_us - ((now_us - (w >> 14)) & STAMP_MASK);
+		ev.dequeued_us = now_us;
+		return ev;
+	}
+};
+
+/**
+ * @brief コア間でキーイベントを渡す単一生産者・単一消費者の通路(ブロックしない)
+ *
+ * RP2040 ではコア間 FIFO(各方向8語)を使う。ホストでは同じ深さのロックフリーリングで代用し、
+ * 2スレッドで同じ分割を動かせるようにする。
+ */
+class KeyEventChannel {
+ public:
+	static inline constexpr size_t DEPTH = 8;
+
+	/**
+	 * @brief PS/2 側から積む
+	 *
+	 * @return false 満杯(USB 側が取り出すまで待つこと)
+	 */
+	bool push(const key_event_t& ev) {
+#ifdef ARDUINO_ARCH_RP2040
+		return rp2040.fifo.push_nb(ev.pack());
+#else
+		return fifo.count() < DEPTH && fifo.put(ev.pack());
+#endif
+	}
+	/**
+	 * @brief USB 側で取り出す
+	 */
+	bool pop(key_event_t& ev) {
+		uint32_t w;
+#ifdef ARDUINO_ARCH_RP2040
+		if (!rp2040.fifo.pop_nb(&w)) {
+			return false;
+		}
+#else
+		if (!fifo.get(w)) {
+			return false;
+		}
+#endif
+		ev = key_event_t::unpack(w, micros());
+		return true;
+	}
+	bool available() const {
+#ifdef ARDUINO_ARCH_RP2040
+		return rp2040.fifo.available() > 0;
+#else
+		return fifo.count() > 0;
+#endif
+	}
+
+ private:
+#ifndef ARDUINO_ARCH_RP2040
+	SPSCQ<uint32_t, DEPTH> fifo;
+#endif
+};
+
+}  // namespace ax2usb
@@ -0,0 +1,68 @@
+#include "keymap.hpp"
+
+namespace ax2usb::keymap {
+
+bool
+Keymap::load(const layer_t* defs, size_t count) {
+	if (count == 0 || count > MAX_LAYERS) {
+		return false;
+	}
+	for (size_t l = 0; l < count; l++) {
+		for (size_t i = 0; i < defs[l].count; i++) {
+			auto& act = defs[l].entries[i].act;
+			bool layer_kind = act.kind == kind_t::momentary || act.kind == kind_t::tap_hold;
+			if (layer_kind && (act.arg == 0 || act.arg >= count)) {
+				return false;
+			}
+		}
+	}
+	for (size_t l = 0; l < count; l++) {
+		for (auto& act : flat[l]) {
+			act = defs[l].fallback;
+		}
+		for (size_t i = 0; i < defs[l].count; i++) {
+			flat[l][defs[l].entries[i].key] = defs[l].entries[i].act;
+		}
+		// 基本レイヤーの TRANS は NONE、それ以外は基本レイヤーの動作にする
+		for (size_t k = 0; k < KEY_COUNT; k++) {
+			if (flat[l][k].kind == kind_t::trans) {
+				flat[l][k] = l == 0 ? NONE : flat[0][k];
+			}
+		}
+	}
+	layers = count;
+	release_all();
+	return true;
+}
+
+void
+Keymap::release_all() {
+	top = 0;
+	for (auto& h : holds) {
+		h = 0;
+	}
+	for (auto& p : pressed) {
+		p = NOT_PRESSED;
+	}
+}
+
+void
+Keymap::set_layer(uint8_t layer, bool on) {
+	if (layer == 0 || layer >= layers) {
+		return;
+	}
+	if (on) {
+		holds[layer]++;
+	} else if (holds[layer] > 0) {
+		holds[layer]--;
+	}
+	top = 0;
+	for (uint8_t l = layers - 1; l > 0; l--) {
+		if (holds[l]) {
+			top = l;
+			break;
+		}
+	}
+}
+
+}  // namespace ax2usb::keymap
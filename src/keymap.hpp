@@ -0,0 +1,145 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace ax2usb::keymap {
+
+/**
+ * @brief キーの位置(スキャンコードセット2から決まる)
+ *
+ * 0x01〜0x84: プレフィクスなしのスキャンコード、0x88: Pause(E1 14 77)、0x90〜0xff: E0 + 0x10〜0x7f
+ */
+using key_t = uint8_t;
+
+static inline constexpr size_t KEY_COUNT = 256;
+static inline constexpr key_t KEY_PAUSE = 0x88;
+
+constexpr key_t
+key_id(uint8_t code) {
+	return code;
+}
+constexpr key_t
+key_id_e0(uint8_t code) {
+	return 0x80 | code;
+}
+
+enum class kind_t : uint8_t {
+	none,          // 何もしない
+	trans,         // 基本レイヤーと同じ
+	usb_key,       // キーボードのキー(arg: モディファイアのUSB_HIDキーコード、0ならなし)
+	consumer,      // Consumer Control。押している間だけ(同時に1つまで)
+	consumer_tap,  // Consumer Control。make で押して離す
+	system,        // System Control。make で送る
+	momentary,     // 押している間だけレイヤー arg を有効にする
+	tap_hold,      // 単独で押して離せば usage のキー、押し続けるか他のキーと使えば momentary(TapHold で判定)
+};
+
+struct action_t {
+	kind_t kind;
+	uint8_t arg;
+	uint16_t usage;
+};
+
+constexpr action_t NONE = { kind_t::none, 0, 0 };
+constexpr action_t TRANS = { kind_t::trans, 0, 0 };
+
+constexpr action_t
+usb_key(uint8_t usb, uint8_t mod = 0) {
+	return { kind_t::usb_key, mod, usb };
+}
+constexpr action_t
+consumer(uint16_t usage) {
+	return { kind_t::consumer, 0, usage };
+}
+constexpr action_t
+consumer_tap(uint16_t usage) {
+	return { kind_t::consumer_tap, 0, usage };
+}
+constexpr action_t
+system(uint8_t usage) {
+	return { kind_t::system, 0, usage };
+}
+constexpr action_t
+momentary(uint8_t layer) {
+	return { kind_t::momentary, layer, 0 };
+}
+
+constexpr action_t
+tap_hold(uint8_t layer, uint8_t tap_usb) {
+	return { kind_t::tap_hold, layer, tap_usb };
+}
+
+struct entry_t {
+	key_t key;
+	action_t act;
+};
+
+/**
+ * @brief レイヤーの定義
+ *
+ * entries に無いキーは fallback(TRANS か NONE)になる。同じキーが複数あれば後のものが優先。
+ */
+struct layer_t {
+	const entry_t* entries;
+	size_t count;
+	action_t fallback;
+};
+
+/**
+ * @brief レイヤー付きキーマップ
+ *
+ * load() でレイヤー定義をレイヤーごとの平坦な表(キーの位置 → 動作)に展開し、TRANS は基本レイヤーの動作に置き換えておく。
+ * キーを引くのは有効な最上位のレイヤーの表を1回読むだけで、レイヤーの数によらない。
+ * 押したときのレイヤーを覚えておき、離したときは同じレイヤーの動作を返す(途中でレイヤーが変わっても離し損ねない)。
+ */
+class Keymap {
+ public:
+	static inline constexpr size_t MAX_LAYERS = 4;
+
+	/**
+	 * @brief レイヤー定義を展開する。キーが押されていないときに呼ぶこと
+	 *
+	 * @param layers [0] が基本レイヤー
+	 * @return false レイヤーが多すぎる・存在しないレイヤーを参照している(このときは何も変えない)
+	 */
+	bool load(const layer_t* layers, size_t count);
+	/**
+	 * @brief キーを押したときの動作。押したままの make(タイプマティック)なら最初に押したときのレイヤーで引く
+	 */
+	const action_t& press(key_t key) {
+		if (pressed[key] == NOT_PRESSED) {
+			pressed[key] = top;
+		}
+		return flat[pressed[key]][key];
+	}
+	/**
+	 * @brief キーを離したときの動作(押したときのレイヤーで引く)。押されていなければ NONE
+	 */
+	const action_t& release(key_t key) {
+		uint8_t layer = pressed[key];
+		pressed[key] = NOT_PRESSED;
+		return layer == NOT_PRESSED ? NONE : flat[layer][key];
+	}
+	bool is_pressed(key_t key) const { return pressed[key] != NOT_PRESSED; }
+	/**
+	 * @brief すべてのキーを押していないことにし、レイヤーを基本レイヤーに戻す
+	 */
+	void release_all();
+	/**
+	 * @brief momentary なレイヤーを有効・無効にする(複数のキーで有効にしたら全部離すまで有効)
+	 */
+	void set_layer(uint8_t layer, bool on);
+	uint8_t top_layer() const { return top; }
+	size_t layer_count() const { return layers; }
+
+ private:
+	static inline constexpr uint8_t NOT_PRESSED = 0xff;
+
+	action_t flat[MAX_LAYERS][KEY_COUNT] = {};
+	uint8_t holds[MAX_LAYERS] = {};
+	uint8_t pressed[KEY_COUNT] = {};
+	uint8_t layers = 0;
+	uint8_t top = 0;
+};
+
+}  // namespace ax2usb::keymap
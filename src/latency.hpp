@@ -0,0 +1,132 @@
+#pragma once
+#include <Arduino.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace ax2usb {
+
+/**
+ * @brief 遅延[us]のヒストグラム
+ *
+ * 8us未満は1us刻み、それ以上は2のべき乗の区間を8分割する(相対誤差12.5%以内)。
+ * 最小・最大・平均は正確な値、p50/p99 は該当する区間の上限を返す。
+ */
+class LatencyHistogram {
+ public:
+	static inline constexpr size_t SUB_BUCKETS = 8;
+	static inline constexpr size_t BUCKETS = SUB_BUCKETS + 21 * SUB_BUCKETS;  // 2^24us(約16秒)まで
+
+	struct summary_t {
+		uint32_t count;
+		uint32_t min;
+		uint32_t max;
+		uint32_t avg;
+		uint32_t p50;
+		uint32_t p99;
+	};
+
+	void add(uint32_t us) {
+		counts[bucket_of(us)]++;
+		if (n == 0 || us < min) {
+			min = us;
+		}
+		if (us > max) {
+			max = us;
+		}
+		sum += us;
+		n++;
+	}
+	summary_t summary() const {
+		if (n == 0) {
+			return {};
+		}
+		return { n, min, max, static_cast<uint32_t>(sum / n), percentile(50), percentile(99) };
+	}
+	void reset() { *this = LatencyHistogram{}; }
+
+	static constexpr size_t bucket_of(uint32_t us) {
+		if (us < SUB_BUCKETS) {
+			return us;
+		}
+		size_t msb = 31 - __builtin_clz(us);
+		size_t index = SUB_BUCKETS + (msb - 3) * SUB_BUCKETS + ((us >> (msb - 3)) & (SUB_BUCKETS - 1));
+		return index < BUCKETS ? index : BUCKETS - 1;
+	}
+	/**
+	 * @brief 区間に入る最大の値
+	 */
+	static constexpr uint32_t bucket_upper(size_t index) {
+		if (index < SUB_BUCKETS) {
+			return index;
+		}
+		size_t msb = (index - SUB_BUCKETS) / SUB_BUCKETS + 3;
+		uint32_t lower = static_cast<uint32_t>(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << (msb - 3);
+		return lower + (1u << (msb - 3)) - 1;
+	}
+
+ private:
+	uint32_t counts[BUCKETS] = {};
+	uint32_t n = 0;
+	uint32_t min = 0;
+	uint32_t max = 0;
+	uint64_t sum = 0;
+
+	uint32_t percentile(uint32_t pct) const {
+		// pct% 以上のサンプルが入るまで区間を数える
+		uint64_t rank = (uint64_t{ n } * pct + 99) / 100;
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; i++) {
+			seen += counts[i];
+			if (seen >= rank) {
+				return std::min(std::max(bucket_upper(i), min), max);
+			}
+		}
+		return max;
+	}
+};
+
+/**
+ * @brief キー入力からUSBレポート送信完了までの各時刻(micros())
+ */
+struct LatencyStamp {
+	uint32_t rx_us;        // PS/2 受信割り込み
+	uint32_t dequeued_us;  // メインループが rx から取り出した
+	uint32_t queued_us;    // レポートを送信キューに積んだ
+	bool valid;
+};
+
+/**
+ * @brief キー入力の遅延を区間ごとに集計する
+ *
+ * queue: 受信割り込み → メインループ、decode: デコード・キューに積むまで、usb: 送信完了まで、total: 全体
+ */
+class KeyLatency {
+ public:
+	enum phase_t { queue, decode, usb, total, phase_count };
+
+	void record(const LatencyStamp& s, uint32_t completed_us) {
+		if (!s.valid) {
+			return;
+		}
+		hist[queue].add(s.dequeued_us - s.rx_us);
+		hist[decode].add(s.queued_us - s.dequeued_us);
+		hist[usb].add(completed_us - s.queued_us);
+		hist[total].add(completed_us - s.rx_us);
+	}
+	LatencyHistogram::summary_t summary(phase_t phase) const { return hist[phase].summary(); }
+	void reset() {
+		for (auto& h : hist) {
+			h.reset();
+		}
+	}
+	static const char* phase_name(phase_t phase) {
+		static const char* const names[] = { "queue", "decode", "usb", "total" };
+		return names[phase];
+	}
+
+ private:
+	LatencyHistogram hist[phase_count];
+};
+
+}  // namespace ax2usb
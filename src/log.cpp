@@ -0,0 +1,143 @@
+#include "log.hpp"
+#include <algorithm>
+#include <spscq.hpp>
+#include "multicore.hpp"
+#ifdef ARDUINO_ARCH_RP2040
+#include <pico/platform.h>
+#endif
+
+namespace ax2usb::log {
+
+namespace {
+
+// 割り込みハンドラ・メインループ・core 1 でリングを分け、どれも単一生産者にする
+// (割り込みハンドラからログを書くのは core 0 の USB 割り込みだけ)
+SPSCQ<record_t, 32> main_ring;
+SPSCQ<record_t, 8> irq_ring;
+SPSCQ<record_t, 16> core1_ring;
+uint32_t reported_overflows = 0;
+
+Print* output = nullptr;
+// 書き出し途中のフレーム
+uint8_t frame[3 + 4 + 4 * MAX_ARGS];
+size_t frame_len = 0;
+size_t frame_pos = 0;
+
+bool
+in_interrupt() {
+#ifdef ARDUINO_ARCH_RP2040
+	return __get_current_exception() != 0;
+#else
+	return false;
+#endif
+}
+
+void
+put_le32(uint8_t* p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+void
+encode(const record_t& rec) {
+	frame[0] = FRAME_START;
+	frame[1] = static_cast<uint8_t>(rec.id);
+	frame[2] = rec.nargs;
+	put_le32(&frame[3], rec.t_us);
+	for (size_t i = 0; i < rec.nargs; i++) {
+		put_le32(&frame[7 + i * 4], rec.args[i]);
+	}
+	frame_len = 7 + rec.nargs * 4;
+	frame_pos = 0;
+}
+
+/**
+ * @brief ring の先頭が oldest より古ければ buf に読んで oldest にする(同時刻なら先に調べたリングを優先)
+ */
+template <size_t N>
+void
+pick_older(const SPSCQ<record_t, N>& ring, record_t& buf, const record_t*& oldest) {
+	if (ring.peek(buf) && (!oldest || static_cast<int32_t>(buf.t_us - oldest->t_us) < 0)) {
+		oldest = &buf;
+	}
+}
+
+/**
+ * @brief リングのうち最も古い記録を次のフレームにする
+ */
+bool
+next_frame() {
+	uint32_t lost = main_ring.overflow_count() + irq_ring.overflow_count() + core1_ring.overflow_count();
+	if (lost != reported_overflows) {
+		record_t rec{ micros(), event_t::LOG_OVERFLOW, 1, { lost - reported_overflows } };
+		reported_overflows = lost;
+		encode(rec);
+		return true;
+	}
+	record_t m, i, c;
+	const record_t* oldest = nullptr;
+	pick_older(main_ring, m, oldest);
+	pick_older(irq_ring, i, oldest);
+	pick_older(core1_ring, c, oldest);
+	if (!oldest) {
+		return false;
+	}
+	encode(*oldest);
+	if (oldest == &m) {
+		main_ring.get(m);
+	} else if (oldest == &i) {
+		irq_ring.get(i);
+	} else {
+		core1_ring.get(c);
+	}
+	return true;
+}
+
+}  // namespace
+
+void
+put(const record_t& rec) {
+	if (in_interrupt()) {
+		irq_ring.put(rec);
+	} else if (core_num() != 0) {
+		core1_ring.put(rec);
+	} else {
+		main_ring.put(rec);
+	}
+}
+
+void
+set_output(Print* out) {
+	output = out;
+}
+
+bool
+drain() {
+	if (!output) {
+		return false;
+	}
+	for (;;) {
+		if (frame_pos == frame_len && !next_frame()) {
+			return false;
+		}
+		int room = output->availableForWrite();
+		if (room <= 0) {
+			return true;
+		}
+		size_t n = std::min(frame_len - frame_pos, static_cast<size_t>(room));
+		output->write(&frame[frame_pos], n);
+		frame_pos += n;
+	}
+}
+
+void
+finish_frame() {
+	if (output && frame_pos < frame_len) {
+		output->write(&frame[frame_pos], frame_len - frame_pos);
+		frame_pos = frame_len;
+	}
+}
+
+}  // namespace ax2usb::log
@@ -0,0 +1,148 @@
+#pragma once
+#include <Arduino.h>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include "log_events.hpp"
+
+/**
+ * ログレベル。AX2USB_LOG_LEVEL より詳細なログはコンパイル時に取り除かれ、引数も評価されない。
+ * リリースビルドでは -DAX2USB_LOG_LEVEL=0 とするとログのコードは一切残らない。
+ */
+#define AX2USB_LOG_NONE 0
+#define AX2USB_LOG_ERROR 1
+#define AX2USB_LOG_WARN 2
+#define AX2USB_LOG_INFO 3
+#define AX2USB_LOG_DEBUG 4
+
+#ifndef AX2USB_LOG_LEVEL
+#define AX2USB_LOG_LEVEL AX2USB_LOG_DEBUG
+#endif
+
+#define AX2USB_LOG_PUT(id, ...) ::ax2usb::log::put(::ax2usb::log::event_t::id, ##__VA_ARGS__)
+#define AX2USB_LOG_PUT_AT(t_us, id, ...) ::ax2usb::log::put_at(t_us, ::ax2usb::log::event_t::id, ##__VA_ARGS__)
+#define AX2USB_LOG_SKIP(id, ...) \
+	do {                           \
+	} while (false)
+
+#if AX2USB_LOG_LEVEL >= AX2USB_LOG_ERROR
+#define LOG_ERROR AX2USB_LOG_PUT
+#else
+#define LOG_ERROR AX2USB_LOG_SKIP
+#endif
+#if AX2USB_LOG_LEVEL >= AX2USB_LOG_WARN
+#define LOG_WARN AX2USB_LOG_PUT
+#else
+#define LOG_WARN AX2USB_LOG_SKIP
+#endif
+#if AX2USB_LOG_LEVEL >= AX2USB_LOG_INFO
+#define LOG_INFO AX2USB_LOG_PUT
+#else
+#define LOG_INFO AX2USB_LOG_SKIP
+#endif
+#if AX2USB_LOG_LEVEL >= AX2USB_LOG_DEBUG
+#define LOG_DEBUG AX2USB_LOG_PUT
+#define LOG_DEBUG_AT AX2USB_LOG_PUT_AT
+#else
+#define LOG_DEBUG AX2USB_LOG_SKIP
+#define LOG_DEBUG_AT(t_us, ...) AX2USB_LOG_SKIP(__VA_ARGS__)
+#endif
+
+/**
+ * @brief 遅延バイナリログ
+ *
+ * LOG_*() はイベント番号と引数をリングバッファに積むだけで、文字列の整形もUARTへの出力もしない。
+ * メインループが仕事のないときに drain() でUARTの送信バッファに入る分だけ書き出し、
+ * ホスト側のデコーダ(`--decode-log`)が元の文字列に戻す。
+ *
+ * UART上の形式: 0x1e, イベント番号, 引数の数 n, 時刻[us](4バイト), 引数(4バイト × n)。すべてリトルエンディアン。
+ * 0x1e 以外のバイトは通常のテキストとしてそのまま表示される。
+ */
+namespace ax2usb::log {
+
+#define AX2USB_LOG_EVENT_ENUM(name, fmt) name,
+enum class event_t : uint8_t { AX2USB_LOG_EVENTS(AX2USB_LOG_EVENT_ENUM) count };
+#undef AX2USB_LOG_EVENT_ENUM
+
+static inline constexpr uint8_t FRAME_START = 0x1e;
+static inline constexpr size_t MAX_ARGS = 8;
+
+struct record_t {
+	uint32_t t_us;
+	event_t id;
+	uint8_t nargs;
+	uint32_t args[MAX_ARGS];
+};
+
+/**
+ * @brief 記録を積む。メインループ・core 1・(core 0 の)割り込みハンドラから呼べる
+ */
+void put(const record_t& rec);
+
+/**
+ * @brief 引数2つ分を使う64ビットの引数(%C など)
+ */
+struct wide {
+	uint64_t v;
+};
+
+namespace detail {
+
+inline void
+add_arg(record_t& rec, wide w) {
+	rec.args[rec.nargs++] = static_cast<uint32_t>(w.v);
+	rec.args[rec.nargs++] = static_cast<uint32_t>(w.v >> 32);
+}
+template <typename T>
+inline void
+add_arg(record_t& rec, T v) {
+	rec.args[rec.nargs++] = static_cast<uint32_t>(v);
+}
+template <typename T>
+constexpr size_t
+arg_slots() {
+	return std::is_same_v<T, wide> ? 2 : 1;
+}
+
+}  // namespace detail
+
+/**
+ * @brief 時刻 t_us のイベントとして記録する(受信割り込みの時刻など)
+ */
+template <typename... A>
+inline void
+put_at(uint32_t t_us, event_t id, A... args) {
+	static_assert((detail::arg_slots<A>() + ... + 0) <= MAX_ARGS, "too many log arguments");
+	record_t rec;
+	rec.t_us = t_us;
+	rec.id = id;
+	rec.nargs = 0;
+	(detail::add_arg(rec, args), ...);
+	put(rec);
+}
+
+/**
+ * @brief イベントを記録する。引数は32ビットに切り詰める(64ビット値は wide で渡す)
+ */
+template <typename... A>
+inline void
+put(event_t id, A... args) {
+	put_at(micros(), id, args...);
+}
+
+/**
+ * @brief drain() の出力先を設定する
+ */
+void set_output(Print* out);
+/**
+ * @brief 出力先の送信バッファに入る分だけ記録を書き出す(ブロックしない)
+ *
+ * @return true まだ書き出していない記録がある
+ */
+bool drain();
+/**
+ * @brief 書き出し途中のフレームを最後まで書く(ブロックする)。出力先へテキストを直接書く前に呼ぶ
+ */
+void finish_frame();
+
+}  // namespace ax2usb::log
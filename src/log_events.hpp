@@ -0,0 +1,38 @@
+#pragma once
+
+// clang-format off
+/**
+ * @brief ログイベントの一覧: X(名前, 書式)
+ *
+ * 書式は printf と同じ %u %x %c などに加え、ホスト側のデコーダが解釈する次の変換を使える。
+ *   %k USB_HIDキーコード → キー名     %M モディファイアのキーコード → 1文字
+ *   %m モディファイアのビット → 文字列  %C 6KRO キーコード配列(64ビット引数)
+ *   %K make/break → '+'/'-'            %F make/break → '#'/'~'
+ *   %B make/break → "make"/"break"     %L USBのLEDビット → 文字列
+ * 記録するのはイベント番号と引数だけなので、ここに追加・並べ替えたらデコーダも同じ版で使うこと。
+ */
+#define AX2USB_LOG_EVENTS(X) \
+	X(LOG_OVERFLOW,   "(%u log records lost)") \
+	X(FIRST_RECEIVED, "First msg received") \
+	X(USB_MOUNTED,    "usb mounted at %u us") \
+	X(FIRST_KEY,      "first key at %u us (keyboard %u us, usb %u us)") \
+	X(ECHO_SENT,      "echo request sent") \
+	X(ACK_TIMEOUT,    "ACK receive timeout, reverted to base") \
+	X(CMD_RESEND,     "resend %02x (try %u)") \
+	X(PS2_ERROR,      "keyboard error %02x") \
+	X(PREFIX_TIMEOUT, "prefix %u timed out") \
+	X(RX_OVERFLOW,    "rx queue overflow (%u bytes lost in total), resyncing") \
+	X(RELEASE_ALL,    "released all keys") \
+	X(CODE_SET,       "scan code set %u") \
+	X(CODE_SET_FAIL,  "code set step %u got %02x") \
+	X(MOUSE_READY,    "mouse streaming (wheel %u)") \
+	X(PS2_RECEIVED,   "<%02x") \
+	X(FAKE_SHIFT,     "simply ignore %Kshift after E0") \
+	X(UNMAPPED,       "%B %02x is not mapped to usb_key") \
+	X(LAYER,          "%Flayer %u") \
+	X(TAP,            "tap %02x") \
+	X(USB_LED,        "USB< %L") \
+	X(USB_MOD,        ">%F%M %m %C") \
+	X(USB_KEY,        ">%K%k %m %C") \
+	X(USB_KEY_MOD,    ">%F%M%K%k %m %C")
+// clang-format on
@@ -1,28 +1,73 @@
 #include <Arduino.h>
+#include <atomic>
 #include "ax2usb.h"
+#include "bench.hpp"
+#include "log.hpp"
 #include "util.h"
 
-#define AX2USB_DEBUG 1
-#include "debug.h"
+// 1: PS/2 の受信・デコードを core 1、USB を core 0 で動かす
+#ifndef AX2USB_DUAL_CORE
+#define AX2USB_DUAL_CORE 0
+#endif
 
 namespace {
 
 constexpr uint8_t data_pin = D9;
 constexpr uint8_t clock_pin = D10;
+#if AX2USB_MOUSE
+constexpr uint8_t mouse_data_pin = D2;
+constexpr uint8_t mouse_clock_pin = D3;
+#endif
 
 }  // namespace
 
 ax2usb::AX2USB a2u;
-bool running;
+std::atomic<bool> running{ false };
+
+namespace {
+
+// デバッグ用シリアルからのコマンド
+//   l: キー入力遅延の集計を表示  r: 集計をリセット
+void
+handle_command(int c) {
+	ax2usb::log::finish_frame();
+	switch (c) {
+		case 'l':
+			a2u.print_latency(Serial1);
+			break;
+		case 'r':
+			a2u.reset_latency();
+			Serial1.println("latency reset");
+			break;
+		default:
+			break;
+	}
+}
+
+}  // namespace
 
 void
 setup() {
 	Serial1.begin(115200);
+#if AX2USB_BENCH
+	// ベンチマークだけを実行し、変換は動かさない
+	delay(1000);
+	ax2usb::bench::run_all(Serial1);
+	return;
+#endif
+	ax2usb::log::set_output(&Serial1);
 	delay(100);
+#if AX2USB_DUAL_CORE
+	if (!a2u.begin_split()) {
+#else
 	if (!a2u.begin(data_pin, clock_pin)) {
+#endif
 		Serial1.println("Failed to init ax2usb");
 		return;
 	}
+#if AX2USB_MOUSE && !AX2USB_DUAL_CORE
+	a2u.begin_mouse(mouse_data_pin, mouse_clock_pin);
+#endif
 #ifdef ARDUINO_SEEED_XIAO_RP2040
 	// turn off LEDs
 	pinMode(16, OUTPUT);
@@ -45,8 +90,34 @@ loop() {
 		delay(1000);
 		return;
 	}
+#if AX2USB_DUAL_CORE
+	a2u.loop_usb();
+#else
 	a2u.loop();
+#endif
+	if (Serial1.available()) {
+		handle_command(Serial1.read());
+	}
 #ifdef ARDUINO_ARCH_RP2040
 	rp2040.wdt_reset();
 #endif
 }
+
+#if AX2USB_DUAL_CORE
+// core 1: PS/2 の受信割り込みもこのコアで受ける
+void
+setup1() {
+	while (!running) {
+		delay(1);
+	}
+	a2u.begin_ps2(data_pin, clock_pin);
+#if AX2USB_MOUSE
+	a2u.begin_mouse(mouse_data_pin, mouse_clock_pin);
+#endif
+}
+
+void
+loop1() {
+	a2u.loop_ps2();
+}
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#ifdef ARDUINO_ARCH_RP2040
+#include <pico/platform.h>
+#endif
+
+namespace ax2usb {
+
+#ifdef ARDUINO_ARCH_RP2040
+/**
+ * @brief 実行中のコア番号(0: USB 側、1: PS/2 側)
+ */
+inline uint32_t
+core_num() {
+	return get_core_num();
+}
+#else
+namespace detail {
+inline thread_local uint32_t core_num = 0;
+}  // namespace detail
+
+/**
+ * @brief 実行中のコア番号(0: USB 側、1: PS/2 側)。ホストではスレッドごとに set_core_num() で決める
+ */
+inline uint32_t
+core_num() {
+	return detail::core_num;
+}
+/**
+ * @brief 呼び出したスレッドをコア n として扱う(ホスト専用)
+ */
+inline void
+set_core_num(uint32_t n) {
+	detail::core_num = n;
+}
+#endif
+
+}  // namespace ax2usb
@@ -15,5 +15,20 @@ class Mutex {
 	critical_section_t _lck;
 };
 
+}  // namespace ax2usb
+#elif defined(AX2USB_NATIVE)
+#include <mutex>
+
+namespace ax2usb {
+
+class Mutex {
+ public:
+	void lock() { _lck.lock(); }
+	void unlock() { _lck.unlock(); }
+
+ private:
+	std::mutex _lck;
+};
+
 }  // namespace ax2usb
 #endif
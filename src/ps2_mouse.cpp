@@ -0,0 +1,243 @@
+#include "ps2_mouse.hpp"
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+
+namespace ax2usb {
+
+namespace {
+
+// マウスはコマンドに 20ms 以内に応答する。届かなければ送り直す
+constexpr uint32_t REPLY_TIMEOUT_USEC = 25000;
+constexpr uint8_t TRIES_MAX = 3;
+// リセットから BAT 完了まで(マウスの自己診断は最長約500ms)
+constexpr uint32_t BAT_TIMEOUT_USEC = 1000000;
+// 初期化に失敗した(つながっていない)ときにリセットからやり直すまでの時間
+constexpr uint32_t RETRY_USEC = 1000000;
+// パケットの途中のバイトが届くまでの時間の上限(1バイトの転送は約1ms)
+constexpr uint32_t PACKET_TIMEOUT_USEC = 10000;
+
+// サンプルレートは set_sample_rate() の値を送る
+constexpr int16_t SEND_SAMPLE_RATE = 0x100;
+// clang-format off
+constexpr ps2_step_t INIT_STEPS[] = {
+	{ ps2mouse::RESET, ps2ind::ACK }, { -1, ps2ind::BAT_COMPLETED }, { -1, ps2mouse::ID_STANDARD },
+	// IntelliMouse の判定: 200,100,80 と設定すると ID が 03 になる
+	{ ps2mouse::SET_SAMPLE_RATE, ps2ind::ACK }, { 200, ps2ind::ACK },
+	{ ps2mouse::SET_SAMPLE_RATE, ps2ind::ACK }, { 100, ps2ind::ACK },
+	{ ps2mouse::SET_SAMPLE_RATE, ps2ind::ACK }, { 80, ps2ind::ACK },
+	{ ps2mouse::READ_ID, ps2ind::ACK }, { -1, ps2mouse::ID_WHEEL },
+	{ ps2mouse::SET_SAMPLE_RATE, ps2ind::ACK }, { SEND_SAMPLE_RATE, ps2ind::ACK },
+	{ ps2mouse::ENABLE, ps2ind::ACK },
+};
+// clang-format on
+constexpr uint8_t BAT_STEP = 1;
+// この手順は ID が何であっても進む(03 ならホイールあり)
+constexpr uint8_t READ_ID_STEP = 10;
+
+constexpr uint8_t PACKET_SYNC = 0x08;  // 1バイト目で常に1のビット
+constexpr uint8_t PACKET_X_SIGN = 0x10;
+constexpr uint8_t PACKET_Y_SIGN = 0x20;
+constexpr uint8_t PACKET_X_OVERFLOW = 0x40;
+constexpr uint8_t PACKET_Y_OVERFLOW = 0x80;
+constexpr uint8_t PACKET_BUTTONS = 0x07;  // 左・右・中(USB と同じ並び)
+
+int8_t
+clamp8(int32_t v) {
+	return static_cast<int8_t>(std::clamp<int32_t>(v, -127, 127));
+}
+
+}  // namespace
+
+Ps2Mouse::result_t
+Ps2Mouse::start() {
+	if (started) {
+		n_restarts++;
+	}
+	started = true;
+	st = state_t::init;
+	step_pos = 0;
+	wheel = false;
+	len = 0;
+	return send_step();
+}
+
+int16_t
+Ps2Mouse::step_byte() const {
+	int16_t send = INIT_STEPS[step_pos].send;
+	return send == SEND_SAMPLE_RATE ? int16_t{ sample_rate } : send;
+}
+
+Ps2Mouse::result_t
+Ps2Mouse::send_step() {
+	tries = 1;
+	return { step_byte(), false };
+}
+
+Ps2Mouse::result_t
+Ps2Mouse::fail() {
+	st = state_t::retry_wait;
+	return {};
+}
+
+Ps2Mouse::result_t
+Ps2Mouse::feed(uint8_t code) {
+	switch (st) {
+		case state_t::init:
+			return feed_reply(code);
+		case state_t::streaming:
+			return feed_packet(code);
+		default:
+			return {};
+	}
+}
+
+Ps2Mouse::result_t
+Ps2Mouse::feed_reply(uint8_t code) {
+	const auto& step = INIT_STEPS[step_pos];
+	if (step_pos == READ_ID_STEP) {
+		wheel = code == ps2mouse::ID_WHEEL;
+	} else if (code == ps2ind::RESEND && step.send >= 0) {
+		// コマンドが化けて届いた
+		if (tries >= TRIES_MAX) {
+			return fail();
+		}
+		tries++;
+		return { step_byte(), false };
+	} else if (code != step.expect) {
+		return fail();
+	}
+	if (++step_pos < std::size(INIT_STEPS)) {
+		return send_step();
+	}
+	st = state_t::streaming;
+	return {};
+}
+
+Ps2Mouse::result_t
+Ps2Mouse::feed_packet(uint8_t code) {
+	if (len == 0 && !(code & PACKET_SYNC)) {
+		// パケットの先頭ではない(同期が外れている)
+		n_dropped++;
+		return {};
+	}
+	buf[len++] = code;
+	if (len == 2 && buf[0] == ps2ind::BAT_COMPLETED && buf[1] == ps2mouse::ID_STANDARD) {
+		// 抜き差しされてマウスがリセットした
+		return start();
+	}
+	if (len < packet_len()) {
+		return {};
+	}
+	len = 0;
+	uint8_t b0 = buf[0];
+	int16_t dx = buf[1] - ((b0 & PACKET_X_SIGN) ? 256 : 0);
+	int16_t dy = buf[2] - ((b0 & PACKET_Y_SIGN) ? 256 : 0);
+	// あふれた動きは値が当てにならないので捨てる
+	last.dx = (b0 & PACKET_X_OVERFLOW) ? 0 : dx;
+	last.dy = (b0 & PACKET_Y_OVERFLOW) ? 0 : -dy;
+	last.buttons = b0 & PACKET_BUTTONS;
+	// IntelliMouse の4バイト目は下へのスクロールが正
+	last.wheel = wheel ? clamp8(-static_cast<int8_t>(buf[3])) : 0;
+	return { -1, true };
+}
+
+Ps2Mouse::result_t
+Ps2Mouse::expire() {
+	switch (st) {
+		case state_t::init:
+			if (step_byte() < 0 || tries >= TRIES_MAX) {
+				return fail();
+			}
+			tries++;
+			return { step_byte(), false };
+		case state_t::streaming:
+			if (len) {
+				n_dropped++;
+				len = 0;
+			}
+			return {};
+		default:
+			return start();
+	}
+}
+
+uint32_t
+Ps2Mouse::timeout_us() const {
+	switch (st) {
+		case state_t::init:
+			return step_pos == BAT_STEP ? BAT_TIMEOUT_USEC : REPLY_TIMEOUT_USEC;
+		case state_t::streaming:
+			return len ? PACKET_TIMEOUT_USEC : 0;
+		default:
+			return RETRY_USEC;
+	}
+}
+
+void
+MouseMotion::add(const Ps2Mouse::packet_t& p) {
+	std::lock_guard<Mutex> lock(lck);
+	n_packets++;
+	bool moved = p.dx || p.dy || p.wheel;
+	pending_t* e;
+	if (n > 0 && entries[(head + n - 1) % DEPTH].buttons == p.buttons) {
+		e = &entries[(head + n - 1) % DEPTH];
+	} else if (n == 0 && p.buttons == buttons && !moved) {
+		return;
+	} else if (n < DEPTH) {
+		e = &entries[(head + n) % DEPTH];
+		*e = { p.buttons, 0, 0, 0 };
+		n++;
+	} else {
+		// 満杯: 途中のボタンの状態を失っても最新の状態は送る
+		e = &entries[(head + n - 1) % DEPTH];
+		e->buttons = p.buttons;
+	}
+	e->dx += p.dx;
+	e->dy += p.dy;
+	e->wheel += p.wheel;
+	buttons = p.buttons;
+}
+
+bool
+MouseMotion::take(hid_mouse_report_t& report) {
+	std::lock_guard<Mutex> lock(lck);
+	if (n == 0) {
+		return false;
+	}
+	auto& e = entries[head];
+	report.buttons = e.buttons;
+	report.x = clamp8(e.dx);
+	report.y = clamp8(e.dy);
+	report.wheel = clamp8(e.wheel);
+	report.pan = 0;
+	e.dx -= report.x;
+	e.dy -= report.y;
+	e.wheel -= report.wheel;
+	if (!e.dx && !e.dy && !e.wheel) {
+		head = (head + 1) % DEPTH;
+		n--;
+	}
+	n_reports++;
+	return true;
+}
+
+bool
+MouseMotion::empty() const {
+	std::lock_guard<Mutex> lock(lck);
+	return n == 0;
+}
+
+uint32_t
+MouseMotion::packets() const {
+	std::lock_guard<Mutex> lock(lck);
+	return n_packets;
+}
+
+uint32_t
+MouseMotion::reports() const {
+	std::lock_guard<Mutex> lock(lck);
+	return n_reports;
+}
+
+}  // namespace ax2usb
@@ -0,0 +1,132 @@
+#pragma once
+// PS/2 マウス: 初期化手順・パケットの組み立て(PS/2 側)と、USB のポーリング周期ごとの動きのまとめ(USB 側)
+#include <Adafruit_TinyUSB.h>
+#include <cstddef>
+#include <cstdint>
+#include "mutex.hpp"
+#include "ps2code.hpp"
+
+namespace ax2usb {
+
+namespace ps2mouse {
+
+constexpr inline uint8_t SET_SAMPLE_RATE = 0xf3;
+constexpr inline uint8_t READ_ID = 0xf2;
+constexpr inline uint8_t ENABLE = 0xf4;
+constexpr inline uint8_t RESET = 0xff;
+constexpr inline uint8_t ID_STANDARD = 0x00;
+constexpr inline uint8_t ID_WHEEL = 0x03;  // IntelliMouse(ホイールあり、4バイトのパケット)
+
+}  // namespace ps2mouse
+
+/**
+ * @brief PS/2 マウスのプロトコル(入出力は呼び出し側が行う)
+ *
+ * リセット(BAT 完了・ID 待ち)→ サンプルレートを 200,100,80 と設定して ID を読み、03 ならホイールあり
+ * → サンプルレートを設定してストリームモードを有効にする。以後は3バイト(ホイールありは4バイト)のパケットを組み立てる。
+ * 応答が来ない・エラーを返したら、しばらく待ってリセットからやり直す(マウスがつながっていない場合も同じ)。
+ */
+class Ps2Mouse {
+ public:
+	struct packet_t {
+		uint8_t buttons;  // USB と同じビット(左 1、右 2、中 4)
+		int16_t dx;       // 右が正
+		int16_t dy;       // 下が正(USB の向き)
+		int8_t wheel;     // 上へのスクロールが正(USB の向き)
+	};
+	struct result_t {
+		int16_t send = -1;    // 送るバイト(負なら無し)
+		bool packet = false;  // packet() に新しいパケットがある
+	};
+	enum class state_t : uint8_t { init, streaming, retry_wait };
+
+	/**
+	 * @brief ストリームモードのサンプルレート(回/秒)。start() の前に設定する
+	 */
+	void set_sample_rate(uint8_t rate) { sample_rate = rate; }
+	/**
+	 * @brief リセットから初期化を始める
+	 */
+	result_t start();
+	/**
+	 * @brief 受信したバイトを処理する
+	 */
+	result_t feed(uint8_t code);
+	/**
+	 * @brief timeout_us() の期限が来た。応答待ちなら送り直し、パケットの途中なら捨てる
+	 */
+	result_t expire();
+	/**
+	 * @brief 今の状態の期限(start()・feed()・expire() のたびに設定し直す)。0 なら期限なし
+	 */
+	uint32_t timeout_us() const;
+	const packet_t& packet() const { return last; }
+	state_t state() const { return st; }
+	bool has_wheel() const { return wheel; }
+	/**
+	 * @brief 初期化をやり直した回数(最初の start() を除く)、同期が外れて捨てたパケットの数
+	 */
+	uint32_t restarts() const { return n_restarts; }
+	uint32_t dropped_packets() const { return n_dropped; }
+
+ private:
+	int16_t step_byte() const;
+	result_t send_step();
+	result_t fail();
+	result_t feed_packet(uint8_t code);
+	result_t feed_reply(uint8_t code);
+	size_t packet_len() const { return wheel ? 4 : 3; }
+
+	state_t st = state_t::retry_wait;
+	uint8_t step_pos = 0;
+	uint8_t tries = 0;
+	uint8_t sample_rate = 100;
+	bool wheel = false;
+	bool started = false;
+	uint8_t buf[4] = {};
+	uint8_t len = 0;
+	packet_t last = {};
+	uint32_t n_restarts = 0;
+	uint32_t n_dropped = 0;
+};
+
+/**
+ * @brief マウスの動きを USB のポーリング周期ごとに1レポートにまとめる
+ *
+ * PS/2 側が add() でパケットを足し、USB 側が送信できるときに take() で1レポート分を取り出す。
+ * 動きは足し合わせ、ボタンの変化は失わないように変化ごとに別のレポートにする(待ちが満杯なら最新の状態にまとめる)。
+ * int8_t に収まらない動きは次のレポートに残す。
+ */
+class MouseMotion {
+ public:
+	static inline constexpr size_t DEPTH = 4;
+
+	void add(const Ps2Mouse::packet_t& p);
+	/**
+	 * @return false 送るものが無い
+	 */
+	bool take(hid_mouse_report_t& report);
+	bool empty() const;
+	/**
+	 * @brief 足したパケットの数、送ったレポートの数
+	 */
+	uint32_t packets() const;
+	uint32_t reports() const;
+
+ private:
+	struct pending_t {
+		uint8_t buttons;
+		int32_t dx;
+		int32_t dy;
+		int32_t wheel;
+	};
+	pending_t entries[DEPTH] = {};
+	size_t head = 0;
+	size_t n = 0;
+	uint8_t buttons = 0;  // 最後に積んだボタンの状態
+	uint32_t n_packets = 0;
+	uint32_t n_reports = 0;
+	mutable Mutex lck;
+};
+
+}  // namespace ax2usb
@@ -13,6 +13,9 @@ constexpr inline uint8_t SET_TYPEMATIC = 0xf3;
 constexpr inline uint8_t ENABLE = 0xf4;
 constexpr inline uint8_t DEFAULT_DISABLE = 0xf5;
 constexpr inline uint8_t DEFAULT = 0xf5;
+// 以下はスキャンコードセット3のみ
+constexpr inline uint8_t SET_ALL_MAKE_BREAK = 0xf8;
+constexpr inline uint8_t SET_KEY_MAKE = 0xfd;
 constexpr inline uint8_t RESEND = 0xfe;
 constexpr inline uint8_t RESET = 0xff;
 
@@ -48,4 +51,13 @@ constexpr inline uint8_t ALT_PRINT_SCREEN = 0x84;
 
 }  // namespace ps2key
 
+/**
+ * @brief ホストからキーボードへのコマンド列の1ステップ: send を送り(負なら送らない。0xff より大きければ送る側が決めた値)、
+ * expect を受け取ったら次へ進む
+ */
+struct ps2_step_t {
+	int16_t send;
+	uint8_t expect;
+};
+
 }  // namespace ax2usb
@@ -0,0 +1,45 @@
+#include "repeater.hpp"
+#include <class/hid/hid.h>  // from Adafruit TinyUSB
+
+namespace ax2usb {
+
+bool
+Repeater::repeats(uint8_t usb) const {
+	switch (cfg.keys) {
+		case keys_t::navigation:
+			return (usb >= HID_KEY_HOME && usb <= HID_KEY_ARROW_UP) || usb == HID_KEY_BACKSPACE || usb == HID_KEY_INSERT;
+		case keys_t::all:
+			// モディファイアとロックキーは除く
+			return usb < HID_KEY_CONTROL_LEFT && usb != HID_KEY_CAPS_LOCK && usb != HID_KEY_NUM_LOCK &&
+			       usb != HID_KEY_SCROLL_LOCK;
+		default:
+			return false;
+	}
+}
+
+void
+Repeater::press(keymap::key_t key, uint8_t usb, uint32_t pressed_us) {
+	if (repeats(usb)) {
+		active = true;
+		rep_key = key;
+		rep_usb = usb;
+		next_us = pressed_us + cfg.delay_us;
+	} else if (usb < HID_KEY_CONTROL_LEFT) {
+		active = false;
+	}
+}
+
+bool
+Repeater::due(uint32_t now_us) {
+	if (!active || static_cast<int32_t>(now_us - next_us) < 0) {
+		return false;
+	}
+	next_us += cfg.interval_us;
+	if (static_cast<int32_t>(now_us - next_us) >= 0) {
+		// 送信が遅れた分をまとめて取り戻さない
+		next_us = now_us + cfg.interval_us;
+	}
+	return true;
+}
+
+}  // namespace ax2usb
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include "keymap.hpp"
+
+// ファームウェアでリピートするキー(0:しない 1:カーソル移動・編集キー 2:全キー)
+#ifndef AX2USB_REPEAT_KEYS
+#define AX2USB_REPEAT_KEYS 0
+#endif
+#ifndef AX2USB_REPEAT_DELAY_MS
+#define AX2USB_REPEAT_DELAY_MS 250
+#endif
+// 1秒あたりの回数
+#ifndef AX2USB_REPEAT_RATE
+#define AX2USB_REPEAT_RATE 40
+#endif
+
+namespace ax2usb {
+
+/**
+ * @brief キーリピート(ファームウェアで生成する)
+ *
+ * 最後に押したキーを、押してから delay_us 後に interval_us ごとに離して押し直す(ホストから見ると新しい打鍵になる)。
+ * 他のキーを押す(モディファイアを除く)か、そのキーを離すと止まる。
+ * 対象外のキーは押したままにしておき、これまでどおりホストがリピートする。
+ */
+class Repeater {
+ public:
+	enum class keys_t : uint8_t { none, navigation, all };
+	struct config_t {
+		keys_t keys = static_cast<keys_t>(AX2USB_REPEAT_KEYS);
+		uint32_t delay_us = AX2USB_REPEAT_DELAY_MS * 1000;
+		uint32_t interval_us = 1000000 / AX2USB_REPEAT_RATE;
+	};
+
+	void configure(const config_t& c) {
+		cfg = c;
+		active = false;
+	}
+	const config_t& config() const { return cfg; }
+	/**
+	 * @brief リピートの対象の USB_HIDキーコードか
+	 */
+	bool repeats(uint8_t usb) const;
+	/**
+	 * @brief キーを押した。対象ならリピートを始め、そうでなければ(モディファイア以外は)止める
+	 */
+	void press(keymap::key_t key, uint8_t usb, uint32_t pressed_us);
+	/**
+	 * @brief キーを離した。リピート中のキーなら止める
+	 */
+	void release(keymap::key_t key) { active = active && key != rep_key; }
+	void stop() { active = false; }
+	/**
+	 * @brief 次のリピートの時刻が来ていれば、次の時刻に進めて true
+	 */
+	bool due(uint32_t now_us);
+	bool repeating() const { return active; }
+	uint8_t usb() const { return rep_usb; }
+	/**
+	 * @brief 次のリピートの時刻(リピート中のみ有効)
+	 */
+	uint32_t next_due_us() const { return next_us; }
+
+ private:
+	config_t cfg;
+	bool active = false;
+	keymap::key_t rep_key = 0;
+	uint8_t rep_usb = 0;
+	uint32_t next_us = 0;
+};
+
+}  // namespace ax2usb
@@ -0,0 +1,147 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include "keymap.hpp"
+#include "ps2code.hpp"
+
+namespace ax2usb::set2 {
+
+/**
+ * @brief 直前までに受け取ったプレフィクス
+ */
+enum class prefix_t : uint8_t { none, brk, e0, e0_brk, e1, e1_brk, count };
+
+enum class op_t : uint8_t {
+	none,        // 何もしない(プレフィクスの途中など)
+	key,         // キーの位置 key を make/break する(キーマップで動作を決める)
+	key_tap,     // キーの位置 key を make してすぐ break する(make だけを送るキー)
+	led_sync,    // BAT完了/ECHO応答: LED状態を送り直す
+	fake_shift,  // E0 12/E0 59: 無視する
+	unmapped,    // キーの位置に対応しない
+	error,       // キーボードからのエラー・再送要求(key は受信バイト)。プレフィクスの途中でも受け付けて同期し直す
+};
+
+struct action_t {
+	op_t op;
+	keymap::key_t key;  // キーの位置
+	prefix_t next;
+	bool make_break;
+};
+
+namespace detail {
+
+/**
+ * @brief どのプレフィクスの後にも来ないバイト: バッファあふれ・BAT失敗・診断エラー・再送要求
+ */
+constexpr bool
+is_error(uint8_t code) {
+	return code == ps2ind::OVERRUN || code == ps2ind::BAT_FAILED || code == ps2ind::DIAG_FAILURE ||
+	       code == ps2ind::RESEND;
+}
+
+constexpr action_t
+code_action(uint8_t code, bool make_break) {
+	if (code != ps2ind::OVERRUN && code <= ps2key::ALT_PRINT_SCREEN) {
+		return { op_t::key, keymap::key_id(code), prefix_t::none, make_break };
+	}
+	return { op_t::unmapped, code, prefix_t::none, make_break };
+}
+
+constexpr action_t
+e0_code_action(uint8_t code, bool make_break) {
+	if (code == ps2key::L_SHIFT || code == ps2key::R_SHIFT) {
+		return { op_t::fake_shift, 0, prefix_t::none, make_break };
+	} else if (code >= 0x10 && code < 0x80) {
+		return { op_t::key, keymap::key_id_e0(code), prefix_t::none, make_break };
+	}
+	return { op_t::unmapped, code, prefix_t::none, make_break };
+}
+
+constexpr action_t
+e1_code_action(uint8_t code, bool make_break) {
+	if (code == ps2key::L_CTRL) {
+		// wait for pause, keep state
+		return { op_t::none, 0, prefix_t::e1, make_break };
+	} else if (code == ps2key::PAUSE) {
+		return { op_t::key, keymap::KEY_PAUSE, prefix_t::none, make_break };
+	}
+	return { op_t::unmapped, code, prefix_t::none, make_break };
+}
+
+constexpr action_t
+transition(prefix_t prefix, uint8_t code) {
+	constexpr action_t to_brk = { op_t::none, 0, prefix_t::brk, false };
+	if (is_error(code)) {
+		return { op_t::error, code, prefix_t::none, true };
+	}
+	switch (prefix) {
+		case prefix_t::none:
+			if (code == ps2ind::BREAK) {
+				return to_brk;
+			} else if (code == ps2ind::E0) {
+				return { op_t::none, 0, prefix_t::e0, true };
+			} else if (code == ps2ind::E1) {
+				return { op_t::none, 0, prefix_t::e1, true };
+			} else if (code == ps2ind::BAT_COMPLETED || code == ps2ind::ECHO_RESPONSE) {
+				return { op_t::led_sync, 0, prefix_t::none, true };
+			}
+			return code_action(code, true);
+		case prefix_t::brk:
+			return code_action(code, false);
+		case prefix_t::e0:
+			if (code == ps2ind::BREAK) {
+				return { op_t::none, 0, prefix_t::e0_brk, false };
+			}
+			return e0_code_action(code, true);
+		case prefix_t::e0_brk:
+			return e0_code_action(code, false);
+		case prefix_t::e1:
+			if (code == ps2ind::BREAK) {
+				return { op_t::none, 0, prefix_t::e1_brk, false };
+			}
+			return e1_code_action(code, true);
+		case prefix_t::e1_brk:
+			return e1_code_action(code, false);
+		default:
+			return { op_t::unmapped, code, prefix_t::none, true };
+	}
+}
+
+constexpr std::array<std::array<action_t, 256>, static_cast<size_t>(prefix_t::count)>
+make_table() {
+	std::array<std::array<action_t, 256>, static_cast<size_t>(prefix_t::count)> t{};
+	for (size_t p = 0; p < t.size(); p++) {
+		for (size_t c = 0; c < 256; c++) {
+			t[p][c] = transition(static_cast<prefix_t>(p), static_cast<uint8_t>(c));
+		}
+	}
+	return t;
+}
+
+}  // namespace detail
+
+/**
+ * @brief プレフィクス × 受信バイト → 動作 の遷移表(コンパイル時に生成)
+ */
+constexpr inline auto table = detail::make_table();
+
+/**
+ * @brief スキャンコードセット2のデコーダ
+ *
+ * 1バイトごとに遷移表を1回引くだけで、次のプレフィクスと実行すべき動作(キーの位置の make/break など)が決まる。
+ */
+class Decoder {
+ public:
+	const action_t& feed(uint8_t code) {
+		const action_t& act = table[static_cast<size_t>(prefix)][code];
+		prefix = act.next;
+		return act;
+	}
+	prefix_t state() const { return prefix; }
+	void reset() { prefix = prefix_t::none; }
+
+ private:
+	prefix_t prefix = prefix_t::none;
+};
+
+}  // namespace ax2usb::set2
@@ -0,0 +1,127 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include "keymap.hpp"
+#include "ps2code.hpp"
+#include "set2_decoder.hpp"
+
+namespace ax2usb::set3 {
+
+// 動作はセット2のデコーダと同じ形で返す(プレフィクスは none/brk だけを使う)
+using set2::action_t;
+using set2::op_t;
+using set2::prefix_t;
+
+// clang-format off
+/**
+ * @brief スキャンコードセット3 → キーの位置(セット2で決めた位置に揃える)
+ *
+ * IBM 101/106キーボードのセット3のコード。0 はキーなし。AXキーボード独自のキー(AX、AX配列の無変換・変換)のコードは不明なので
+ * 含めていない(受け取ると UNMAPPED としてログに残る)。
+ */
+constexpr inline keymap::key_t code_key[0x90] = {
+	//       00    01    02    03    04    05    06    07    08    09    0a    0b    0c    0d    0e    0f
+	//                                                     F1    Esc                           Tab   `~    F2
+	/* 00 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05, 0x76, 0x00, 0x00, 0x00, 0x00, 0x0d, 0x0e, 0x06,
+	//             LCtrl LShft \|下  Caps  Q     1!    F3                LAlt  Z     S     A     W     2@    F4
+	/* 10 */ 0x00, 0x14, 0x12, 0x61, 0x58, 0x15, 0x16, 0x04, 0x00, 0x11, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x0c,
+	//             C     X     D     E     4$    3#    F5                SPC   V     F     T     R     5%    F6
+	/* 20 */ 0x00, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x03, 0x00, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x0b,
+	//             N     B     H     G     Y     6^    F7                RAlt  M     J     U     7&    8*    F8
+	/* 30 */ 0x00, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x83, 0x00, 0x91, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x0a,
+	//             ,<    K     I     O     0)    9(    F9                .>    /?    L     ;:    P     -_    F10
+	/* 40 */ 0x00, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x01, 0x00, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x09,
+	//             \_    '"          [{    =+    F11   PrtSc RCtrl RShft Enter ]}    \|    yen   F12   ScrLk
+	/* 50 */ 0x00, 0x51, 0x52, 0x00, 0x54, 0x55, 0x78, 0xfc, 0x94, 0x59, 0x5a, 0x5b, 0x5d, 0x6a, 0x07, 0x7e,
+	//       ↓     ←     Pause ↑     Del   End   BS    Ins         1     →     4     7     PgDn  Home  PgUp
+	/* 60 */ 0xf2, 0xeb, 0x88, 0xf5, 0xf1, 0xe9, 0x66, 0xf0, 0x00, 0x69, 0xf4, 0x6b, 0x6c, 0xfa, 0xec, 0xfd,
+	//       0     .     2     5     6     8     Num   /           Enter 3           +     9     *
+	/* 70 */ 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x77, 0xca, 0x00, 0xda, 0x7a, 0x00, 0x79, 0x7d, 0x7c, 0x00,
+	//                               -     無変換変換  かな              LWin  RWin  Menu
+	/* 80 */ 0x00, 0x00, 0x00, 0x00, 0x7b, 0x67, 0x64, 0x13, 0x00, 0x00, 0x00, 0x9f, 0xa7, 0xaf, 0x00, 0x00,
+};
+// clang-format on
+
+/**
+ * @brief make だけを送らせるキー(セット3のコード)
+ *
+ * 受け取ったらすぐに離したことにする。セット2で make と break を続けて送ってくる Pause を同じ扱いにする。
+ */
+constexpr inline uint8_t make_only_codes[] = { 0x62 };
+
+namespace detail {
+
+constexpr bool
+is_make_only(uint8_t code) {
+	for (auto c : make_only_codes) {
+		if (c == code) {
+			return true;
+		}
+	}
+	return false;
+}
+
+constexpr action_t
+code_action(uint8_t code, bool make_break) {
+	if (code >= std::size(code_key) || code_key[code] == 0) {
+		return { op_t::unmapped, code, prefix_t::none, make_break };
+	}
+	if (is_make_only(code)) {
+		// break は来ないはず
+		return { make_break ? op_t::key_tap : op_t::none, code_key[code], prefix_t::none, make_break };
+	}
+	return { op_t::key, code_key[code], prefix_t::none, make_break };
+}
+
+constexpr action_t
+transition(prefix_t prefix, uint8_t code) {
+	if (set2::detail::is_error(code)) {
+		return { op_t::error, code, prefix_t::none, true };
+	} else if (prefix == prefix_t::brk) {
+		return code_action(code, false);
+	} else if (code == ps2ind::BREAK) {
+		return { op_t::none, 0, prefix_t::brk, false };
+	} else if (code == ps2ind::BAT_COMPLETED || code == ps2ind::ECHO_RESPONSE) {
+		return { op_t::led_sync, 0, prefix_t::none, true };
+	}
+	return code_action(code, true);
+}
+
+constexpr std::array<std::array<action_t, 256>, 2>
+make_table() {
+	std::array<std::array<action_t, 256>, 2> t{};
+	for (size_t c = 0; c < 256; c++) {
+		t[0][c] = transition(prefix_t::none, c);
+		t[1][c] = transition(prefix_t::brk, c);
+	}
+	return t;
+}
+
+}  // namespace detail
+
+/**
+ * @brief break の有無 × 受信バイト → 動作 の遷移表(コンパイル時に生成)
+ */
+constexpr inline auto table = detail::make_table();
+
+/**
+ * @brief スキャンコードセット3のデコーダ
+ *
+ * セット3はプレフィクスが F0(break)だけなので、セット2より短いバイト列を同じように1回の表引きで処理できる。
+ */
+class Decoder {
+ public:
+	const action_t& feed(uint8_t code) {
+		const action_t& act = table[prefix == prefix_t::brk][code];
+		prefix = act.next;
+		return act;
+	}
+	prefix_t state() const { return prefix; }
+	void reset() { prefix = prefix_t::none; }
+
+ private:
+	prefix_t prefix = prefix_t::none;
+};
+
+}  // namespace ax2usb::set3
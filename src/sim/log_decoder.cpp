@@ -0,0 +1,232 @@
+#include "log_decoder.hpp"
+#include <Adafruit_TinyUSB.h>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+namespace ax2usb::log {
+
+namespace {
+
+#define AX2USB_LOG_EVENT_FORMAT(name, fmt) fmt,
+constexpr const char* formats[] = { AX2USB_LOG_EVENTS(AX2USB_LOG_EVENT_FORMAT) };
+#undef AX2USB_LOG_EVENT_FORMAT
+#define AX2USB_LOG_EVENT_NAME(name, fmt) #name,
+constexpr const char* names[] = { AX2USB_LOG_EVENTS(AX2USB_LOG_EVENT_NAME) };
+#undef AX2USB_LOG_EVENT_NAME
+
+std::string
+hex2(uint8_t v) {
+	char buf[3];
+	snprintf(buf, sizeof(buf), "%02x", v);
+	return buf;
+}
+
+std::string
+usb_key_str(uint8_t key) {
+	if (key >= HID_KEY_0 && key <= HID_KEY_9) {
+		return std::string{ static_cast<char>('0' + key - HID_KEY_0) };
+	} else if (key >= HID_KEY_A && key <= HID_KEY_Z) {
+		return std::string{ static_cast<char>('A' + key - HID_KEY_A) };
+	} else if (key == HID_KEY_PRINT_SCREEN) {
+		return "Prt";
+	} else if (key == HID_KEY_PAUSE) {
+		return "Pause";
+	}
+	return hex2(key);
+}
+
+char
+usb_mod_char(uint8_t mod_key) {
+	switch (mod_key) {
+		case HID_KEY_CONTROL_LEFT:
+			return 'C';
+		case HID_KEY_SHIFT_LEFT:
+			return 'S';
+		case HID_KEY_ALT_LEFT:
+			return 'A';
+		case HID_KEY_GUI_LEFT:
+			return 'W';
+		case HID_KEY_CONTROL_RIGHT:
+			return 'c';
+		case HID_KEY_SHIFT_RIGHT:
+			return 's';
+		case HID_KEY_ALT_RIGHT:
+			return 'a';
+		case HID_KEY_GUI_RIGHT:
+			return 'w';
+		default:
+			return '*';
+	}
+}
+
+std::string
+usb_mods_str(uint8_t mod) {
+	std::string ret;
+	const char* marks = "CSAW";
+	for (int i = 0; i < 8; i++) {
+		if (i == 4) {
+			ret += '|';
+		}
+		ret += (mod & (1 << i)) ? marks[i % 4] : static_cast<char>(marks[i % 4] - 'A' + 'a');
+	}
+	return ret;
+}
+
+std::string
+usb_codes_str(uint64_t packed) {
+	std::string ret;
+	for (int i = 0; i < 6; i++) {
+		ret += '[';
+		ret += usb_key_str(packed >> (i * 8));
+		ret += ']';
+	}
+	return ret;
+}
+
+std::string
+usb_led_str(uint8_t led) {
+	std::string ret;
+	ret += (led & 0x01) ? 'N' : 'n';
+	ret += (led & 0x02) ? 'C' : 'c';
+	ret += (led & 0x04) ? 'S' : 's';
+	ret += (led & 0x08) ? 'M' : 'm';
+	ret += (led & 0x10) ? 'K' : 'k';
+	return ret;
+}
+
+uint32_t
+get_le32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+}  // namespace
+
+std::string
+format(const record_t& rec) {
+	char stamp[32];
+	snprintf(stamp, sizeof(stamp), "%10.6f ", rec.t_us / 1e6);
+	std::string out = stamp;
+	auto id = static_cast<size_t>(rec.id);
+	if (id >= std::size(formats)) {
+		snprintf(stamp, sizeof(stamp), "(unknown event %u)", static_cast<unsigned>(id));
+		return out + stamp;
+	}
+	size_t ai = 0;
+	auto arg = [&]() -> uint32_t { return ai < rec.nargs ? rec.args[ai++] : 0; };
+	for (const char* p = formats[id]; *p; p++) {
+		if (*p != '%') {
+			out += *p;
+			continue;
+		}
+		// フラグと幅はそのまま snprintf に渡す
+		std::string spec = "%";
+		while (*++p && strchr("-+ #0123456789", *p)) {
+			spec += *p;
+		}
+		char buf[32];
+		switch (*p) {
+			case 'u':
+			case 'x':
+			case 'X':
+			case 'c':
+				spec += *p;
+				snprintf(buf, sizeof(buf), spec.c_str(), arg());
+				out += buf;
+				break;
+			case 'd':
+				spec += *p;
+				snprintf(buf, sizeof(buf), spec.c_str(), static_cast<int32_t>(arg()));
+				out += buf;
+				break;
+			case 'k':
+				out += usb_key_str(arg());
+				break;
+			case 'M':
+				out += usb_mod_char(arg());
+				break;
+			case 'm':
+				out += usb_mods_str(arg());
+				break;
+			case 'C': {
+				uint64_t lo = arg();
+				out += usb_codes_str(lo | uint64_t{ arg() } << 32);
+				break;
+			}
+			case 'K':
+				out += arg() ? '+' : '-';
+				break;
+			case 'F':
+				out += arg() ? '#' : '~';
+				break;
+			case 'B':
+				out += arg() ? "make" : "break";
+				break;
+			case 'L':
+				out += usb_led_str(arg());
+				break;
+			case '%':
+				out += '%';
+				break;
+			default:
+				out += "<bad format in ";
+				out += names[id];
+				out += '>';
+				return out;
+		}
+	}
+	return out;
+}
+
+void
+Decoder::feed(uint8_t b) {
+	if (frame_len == 0) {
+		if (b == FRAME_START) {
+			flush();
+			frame[0] = b;
+			frame_pos = 1;
+			frame_len = 3;  // 引数の数を読むまで
+		} else if (b == '\n') {
+			on_line(text);
+			text.clear();
+		} else if (b != '\r') {
+			text += static_cast<char>(b);
+		}
+		return;
+	}
+	frame[frame_pos++] = b;
+	if (frame_pos == 3) {
+		if (b > MAX_ARGS) {
+			on_line("(broken log frame)");
+			frame_len = 0;
+			return;
+		}
+		frame_len = 7 + b * 4;
+	}
+	if (frame_pos < frame_len) {
+		return;
+	}
+	record_t rec{};
+	rec.id = static_cast<event_t>(frame[1]);
+	rec.nargs = frame[2];
+	rec.t_us = get_le32(&frame[3]);
+	for (size_t i = 0; i < rec.nargs; i++) {
+		rec.args[i] = get_le32(&frame[7 + i * 4]);
+	}
+	frame_len = 0;
+	if (on_record) {
+		on_record(rec);
+	} else {
+		on_line(format(rec));
+	}
+}
+
+void
+Decoder::flush() {
+	if (!text.empty()) {
+		on_line(text);
+		text.clear();
+	}
+}
+
+}  // namespace ax2usb::log
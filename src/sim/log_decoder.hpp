@@ -0,0 +1,40 @@
+#pragma once
+// ax2usb::log のバイナリ記録をホスト上で元の文字列に戻す
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "log.hpp"
+
+namespace ax2usb::log {
+
+/**
+ * @brief 記録1つを1行の文字列にする(先頭に時刻を付ける)
+ */
+std::string format(const record_t& rec);
+
+/**
+ * @brief UART から読んだバイト列を行に分ける
+ *
+ * フレームは format() で整形し、それ以外のバイトはテキストとして改行ごとに出力する。
+ * on_record を渡すと、フレームは整形せずに記録のまま渡す。
+ */
+class Decoder {
+ public:
+	explicit Decoder(std::function<void(const std::string&)> on_line, std::function<void(const record_t&)> on_record = nullptr)
+	    : on_line(std::move(on_line)), on_record(std::move(on_record)) {}
+	void feed(uint8_t b);
+	/**
+	 * @brief 改行で終わっていないテキストを出力する
+	 */
+	void flush();
+
+ private:
+	std::function<void(const std::string&)> on_line;
+	std::function<void(const record_t&)> on_record;
+	std::string text;
+	uint8_t frame[3 + 4 + 4 * MAX_ARGS];
+	size_t frame_len = 0;  // 0 ならテキスト中
+	size_t frame_pos = 0;
+};
+
+}  // namespace ax2usb::log
@@ -0,0 +1,383 @@
+#include "replay.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <strings.h>
+#include "ax2usb.h"
+
+namespace ax2usb::replay {
+
+namespace {
+
+constexpr uint8_t REPORT_ID_SYS = 2;
+constexpr uint8_t REPORT_ID_CONSUMER = 3;
+
+// シナリオの時間割り
+constexpr uint64_t START_US = 1000000;
+constexpr uint64_t STEP_GAP_US = 20000;
+constexpr uint64_t DEFAULT_HOLD_US = 50000;
+constexpr uint64_t BYTE_US = 1000;  // sim::Device::byte_us の既定値
+// 最後の記録の後、キーリピート・タップ・ホールドの期限・送信待ちが終わるまで回す時間
+constexpr uint64_t SETTLE_US = 1000000;
+constexpr uint32_t LOOP_US = 5;
+// これより大きい差分は LCS を求めず、行ごとに比べる
+constexpr size_t DIFF_CELLS_MAX = 4 * 1024 * 1024;
+
+constexpr uint16_t E0 = sim::Keyboard::E0;
+
+struct key_name_t {
+	const char* name;
+	uint16_t code;  // セット2(E0付きは E0 | code)
+};
+
+// clang-format off
+constexpr key_name_t KEY_NAMES[] = {
+	{ "a", 0x1c }, { "b", 0x32 }, { "c", 0x21 }, { "d", 0x23 }, { "e", 0x24 }, { "f", 0x2b }, { "g", 0x34 },
+	{ "h", 0x33 }, { "i", 0x43 }, { "j", 0x3b }, { "k", 0x42 }, { "l", 0x4b }, { "m", 0x3a }, { "n", 0x31 },
+	{ "o", 0x44 }, { "p", 0x4d }, { "q", 0x15 }, { "r", 0x2d }, { "s", 0x1b }, { "t", 0x2c }, { "u", 0x3c },
+	{ "v", 0x2a }, { "w", 0x1d }, { "x", 0x22 }, { "y", 0x35 }, { "z", 0x1a },
+	{ "1", 0x16 }, { "2", 0x1e }, { "3", 0x26 }, { "4", 0x25 }, { "5", 0x2e }, { "6", 0x36 }, { "7", 0x3d },
+	{ "8", 0x3e }, { "9", 0x46 }, { "0", 0x45 },
+	{ "f1", 0x05 }, { "f2", 0x06 }, { "f3", 0x04 }, { "f4", 0x0c }, { "f5", 0x03 }, { "f6", 0x0b },
+	{ "f7", 0x83 }, { "f8", 0x0a }, { "f9", 0x01 }, { "f10", 0x09 }, { "f11", 0x78 }, { "f12", 0x07 },
+	{ "enter", 0x5a }, { "esc", 0x76 }, { "tab", 0x0d }, { "space", 0x29 }, { "backspace", 0x66 },
+	{ "shift", 0x12 }, { "rshift", 0x59 }, { "ctrl", 0x14 }, { "alt", 0x11 }, { "ralt", E0 | 0x11 },
+	{ "caps", 0x58 }, { "fn", E0 | 0x14 },
+	{ "up", E0 | 0x75 }, { "down", E0 | 0x72 }, { "left", E0 | 0x6b }, { "right", E0 | 0x74 },
+	{ "home", E0 | 0x6c }, { "end", E0 | 0x69 }, { "pgup", E0 | 0x7d }, { "pgdn", E0 | 0x7a },
+	{ "ins", E0 | 0x70 }, { "del", E0 | 0x71 },
+};
+// clang-format on
+
+struct led_name_t {
+	const char* name;
+	uint8_t bit;
+};
+constexpr led_name_t LED_NAMES[] = { { "num", 0x01 }, { "caps", 0x02 }, { "scroll", 0x04 }, { "kana", 0x10 } };
+
+/**
+ * @brief ホストからのコマンドに応答しないデバイス(応答はトレースに記録されている)
+ */
+class Player : public sim::Device {
+ public:
+	Player() : Device(0) {}
+
+ protected:
+	void on_host_send(uint8_t) override {}
+};
+
+bool
+parse_key(const std::string& s, uint16_t& code) {
+	if (s.size() > 2 && !strncasecmp(s.c_str(), "0x", 2)) {
+		char* end;
+		unsigned long v = strtoul(s.c_str() + 2, &end, 16);
+		if (*end || (v > 0xff && (v >> 8) != 0xe0)) {
+			return false;
+		}
+		code = v > 0xff ? E0 | (v & 0xff) : v;
+		return true;
+	}
+	for (auto& k : KEY_NAMES) {
+		if (!strcasecmp(s.c_str(), k.name)) {
+			code = k.code;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool
+parse_keys(const std::string& s, std::vector<uint16_t>& keys) {
+	std::istringstream in(s);
+	std::string name;
+	while (std::getline(in, name, '+')) {
+		uint16_t code;
+		if (!parse_key(name, code)) {
+			return false;
+		}
+		keys.push_back(code);
+	}
+	return !keys.empty();
+}
+
+bool
+parse_duration(const std::string& s, uint64_t& us) {
+	char* end;
+	double v = strtod(s.c_str(), &end);
+	std::string unit = end;
+	if (end == s.c_str() || v < 0) {
+		return false;
+	}
+	if (unit == "us") {
+		us = v;
+	} else if (unit.empty() || unit == "ms") {
+		us = v * 1000;
+	} else if (unit == "s") {
+		us = v * 1000000;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+class ScenarioWriter {
+ public:
+	explicit ScenarioWriter(std::vector<trace::record_t>& records) : records(records) {}
+
+	/**
+	 * @brief バイト列を t_us から1バイトずつ届くように積む
+	 *
+	 * @return uint64_t 最後のバイトが届く時刻
+	 */
+	uint64_t bytes(uint64_t t_us, const std::vector<uint8_t>& bs) {
+		for (auto b : bs) {
+			t_us += BYTE_US;
+			records.push_back({ t_us, trace::kind_t::ps2, b });
+		}
+		return t_us;
+	}
+	uint64_t key(uint64_t t_us, uint16_t code, bool make_break) {
+		std::vector<uint8_t> bs;
+		if (code & E0) {
+			bs.push_back(0xe0);
+		}
+		if (!make_break) {
+			bs.push_back(0xf0);
+		}
+		bs.push_back(code & 0xff);
+		return bytes(t_us, bs);
+	}
+	void led(uint64_t t_us, uint8_t value) { records.push_back({ t_us, trace::kind_t::led, value }); }
+
+ private:
+	std::vector<trace::record_t>& records;
+};
+
+std::string
+hex_bytes(const uint8_t* data, size_t len) {
+	std::string out;
+	char buf[4];
+	for (size_t i = 0; i < len; i++) {
+		snprintf(buf, sizeof(buf), " %02x", data[i]);
+		out += buf;
+	}
+	return out;
+}
+
+}  // namespace
+
+bool
+parse_scenario(const std::string& text, std::vector<trace::record_t>& records, std::string& error) {
+	ScenarioWriter w(records);
+	uint64_t t = START_US;
+	std::istringstream lines(text);
+	std::string line;
+	for (size_t line_no = 1; std::getline(lines, line); line_no++) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream in(line);
+		std::vector<std::string> tok;
+		for (std::string s; in >> s;) {
+			tok.push_back(s);
+		}
+		if (tok.empty()) {
+			continue;
+		}
+		auto fail = [&](const std::string& why) {
+			error = "line " + std::to_string(line_no) + ": " + why;
+			return false;
+		};
+		const std::string& cmd = tok[0];
+		if (!strcasecmp(cmd.c_str(), "wait")) {
+			uint64_t d;
+			if (tok.size() != 2 || !parse_duration(tok[1], d)) {
+				return fail("usage: wait DURATION");
+			}
+			t += d;
+			continue;
+		}
+		if (!strcasecmp(cmd.c_str(), "led")) {
+			uint8_t value = 0;
+			for (size_t i = 1; i < tok.size(); i++) {
+				auto led = std::find_if(std::begin(LED_NAMES), std::end(LED_NAMES),
+				                        [&](auto& l) { return !strcasecmp(tok[i].c_str(), l.name); });
+				if (led == std::end(LED_NAMES)) {
+					return fail("unknown led '" + tok[i] + "'");
+				}
+				value |= led->bit;
+			}
+			w.led(t, value);
+		} else if (!strcasecmp(cmd.c_str(), "raw")) {
+			std::vector<uint8_t> bs;
+			for (size_t i = 1; i < tok.size(); i++) {
+				char* end;
+				unsigned long v = strtoul(tok[i].c_str(), &end, 16);
+				if (*end || v > 0xff) {
+					return fail("bad byte '" + tok[i] + "'");
+				}
+				bs.push_back(v);
+			}
+			t = w.bytes(t, bs);
+		} else if (!strcasecmp(cmd.c_str(), "press") || !strcasecmp(cmd.c_str(), "release")) {
+			std::vector<uint16_t> keys;
+			if (tok.size() != 2 || !parse_keys(tok[1], keys)) {
+				return fail("usage: " + cmd + " KEY[+KEY...]");
+			}
+			bool make_break = !strcasecmp(cmd.c_str(), "press");
+			for (auto k : keys) {
+				t = w.key(t, k, make_break);
+			}
+		} else {
+			std::vector<uint16_t> keys;
+			if (!parse_keys(cmd, keys)) {
+				return fail("unknown key in '" + cmd + "'");
+			}
+			uint64_t hold = DEFAULT_HOLD_US;
+			if (tok.size() == 3 && !strcasecmp(tok[1].c_str(), "hold")) {
+				if (!parse_duration(tok[2], hold)) {
+					return fail("bad duration '" + tok[2] + "'");
+				}
+			} else if (tok.size() != 1) {
+				return fail("usage: KEY[+KEY...] [hold DURATION]");
+			}
+			uint64_t down = t;
+			for (auto k : keys) {
+				t = w.key(t, k, true);
+			}
+			t = std::max(t, down + hold);
+			for (auto it = keys.rbegin(); it != keys.rend(); ++it) {
+				t = w.key(t, *it, false);
+			}
+		}
+		t += STEP_GAP_US;
+	}
+	return true;
+}
+
+result_t
+run(const std::vector<trace::record_t>& records, bool answer_commands) {
+	sim::reset();
+	AX2USB a2u;
+	std::unique_ptr<sim::Device> dev;
+	if (answer_commands) {
+		dev = std::make_unique<sim::Keyboard>();
+	} else {
+		dev = std::make_unique<Player>();
+	}
+	result_t result;
+	if (!a2u.begin(9, 10)) {
+		return result;
+	}
+	for (auto& rec : records) {
+		if (rec.kind == trace::kind_t::led) {
+			sim::schedule_at(rec.t_us, [v = rec.value]() { sim::usb_host_set_led(AX2USB::REPORT_ID_KBD, v); });
+			continue;
+		}
+		// 送信中のバイト(キーボードの応答)があればその後に続ける
+		sim::Device* d = dev.get();
+		uint64_t at = rec.t_us > d->byte_us ? rec.t_us - d->byte_us : 0;
+		sim::schedule_at(at, [d, v = rec.value]() { d->send_at(0, &v, 1); });
+	}
+	const uint64_t end_us = (records.empty() ? 0 : records.back().t_us) + SETTLE_US;
+	auto wall_start = std::chrono::steady_clock::now();
+	// 受信割り込みからレポート送信まで、キー入力の経路はヒープを使わない
+	sim::heap_check_arm(true);
+	while (sim::now_us() < end_us) {
+		a2u.loop();
+		sim::advance_us(LOOP_US);
+	}
+	result.allocations = sim::heap_allocations();
+	sim::heap_check_arm(false);
+	result.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+	result.events = records.size();
+	for (auto& r : sim::usb_reports()) {
+		result.reports.push_back(format_report(r));
+	}
+	return result;
+}
+
+std::string
+format_report(const sim::Report& r) {
+	std::string out;
+	switch (r.report_id) {
+		case AX2USB::REPORT_ID_KBD:
+			out = "kbd";
+			break;
+		case AX2USB::REPORT_ID_NKRO:
+			out = "nkro";
+			break;
+		case REPORT_ID_SYS:
+			out = "sys";
+			break;
+		case REPORT_ID_CONSUMER:
+			out = "consumer";
+			break;
+		default:
+			out = "id" + std::to_string(r.report_id);
+			break;
+	}
+	return out + hex_bytes(r.data, r.len);
+}
+
+std::vector<std::string>
+diff(const std::vector<std::string>& expected, const std::vector<std::string>& actual) {
+	struct op_t {
+		char mark;
+		const std::string* line;
+		size_t e, a;  // その行の位置(1から)
+	};
+	std::vector<op_t> ops;
+	const size_t n = expected.size(), m = actual.size();
+	if ((n + 1) * (m + 1) <= DIFF_CELLS_MAX) {
+		// 最長共通部分列: lcs[i][j] は expected[i..] と actual[j..] の共通部分列の長さ
+		std::vector<uint32_t> lcs((n + 1) * (m + 1));
+		auto at = [&](size_t i, size_t j) -> uint32_t& { return lcs[i * (m + 1) + j]; };
+		for (size_t i = n; i-- > 0;) {
+			for (size_t j = m; j-- > 0;) {
+				at(i, j) = expected[i] == actual[j] ? at(i + 1, j + 1) + 1 : std::max(at(i + 1, j), at(i, j + 1));
+			}
+		}
+		size_t i = 0, j = 0;
+		while (i < n || j < m) {
+			if (i < n && j < m && expected[i] == actual[j]) {
+				ops.push_back({ ' ', &expected[i], i + 1, j + 1 }), i++, j++;
+			} else if (i < n && (j == m || at(i + 1, j) >= at(i, j + 1))) {
+				ops.push_back({ '-', &expected[i], i + 1, j + 1 }), i++;
+			} else {
+				ops.push_back({ '+', &actual[j], i + 1, j + 1 }), j++;
+			}
+		}
+	} else {
+		for (size_t i = 0; i < std::max(n, m); i++) {
+			if (i < n && i < m && expected[i] == actual[i]) {
+				ops.push_back({ ' ', &expected[i], i + 1, i + 1 });
+				continue;
+			}
+			if (i < n) {
+				ops.push_back({ '-', &expected[i], i + 1, i + 1 });
+			}
+			if (i < m) {
+				ops.push_back({ '+', &actual[i], i + 1, i + 1 });
+			}
+		}
+	}
+	std::vector<std::string> out;
+	auto changed = [&](size_t k) { return k < ops.size() && ops[k].mark != ' '; };
+	bool gap = true;
+	for (size_t k = 0; k < ops.size(); k++) {
+		if (!changed(k) && !(k > 0 && changed(k - 1)) && !changed(k + 1)) {
+			gap = true;
+			continue;
+		}
+		if (gap) {
+			out.push_back("@@ -" + std::to_string(ops[k].e) + " +" + std::to_string(ops[k].a) + " @@");
+			gap = false;
+		}
+		out.push_back(ops[k].mark + *ops[k].line);
+	}
+	return out;
+}
+
+}  // namespace ax2usb::replay
@@ -0,0 +1,55 @@
+#pragma once
+// トレース・シナリオをホスト上の AX2USB に流し、USB レポートの列を期待値(golden)と比べる
+#include <sim.h>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "trace.hpp"
+
+namespace ax2usb::replay {
+
+/**
+ * @brief シナリオ(1行1ステップのテキスト)をトレースの記録の列にする
+ *
+ *   Fn+Up hold 300ms   キーを順に押し、300ms 後に逆順に離す(hold を省くと 50ms)
+ *   press Shift        押すだけ / release Shift 離すだけ
+ *   wait 1s            何もしない(単位は us・ms・s、省くと ms)
+ *   led caps num       ホストから LED 出力レポートを送る(num caps scroll kana。何も書かなければ全消灯)
+ *   raw e0 f0 75       PS/2 バイトをそのまま送る
+ *
+ * キーは A〜Z 0〜9 F1〜F12 Enter Esc Tab Space Backspace Shift RShift Ctrl Alt RAlt Caps Fn(英数カナ)
+ * Up Down Left Right Home End PgUp PgDn Ins Del(大文字小文字は区別しない)か、セット2のコード(0x1c、E0付きは 0xe075)。
+ * 各ステップの後に 20ms 空ける。# から行末まではコメント。
+ * 起動時の ECHO と初期化が終わる 1s 後から始める。
+ *
+ * @return false 書式の誤り(error に行番号と理由)
+ */
+bool parse_scenario(const std::string& text, std::vector<trace::record_t>& records, std::string& error);
+
+struct result_t {
+	std::vector<std::string> reports;  // format_report() で1行にしたレポート(ホストが受け取った順)
+	size_t events = 0;                 // 流した記録の数
+	double wall_s = 0;                 // かかった実時間
+	uint64_t allocations = 0;          // 再生中のファームウェアのヒープ確保(begin() の後。0 のはず)
+};
+
+/**
+ * @brief 記録の列を仮想時計で AX2USB に流し、ホストが受け取ったレポートを返す
+ *
+ * PS/2 バイトは記録の時刻にファームウェアに届く。シナリオはキーボード(sim::Keyboard)がコマンドに応答するので
+ * answer_commands = true、実機のトレースは応答も記録に含まれているので false にする。
+ * sim::reset() してから始める。再生中はファームウェアのヒープ確保を数える(sim::heap_check_arm())。
+ */
+result_t run(const std::vector<trace::record_t>& records, bool answer_commands);
+
+/**
+ * @brief レポートを1行にする(種類とデータの16進。例 "kbd 02 00 04 00 00 00 00 00")
+ */
+std::string format_report(const sim::Report& r);
+
+/**
+ * @brief 期待値と結果の差分("-期待" "+結果" と一致する行を前後に1行ずつ)。一致すれば空
+ */
+std::vector<std::string> diff(const std::vector<std::string>& expected, const std::vector<std::string>& actual);
+
+}  // namespace ax2usb::replay
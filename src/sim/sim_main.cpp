@@ -0,0 +1,691 @@
+// ホスト上で AX2USB を仮想時計で動かし、PS/2 バイト到着から USB レポート送信完了までの遅延を計測する
+//   pio run -e native -t exec -a "--seconds 3600"
+// 実機のデバッグ用シリアルの出力(バイナリログ)を文字列に戻す
+//   pio run -e native -t exec -a "--decode-log /dev/ttyUSB0"
+// PS/2 側・USB 側を2スレッドに分け(2コア構成相当)、実時間でキーストームを流してスループットと遅延を計測する
+//   pio run -e native -t exec -a "--storm 5"
+// トレース・シナリオを再生して USB レポートの列を golden と比べ、再生の速さを計測する
+//   pio run -e native -t exec -a "--replay test/replay/fn_media.scn --golden test/replay/fn_media.golden"
+// デコードとレポート組み立てのホットパスのマイクロベンチマーク
+//   pio run -e native -t exec -a "--bench"
+#ifndef PIO_UNIT_TESTING
+#include <sim.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+#include "ax2usb.h"
+#include "ax2usbmap.hpp"
+#include "bench.hpp"
+#include "log_decoder.hpp"
+#include "multicore.hpp"
+#include "replay.hpp"
+#include "trace.hpp"
+
+namespace {
+
+struct Options {
+	uint32_t seconds = 60;
+	double keys_per_sec = 8;
+	uint32_t loop_us = 5;
+	uint32_t seed = 1;
+	uint32_t wake_trials = 0;
+	uint32_t enumerate_ms = 0;
+	uint32_t burst = 1;
+	uint32_t storm_seconds = 0;
+	uint32_t repeat = 1;
+	uint32_t poll_ms = AX2USB_POLL_INTERVAL_MS;
+	uint32_t poll_offset_us = 0;
+	uint32_t sof_delay_us = 0;
+	hid_util::HidUtil::timing_t timing = hid_util::HidUtil::timing_t::immediate;
+	bool coalesce = true;
+	bool single_core = false;
+	bool set3 = false;
+	bool verbose = false;
+	bool bench = false;
+	const char* decode_log = nullptr;
+	const char* replay = nullptr;
+	const char* golden = nullptr;
+	const char* write_golden = nullptr;
+	const char* record_trace = nullptr;
+	const char* log_to_trace = nullptr;
+};
+
+struct KeyEvent {
+	uint64_t t_us;
+	uint16_t key;  // PS/2 set 2 (E0 付きは sim::Keyboard::E0)
+	uint8_t usb;
+	bool make_break;
+	uint64_t last_byte_us;
+};
+
+// 通常キーのみ(Fn やモディファイアを含まない)を打鍵対象とする
+constexpr uint16_t TYPING_KEYS[] = {
+	0x1c, 0x32, 0x21, 0x23, 0x24, 0x2b, 0x34, 0x33, 0x43, 0x3b, 0x42, 0x4b, 0x3a, 0x31, 0x44, 0x4d, 0x15, 0x2d, 0x1b, 0x2c,
+	0x3c, 0x2a, 0x1d, 0x22, 0x35, 0x1a, 0x16, 0x1e, 0x26, 0x25, 0x2e, 0x36, 0x3d, 0x3e, 0x46, 0x45, 0x29, 0x5a, 0x66,
+	sim::Keyboard::E0 | 0x75, sim::Keyboard::E0 | 0x72, sim::Keyboard::E0 | 0x6b, sim::Keyboard::E0 | 0x74,
+};
+
+uint8_t
+usb_of(uint16_t key) {
+	uint8_t code = key & 0xff;
+	if (key & sim::Keyboard::E0) {
+		for (auto& ent : ax2usb::map::ax2e0_usb) {
+			if (ent.ps2 == code) {
+				return ent.usb;
+			}
+		}
+		return 0;
+	}
+	return code < std::size(ax2usb::map::ax2_usb) ? ax2usb::map::ax2_usb[code] : 0;
+}
+
+bool
+parse_timing(const char* name, hid_util::HidUtil::timing_t& timing) {
+	using timing_t = hid_util::HidUtil::timing_t;
+	if (!strcmp(name, "immediate")) {
+		timing = timing_t::immediate;
+	} else if (!strcmp(name, "measured")) {
+		timing = timing_t::measured;
+	} else if (!strcmp(name, "sof")) {
+		timing = timing_t::sof;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+Options
+parse_options(int argc, char** argv) {
+	Options opt;
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const char* val = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!strcmp(arg, "--verbose")) {
+			opt.verbose = true;
+		} else if (!strcmp(arg, "--no-coalesce")) {
+			opt.coalesce = false;
+		} else if (!strcmp(arg, "--single-core")) {
+			opt.single_core = true;
+		} else if (!strcmp(arg, "--set3")) {
+			opt.set3 = true;
+		} else if (!strcmp(arg, "--bench")) {
+			opt.bench = true;
+		} else if (val && !strcmp(arg, "--seconds")) {
+			opt.seconds = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--rate")) {
+			opt.keys_per_sec = strtod(val, nullptr), i++;
+		} else if (val && !strcmp(arg, "--loop-us")) {
+			opt.loop_us = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--seed")) {
+			opt.seed = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--enumerate-ms")) {
+			opt.enumerate_ms = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--poll-ms")) {
+			opt.poll_ms = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--poll-offset-us")) {
+			opt.poll_offset_us = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--sof-delay-us")) {
+			opt.sof_delay_us = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--timing") && parse_timing(val, opt.timing)) {
+			i++;
+		} else if (val && !strcmp(arg, "--wake-trials")) {
+			opt.wake_trials = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--decode-log")) {
+			opt.decode_log = val, i++;
+		} else if (val && !strcmp(arg, "--burst")) {
+			opt.burst = std::max(1ul, strtoul(val, nullptr, 0)), i++;
+		} else if (val && !strcmp(arg, "--storm")) {
+			opt.storm_seconds = strtoul(val, nullptr, 0), i++;
+		} else if (val && !strcmp(arg, "--replay")) {
+			opt.replay = val, i++;
+		} else if (val && !strcmp(arg, "--golden")) {
+			opt.golden = val, i++;
+		} else if (val && !strcmp(arg, "--write-golden")) {
+			opt.write_golden = val, i++;
+		} else if (val && !strcmp(arg, "--record-trace")) {
+			opt.record_trace = val, i++;
+		} else if (val && !strcmp(arg, "--repeat")) {
+			opt.repeat = std::max(1ul, strtoul(val, nullptr, 0)), i++;
+		} else if (val && i + 2 < argc && !strcmp(arg, "--log-to-trace")) {
+			opt.log_to_trace = val, opt.record_trace = argv[i + 2], i += 2;
+		} else {
+			fprintf(stderr,
+			        "usage: %s [--seconds N] [--rate KEYS_PER_SEC] [--loop-us N] [--seed N] [--wake-trials N] [--burst N] "
+			        "[--enumerate-ms N] [--poll-ms 1|2|4|8] [--timing immediate|measured|sof] [--poll-offset-us N] [--sof-delay-us N] "
+			        "[--no-coalesce] [--set3] [--verbose]\n"
+			        "       %s --storm SECONDS [--single-core] [--no-coalesce]\n"
+			        "       %s --decode-log FILE|-\n"
+			        "       %s --replay TRACE|SCENARIO [--golden FILE] [--write-golden FILE] [--record-trace FILE] [--repeat N]\n"
+			        "       %s --log-to-trace LOG TRACE\n"
+			        "       %s --bench\n",
+			        argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+			exit(1);
+		}
+	}
+	return opt;
+}
+
+// 打鍵間隔は指数分布、押下時間は 40〜140ms。同じキーが押されている間は再度押さない。
+// burst > 1 なら 0〜2ms 間隔で burst 個のキーを続けて押す(同時押し・速いロールオーバー)
+std::vector<KeyEvent>
+generate_typing(const Options& opt, uint64_t start_us, uint64_t end_us) {
+	std::mt19937 rng(opt.seed);
+	std::exponential_distribution<double> gap(opt.keys_per_sec / opt.burst);
+	std::uniform_int_distribution<uint32_t> hold(40000, 140000);
+	std::uniform_int_distribution<uint32_t> spread(0, 2000);
+	std::uniform_int_distribution<size_t> pick(0, std::size(TYPING_KEYS) - 1);
+	std::vector<KeyEvent> events;
+	uint64_t released_at[std::size(TYPING_KEYS)] = {};
+
+	for (uint64_t t = start_us; t < end_us; t += static_cast<uint64_t>(gap(rng) * 1e6) + 1) {
+		uint64_t down = t;
+		for (uint32_t i = 0; i < opt.burst; i++, down += spread(rng)) {
+			size_t k = pick(rng);
+			if (released_at[k] > down) {
+				continue;
+			}
+			uint64_t up = down + hold(rng);
+			released_at[k] = up + 1;
+			events.push_back({ down, TYPING_KEYS[k], usb_of(TYPING_KEYS[k]), true, 0 });
+			events.push_back({ up, TYPING_KEYS[k], usb_of(TYPING_KEYS[k]), false, 0 });
+		}
+	}
+	std::stable_sort(events.begin(), events.end(), [](auto& a, auto& b) { return a.t_us < b.t_us; });
+	return events;
+}
+
+// キーの状態変化を最初に反映したレポートの送信完了時刻までを遅延とする
+std::vector<uint64_t>
+match_latencies(const std::vector<KeyEvent>& events, const std::vector<sim::Report>& reports, size_t& unmatched) {
+	std::vector<uint64_t> samples;
+	samples.reserve(events.size());
+	unmatched = 0;
+	size_t first = 0;
+	for (auto& ev : events) {
+		while (first < reports.size() && reports[first].queued_us < ev.last_byte_us) {
+			first++;
+		}
+		bool found = false;
+		for (size_t i = first; i < reports.size(); i++) {
+			auto& r = reports[i];
+			if ((r.report_id != ax2usb::AX2USB::REPORT_ID_KBD && r.report_id != ax2usb::AX2USB::REPORT_ID_NKRO) ||
+			    r.sent_us == UINT64_MAX) {
+				continue;
+			}
+			if (sim::report_has_key(r, ev.usb) == ev.make_break) {
+				samples.push_back(r.sent_us - ev.last_byte_us);
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			unmatched++;
+		}
+	}
+	return samples;
+}
+
+ax2usb::AX2USB a2u;
+
+class StdoutPrint : public Print {
+ public:
+	size_t write(uint8_t c) override { return c == '\r' || fputc(c, stdout) != EOF; }
+};
+
+void
+run_loop_until(uint64_t t_us, uint32_t loop_us, uint64_t& loops) {
+	while (sim::now_us() < t_us) {
+		a2u.loop();
+		sim::advance_us(loop_us);
+		loops++;
+	}
+}
+
+void
+print_duty(uint64_t elapsed_us, uint64_t loops) {
+	auto ws = a2u.wake_stats();
+	printf("cpu duty: %.3f%% (slept %llu us in %u sleeps, %llu loop iterations)\n",
+	       100.0 * static_cast<double>(elapsed_us - ws.sleep_us) / elapsed_us, static_cast<unsigned long long>(ws.sleep_us), ws.sleeps,
+	       static_cast<unsigned long long>(loops));
+}
+
+void
+print_ps2_errors(const ax2usb::AX2USB& a) {
+	auto e = a.ps2_errors();
+	printf("ps2 errors: overrun %u, self test %u, resend %u, ack timeout %u (led %u), prefix timeout %u, resync %u, unexpected %u (set 3 unmapped %u)\n",
+	       unsigned(e.overrun), unsigned(e.self_test), unsigned(e.resend), unsigned(e.ack_timeout), unsigned(e.led_timeout),
+	       unsigned(e.prefix_timeout), unsigned(e.resync), unsigned(e.unexpected),
+	       unsigned(e.set3_unmapped));
+}
+
+void
+print_boot(const ax2usb::AX2USB& a) {
+	auto b = a.boot_times();
+	printf("boot: keyboard ready %u us, usb mounted %u us, first key %u us\n", unsigned(b.ps2_ready_us), unsigned(b.usb_mounted_us),
+	       unsigned(b.first_key_us));
+}
+
+// USB サスペンド中にキーを押し、最初のバイト到着から remoteWakeup() までの時間を計測する
+int
+run_wake_trials(const Options& opt, sim::Keyboard& kbd, uint64_t& loops) {
+	std::mt19937 rng(opt.seed);
+	std::uniform_int_distribution<uint32_t> idle(50000, 1500000);
+	std::vector<uint64_t> samples;
+	size_t missed = 0;
+
+	for (uint32_t i = 0; i < opt.wake_trials; i++) {
+		sim::usb_set_suspended(true);
+		uint64_t first_byte = kbd.press(0x1c, sim::now_us() + idle(rng));
+		run_loop_until(first_byte + 1000000, opt.loop_us, loops);
+		if (sim::usb_remote_wakeup_us() >= first_byte && sim::usb_remote_wakeup_us() != UINT64_MAX) {
+			samples.push_back(sim::usb_remote_wakeup_us() - first_byte);
+		} else {
+			missed++;
+		}
+		run_loop_until(kbd.release(0x1c) + 10000, opt.loop_us, loops);
+	}
+	auto stats = sim::summarize(samples);
+	printf("wake trials: %u, missed: %zu\n", opt.wake_trials, missed);
+	printf("byte-to-remoteWakeup latency [us]: min %llu avg %.1f p50 %llu p99 %llu max %llu\n",
+	       static_cast<unsigned long long>(stats.min), stats.avg, static_cast<unsigned long long>(stats.p50),
+	       static_cast<unsigned long long>(stats.p99), static_cast<unsigned long long>(stats.max));
+	print_duty(sim::now_us(), loops);
+	return missed == 0 ? 0 : 2;
+}
+
+// キーストーム: ROLLOVER 個のキーを押したまま、次のキーを押すたびに一番古いキーを離す
+constexpr size_t STORM_ROLLOVER = 4;
+// rx(16バイト)を溢れさせないよう、PS/2 側の処理待ちがこれ未満のときだけ次のキーを送る
+constexpr size_t STORM_BACKLOG_MAX = 8;
+
+size_t
+storm_bytes(uint16_t key, bool make_break, uint8_t* buf) {
+	size_t len = 0;
+	if (key & sim::Keyboard::E0) {
+		buf[len++] = 0xe0;
+	}
+	if (!make_break) {
+		buf[len++] = 0xf0;
+	}
+	buf[len++] = key & 0xff;
+	return len;
+}
+
+class StormFeeder {
+ public:
+	size_t events = 0;
+
+	// 受信割り込み相当としてバイトを届ける。送れる状態でなければ何もしない
+	void feed(bool stopping) {
+		if (a2u.ps2_backlog() >= STORM_BACKLOG_MAX) {
+			return;
+		}
+		uint8_t buf[3];
+		size_t len;
+		if (!stopping) {
+			if (next >= STORM_ROLLOVER) {
+				len = storm_bytes(key_at(next - STORM_ROLLOVER), false, buf);
+				send(buf, len);
+			}
+			len = storm_bytes(key_at(next), true, buf);
+			send(buf, len);
+			next++;
+		} else if (released < next) {
+			// 押したままのキーをすべて離す
+			released = std::max(released, next >= STORM_ROLLOVER ? next - STORM_ROLLOVER : 0);
+			len = storm_bytes(key_at(released++), false, buf);
+			send(buf, len);
+		}
+	}
+	bool done() const { return released >= next; }
+
+ private:
+	size_t next = 0;
+	size_t released = 0;
+
+	static uint16_t key_at(size_t i) { return TYPING_KEYS[i % std::size(TYPING_KEYS)]; }
+	void send(const uint8_t* buf, size_t len) {
+		for (size_t i = 0; i < len; i++) {
+			libps2::PS2::sim_port(0)->sim_receive(buf[i]);
+		}
+		events++;
+	}
+};
+
+// 実時間で storm_seconds 秒間キーストームを流す。2コア構成では PS/2 側と USB 側を別スレッドで回す
+int
+run_storm(const Options& opt) {
+	a2u.set_coalescing(opt.coalesce);
+	if (opt.single_core ? !a2u.begin(9, 10) : !a2u.begin_split()) {
+		fprintf(stderr, "Failed to init ax2usb\n");
+		return 1;
+	}
+	if (!opt.single_core) {
+		a2u.begin_ps2(9, 10);
+	}
+	sim::set_realtime(true);
+	StormFeeder feeder;
+	const auto wall_start = std::chrono::steady_clock::now();
+	const auto feed_until = wall_start + std::chrono::seconds(opt.storm_seconds);
+	auto feeding = [&]() { return std::chrono::steady_clock::now() < feed_until; };
+	auto usb_idle = []() { return sim::next_event_us() == UINT64_MAX; };
+
+	if (opt.single_core) {
+		for (;;) {
+			bool stopping = !feeding();
+			if (stopping && feeder.done() && a2u.ps2_backlog() == 0 && usb_idle()) {
+				break;
+			}
+			feeder.feed(stopping);
+			a2u.poll_ps2();
+			sim::advance_us(0);
+		}
+	} else {
+		std::atomic<bool> ps2_done{ false };
+		std::thread ps2_side([&]() {
+			ax2usb::set_core_num(1);
+			for (;;) {
+				bool stopping = !feeding();
+				if (stopping && feeder.done() && a2u.ps2_backlog() == 0) {
+					break;
+				}
+				feeder.feed(stopping);
+				if (!a2u.poll_ps2()) {
+					std::this_thread::yield();
+				}
+			}
+			ps2_done.store(true, std::memory_order_release);
+		});
+		// USB 側(core 0)はこのスレッド。送信完了などのイベントもここで実行する
+		for (;;) {
+			bool finished = ps2_done.load(std::memory_order_acquire);
+			bool worked = a2u.poll_usb();
+			sim::advance_us(0);
+			if (finished && !worked && usb_idle()) {
+				break;
+			}
+			if (!worked) {
+				std::this_thread::yield();
+			}
+		}
+		ps2_side.join();
+	}
+	auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+	auto& reports = sim::usb_reports();
+	bool released = !reports.empty();
+	for (auto key : TYPING_KEYS) {
+		released = released && !sim::report_has_key(reports.back(), usb_of(key));
+	}
+	printf("%s, %s: %zu key events in %.2f s wall (%.0f events/s)\n", opt.single_core ? "single core" : "two threads",
+	       opt.coalesce ? "coalesced" : "not coalesced", feeder.events, wall, feeder.events / wall);
+	printf("usb reports: %zu (%.2f events per report), all keys released: %s\n", reports.size(),
+	       static_cast<double>(feeder.events) / reports.size(), released ? "yes" : "NO");
+	print_ps2_errors(a2u);
+	printf("firmware-side latency (oldest key in each report):\n");
+	StdoutPrint out;
+	a2u.print_latency(out);
+	return released ? 0 : 2;
+}
+
+// ファイル(- なら標準入力)のバイナリログを文字列に戻して表示する
+int
+decode_log(const char* path) {
+	FILE* in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if (!in) {
+		perror(path);
+		return 1;
+	}
+	ax2usb::log::Decoder decoder([](const std::string& line) {
+		puts(line.c_str());
+		fflush(stdout);
+	});
+	for (int c; (c = fgetc(in)) != EOF;) {
+		decoder.feed(c);
+	}
+	decoder.flush();
+	return 0;
+}
+
+bool
+read_file(const char* path, std::vector<uint8_t>& data) {
+	FILE* in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return false;
+	}
+	for (int c; (c = fgetc(in)) != EOF;) {
+		data.push_back(c);
+	}
+	fclose(in);
+	return true;
+}
+
+bool
+write_file(const char* path, const std::vector<uint8_t>& data) {
+	FILE* out = fopen(path, "wb");
+	if (!out || fwrite(data.data(), 1, data.size(), out) != data.size() || fclose(out) != 0) {
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
+std::vector<uint8_t>
+join_lines(const std::vector<std::string>& lines) {
+	std::vector<uint8_t> data;
+	for (auto& line : lines) {
+		data.insert(data.end(), line.begin(), line.end());
+		data.push_back('\n');
+	}
+	return data;
+}
+
+std::vector<std::string>
+split_lines(const std::vector<uint8_t>& data) {
+	std::vector<std::string> lines;
+	std::string line;
+	for (auto c : data) {
+		if (c == '\n') {
+			lines.push_back(line);
+			line.clear();
+		} else if (c != '\r') {
+			line += static_cast<char>(c);
+		}
+	}
+	if (!line.empty()) {
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+// 実機のバイナリログ(PS2_RECEIVED・USB_LED)をトレースにする
+int
+log_to_trace(const char* log_path, const char* trace_path) {
+	std::vector<uint8_t> data;
+	if (!read_file(log_path, data)) {
+		return 1;
+	}
+	ax2usb::trace::LogConverter converter;
+	ax2usb::log::Decoder decoder([](const std::string&) {}, [&converter](auto& rec) { converter.add(rec); });
+	for (auto b : data) {
+		decoder.feed(b);
+	}
+	auto encoded = ax2usb::trace::encode(converter.records());
+	if (!write_file(trace_path, encoded)) {
+		return 1;
+	}
+	printf("%zu records, %zu bytes\n", converter.records().size(), encoded.size());
+	return 0;
+}
+
+// トレース(先頭が "AXT")かシナリオを再生し、USB レポートの列を表示するか golden と比べる
+int
+run_replay(const Options& opt) {
+	std::vector<uint8_t> data;
+	if (!read_file(opt.replay, data)) {
+		return 1;
+	}
+	std::vector<ax2usb::trace::record_t> records;
+	bool is_trace = ax2usb::trace::is_trace(data.data(), data.size());
+	if (is_trace && !ax2usb::trace::decode(data.data(), data.size(), records)) {
+		fprintf(stderr, "%s: broken trace\n", opt.replay);
+		return 1;
+	}
+	std::string error;
+	if (!is_trace && !ax2usb::replay::parse_scenario(std::string(data.begin(), data.end()), records, error)) {
+		fprintf(stderr, "%s: %s\n", opt.replay, error.c_str());
+		return 1;
+	}
+	// ファームウェアが受信したバイトをログから取り出す(実機で記録するのと同じ経路)
+	ax2usb::trace::LogConverter recorder;
+	ax2usb::log::Decoder log_records([](const std::string&) {}, [&recorder](auto& rec) { recorder.add(rec); });
+	if (opt.record_trace) {
+		sim::set_serial_sink([&log_records](uint8_t b) { log_records.feed(b); });
+	}
+	ax2usb::replay::result_t result;
+	size_t events = 0;
+	double wall = 0;
+	uint64_t allocations = 0;
+	for (uint32_t i = 0; i < opt.repeat; i++) {
+		result = ax2usb::replay::run(records, !is_trace);
+		events += result.events;
+		wall += result.wall_s;
+		allocations += result.allocations;
+		sim::set_serial_sink(nullptr);
+	}
+	if (opt.record_trace && !write_file(opt.record_trace, ax2usb::trace::encode(recorder.records()))) {
+		return 1;
+	}
+	if (opt.write_golden && !write_file(opt.write_golden, join_lines(result.reports))) {
+		return 1;
+	}
+	bool print_reports = !opt.golden && !opt.write_golden && !opt.record_trace;
+	if (print_reports) {
+		for (auto& line : result.reports) {
+			puts(line.c_str());
+		}
+	}
+	FILE* summary = print_reports ? stderr : stdout;
+	fprintf(summary, "replayed %zu events in %.3f s wall (%.0f events/s), %zu usb reports\n", events, wall,
+	        wall > 0 ? events / wall : 0.0, result.reports.size());
+	if (allocations) {
+		fprintf(summary, "firmware heap allocations during replay: %llu\n", static_cast<unsigned long long>(allocations));
+		return 3;
+	}
+	if (!opt.golden) {
+		return 0;
+	}
+	std::vector<uint8_t> golden;
+	if (!read_file(opt.golden, golden)) {
+		return 1;
+	}
+	auto d = ax2usb::replay::diff(split_lines(golden), result.reports);
+	for (auto& line : d) {
+		puts(line.c_str());
+	}
+	printf("golden %s: %s\n", opt.golden, d.empty() ? "match" : "DIFFERENT");
+	return d.empty() ? 0 : 2;
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv) {
+	Options opt = parse_options(argc, argv);
+	if (opt.decode_log) {
+		return decode_log(opt.decode_log);
+	}
+	if (opt.log_to_trace) {
+		return log_to_trace(opt.log_to_trace, opt.record_trace);
+	}
+	if (opt.bench) {
+		StdoutPrint out;
+		ax2usb::bench::run_all(out);
+		return 0;
+	}
+	sim::reset();
+	ax2usb::log::set_output(&Serial1);
+	ax2usb::log::Decoder log_decoder([](const std::string& line) { fprintf(stderr, "%s\n", line.c_str()); });
+	if (opt.verbose) {
+		sim::set_serial_sink([&log_decoder](uint8_t b) { log_decoder.feed(b); });
+	}
+	if (opt.storm_seconds) {
+		return run_storm(opt);
+	}
+	if (opt.replay) {
+		return run_replay(opt);
+	}
+	sim::Keyboard kbd;
+	kbd.set3_capable = opt.set3;
+
+	a2u.set_coalescing(opt.coalesce);
+	a2u.set_prefer_set3(opt.set3);
+	if (!a2u.set_poll_interval(opt.poll_ms)) {
+		fprintf(stderr, "poll interval must be 1, 2, 4 or 8 ms\n");
+		return 1;
+	}
+	a2u.set_report_timing(opt.timing);
+	sim::usb_set_poll_offset_us(opt.poll_offset_us);
+	sim::usb_set_sof_delay_us(opt.sof_delay_us);
+	if (opt.enumerate_ms) {
+		// ホストが列挙を終えるまでの時間(この間もキーボードの初期化を進める)
+		sim::usb_set_mounted(false);
+		sim::schedule_at(uint64_t{ opt.enumerate_ms } * 1000, []() { sim::usb_set_mounted(true); });
+	}
+	if (!a2u.begin(9, 10)) {
+		fprintf(stderr, "Failed to init ax2usb\n");
+		return 1;
+	}
+
+	// 初回 ECHO と LED 設定が終わるまで待ってから打鍵を始める
+	constexpr uint64_t WARMUP_US = 1000000;
+	if (opt.wake_trials) {
+		uint64_t loops = 0;
+		run_loop_until(WARMUP_US, opt.loop_us, loops);
+		return run_wake_trials(opt, kbd, loops);
+	}
+	const uint64_t end_us = WARMUP_US + uint64_t{ opt.seconds } * 1000000;
+	uint64_t loops = 0;
+	run_loop_until(WARMUP_US - 100000, opt.loop_us, loops);
+	const size_t warmup_bytes = kbd.bytes_sent();
+	auto events = generate_typing(opt, WARMUP_US, end_us);
+
+	auto wall_start = std::chrono::steady_clock::now();
+	size_t next = 0;
+	while (sim::now_us() < end_us + WARMUP_US) {
+		// 打鍵は少し先の分まで PS/2 送信予約しておく
+		while (next < events.size() && events[next].t_us <= sim::now_us() + 100000) {
+			auto& ev = events[next++];
+			ev.last_byte_us = ev.make_break ? kbd.press(ev.key, ev.t_us) : kbd.release(ev.key, ev.t_us);
+		}
+		a2u.loop();
+		sim::advance_us(opt.loop_us);
+		loops++;
+	}
+	auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+	size_t unmatched;
+	auto stats = sim::summarize(match_latencies(events, sim::usb_reports(), unmatched));
+	printf("simulated %u s in %.2f s wall\n", opt.seconds, wall);
+	printf("key events: %zu, usb reports: %zu (%.2f per event), unmatched: %zu\n", events.size(), sim::usb_reports().size(),
+	       static_cast<double>(sim::usb_reports().size()) / events.size(), unmatched);
+	printf("scan code set %u: %zu ps2 bytes (%.2f per event)\n", a2u.scan_code_set(), kbd.bytes_sent() - warmup_bytes,
+	       static_cast<double>(kbd.bytes_sent() - warmup_bytes) / events.size());
+	print_ps2_errors(a2u);
+	print_boot(a2u);
+	printf("byte-to-report latency [us]: min %llu avg %.1f p50 %llu p99 %llu max %llu\n",
+	       static_cast<unsigned long long>(stats.min), stats.avg, static_cast<unsigned long long>(stats.p50),
+	       static_cast<unsigned long long>(stats.p99), static_cast<unsigned long long>(stats.max));
+	printf("firmware-side latency (oldest key in each report):\n");
+	StdoutPrint out;
+	a2u.print_latency(out);
+	print_duty(sim::now_us(), loops);
+	return unmatched == 0 ? 0 : 2;
+}
+#endif
@@ -0,0 +1,78 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <iterator>
+
+namespace ax2usb::trace {
+
+std::vector<uint8_t>
+encode(const std::vector<record_t>& records) {
+	std::vector<uint8_t> out(std::begin(MAGIC), std::end(MAGIC));
+	uint64_t prev = 0;
+	for (auto& rec : records) {
+		// 時刻が戻っている記録は同時刻にする
+		uint64_t delta = rec.t_us > prev ? rec.t_us - prev : 0;
+		prev = std::max(prev, rec.t_us);
+		uint64_t v = delta << 1 | static_cast<uint64_t>(rec.kind);
+		for (; v >= 0x80; v >>= 7) {
+			out.push_back(static_cast<uint8_t>(v) | 0x80);
+		}
+		out.push_back(static_cast<uint8_t>(v));
+		out.push_back(rec.value);
+	}
+	return out;
+}
+
+bool
+is_trace(const uint8_t* data, size_t len) {
+	return len >= std::size(MAGIC) && std::equal(std::begin(MAGIC), std::end(MAGIC), data);
+}
+
+bool
+decode(const uint8_t* data, size_t len, std::vector<record_t>& records) {
+	if (!is_trace(data, len)) {
+		return false;
+	}
+	uint64_t t = 0;
+	for (size_t i = std::size(MAGIC); i < len;) {
+		uint64_t v = 0;
+		for (int shift = 0;; shift += 7) {
+			if (i >= len || shift > 63) {
+				return false;
+			}
+			uint8_t b = data[i++];
+			v |= uint64_t{ b & 0x7fu } << shift;
+			if (!(b & 0x80)) {
+				break;
+			}
+		}
+		if (i >= len) {
+			return false;
+		}
+		t += v >> 1;
+		records.push_back({ t, static_cast<kind_t>(v & 1), data[i++] });
+	}
+	return true;
+}
+
+void
+LogConverter::add(const log::record_t& rec) {
+	kind_t kind;
+	if (rec.id == log::event_t::PS2_RECEIVED) {
+		kind = kind_t::ps2;
+	} else if (rec.id == log::event_t::USB_LED) {
+		kind = kind_t::led;
+	} else {
+		return;
+	}
+	// 時刻が戻った記録(リングの間で少し前後したもの)は前の記録と同時刻にする
+	if (recs.empty()) {
+		t_us = rec.t_us;
+		last_us = rec.t_us;
+	} else if (int32_t delta = rec.t_us - last_us; delta > 0) {
+		t_us += delta;
+		last_us = rec.t_us;
+	}
+	recs.push_back({ t_us, kind, static_cast<uint8_t>(rec.args[0]) });
+}
+
+}  // namespace ax2usb::trace
@@ -0,0 +1,60 @@
+#pragma once
+// PS/2 セッションのトレース(受信した PS/2 バイトとホストからの LED 出力レポート)
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "log.hpp"
+
+namespace ax2usb::trace {
+
+/**
+ * @brief トレースの記録の種類
+ */
+enum class kind_t : uint8_t {
+	ps2,  // ファームウェアが受信した PS/2 バイト(キーボードの応答を含む)
+	led,  // ホストからの LED 出力レポート(USB の LED ビット)
+};
+
+struct record_t {
+	uint64_t t_us;  // 起動からの時刻
+	kind_t kind;
+	uint8_t value;
+};
+
+/**
+ * ファイル形式: "AXT" 1(版), 記録の列。
+ * 記録は LEB128 の可変長整数 (前の記録からの時間[us] << 1 | kind) と値の1バイト。
+ * キー入力のバイト間隔(約1ms)なら1記録3バイトになる。
+ */
+static inline constexpr uint8_t MAGIC[] = { 'A', 'X', 'T', 1 };
+
+std::vector<uint8_t> encode(const std::vector<record_t>& records);
+/**
+ * @brief ファイルの内容を記録の列に戻す
+ *
+ * @return false 形式が違うか途中で切れている
+ */
+bool decode(const uint8_t* data, size_t len, std::vector<record_t>& records);
+/**
+ * @brief トレースのファイルか(先頭が MAGIC)
+ */
+bool is_trace(const uint8_t* data, size_t len);
+
+/**
+ * @brief 実機のバイナリログ(`--decode-log` と同じ入力)からトレースを取り出す
+ *
+ * PS2_RECEIVED(受信割り込みの時刻で記録される)と USB_LED を記録にする。ログの時刻(32ビット)の桁あふれは
+ * 前の記録からの差で戻す。記録を取りこぼさないように、デバッグログ(AX2USB_LOG_LEVEL=4)でビルドすること。
+ */
+class LogConverter {
+ public:
+	void add(const log::record_t& rec);
+	const std::vector<record_t>& records() const { return recs; }
+
+ private:
+	std::vector<record_t> recs;
+	uint64_t t_us = 0;
+	uint32_t last_us = 0;
+};
+
+}  // namespace ax2usb::trace
@@ -0,0 +1,89 @@
+#include "tap_hold.hpp"
+
+namespace ax2usb {
+
+void
+TapHold::begin(keymap::key_t key, const keymap::action_t& a, uint32_t t_us) {
+	held_key = key;
+	act = a;
+	pressed_us = t_us;
+	seen = 0;
+	pending = true;
+}
+
+bool
+TapHold::push(const key_event_t& ev) {
+	if (full()) {
+		return false;
+	}
+	buf[n++] = ev;
+	return true;
+}
+
+TapHold::decision_t
+TapHold::decide() {
+	if (!pending) {
+		return decision_t::undecided;
+	}
+	while (seen < n) {
+		const auto& ev = buf[seen];
+		if (ev.rx_us - pressed_us >= cfg.timeout_us) {
+			// 期限より後のイベント。タイマーが先に判定したのと同じ結果にする
+			return finish(decision_t::hold);
+		}
+		if (ev.key == held_key) {
+			bool released = !ev.make_break || ev.tap;
+			remove(seen);
+			if (released) {
+				return finish(decision_t::tap);
+			}
+			continue;
+		}
+		seen++;
+		if (ev.key == key_event_t::RELEASE_ALL) {
+			// すべて離す前に溜めたイベントを処理させる
+			return finish(decision_t::hold);
+		}
+		if (ev.tap || (ev.make_break ? cfg.hold_on_other_press : pressed_before(ev.key, seen - 1))) {
+			return finish(decision_t::hold);
+		}
+	}
+	return full() ? finish(decision_t::hold) : decision_t::undecided;
+}
+
+TapHold::decision_t
+TapHold::expire(uint32_t now_us) {
+	if (pending && now_us - pressed_us >= cfg.timeout_us) {
+		return finish(decision_t::hold);
+	}
+	return decision_t::undecided;
+}
+
+bool
+TapHold::pop(key_event_t& ev) {
+	if (pending || n == 0) {
+		return false;
+	}
+	ev = buf[0];
+	remove(0);
+	return true;
+}
+
+void
+TapHold::remove(size_t i) {
+	for (n--; i < n; i++) {
+		buf[i] = buf[i + 1];
+	}
+}
+
+bool
+TapHold::pressed_before(keymap::key_t key, size_t end) const {
+	for (size_t i = 0; i < end; i++) {
+		if (buf[i].key == key && buf[i].make_break) {
+			return true;
+		}
+	}
+	return false;
+}
+
+}  // namespace ax2usb
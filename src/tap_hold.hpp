@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include "key_event.hpp"
+#include "keymap.hpp"
+
+namespace ax2usb {
+
+/**
+ * @brief タップ・ホールドキー(keymap::kind_t::tap_hold)の判定
+ *
+ * キーを押してから判定が決まるまでのキーイベントを溜めておき、決まったら到着順に取り出す。
+ * 次のいずれかでホールド(レイヤー有効)と決め、それより先にキーを離せばタップと決める。
+ * - 押してから timeout_us 経過した(期限はタイマーで判定し、次のバイトの到着を待たない)
+ * - 押している間に別のキーを押して離した(permissive hold。make だけを送るキーの tap も含む)
+ * - hold_on_other_press なら、押している間に別のキーを押した
+ * - 溜めておけるイベントが満杯になった、またはキーボードとの同期が崩れた(key_event_t::RELEASE_ALL)
+ * 経過時間はイベントの受信時刻で比べるので、処理が遅れても判定は変わらない。
+ */
+class TapHold {
+ public:
+	static inline constexpr size_t DEPTH = 8;
+	static inline constexpr uint32_t DEFAULT_TIMEOUT_US = 200000;
+
+	enum class decision_t : uint8_t { undecided, tap, hold };
+	struct config_t {
+		uint32_t timeout_us = DEFAULT_TIMEOUT_US;
+		bool hold_on_other_press = false;
+	};
+
+	void configure(const config_t& c) { cfg = c; }
+	const config_t& config() const { return cfg; }
+	/**
+	 * @brief タップ・ホールドキーが押された。判定を始める
+	 *
+	 * 溜めたイベントを取り出している途中なら、残りのイベントはこのキーの判定に使う。
+	 */
+	void begin(keymap::key_t key, const keymap::action_t& act, uint32_t pressed_us);
+	/**
+	 * @brief 判定中か
+	 */
+	bool undecided() const { return pending; }
+	/**
+	 * @brief 判定中か、取り出していないイベントがある(新しいイベントは push() して後ろに並べること)
+	 */
+	bool active() const { return pending || n > 0; }
+	bool full() const { return n == DEPTH; }
+	keymap::key_t key() const { return held_key; }
+	const keymap::action_t& action() const { return act; }
+	/**
+	 * @brief イベントを溜める
+	 *
+	 * @return false 満杯
+	 */
+	bool push(const key_event_t& ev);
+	/**
+	 * @brief 溜めたイベントを調べて判定する
+	 *
+	 * 判定中のキーのタイプマティック(make の繰り返し)と、タップと決めたときのキーを離したイベントは取り除く。
+	 */
+	decision_t decide();
+	/**
+	 * @brief 期限が過ぎていればホールドと決める
+	 */
+	decision_t expire(uint32_t now_us);
+	/**
+	 * @brief 判定が決まった後、溜めたイベントを到着順に取り出す
+	 */
+	bool pop(key_event_t& ev);
+
+ private:
+	config_t cfg;
+	key_event_t buf[DEPTH] = {};
+	uint8_t n = 0;
+	uint8_t seen = 0;  // decide() で調べ終えたイベントの数
+	bool pending = false;
+	keymap::key_t held_key = 0;
+	keymap::action_t act = keymap::NONE;
+	uint32_t pressed_us = 0;
+
+	decision_t finish(decision_t d) {
+		pending = false;
+		return d;
+	}
+	void remove(size_t i);
+	/**
+	 * @brief buf[0, end) でキーを押したか
+	 */
+	bool pressed_before(keymap::key_t key, size_t end) const;
+};
+
+}  // namespace ax2usb
@@ -0,0 +1,72 @@
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+#include <cstdint>
+#ifdef ARDUINO_ARCH_RP2040
+#include <hardware/sync.h>
+#include <pico/time.h>
+#elif defined(AX2USB_NATIVE)
+#include <sim.h>
+#endif
+
+namespace ax2usb {
+
+/**
+ * @brief メインループを起こすイベント
+ *
+ * 受信割り込みやUSBのコールバックから signal() し、メインループは仕事がなければ sleep() で眠る。
+ * RP2040 では WFE で眠り、SEV・割り込み・タイムアウトのいずれかで起きる。
+ */
+class WakeEvent {
+ public:
+	struct stats_t {
+		uint64_t sleep_us;  // 眠っていた時間の合計
+		uint32_t sleeps;    // 眠った回数
+		uint32_t signals;   // signal() された回数
+	};
+
+	/**
+	 * @brief メインループを起こす(割り込みハンドラから呼んでよい)
+	 */
+	void signal() {
+		pending.store(true, std::memory_order_release);
+		signals.store(signals.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+#ifdef ARDUINO_ARCH_RP2040
+		__sev();
+#endif
+	}
+	/**
+	 * @brief signal() されるか割り込みが入るか timeout_us 経過するまで眠る
+	 *
+	 * 割り込みで起きた場合も戻るので、呼び出し側は状態を確認し直すこと。
+	 */
+	void sleep(uint32_t timeout_us) {
+		// RMW 命令のない Cortex-M0+ 向けに load/store のみで扱う。
+		// 確認後に signal() されても SEV によって WFE はすぐに戻る
+		if (pending.load(std::memory_order_acquire)) {
+			pending.store(false, std::memory_order_relaxed);
+			return;
+		}
+		uint32_t start = micros();
+#ifdef ARDUINO_ARCH_RP2040
+		best_effort_wfe_or_timeout(make_timeout_time_us(timeout_us));
+#elif defined(AX2USB_NATIVE)
+		sim::wait_for_event(timeout_us);
+#endif
+		pending.store(false, std::memory_order_relaxed);
+		st.sleep_us += static_cast<uint32_t>(micros() - start);
+		st.sleeps++;
+	}
+	stats_t stats() const {
+		stats_t s = st;
+		s.signals = signals.load(std::memory_order_relaxed);
+		return s;
+	}
+
+ private:
+	std::atomic<bool> pending{ false };
+	std::atomic<uint32_t> signals{ 0 };
+	stats_t st{};
+};
+
+}  // namespace ax2usb
@@ -0,0 +1,88 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "deadlines.hpp"
+
+using ax2usb::Deadlines;
+
+enum class timer_id : uint8_t { a, b, c, count };
+
+void
+setUp(void) {}
+
+void
+tearDown(void) {}
+
+void
+test_arm_cancel() {
+	Deadlines<timer_id> d;
+	TEST_ASSERT_EQUAL(UINT32_MAX, d.remaining_us(0));
+	d.arm(timer_id::a, 1000);
+	d.arm(timer_id::b, 300);
+	TEST_ASSERT_TRUE(d.armed(timer_id::a));
+	TEST_ASSERT_FALSE(d.armed(timer_id::c));
+	TEST_ASSERT_EQUAL(200, d.remaining_us(100));
+	d.cancel(timer_id::b);
+	TEST_ASSERT_FALSE(d.armed(timer_id::b));
+	TEST_ASSERT_EQUAL(900, d.remaining_us(100));
+	// 設定し直すと前の期限は消える
+	d.arm(timer_id::a, 2000);
+	TEST_ASSERT_EQUAL(1900, d.remaining_us(100));
+}
+
+void
+test_pop_expired() {
+	Deadlines<timer_id> d;
+	timer_id t;
+	d.arm(timer_id::a, 500);
+	d.arm(timer_id::c, 100);
+	TEST_ASSERT_FALSE(d.pop_expired(99, t));
+	TEST_ASSERT_TRUE(d.pop_expired(100, t));
+	TEST_ASSERT_EQUAL(timer_id::c, t);
+	TEST_ASSERT_FALSE(d.armed(timer_id::c));
+	TEST_ASSERT_EQUAL(0, d.remaining_us(600));
+	TEST_ASSERT_TRUE(d.pop_expired(600, t));
+	TEST_ASSERT_EQUAL(timer_id::a, t);
+	TEST_ASSERT_FALSE(d.pop_expired(600, t));
+	TEST_ASSERT_EQUAL(UINT32_MAX, d.remaining_us(600));
+}
+
+void
+test_wrap() {
+	// micros() の桁あふれをまたいでも期限の前後は正しい
+	Deadlines<timer_id> d;
+	timer_id t;
+	d.arm(timer_id::b, 50);
+	TEST_ASSERT_EQUAL(100, d.remaining_us(UINT32_MAX - 49));
+	TEST_ASSERT_FALSE(d.pop_expired(UINT32_MAX, t));
+	TEST_ASSERT_TRUE(d.pop_expired(50, t));
+	TEST_ASSERT_EQUAL(timer_id::b, t);
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_arm_cancel);
+	RUN_TEST(test_pop_expired);
+	RUN_TEST(test_wrap);
+	UNITY_END();
+}
+
+#ifndef ARDUINO
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
+#else
+void
+setup() {
+	Serial.begin(115200);
+	delay(3000);
+	run_tests();
+}
+
+void
+loop() {
+	delay(100);
+}
+#endif
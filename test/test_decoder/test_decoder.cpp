@@ -0,0 +1,575 @@
+#include <Adafruit_TinyUSB.h>
+#include <sim.h>
+#include <unity.h>
+#include <algorithm>
+#include <array>
+#include "ax2usb.h"
+#include "ax2usbmap.hpp"
+#include "set2_decoder.hpp"
+#include "set3_decoder.hpp"
+
+using namespace ax2usb;
+using set2::op_t;
+using set2::prefix_t;
+
+void
+setUp(void) {}
+
+void
+tearDown(void) {}
+
+namespace {
+
+struct effect_t {
+	op_t op;
+	uint8_t usb;
+	uint8_t mod;
+	bool make_break;
+};
+
+// 表駆動化する前の state_* 関数群と同じ振る舞いをする参照実装
+class Reference {
+ public:
+	prefix_t state = prefix_t::none;
+
+	effect_t feed(uint8_t code) {
+		if (code == ps2ind::OVERRUN || code == ps2ind::BAT_FAILED || code == ps2ind::DIAG_FAILURE ||
+		    code == ps2ind::RESEND) {
+			// どの状態でもエラーとして扱い、プレフィクスを捨てる
+			return done({ op_t::error, 0, 0, true });
+		}
+		switch (state) {
+			case prefix_t::none:
+				if (code == ps2ind::BREAK) {
+					return next(prefix_t::brk);
+				} else if (code == ps2ind::E0) {
+					return next(prefix_t::e0);
+				} else if (code == ps2ind::E1) {
+					return next(prefix_t::e1);
+				} else if (code == ps2ind::BAT_COMPLETED || code == ps2ind::ECHO_RESPONSE) {
+					return done({ op_t::led_sync, 0, 0, true });
+				}
+				return done(handle_code(code, true));
+			case prefix_t::brk:
+				return done(handle_code(code, false));
+			case prefix_t::e0:
+				if (code == ps2ind::BREAK) {
+					return next(prefix_t::e0_brk);
+				}
+				return done(handle_e0_code(code, true));
+			case prefix_t::e0_brk:
+				return done(handle_e0_code(code, false));
+			case prefix_t::e1:
+			case prefix_t::e1_brk:
+				if (state == prefix_t::e1 && code == ps2ind::BREAK) {
+					return next(prefix_t::e1_brk);
+				} else if (code == ps2key::L_CTRL) {
+					return next(prefix_t::e1);
+				} else if (code == ps2key::PAUSE) {
+					return done({ op_t::key, HID_KEY_PAUSE, 0, state == prefix_t::e1 });
+				}
+				return done({ op_t::unmapped, 0, 0, state == prefix_t::e1 });
+			default:
+				return done({ op_t::unmapped, 0, 0, true });
+		}
+	}
+
+ private:
+	effect_t next(prefix_t p) {
+		state = p;
+		return { op_t::none, 0, 0, false };
+	}
+	effect_t done(effect_t e) {
+		state = prefix_t::none;
+		return e;
+	}
+	static effect_t handle_code(uint8_t code, bool make_break) {
+		if (code == ps2key::ALT_PRINT_SCREEN) {
+			return { op_t::key, HID_KEY_PRINT_SCREEN, HID_KEY_ALT_LEFT, make_break };
+		} else if (code < std::size(map::ax2_usb) && map::ax2_usb[code]) {
+			return { op_t::key, map::ax2_usb[code], 0, make_break };
+		}
+		return { op_t::unmapped, 0, 0, make_break };
+	}
+	static effect_t handle_e0_code(uint8_t code, bool make_break) {
+		if (code == ps2key::L_SHIFT || code == ps2key::R_SHIFT) {
+			return { op_t::fake_shift, 0, 0, make_break };
+		} else if (code == ps2key::BREAK) {
+			return { op_t::key, HID_KEY_PAUSE, HID_KEY_CONTROL_LEFT, make_break };
+		}
+		// 線形探索
+		for (auto& ent : map::ax2e0_usb) {
+			if (ent.ps2 == code) {
+				return { op_t::key, ent.usb, 0, make_break };
+			}
+		}
+		return { op_t::unmapped, 0, 0, make_break };
+	}
+};
+
+// キーの位置を表駆動化する前の変換表で USB_HIDキーコードに戻す
+effect_t
+resolve(const set2::action_t& act) {
+	keymap::key_t key = act.key;
+	if (key == keymap::KEY_PAUSE) {
+		return { op_t::key, HID_KEY_PAUSE, 0, act.make_break };
+	} else if (key == keymap::key_id_e0(ps2key::BREAK)) {
+		return { op_t::key, HID_KEY_PAUSE, HID_KEY_CONTROL_LEFT, act.make_break };
+	} else if (key == keymap::key_id(ps2key::ALT_PRINT_SCREEN)) {
+		return { op_t::key, HID_KEY_PRINT_SCREEN, HID_KEY_ALT_LEFT, act.make_break };
+	} else if (key >= keymap::key_id_e0(0x10)) {
+		for (auto& ent : map::ax2e0_usb) {
+			if (keymap::key_id_e0(ent.ps2) == key) {
+				return { op_t::key, ent.usb, 0, act.make_break };
+			}
+		}
+	} else if (key < std::size(map::ax2_usb) && map::ax2_usb[key]) {
+		return { op_t::key, map::ax2_usb[key], 0, act.make_break };
+	}
+	return { op_t::unmapped, 0, 0, act.make_break };
+}
+
+bool
+same(const effect_t& ref, const set2::action_t& act) {
+	if (act.op == op_t::key) {
+		auto got = resolve(act);
+		return ref.op == got.op && ref.usb == got.usb && ref.mod == got.mod && ref.make_break == got.make_break;
+	}
+	if (ref.op != act.op) {
+		return false;
+	}
+	if (ref.op == op_t::none) {
+		return true;
+	}
+	return ref.make_break == act.make_break;
+}
+
+}  // namespace
+
+void
+test_every_transition() {
+	for (uint8_t p = 0; p < static_cast<uint8_t>(prefix_t::count); p++) {
+		for (int code = 0; code < 256; code++) {
+			Reference ref;
+			ref.state = static_cast<prefix_t>(p);
+			auto expected = ref.feed(code);
+			auto& act = set2::table[p][code];
+			TEST_ASSERT_TRUE_MESSAGE(same(expected, act), "action differs");
+			TEST_ASSERT_EQUAL_MESSAGE(static_cast<int>(ref.state), static_cast<int>(act.next), "next prefix differs");
+		}
+	}
+}
+
+void
+test_every_3byte_sequence() {
+	uint32_t mismatches = 0;
+	for (uint32_t seq = 0; seq < (1u << 24); seq++) {
+		Reference ref;
+		set2::Decoder dec;
+		for (int i = 0; i < 3; i++) {
+			uint8_t code = seq >> (8 * i);
+			if (!same(ref.feed(code), dec.feed(code)) || ref.state != dec.state()) {
+				mismatches++;
+			}
+		}
+	}
+	TEST_ASSERT_EQUAL(0, mismatches);
+}
+
+void
+test_key_ids_do_not_overlap() {
+	bool used[keymap::KEY_COUNT] = {};
+	for (auto p : { prefix_t::none, prefix_t::e0, prefix_t::e1 }) {
+		for (int code = 0; code < 256; code++) {
+			auto& act = set2::table[static_cast<size_t>(p)][code];
+			if (act.op != op_t::key) {
+				continue;
+			}
+			TEST_ASSERT_FALSE_MESSAGE(used[act.key], "key id reused");
+			used[act.key] = true;
+			// break も同じ位置
+			auto brk = p == prefix_t::none ? prefix_t::brk : p == prefix_t::e0 ? prefix_t::e0_brk : prefix_t::e1_brk;
+			TEST_ASSERT_EQUAL(act.key, set2::table[static_cast<size_t>(brk)][code].key);
+		}
+	}
+	for (auto& ent : map::ax2e0_usb) {
+		TEST_ASSERT_EQUAL(keymap::key_id_e0(ent.ps2), set2::table[static_cast<size_t>(prefix_t::e0)][ent.ps2].key);
+	}
+}
+
+void
+test_pause_break() {
+	set2::Decoder dec;
+	// Pause make: E1 14 77
+	TEST_ASSERT_TRUE(dec.feed(0xe1).op == op_t::none);
+	TEST_ASSERT_TRUE(dec.feed(0x14).op == op_t::none);
+	auto& make = dec.feed(0x77);
+	TEST_ASSERT_TRUE(make.op == op_t::key);
+	TEST_ASSERT_EQUAL(keymap::KEY_PAUSE, make.key);
+	TEST_ASSERT_TRUE(make.make_break);
+	// Pause break: E1 F0 14 F0 77
+	for (uint8_t code : { 0xe1, 0xf0, 0x14, 0xf0 }) {
+		TEST_ASSERT_TRUE(dec.feed(code).op == op_t::none);
+	}
+	auto& brk = dec.feed(0x77);
+	TEST_ASSERT_TRUE(brk.op == op_t::key);
+	TEST_ASSERT_EQUAL(keymap::KEY_PAUSE, brk.key);
+	TEST_ASSERT_FALSE(brk.make_break);
+	TEST_ASSERT_TRUE(dec.state() == prefix_t::none);
+
+	// Ctrl+Pause(Break): E0 7E / E0 F0 7E
+	dec.feed(0xe0);
+	auto& ctrl_brk = dec.feed(0x7e);
+	TEST_ASSERT_TRUE(ctrl_brk.op == op_t::key);
+	TEST_ASSERT_EQUAL(keymap::key_id_e0(ps2key::BREAK), ctrl_brk.key);
+	dec.feed(0xe0);
+	dec.feed(0xf0);
+	TEST_ASSERT_FALSE(dec.feed(0x7e).make_break);
+}
+
+void
+test_alt_print_screen_and_fake_shift() {
+	set2::Decoder dec;
+	auto& prt = dec.feed(ps2key::ALT_PRINT_SCREEN);
+	TEST_ASSERT_TRUE(prt.op == op_t::key);
+	TEST_ASSERT_EQUAL(keymap::key_id(ps2key::ALT_PRINT_SCREEN), prt.key);
+
+	// PrintScreen: E0 12 E0 7C
+	dec.feed(0xe0);
+	TEST_ASSERT_TRUE(dec.feed(0x12).op == op_t::fake_shift);
+	dec.feed(0xe0);
+	TEST_ASSERT_EQUAL(keymap::key_id_e0(0x7c), dec.feed(0x7c).key);
+	// E0 F0 59
+	dec.feed(0xe0);
+	dec.feed(0xf0);
+	TEST_ASSERT_TRUE(dec.feed(0x59).op == op_t::fake_shift);
+}
+
+// セット3のコードはセット2の同じキーと同じ位置になる
+void
+test_set3_matches_set2_keys() {
+	size_t mapped = 0;
+	for (int key = 0; key < 0x100; key++) {
+		uint16_t set2_key = key <= ps2key::ALT_PRINT_SCREEN ? key : sim::Keyboard::E0 | (key & 0x7f);
+		uint8_t code = sim::Keyboard::set3_code(set2_key);
+		if (code == 0) {
+			continue;
+		}
+		set3::Decoder dec;
+		auto& make = dec.feed(code);
+		TEST_ASSERT_TRUE(make.op == op_t::key);
+		TEST_ASSERT_EQUAL(key, make.key);
+		TEST_ASSERT_TRUE(dec.feed(ps2ind::BREAK).op == op_t::none);
+		auto& brk = dec.feed(code);
+		TEST_ASSERT_EQUAL(key, brk.key);
+		TEST_ASSERT_FALSE(brk.make_break);
+		mapped++;
+	}
+	// 変換表のキーはすべてシミュレータのキーボードにもある(Pause は別扱い)
+	size_t in_table = 0;
+	for (auto key : set3::code_key) {
+		in_table += key != 0 && key != keymap::KEY_PAUSE;
+	}
+	TEST_ASSERT_EQUAL(in_table, mapped);
+	// make だけを送らせる Pause は make で押して離す
+	set3::Decoder dec;
+	auto& pause = dec.feed(0x62);
+	TEST_ASSERT_TRUE(pause.op == op_t::key_tap);
+	TEST_ASSERT_EQUAL(keymap::KEY_PAUSE, pause.key);
+	TEST_ASSERT_TRUE(dec.feed(0xaa).op == op_t::led_sync);
+	TEST_ASSERT_TRUE(dec.feed(0x01).op == op_t::unmapped);
+	// バッファあふれは break の途中でもエラーとして扱う
+	dec.feed(ps2ind::BREAK);
+	TEST_ASSERT_TRUE(dec.feed(ps2ind::OVERRUN).op == op_t::error);
+	TEST_ASSERT_TRUE(dec.state() == prefix_t::none);
+}
+
+namespace {
+
+void
+run_until(ax2usb::AX2USB& a2u, uint64_t t_us) {
+	while (sim::now_us() < t_us) {
+		a2u.loop();
+		sim::advance_us(5);
+	}
+}
+
+bool
+saw_key(uint8_t usb) {
+	for (auto& r : sim::usb_reports()) {
+		if (sim::report_has_key(r, usb)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+}  // namespace
+
+void
+test_switch_to_set3() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	kbd.set3_capable = true;
+	a2u.set_prefer_set3(true);
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	TEST_ASSERT_EQUAL(3, kbd.code_set());
+	TEST_ASSERT_EQUAL(3, a2u.scan_code_set());
+
+	kbd.press(sim::Keyboard::E0 | 0x75, 1000000);
+	kbd.release(sim::Keyboard::E0 | 0x75);
+	kbd.send({ 0x62 });  // Pause(make のみ)
+	run_until(a2u, 1100000);
+	TEST_ASSERT_TRUE(saw_key(HID_KEY_ARROW_UP));
+	TEST_ASSERT_TRUE(saw_key(HID_KEY_PAUSE));
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_PAUSE));
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_ARROW_UP));
+	TEST_ASSERT_EQUAL(0, a2u.ps2_errors().set3_unmapped);
+
+	// コード表に無いキー(AXキーボード独自のキーなど)は捨てて、make を数える
+	size_t reports = sim::usb_reports().size();
+	kbd.send({ 0x53 });
+	kbd.send({ ps2ind::BREAK, 0x53 });
+	run_until(a2u, 1150000);
+	TEST_ASSERT_EQUAL(reports, sim::usb_reports().size());
+	TEST_ASSERT_EQUAL(1, a2u.ps2_errors().set3_unmapped);
+	TEST_ASSERT_EQUAL(2, a2u.ps2_errors().unexpected);
+
+	// キーボードのリセット後はセット2から切り替え直す
+	kbd.send({ 0xaa });
+	run_until(a2u, 1200000);
+	TEST_ASSERT_EQUAL(3, kbd.code_set());
+	TEST_ASSERT_EQUAL(3, a2u.scan_code_set());
+}
+
+void
+test_set3_refused_falls_back_to_set2() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	a2u.set_prefer_set3(true);
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	TEST_ASSERT_EQUAL(2, a2u.scan_code_set());
+	// 読み戻しで2が返ったので、セット2に戻すコマンドを送っている
+	auto& cmds = kbd.received_commands();
+	bool set2_selected = false;
+	for (size_t i = 0; i + 1 < cmds.size(); i++) {
+		set2_selected = set2_selected || (cmds[i] == ps2cmd::SELECT_CODE_SET && cmds[i + 1] == 0x02);
+	}
+	TEST_ASSERT_TRUE(set2_selected);
+	TEST_ASSERT_EQUAL(2, kbd.code_set());
+
+	kbd.press(sim::Keyboard::E0 | 0x75, 1000000);
+	run_until(a2u, kbd.release(sim::Keyboard::E0 | 0x75) + 10000);
+	TEST_ASSERT_TRUE(saw_key(HID_KEY_ARROW_UP));
+}
+
+void
+test_lost_prefix_resyncs() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	// E0 の後が届かなくても、次の A を E0 付きのコードとして読まない
+	kbd.send_at(1000000, std::array<uint8_t, 1>{ ps2ind::E0 }.data(), 1);
+	kbd.press(0x1c, 1100000);
+	run_until(a2u, kbd.release(0x1c) + 10000);
+	TEST_ASSERT_TRUE(saw_key(HID_KEY_A));
+	TEST_ASSERT_EQUAL(1, a2u.ps2_errors().prefix_timeout);
+	TEST_ASSERT_EQUAL(0, a2u.ps2_errors().resync);
+
+	// A の break の F0 の後が届かなければ、次のバイトを待たずにすべて離す
+	uint64_t pressed = kbd.press(0x1c, 1200000);
+	uint64_t lost = kbd.send_at(pressed + 100000, std::array<uint8_t, 1>{ ps2ind::BREAK }.data(), 1);
+	run_until(a2u, lost + 20000);
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_A));
+	TEST_ASSERT_TRUE(sim::usb_reports().back().queued_us < lost + 12000);
+	TEST_ASSERT_EQUAL(2, a2u.ps2_errors().prefix_timeout);
+	TEST_ASSERT_EQUAL(1, a2u.ps2_errors().resync);
+}
+
+void
+test_overrun_releases_all() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	kbd.press(0x12, 1000000);  // 左Shift
+	kbd.press(0x1c);
+	uint64_t t = kbd.send({ ps2ind::OVERRUN });
+	run_until(a2u, t + 10000);
+	auto& last = sim::usb_reports().back();
+	TEST_ASSERT_FALSE(sim::report_has_key(last, HID_KEY_A));
+	TEST_ASSERT_EQUAL(0, sim::report_modifier(last));
+	TEST_ASSERT_EQUAL(1, a2u.ps2_errors().overrun);
+	// 押し続けていたキーはタイプマティックの make で押し直される
+	kbd.press(0x1c);
+	run_until(a2u, sim::now_us() + 10000);
+	TEST_ASSERT_TRUE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_A));
+}
+
+void
+test_command_retry() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	// LED の値が化けて再送要求、次の MODE_IND は応答なし。どちらも送り直して数ミリ秒〜数十ミリ秒で反映する
+	kbd.garble_commands = 2;
+	sim::usb_host_set_led(ax2usb::AX2USB::REPORT_ID_KBD, 0x02);  // Caps Lock
+	run_until(a2u, 1050000);
+	TEST_ASSERT_EQUAL(0x04, kbd.leds());
+	TEST_ASSERT_EQUAL(2, a2u.ps2_errors().resend);
+
+	kbd.ignore_commands = 1;
+	sim::usb_host_set_led(ax2usb::AX2USB::REPORT_ID_KBD, 0x01);  // Num Lock
+	run_until(a2u, 1100000);
+	TEST_ASSERT_EQUAL(0x02, kbd.leds());
+	TEST_ASSERT_EQUAL(1, a2u.ps2_errors().ack_timeout);
+	TEST_ASSERT_EQUAL(1, a2u.ps2_errors().led_timeout);
+}
+
+void
+test_bat_failure_resets_keyboard() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	kbd.send({ ps2ind::BAT_FAILED });
+	run_until(a2u, 1500000);
+	auto& cmds = kbd.received_commands();
+	TEST_ASSERT_TRUE(std::find(cmds.begin(), cmds.end(), ps2cmd::RESET) != cmds.end());
+	TEST_ASSERT_EQUAL(1, a2u.ps2_errors().self_test);
+	// リセット後(BAT 完了)にタイプマティックを設定し直している
+	TEST_ASSERT_EQUAL(ps2cmd::SET_TYPEMATIC, cmds[cmds.size() - 4]);
+}
+
+void
+test_keys_during_led_update_are_kept() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	// LED のコマンドを受け取る前にキーボードが送っていたキーも、応答の間に届くキーも取りこぼさない
+	constexpr uint16_t keys[] = { 0x1c, 0x32, 0x21, 0x23, 0x24, 0x2b, 0x34, 0x33 };
+	uint64_t t = 1000000;
+	for (auto k : keys) {
+		kbd.press(k, t);
+		t = kbd.release(k);
+	}
+	run_until(a2u, 1002000);
+	// Caps Lock を3回切り替えても、送るのは最新の値(2回目以降はまとめる)
+	sim::usb_host_set_led(ax2usb::AX2USB::REPORT_ID_KBD, 0x02);
+	run_until(a2u, 1003000);
+	sim::usb_host_set_led(ax2usb::AX2USB::REPORT_ID_KBD, 0x00);
+	sim::usb_host_set_led(ax2usb::AX2USB::REPORT_ID_KBD, 0x02);
+	run_until(a2u, t + 100000);
+	for (auto k : keys) {
+		TEST_ASSERT_TRUE(saw_key(map::ax2_usb[k]));
+	}
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_A));
+	TEST_ASSERT_EQUAL(0x04, kbd.leds());
+	auto& cmds = kbd.received_commands();
+	TEST_ASSERT_TRUE(std::count(cmds.begin(), cmds.end(), ps2cmd::MODE_IND) <= 1 + 2);
+	TEST_ASSERT_EQUAL(0, a2u.ps2_errors().ack_timeout);
+}
+
+void
+test_boot_overlaps_usb_enumeration() {
+	sim::reset();
+	sim::usb_set_mounted(false);
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 200000);
+	// USB の列挙を待たずに ECHO を送り、応答でタイプマティックと LED を設定している
+	auto boot = a2u.boot_times();
+	TEST_ASSERT_TRUE(boot.ps2_ready_us > 0 && boot.ps2_ready_us < 10000);
+	TEST_ASSERT_EQUAL(0, boot.usb_mounted_us);
+	auto& cmds = kbd.received_commands();
+	TEST_ASSERT_TRUE(std::find(cmds.begin(), cmds.end(), ps2cmd::SET_TYPEMATIC) != cmds.end());
+	TEST_ASSERT_TRUE(std::find(cmds.begin(), cmds.end(), ps2cmd::MODE_IND) != cmds.end());
+
+	// 列挙の間に押したキーは列挙が終わってから送る
+	kbd.press(0x1c, 250000);
+	run_until(a2u, 300000);
+	TEST_ASSERT_TRUE(sim::usb_reports().empty());
+	sim::usb_set_mounted(true);
+	run_until(a2u, 320000);
+	TEST_ASSERT_TRUE(sim::report_has_key(sim::usb_reports().front(), HID_KEY_A));
+	boot = a2u.boot_times();
+	TEST_ASSERT_TRUE(boot.usb_mounted_us >= 300000 && boot.usb_mounted_us < 320000);
+	TEST_ASSERT_TRUE(boot.first_key_us > 250000 && boot.first_key_us < 300000);
+}
+
+void
+test_health_feature_report() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	kbd.press(0x1c, 1000000);
+	kbd.release(0x1c);
+	// E0 の後に来ないはずのコード
+	uint64_t t = kbd.send({ ps2ind::E0, 0x05 });
+	run_until(a2u, t + 10000);
+
+	ax2usb::health::health_report_t h;
+	uint16_t len = sim::usb_host_get_feature(ax2usb::AX2USB::REPORT_ID_HEALTH, reinterpret_cast<uint8_t*>(&h), sizeof(h));
+	TEST_ASSERT_EQUAL(sizeof(h), len);
+	TEST_ASSERT_EQUAL(ax2usb::health::VERSION, h.version);
+	TEST_ASSERT_EQUAL(2, h.scan_code_set);
+	TEST_ASSERT_EQUAL(1, h.uptime_s);
+	// ECHO・コマンドの応答と、キー・E0 05 の5バイト
+	TEST_ASSERT_TRUE(h.rx_bytes >= 5 + 4);
+	TEST_ASSERT_EQUAL(0, h.rx_dropped);
+	TEST_ASSERT_TRUE(h.rx_high_watermark >= 1);
+	TEST_ASSERT_EQUAL(1, h.unexpected);
+	TEST_ASSERT_EQUAL(0, h.set3_unmapped);
+	TEST_ASSERT_EQUAL(0, h.overrun + h.self_test + h.resend + h.prefix_timeout + h.resync + h.ack_timeout);
+	TEST_ASSERT_EQUAL(2, h.usb_reports);
+	TEST_ASSERT_EQUAL(0, h.usb_dropped + h.usb_retries);
+	TEST_ASSERT_EQUAL(1, h.tx_high_watermark);
+	// ほかのレポートIDには応答しない(STALL)
+	TEST_ASSERT_EQUAL(0, sim::usb_host_get_feature(ax2usb::AX2USB::REPORT_ID_KBD, reinterpret_cast<uint8_t*>(&h), sizeof(h)));
+
+	// micros() が一周しても起動からの時間は戻らない
+	ax2usb::health::Uptime up;
+	up.update(0xffffff00);
+	up.update(100);
+	TEST_ASSERT_EQUAL(4294, up.seconds());
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_every_transition);
+	RUN_TEST(test_every_3byte_sequence);
+	RUN_TEST(test_key_ids_do_not_overlap);
+	RUN_TEST(test_pause_break);
+	RUN_TEST(test_alt_print_screen_and_fake_shift);
+	RUN_TEST(test_set3_matches_set2_keys);
+	RUN_TEST(test_switch_to_set3);
+	RUN_TEST(test_set3_refused_falls_back_to_set2);
+	RUN_TEST(test_lost_prefix_resyncs);
+	RUN_TEST(test_overrun_releases_all);
+	RUN_TEST(test_command_retry);
+	RUN_TEST(test_bat_failure_resets_keyboard);
+	RUN_TEST(test_keys_during_led_update_are_kept);
+	RUN_TEST(test_boot_overlaps_usb_enumeration);
+	RUN_TEST(test_health_feature_report);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,279 @@
+#include <sim.h>
+#include <unity.h>
+#include "hid_util.h"
+
+namespace {
+
+constexpr uint8_t REPORT_ID_KBD = 1;
+constexpr uint8_t REPORT_ID_NKRO = 4;
+constexpr uint8_t KEYS[] = { HID_KEY_A, HID_KEY_S, HID_KEY_D, HID_KEY_F, HID_KEY_J, HID_KEY_K, HID_KEY_L };
+
+Adafruit_USBD_HID usb_hid;
+
+const sim::Report&
+last_report() {
+	// 送信完了まで進める
+	sim::advance_us(10000);
+	return sim::usb_reports().back();
+}
+
+}  // namespace
+
+void
+setUp(void) {
+	sim::reset();
+	usb_hid.setPollInterval(1);
+	usb_hid.begin();
+}
+
+void
+tearDown(void) {}
+
+void
+test_bitmap_make_break() {
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD, REPORT_ID_NKRO };
+
+	TEST_ASSERT_TRUE(kutil.update_usb_codes(HID_KEY_A, true));
+	TEST_ASSERT_FALSE(kutil.update_usb_codes(HID_KEY_A, true));
+	TEST_ASSERT_TRUE(kutil.is_pressed(HID_KEY_A));
+	TEST_ASSERT_EQUAL(1, kutil.pressed_count());
+	TEST_ASSERT_TRUE(kutil.update_usb_codes(HID_KEY_A, false));
+	TEST_ASSERT_FALSE(kutil.update_usb_codes(HID_KEY_A, false));
+	TEST_ASSERT_FALSE(kutil.is_pressed(HID_KEY_A));
+	TEST_ASSERT_EQUAL(0, kutil.pressed_count());
+}
+
+void
+test_nkro_report() {
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD, REPORT_ID_NKRO };
+
+	for (auto key : KEYS) {
+		kutil.send_usb_key(key, true);
+		sim::advance_us(1000);
+	}
+	kutil.send_usb_key(HID_KEY_SHIFT_LEFT, true);
+	auto& r = last_report();
+	TEST_ASSERT_EQUAL(REPORT_ID_NKRO, r.report_id);
+	TEST_ASSERT_EQUAL(1 + hid_util::HidUtil::NKRO_USAGES / 8, r.len);
+	TEST_ASSERT_EQUAL(0x02, sim::report_modifier(r));
+	for (auto key : KEYS) {
+		TEST_ASSERT_TRUE(sim::report_has_key(r, key));
+	}
+	TEST_ASSERT_FALSE(sim::report_has_key(r, HID_KEY_G));
+}
+
+void
+test_6kro_rollover() {
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD };
+
+	for (size_t i = 0; i < 6; i++) {
+		kutil.send_usb_key(KEYS[i], true);
+		sim::advance_us(1000);
+	}
+	auto& six = last_report();
+	TEST_ASSERT_EQUAL(REPORT_ID_KBD, six.report_id);
+	for (size_t i = 0; i < 6; i++) {
+		TEST_ASSERT_TRUE(sim::report_has_key(six, KEYS[i]));
+	}
+
+	// 7キー目で ErrorRollOver
+	kutil.send_usb_key(KEYS[6], true);
+	auto& over = last_report();
+	for (size_t i = 2; i < 8; i++) {
+		TEST_ASSERT_EQUAL(0x01, over.data[i]);
+	}
+
+	// 6キーに戻れば通常のレポート
+	kutil.send_usb_key(KEYS[0], false);
+	auto& back = last_report();
+	TEST_ASSERT_FALSE(sim::report_has_key(back, KEYS[0]));
+	TEST_ASSERT_TRUE(sim::report_has_key(back, KEYS[6]));
+}
+
+void
+test_boot_protocol_fallback() {
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD, REPORT_ID_NKRO };
+
+	sim::usb_set_protocol(HID_PROTOCOL_BOOT);
+	kutil.send_usb_key(HID_KEY_A, true);
+	auto& r = last_report();
+	// ブートプロトコルではレポートIDなしの8バイト
+	TEST_ASSERT_EQUAL(0, r.report_id);
+	TEST_ASSERT_EQUAL(8, r.len);
+	TEST_ASSERT_TRUE(sim::report_has_key(r, HID_KEY_A));
+
+	sim::usb_set_protocol(HID_PROTOCOL_REPORT);
+	kutil.send_usb_key(HID_KEY_A, false);
+	TEST_ASSERT_EQUAL(REPORT_ID_NKRO, last_report().report_id);
+}
+
+void
+test_batch_single_report() {
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD, REPORT_ID_NKRO };
+
+	kutil.begin_batch();
+	kutil.send_usb_key(HID_KEY_SHIFT_LEFT, true);
+	for (auto key : KEYS) {
+		kutil.send_usb_key(key, true);
+	}
+	kutil.end_batch();
+	TEST_ASSERT_EQUAL(1, sim::usb_reports().size());
+	auto& r = last_report();
+	TEST_ASSERT_EQUAL(0x02, sim::report_modifier(r));
+	for (auto key : KEYS) {
+		TEST_ASSERT_TRUE(sim::report_has_key(r, key));
+	}
+}
+
+void
+test_batch_keeps_order() {
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD, REPORT_ID_NKRO };
+
+	// Shift+A のあと Shift を離す: A を Shift なしで送ってはいけない
+	kutil.begin_batch();
+	kutil.send_usb_key(HID_KEY_SHIFT_LEFT, true);
+	kutil.send_usb_key(HID_KEY_A, true);
+	kutil.send_usb_key(HID_KEY_SHIFT_LEFT, false);
+	// 同じバッチ内の make/break は両方送る
+	kutil.send_usb_key(HID_KEY_S, true);
+	kutil.send_usb_key(HID_KEY_S, false);
+	kutil.end_batch();
+	sim::advance_us(10000);
+
+	auto& reports = sim::usb_reports();
+	TEST_ASSERT_EQUAL(3, reports.size());
+	TEST_ASSERT_EQUAL(0x02, sim::report_modifier(reports[0]));
+	TEST_ASSERT_TRUE(sim::report_has_key(reports[0], HID_KEY_A));
+	TEST_ASSERT_EQUAL(0x00, sim::report_modifier(reports[1]));
+	TEST_ASSERT_TRUE(sim::report_has_key(reports[1], HID_KEY_S));
+	TEST_ASSERT_FALSE(sim::report_has_key(reports[2], HID_KEY_S));
+	TEST_ASSERT_TRUE(sim::report_has_key(reports[2], HID_KEY_A));
+}
+
+void
+test_oneshot_does_not_block() {
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD };
+	constexpr uint8_t REPORT_ID_CONSUMER = 3;
+
+	uint64_t start = sim::now_us();
+	kutil.send_report16_oneshot(REPORT_ID_CONSUMER, 0xcd);
+	TEST_ASSERT_EQUAL(start, sim::now_us());
+	sim::advance_us(10000);
+
+	auto& reports = sim::usb_reports();
+	TEST_ASSERT_EQUAL(2, reports.size());
+	TEST_ASSERT_EQUAL(0xcd, reports[0].data[0]);
+	TEST_ASSERT_EQUAL(0x00, reports[1].data[0]);
+	TEST_ASSERT_TRUE(reports[0].sent_us < reports[1].sent_us);
+}
+
+void
+test_queue_bound() {
+	hid_util::ReportQueue q;
+	uint8_t v = 0;
+
+	for (size_t i = 0; i < hid_util::ReportQueue::DEPTH; i++, v++) {
+		TEST_ASSERT_TRUE(q.push(2, &v, 1, false));
+	}
+	TEST_ASSERT_EQUAL(0, q.space());
+	// 満杯: 末尾と同じIDなら上書き、違うIDなら捨てる
+	TEST_ASSERT_FALSE(q.push(2, &v, 1, false));
+	TEST_ASSERT_FALSE(q.push(3, &v, 1, false));
+	TEST_ASSERT_TRUE(q.push(2, &v, 1, true));
+	auto st = q.stats();
+	TEST_ASSERT_EQUAL(2, st.dropped);
+	TEST_ASSERT_EQUAL(1, st.merged);
+	TEST_ASSERT_EQUAL(hid_util::ReportQueue::DEPTH, st.high_watermark);
+
+	// 1周期に1つずつ送信される
+	q.send_next(usb_hid);
+	q.send_next(usb_hid);
+	TEST_ASSERT_EQUAL(hid_util::ReportQueue::DEPTH - 1, q.count());
+}
+
+void
+test_sof_holds_follow_up_reports() {
+	using timing_t = hid_util::HidUtil::timing_t;
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD };
+	usb_hid.setPollInterval(4);
+	sim::usb_set_poll_offset_us(100);
+	kutil.set_timing(timing_t::sof, 4);
+
+	// 送信中のレポートが無ければすぐに送信する(4.1ms のポーリングで送られる)
+	sim::advance_to(1000);
+	kutil.send_usb_key(HID_KEY_A, true);
+	sim::advance_to(2000);
+	kutil.send_usb_key(HID_KEY_S, true);
+	// 送信完了の後も次のポーリングのフレーム(8ms)までは送らず、後の変化をまとめる
+	sim::advance_to(5000);
+	TEST_ASSERT_EQUAL(1, sim::usb_reports().size());
+	kutil.send_usb_key(HID_KEY_D, true);
+	sim::advance_to(9000);
+
+	auto& reports = sim::usb_reports();
+	TEST_ASSERT_EQUAL(2, reports.size());
+	TEST_ASSERT_EQUAL(4100, reports[0].sent_us);
+	TEST_ASSERT_EQUAL(8000, reports[1].queued_us);
+	TEST_ASSERT_EQUAL(8100, reports[1].sent_us);
+	TEST_ASSERT_TRUE(sim::report_has_key(reports[1], HID_KEY_S));
+	TEST_ASSERT_TRUE(sim::report_has_key(reports[1], HID_KEY_D));
+	// 積んでから送信されたフレームの SOF まで: 1ms→4ms、2ms→8ms
+	auto s = kutil.ready_to_sof();
+	TEST_ASSERT_EQUAL(2, s.count);
+	TEST_ASSERT_EQUAL(3000, s.min);
+	TEST_ASSERT_EQUAL(6000, s.max);
+}
+
+// 実機のように SOF のコールバックが遅れて呼ばれても、同じフレームで送信し、SOF の時刻はフレーム番号から推定する
+void
+test_sof_callback_delay() {
+	using timing_t = hid_util::HidUtil::timing_t;
+	hid_util::HidUtil kutil{ usb_hid, REPORT_ID_KBD };
+	usb_hid.setPollInterval(4);
+	sim::usb_set_poll_offset_us(500);
+	sim::usb_set_sof_delay_us(400);
+	kutil.set_timing(timing_t::sof, 4);
+
+	sim::advance_to(101000);
+	kutil.send_usb_key(HID_KEY_A, true);
+	sim::advance_to(102000);
+	kutil.send_usb_key(HID_KEY_S, true);
+	sim::advance_to(105000);
+	kutil.send_usb_key(HID_KEY_D, true);
+	sim::advance_to(109000);
+
+	auto& reports = sim::usb_reports();
+	TEST_ASSERT_EQUAL(2, reports.size());
+	TEST_ASSERT_EQUAL(104500, reports[0].sent_us);
+	// 108ms の SOF のコールバックは 320us 遅れたが、同じフレームの IN トークンに間に合う
+	TEST_ASSERT_EQUAL(108320, reports[1].queued_us);
+	TEST_ASSERT_EQUAL(108500, reports[1].sent_us);
+	TEST_ASSERT_TRUE(sim::report_has_key(reports[1], HID_KEY_D));
+	// 積んでから SOF まで: 101ms→104ms、102ms→108ms。推定の誤差は遅れないフレームからのフレーム数[us]まで
+	auto s = kutil.ready_to_sof();
+	TEST_ASSERT_EQUAL(2, s.count);
+	TEST_ASSERT_EQUAL(3000, s.min);
+	TEST_ASSERT_TRUE(s.max >= 6000 && s.max <= 6004);
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_bitmap_make_break);
+	RUN_TEST(test_nkro_report);
+	RUN_TEST(test_6kro_rollover);
+	RUN_TEST(test_boot_protocol_fallback);
+	RUN_TEST(test_batch_single_report);
+	RUN_TEST(test_batch_keeps_order);
+	RUN_TEST(test_oneshot_does_not_block);
+	RUN_TEST(test_queue_bound);
+	RUN_TEST(test_sof_holds_follow_up_reports);
+	RUN_TEST(test_sof_callback_delay);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include <Adafruit_TinyUSB.h>
+#include <sim.h>
+#include <unity.h>
+#include "ax2usb.h"
+#include "key_event.hpp"
+
+using ax2usb::key_event_t;
+using ax2usb::KeyEventChannel;
+
+void
+setUp(void) {}
+
+void
+tearDown(void) {}
+
+void
+test_pack_round_trip() {
+	key_event_t ev{ ax2usb::keymap::key_id_e0(0x7c), true, 123456, 0 };
+	auto got = key_event_t::unpack(ev.pack(), 123456 + 250);
+	TEST_ASSERT_EQUAL(0xfc, got.key);
+	TEST_ASSERT_TRUE(got.make_break);
+	TEST_ASSERT_EQUAL(123456, got.rx_us);
+	TEST_ASSERT_EQUAL(123456 + 250, got.dequeued_us);
+
+	key_event_t brk{ ax2usb::keymap::KEY_PAUSE, false, 0, 0 };
+	got = key_event_t::unpack(brk.pack(), 10);
+	TEST_ASSERT_EQUAL(ax2usb::keymap::KEY_PAUSE, got.key);
+	TEST_ASSERT_FALSE(got.make_break);
+	TEST_ASSERT_FALSE(got.tap);
+
+	key_event_t tap{ ax2usb::keymap::KEY_PAUSE, true, 0, 0, true };
+	got = key_event_t::unpack(tap.pack(), 10);
+	TEST_ASSERT_TRUE(got.make_break);
+	TEST_ASSERT_TRUE(got.tap);
+}
+
+void
+test_stamp_restored_across_wrap() {
+	uint32_t rx_us = 0xfffffff0u;
+	key_event_t ev{ 0x1c, true, rx_us, 0 };
+	TEST_ASSERT_EQUAL(rx_us, key_event_t::unpack(ev.pack(), rx_us + 300).rx_us);
+	TEST_ASSERT_EQUAL(rx_us, key_event_t::unpack(ev.pack(), rx_us + key_event_t::STAMP_MASK).rx_us);
+}
+
+void
+test_channel_is_bounded_fifo() {
+	KeyEventChannel ch;
+	for (uint8_t i = 0; i < KeyEventChannel::DEPTH; i++) {
+		TEST_ASSERT_TRUE(ch.push({ static_cast<uint8_t>(0x10 + i), true, 0, 0 }));
+	}
+	TEST_ASSERT_FALSE(ch.push({ 0x1a, true, 0, 0 }));
+	key_event_t ev;
+	for (uint8_t i = 0; i < KeyEventChannel::DEPTH; i++) {
+		TEST_ASSERT_TRUE(ch.pop(ev));
+		TEST_ASSERT_EQUAL(0x10 + i, ev.key);
+	}
+	TEST_ASSERT_FALSE(ch.pop(ev));
+	TEST_ASSERT_FALSE(ch.available());
+}
+
+// PS/2 側と USB 側を交互に回し(2コア構成を1スレッドで模擬)、キーが欠けずにレポートへ届くこと
+void
+test_split_delivers_keys() {
+	sim::reset();
+	ax2usb::AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin_split());
+	a2u.begin_ps2(9, 10);
+
+	kbd.press(0x1c, 1000);
+	kbd.press(sim::Keyboard::E0 | 0x74);
+	kbd.release(0x1c);
+	uint64_t end = kbd.release(sim::Keyboard::E0 | 0x74) + 20000;
+	while (sim::now_us() < end) {
+		a2u.poll_ps2();
+		a2u.poll_usb();
+		sim::advance_us(5);
+	}
+
+	auto& reports = sim::usb_reports();
+	bool saw_a = false, saw_right = false;
+	for (auto& r : reports) {
+		saw_a = saw_a || sim::report_has_key(r, HID_KEY_A);
+		saw_right = saw_right || sim::report_has_key(r, HID_KEY_ARROW_RIGHT);
+	}
+	TEST_ASSERT_TRUE(saw_a);
+	TEST_ASSERT_TRUE(saw_right);
+	TEST_ASSERT_FALSE(sim::report_has_key(reports.back(), HID_KEY_A));
+	TEST_ASSERT_FALSE(sim::report_has_key(reports.back(), HID_KEY_ARROW_RIGHT));
+	TEST_ASSERT_EQUAL(0, a2u.ps2_backlog());
+	TEST_ASSERT_TRUE(a2u.latency(ax2usb::KeyLatency::total).count > 0);
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_pack_round_trip);
+	RUN_TEST(test_stamp_restored_across_wrap);
+	RUN_TEST(test_channel_is_bounded_fifo);
+	RUN_TEST(test_split_delivers_keys);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,389 @@
+#include <Adafruit_TinyUSB.h>
+#include <sim.h>
+#include <unity.h>
+#include <algorithm>
+#include <vector>
+#include "ax2usb.h"
+#include "ax2usbmap.hpp"
+#include "keymap.hpp"
+#include "tap_hold.hpp"
+
+using namespace ax2usb;
+using keymap::kind_t;
+
+namespace {
+
+constexpr uint8_t REPORT_ID_CONSUMER = 3;
+constexpr uint16_t CAPS = 0x58;
+constexpr uint16_t SHIFT = 0x12;
+constexpr uint16_t KEY_A = 0x1c;
+constexpr uint16_t SPACE = 0x29;
+constexpr uint16_t UP = sim::Keyboard::E0 | 0x75;
+
+constexpr keymap::entry_t base[] = {
+	{ 0x1c, keymap::usb_key(HID_KEY_A) },
+	{ 0x32, keymap::usb_key(HID_KEY_B) },
+	{ 0x58, keymap::momentary(1) },
+};
+constexpr keymap::entry_t user[] = {
+	{ 0x1c, keymap::consumer(0xe9) },
+};
+constexpr keymap::layer_t layers[] = {
+	{ base, std::size(base), keymap::NONE },
+	{ user, std::size(user), keymap::TRANS },
+};
+
+void
+run_until(AX2USB& a2u, uint64_t t_us) {
+	while (sim::now_us() < t_us) {
+		a2u.loop();
+		sim::advance_us(5);
+	}
+}
+
+// キーを含む最初のキーボードレポートの位置(無ければ -1)
+int
+first_report_with(uint8_t usb) {
+	auto& reports = sim::usb_reports();
+	for (size_t i = 0; i < reports.size(); i++) {
+		if (reports[i].report_id != REPORT_ID_CONSUMER && sim::report_has_key(reports[i], usb)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// キーを押したレポートの数(離した状態からの変化を数える)
+int
+count_presses(uint8_t usb) {
+	int n = 0;
+	bool down = false;
+	for (auto& r : sim::usb_reports()) {
+		if (r.report_id == REPORT_ID_CONSUMER) {
+			continue;
+		}
+		bool d = sim::report_has_key(r, usb);
+		n += d && !down;
+		down = d;
+	}
+	return n;
+}
+
+std::vector<uint16_t>
+consumer_reports() {
+	std::vector<uint16_t> v;
+	for (auto& r : sim::usb_reports()) {
+		if (r.report_id == REPORT_ID_CONSUMER) {
+			v.push_back(r.data[0] | r.data[1] << 8);
+		}
+	}
+	return v;
+}
+
+}  // namespace
+
+void
+setUp(void) {
+	sim::reset();
+}
+
+void
+tearDown(void) {}
+
+void
+test_trans_falls_back_to_base() {
+	keymap::Keymap km;
+	TEST_ASSERT_TRUE(km.load(layers, std::size(layers)));
+	TEST_ASSERT_TRUE(km.press(0x58).kind == kind_t::momentary);
+	km.set_layer(1, true);
+	TEST_ASSERT_TRUE(km.press(0x1c).kind == kind_t::consumer);
+	TEST_ASSERT_EQUAL(HID_KEY_B, km.press(0x32).usage);
+	TEST_ASSERT_TRUE(km.press(0x33).kind == kind_t::none);
+}
+
+void
+test_release_uses_press_layer() {
+	keymap::Keymap km;
+	TEST_ASSERT_TRUE(km.load(layers, std::size(layers)));
+	TEST_ASSERT_TRUE(km.press(0x1c).kind == kind_t::usb_key);
+	km.set_layer(1, true);
+	// 押したときは基本レイヤーだったので、レイヤーが変わっても通常キーとして離す
+	TEST_ASSERT_TRUE(km.release(0x1c).kind == kind_t::usb_key);
+	TEST_ASSERT_TRUE(km.press(0x1c).kind == kind_t::consumer);
+	km.set_layer(1, false);
+	TEST_ASSERT_EQUAL(0, km.top_layer());
+	TEST_ASSERT_TRUE(km.release(0x1c).kind == kind_t::consumer);
+	// 押していないキー
+	TEST_ASSERT_TRUE(km.release(0x32).kind == kind_t::none);
+}
+
+void
+test_load_rejects_bad_layer() {
+	static constexpr keymap::entry_t bad[] = { { 0x58, keymap::momentary(2) } };
+	constexpr keymap::layer_t bad_layers[] = { { bad, std::size(bad), keymap::NONE } };
+	keymap::Keymap km;
+	TEST_ASSERT_TRUE(km.load(layers, std::size(layers)));
+	TEST_ASSERT_FALSE(km.load(bad_layers, std::size(bad_layers)));
+	TEST_ASSERT_EQUAL(2, km.layer_count());
+	TEST_ASSERT_FALSE(km.load(layers, 0));
+}
+
+void
+test_default_base_layer_matches_map() {
+	keymap::Keymap km;
+	TEST_ASSERT_TRUE(km.load(map::default_layers, std::size(map::default_layers)));
+	for (size_t code = 0; code < std::size(map::ax2_usb); code++) {
+		auto& act = km.press(keymap::key_id(code));
+		if (code == ps2key::CAPS) {
+			TEST_ASSERT_TRUE(act.kind == kind_t::tap_hold);
+			TEST_ASSERT_EQUAL(map::LAYER_FN, act.arg);
+		} else if (code == ps2key::ALT_PRINT_SCREEN) {
+			TEST_ASSERT_EQUAL(HID_KEY_ALT_LEFT, act.arg);
+		} else if (map::ax2_usb[code]) {
+			TEST_ASSERT_EQUAL(map::ax2_usb[code], act.usage);
+		} else {
+			TEST_ASSERT_TRUE(act.kind == kind_t::none);
+		}
+	}
+	TEST_ASSERT_TRUE(km.press(keymap::key_id_e0(ps2key::L_CTRL)).kind == kind_t::momentary);
+}
+
+void
+test_set_keymap_before_begin() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.set_keymap(layers, std::size(layers)));
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	// begin() の後も差し替えたキーマップのまま: Caps はタップ・ホールドではなくレイヤー1のモーメンタリ
+	kbd.press(CAPS, 1000000);
+	kbd.press(KEY_A);
+	kbd.release(KEY_A);
+	run_until(a2u, kbd.release(CAPS) + 20000);
+	auto v = consumer_reports();
+	TEST_ASSERT_EQUAL(2, v.size());
+	TEST_ASSERT_EQUAL(0xe9, v[0]);
+	TEST_ASSERT_EQUAL(0, v[1]);
+	TEST_ASSERT_EQUAL(-1, first_report_with(HID_KEY_CAPS_LOCK));
+}
+
+void
+test_fn_volume_released_after_fn() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	kbd.press(CAPS, 1000000);
+	kbd.press(UP, 1300000);
+	kbd.release(CAPS);
+	run_until(a2u, kbd.release(UP) + 20000);
+	// Fn(make、期限でホールド) → ↑(make) → Fn(break) → ↑(break) でもボリューム+を離す
+	auto v = consumer_reports();
+	TEST_ASSERT_EQUAL(2, v.size());
+	TEST_ASSERT_EQUAL(map::AUDIO_CONTROL_VOLUME_INCREMENT, v[0]);
+	TEST_ASSERT_EQUAL(0, v[1]);
+	for (auto& r : sim::usb_reports()) {
+		TEST_ASSERT_FALSE(sim::report_has_key(r, HID_KEY_ARROW_UP));
+	}
+}
+
+void
+test_shift_caps_and_fn_blocks_keys() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	kbd.press(SHIFT, 1000000);
+	kbd.press(CAPS);
+	kbd.release(CAPS);
+	kbd.release(SHIFT);
+	// Fn を押している間、Fn レイヤーに無いキーは無効
+	kbd.press(CAPS);
+	kbd.press(KEY_A);
+	kbd.release(KEY_A);
+	run_until(a2u, kbd.release(CAPS) + 20000);
+
+	bool caps = false, a = false;
+	for (auto& r : sim::usb_reports()) {
+		caps = caps || sim::report_has_key(r, HID_KEY_CAPS_LOCK);
+		a = a || sim::report_has_key(r, HID_KEY_A);
+	}
+	TEST_ASSERT_TRUE(caps);
+	TEST_ASSERT_FALSE(a);
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_CAPS_LOCK));
+}
+
+void
+test_tap_hold_skips_repeat() {
+	TapHold th;
+	th.begin(0x58, map::CAPS_FN, 1000);
+	TEST_ASSERT_TRUE(th.push({ 0x58, true, 60000, 0 }));  // タイプマティック
+	TEST_ASSERT_TRUE(th.decide() == TapHold::decision_t::undecided);
+	TEST_ASSERT_TRUE(th.push({ 0x1c, true, 70000, 0 }));
+	TEST_ASSERT_TRUE(th.push({ 0x58, false, 80000, 0 }));
+	TEST_ASSERT_TRUE(th.decide() == TapHold::decision_t::tap);
+	key_event_t ev;
+	TEST_ASSERT_TRUE(th.pop(ev));
+	TEST_ASSERT_EQUAL(0x1c, ev.key);
+	TEST_ASSERT_FALSE(th.pop(ev));
+	TEST_ASSERT_FALSE(th.active());
+
+	th.begin(0x58, map::CAPS_FN, 1000);
+	TEST_ASSERT_TRUE(th.expire(1000 + TapHold::DEFAULT_TIMEOUT_US - 1) == TapHold::decision_t::undecided);
+	TEST_ASSERT_TRUE(th.expire(1000 + TapHold::DEFAULT_TIMEOUT_US) == TapHold::decision_t::hold);
+	TEST_ASSERT_FALSE(th.active());
+}
+
+void
+test_caps_tap_sends_tap_key() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	kbd.press(CAPS, 1000000);
+	kbd.release(CAPS);
+	run_until(a2u, kbd.press(KEY_A) + 20000);
+	// 単独で押して離せば Caps Lock を押して離し、その後のキーは通常どおり
+	int caps = first_report_with(HID_KEY_CAPS_LOCK);
+	TEST_ASSERT_TRUE(caps >= 0);
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports()[caps + 1], HID_KEY_CAPS_LOCK));
+	TEST_ASSERT_TRUE(first_report_with(HID_KEY_A) > caps);
+	TEST_ASSERT_TRUE(consumer_reports().empty());
+}
+
+void
+test_roll_over_caps_replays_in_order() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	// Caps(make) → A(make) → Caps(break) → A(break): A を離す前に Caps を離したのでタップ
+	kbd.press(CAPS, 1000000);
+	kbd.press(KEY_A);
+	kbd.release(CAPS);
+	run_until(a2u, kbd.release(KEY_A) + 20000);
+	int caps = first_report_with(HID_KEY_CAPS_LOCK);
+	int a = first_report_with(HID_KEY_A);
+	TEST_ASSERT_TRUE(caps >= 0);
+	TEST_ASSERT_TRUE(a > caps);
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_A));
+}
+
+void
+test_permissive_hold() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	// Caps を押している間に Space を押して離したので、期限前でも Fn+Space(再生/ポーズ)
+	kbd.press(CAPS, 1000000);
+	kbd.press(SPACE);
+	kbd.release(SPACE);
+	run_until(a2u, kbd.release(CAPS) + 20000);
+	auto v = consumer_reports();
+	TEST_ASSERT_EQUAL(2, v.size());
+	TEST_ASSERT_EQUAL(map::TRANSPORT_CONTROL_PLAY_PAUSE, v[0]);
+	TEST_ASSERT_EQUAL(-1, first_report_with(HID_KEY_CAPS_LOCK));
+	TEST_ASSERT_EQUAL(-1, first_report_with(HID_KEY_SPACE));
+}
+
+void
+test_hold_decided_by_timer() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	uint64_t pressed = kbd.press(CAPS, 1000000);
+	kbd.press(UP, pressed + 50000);
+	// 次のバイト(↑の break)を待たずに期限でホールドと決め、溜めていた↑をすぐ処理する
+	kbd.release(UP, pressed + 600000);
+	run_until(a2u, kbd.release(CAPS) + 20000);
+	auto& reports = sim::usb_reports();
+	auto it = std::find_if(reports.begin(), reports.end(), [](auto& r) { return r.report_id == REPORT_ID_CONSUMER; });
+	TEST_ASSERT_TRUE(it != reports.end());
+	TEST_ASSERT_EQUAL(map::AUDIO_CONTROL_VOLUME_INCREMENT, it->data[0]);
+	TEST_ASSERT_TRUE(it->queued_us >= pressed + TapHold::DEFAULT_TIMEOUT_US - 1000);
+	TEST_ASSERT_TRUE(it->queued_us < pressed + TapHold::DEFAULT_TIMEOUT_US + 1000);
+	TEST_ASSERT_EQUAL(-1, first_report_with(HID_KEY_CAPS_LOCK));
+}
+
+void
+test_hold_timer_uses_configured_timeout() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	a2u.set_tap_hold({ 100000, false });
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	uint64_t pressed = kbd.press(CAPS, 1000000);
+	kbd.press(UP, pressed + 20000);
+	kbd.release(UP, pressed + 300000);
+	run_until(a2u, kbd.release(CAPS) + 20000);
+	// 判定の期限のタイマーは set_tap_hold() の期限で起きる
+	auto v = consumer_reports();
+	TEST_ASSERT_EQUAL(2, v.size());
+	auto& reports = sim::usb_reports();
+	auto it = std::find_if(reports.begin(), reports.end(), [](auto& r) { return r.report_id == REPORT_ID_CONSUMER; });
+	TEST_ASSERT_TRUE(it->queued_us >= pressed + 100000 - 1000);
+	TEST_ASSERT_TRUE(it->queued_us < pressed + 100000 + 1000);
+	TEST_ASSERT_EQUAL(-1, first_report_with(HID_KEY_CAPS_LOCK));
+}
+
+void
+test_firmware_repeat() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	a2u.set_repeat({ Repeater::keys_t::navigation, 250000, 20000 });
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	// キーボード自身のタイプマティックは最も遅くしている
+	TEST_ASSERT_EQUAL_HEX8(0x7f, kbd.typematic());
+
+	// ↑は 250ms 後から 20ms ごとに押し直す。キーボードのタイプマティックの make は無視する
+	uint64_t pressed = kbd.press(UP, 1000000);
+	kbd.press(UP, pressed + 400000);
+	run_until(a2u, kbd.release(UP, pressed + 500000) + 20000);
+	TEST_ASSERT_EQUAL(1 + 13, count_presses(HID_KEY_ARROW_UP));
+	TEST_ASSERT_FALSE(sim::report_has_key(sim::usb_reports().back(), HID_KEY_ARROW_UP));
+
+	// 対象外のキーは押したまま(ホストがリピートする)
+	run_until(a2u, kbd.release(KEY_A, kbd.press(KEY_A, 2000000) + 500000) + 20000);
+	TEST_ASSERT_EQUAL(1, count_presses(HID_KEY_A));
+}
+
+void
+test_repeat_stops_on_other_key() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	a2u.set_repeat({ Repeater::keys_t::all, 100000, 10000 });
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	uint64_t pressed = kbd.press(KEY_A, 1000000);
+	// Shift ではリピートは止まらない。B を押すと A は止まり B がリピートする
+	kbd.press(SHIFT, pressed + 150000);
+	kbd.press(0x32, pressed + 200000);
+	kbd.release(KEY_A, pressed + 250000);
+	kbd.release(SHIFT);
+	run_until(a2u, kbd.release(0x32, pressed + 345000) + 20000);
+	// A は 100ms 後から B を押すまで 10ms ごと(B の到着とほぼ同時の1回は含むことがある)
+	int a = count_presses(HID_KEY_A);
+	TEST_ASSERT_TRUE(a >= 1 + 10 && a <= 1 + 11);
+	TEST_ASSERT_EQUAL(1 + 5, count_presses(HID_KEY_B));
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_trans_falls_back_to_base);
+	RUN_TEST(test_release_uses_press_layer);
+	RUN_TEST(test_load_rejects_bad_layer);
+	RUN_TEST(test_default_base_layer_matches_map);
+	RUN_TEST(test_set_keymap_before_begin);
+	RUN_TEST(test_fn_volume_released_after_fn);
+	RUN_TEST(test_shift_caps_and_fn_blocks_keys);
+	RUN_TEST(test_tap_hold_skips_repeat);
+	RUN_TEST(test_caps_tap_sends_tap_key);
+	RUN_TEST(test_roll_over_caps_replays_in_order);
+	RUN_TEST(test_permissive_hold);
+	RUN_TEST(test_hold_decided_by_timer);
+	RUN_TEST(test_hold_timer_uses_configured_timeout);
+	RUN_TEST(test_firmware_repeat);
+	RUN_TEST(test_repeat_stops_on_other_key);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
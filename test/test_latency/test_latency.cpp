@@ -0,0 +1,89 @@
+#include <Arduino.h>
+#include <unity.h>
+#include "latency.hpp"
+
+using ax2usb::KeyLatency;
+using ax2usb::LatencyHistogram;
+
+void
+setUp(void) {}
+
+void
+tearDown(void) {}
+
+void
+test_buckets() {
+	// 各値は自分の区間の上限以下、1つ前の区間の上限より大きい
+	for (uint32_t us = 0; us < (1u << 20); us += 1 + us / 64) {
+		size_t i = LatencyHistogram::bucket_of(us);
+		TEST_ASSERT_TRUE(us <= LatencyHistogram::bucket_upper(i));
+		if (i > 0) {
+			TEST_ASSERT_TRUE(us > LatencyHistogram::bucket_upper(i - 1));
+		}
+	}
+	TEST_ASSERT_EQUAL(LatencyHistogram::BUCKETS - 1, LatencyHistogram::bucket_of(UINT32_MAX));
+}
+
+void
+test_summary() {
+	LatencyHistogram h;
+	TEST_ASSERT_EQUAL(0, h.summary().count);
+	for (uint32_t us = 1; us <= 1000; us++) {
+		h.add(us);
+	}
+	auto s = h.summary();
+	TEST_ASSERT_EQUAL(1000, s.count);
+	TEST_ASSERT_EQUAL(1, s.min);
+	TEST_ASSERT_EQUAL(1000, s.max);
+	TEST_ASSERT_EQUAL(500, s.avg);
+	// 区間の上限なので 12.5% 以内で大きめになる
+	TEST_ASSERT_TRUE(s.p50 >= 500 && s.p50 <= 500 * 9 / 8);
+	TEST_ASSERT_TRUE(s.p99 >= 990 && s.p99 <= 1000);
+	h.reset();
+	TEST_ASSERT_EQUAL(0, h.summary().count);
+}
+
+void
+test_key_latency() {
+	KeyLatency k;
+	k.record({ 100, 110, 130, true }, 1130);
+	k.record({ 0, 0, 0, false }, 5000);
+	TEST_ASSERT_EQUAL(1, k.summary(KeyLatency::total).count);
+	TEST_ASSERT_EQUAL(10, k.summary(KeyLatency::queue).max);
+	TEST_ASSERT_EQUAL(20, k.summary(KeyLatency::decode).max);
+	TEST_ASSERT_EQUAL(1000, k.summary(KeyLatency::usb).max);
+	TEST_ASSERT_EQUAL(1030, k.summary(KeyLatency::total).max);
+	// micros() の桁あふれをまたいでも差分は正しい
+	k.reset();
+	k.record({ UINT32_MAX - 9, 5, 5, true }, 10);
+	TEST_ASSERT_EQUAL(20, k.summary(KeyLatency::total).max);
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_buckets);
+	RUN_TEST(test_summary);
+	RUN_TEST(test_key_latency);
+	UNITY_END();
+}
+
+#ifndef ARDUINO
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
+#else
+void
+setup() {
+	Serial.begin(115200);
+	delay(3000);
+	run_tests();
+}
+
+void
+loop() {
+	delay(100);
+}
+#endif
@@ -0,0 +1,122 @@
+#include <Adafruit_TinyUSB.h>
+#include <sim.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "log.hpp"
+#include "sim/log_decoder.hpp"
+
+namespace {
+
+class CapturePrint : public Print {
+ public:
+	size_t write(uint8_t c) override {
+		bytes.push_back(c);
+		room--;
+		return 1;
+	}
+	int availableForWrite() override { return room; }
+	std::vector<uint8_t> bytes;
+	int room = 1000;
+};
+
+std::vector<std::string>
+decode(const std::vector<uint8_t>& bytes) {
+	std::vector<std::string> lines;
+	ax2usb::log::Decoder decoder([&lines](const std::string& line) { lines.push_back(line); });
+	for (auto b : bytes) {
+		decoder.feed(b);
+	}
+	decoder.flush();
+	return lines;
+}
+
+// 先頭の時刻を除く
+std::string
+body(const std::string& line) {
+	return line.substr(line.find(' ', line.find_first_not_of(' ')) + 1);
+}
+
+}  // namespace
+
+void
+setUp(void) {
+	sim::reset();
+}
+
+void
+tearDown(void) {
+	ax2usb::log::set_output(nullptr);
+}
+
+void
+test_round_trip() {
+	CapturePrint out;
+	ax2usb::log::set_output(&out);
+	LOG_DEBUG(PS2_RECEIVED, 0xe0);
+	LOG_DEBUG(UNMAPPED, false, 0x5f);
+	LOG_INFO(USB_LED, 0x03);
+	LOG_DEBUG(USB_KEY_MOD, true, HID_KEY_ALT_LEFT, true, HID_KEY_PRINT_SCREEN, 0x04,
+	          ax2usb::log::wide{ HID_KEY_PRINT_SCREEN | uint64_t{ HID_KEY_A } << 8 });
+	TEST_ASSERT_FALSE(ax2usb::log::drain());
+
+	auto lines = decode(out.bytes);
+	TEST_ASSERT_EQUAL(4, lines.size());
+	TEST_ASSERT_EQUAL_STRING("<e0", body(lines[0]).c_str());
+	TEST_ASSERT_EQUAL_STRING("break 5f is not mapped to usb_key", body(lines[1]).c_str());
+	TEST_ASSERT_EQUAL_STRING("USB< NCsmk", body(lines[2]).c_str());
+	TEST_ASSERT_EQUAL_STRING(">#A+Prt csAw|csaw [Prt][A][00][00][00][00]", body(lines[3]).c_str());
+}
+
+void
+test_drain_is_bounded() {
+	CapturePrint out;
+	ax2usb::log::set_output(&out);
+	LOG_DEBUG(PS2_RECEIVED, 0x1c);
+	LOG_INFO(FIRST_RECEIVED);
+	out.room = 5;
+	// 送信バッファに入る分だけ書いて戻る
+	TEST_ASSERT_TRUE(ax2usb::log::drain());
+	TEST_ASSERT_EQUAL(5, out.bytes.size());
+	// 途中のフレームの後にテキストを書いても崩れない
+	ax2usb::log::finish_frame();
+	out.print("latency reset\r\n");
+	out.room = 1000;
+	TEST_ASSERT_FALSE(ax2usb::log::drain());
+
+	auto lines = decode(out.bytes);
+	TEST_ASSERT_EQUAL(3, lines.size());
+	TEST_ASSERT_EQUAL_STRING("<1c", body(lines[0]).c_str());
+	TEST_ASSERT_EQUAL_STRING("latency reset", lines[1].c_str());
+	TEST_ASSERT_EQUAL_STRING("First msg received", body(lines[2]).c_str());
+}
+
+void
+test_overflow_reported() {
+	CapturePrint out;
+	for (int i = 0; i < 40; i++) {
+		LOG_DEBUG(PS2_RECEIVED, i);
+	}
+	ax2usb::log::set_output(&out);
+	TEST_ASSERT_FALSE(ax2usb::log::drain());
+
+	auto lines = decode(out.bytes);
+	TEST_ASSERT_EQUAL(33, lines.size());
+	TEST_ASSERT_EQUAL_STRING("(8 log records lost)", body(lines[0]).c_str());
+	TEST_ASSERT_EQUAL_STRING("<00", body(lines[1]).c_str());
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_round_trip);
+	RUN_TEST(test_drain_is_bounded);
+	RUN_TEST(test_overflow_reported);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,345 @@
+#include <Adafruit_TinyUSB.h>
+#include <sim.h>
+#include <unity.h>
+#include <cstring>
+#include <vector>
+#include "ax2usb.h"
+#include "ps2_mouse.hpp"
+
+using namespace ax2usb;
+
+void
+setUp(void) {}
+
+void
+tearDown(void) {}
+
+namespace {
+
+constexpr uint8_t ACK = 0xfa;
+
+// 初期化の手順に応答してストリームモードまで進める
+void
+init_mouse(Ps2Mouse& m, bool wheel) {
+	auto r = m.start();
+	TEST_ASSERT_EQUAL(ps2mouse::RESET, r.send);
+	m.feed(ACK);
+	m.feed(0xaa);
+	r = m.feed(ps2mouse::ID_STANDARD);
+	for (uint8_t rate : { 200, 100, 80 }) {
+		TEST_ASSERT_EQUAL(ps2mouse::SET_SAMPLE_RATE, r.send);
+		r = m.feed(ACK);
+		TEST_ASSERT_EQUAL(rate, r.send);
+		r = m.feed(ACK);
+	}
+	TEST_ASSERT_EQUAL(ps2mouse::READ_ID, r.send);
+	m.feed(ACK);
+	r = m.feed(wheel ? ps2mouse::ID_WHEEL : ps2mouse::ID_STANDARD);
+	TEST_ASSERT_EQUAL(ps2mouse::SET_SAMPLE_RATE, r.send);
+	r = m.feed(ACK);
+	TEST_ASSERT_EQUAL(100, r.send);
+	r = m.feed(ACK);
+	TEST_ASSERT_EQUAL(ps2mouse::ENABLE, r.send);
+	m.feed(ACK);
+	TEST_ASSERT_TRUE(m.state() == Ps2Mouse::state_t::streaming);
+	TEST_ASSERT_EQUAL(0, m.timeout_us());
+}
+
+Ps2Mouse::result_t
+feed_all(Ps2Mouse& m, std::initializer_list<uint8_t> bytes) {
+	Ps2Mouse::result_t r;
+	for (auto b : bytes) {
+		r = m.feed(b);
+	}
+	return r;
+}
+
+void
+run_until(AX2USB& a2u, uint64_t t_us) {
+	while (sim::now_us() < t_us) {
+		a2u.loop();
+		sim::advance_us(5);
+	}
+}
+
+std::vector<hid_mouse_report_t>
+mouse_reports() {
+	std::vector<hid_mouse_report_t> v;
+	for (auto& r : sim::usb_reports()) {
+		if (r.report_id == AX2USB::REPORT_ID_MOUSE) {
+			hid_mouse_report_t m;
+			memcpy(&m, r.data, sizeof(m));
+			v.push_back(m);
+		}
+	}
+	return v;
+}
+
+}  // namespace
+
+void
+test_packet_decode() {
+	Ps2Mouse m;
+	init_mouse(m, true);
+	TEST_ASSERT_TRUE(m.has_wheel());
+	// 左ボタン、右へ5、上へ3(PS/2 は上が正)、ホイールを上へ1(PS/2 は下が正)
+	auto r = feed_all(m, { 0x09, 5, 3, 0xff });
+	TEST_ASSERT_TRUE(r.packet);
+	TEST_ASSERT_EQUAL(1, m.packet().buttons);
+	TEST_ASSERT_EQUAL(5, m.packet().dx);
+	TEST_ASSERT_EQUAL(-3, m.packet().dy);
+	TEST_ASSERT_EQUAL(1, m.packet().wheel);
+	// 9ビットの符号: 左へ 256-200、下へ 1
+	r = feed_all(m, { 0x38, 56, 0xff, 0 });
+	TEST_ASSERT_TRUE(r.packet);
+	TEST_ASSERT_EQUAL(-200, m.packet().dx);
+	TEST_ASSERT_EQUAL(1, m.packet().dy);
+	// あふれた動きは捨てる
+	feed_all(m, { 0x48, 0xff, 2, 0 });
+	TEST_ASSERT_EQUAL(0, m.packet().dx);
+	TEST_ASSERT_EQUAL(-2, m.packet().dy);
+}
+
+void
+test_packet_resync() {
+	Ps2Mouse m;
+	init_mouse(m, false);
+	// 先頭ではないバイトは捨て、次の先頭から組み立てる
+	TEST_ASSERT_FALSE(m.feed(0x05).packet);
+	TEST_ASSERT_EQUAL(1, m.dropped_packets());
+	TEST_ASSERT_TRUE(feed_all(m, { 0x08, 1, 1 }).packet);
+	// パケットの途中で途切れたら期限で捨てる
+	m.feed(0x08);
+	TEST_ASSERT_TRUE(m.timeout_us() > 0);
+	m.expire();
+	TEST_ASSERT_EQUAL(2, m.dropped_packets());
+	TEST_ASSERT_TRUE(feed_all(m, { 0x0a, 0, 0 }).packet);
+	TEST_ASSERT_EQUAL(2, m.packet().buttons);
+	// 抜き差し(BAT 完了)で初期化からやり直す
+	auto r = feed_all(m, { 0xaa, 0x00 });
+	TEST_ASSERT_EQUAL(ps2mouse::RESET, r.send);
+	TEST_ASSERT_EQUAL(1, m.restarts());
+}
+
+void
+test_init_failure_retries() {
+	Ps2Mouse m;
+	TEST_ASSERT_EQUAL(ps2mouse::RESET, m.start().send);
+	// 応答が無ければ送り直し、諦めたらしばらく待ってリセットから
+	TEST_ASSERT_EQUAL(ps2mouse::RESET, m.expire().send);
+	TEST_ASSERT_EQUAL(ps2mouse::RESET, m.expire().send);
+	TEST_ASSERT_EQUAL(-1, m.expire().send);
+	TEST_ASSERT_TRUE(m.state() == Ps2Mouse::state_t::retry_wait);
+	TEST_ASSERT_EQUAL(ps2mouse::RESET, m.expire().send);
+	TEST_ASSERT_EQUAL(1, m.restarts());
+}
+
+void
+test_motion_sum_and_clamp() {
+	MouseMotion mm;
+	hid_mouse_report_t r;
+	TEST_ASSERT_FALSE(mm.take(r));
+	mm.add({ 0, 100, -50, 1 });
+	mm.add({ 0, 100, -50, 0 });
+	// int8_t に収まらない分は次のレポートに残す
+	TEST_ASSERT_TRUE(mm.take(r));
+	TEST_ASSERT_EQUAL(127, r.x);
+	TEST_ASSERT_EQUAL(-100, r.y);
+	TEST_ASSERT_EQUAL(1, r.wheel);
+	TEST_ASSERT_TRUE(mm.take(r));
+	TEST_ASSERT_EQUAL(73, r.x);
+	TEST_ASSERT_EQUAL(0, r.y);
+	TEST_ASSERT_FALSE(mm.take(r));
+	// 動きもボタンの変化もないパケットはレポートにしない
+	mm.add({ 0, 0, 0, 0 });
+	TEST_ASSERT_TRUE(mm.empty());
+}
+
+void
+test_motion_keeps_clicks() {
+	MouseMotion mm;
+	hid_mouse_report_t r;
+	// 押して離すまでが1周期に収まっても、押したレポートを失わない
+	mm.add({ 0, 3, 0, 0 });
+	mm.add({ 1, 2, 0, 0 });
+	mm.add({ 1, 1, 0, 0 });
+	mm.add({ 0, 0, 0, 0 });
+	TEST_ASSERT_TRUE(mm.take(r));
+	TEST_ASSERT_EQUAL(0, r.buttons);
+	TEST_ASSERT_EQUAL(3, r.x);
+	TEST_ASSERT_TRUE(mm.take(r));
+	TEST_ASSERT_EQUAL(1, r.buttons);
+	TEST_ASSERT_EQUAL(3, r.x);
+	TEST_ASSERT_TRUE(mm.take(r));
+	TEST_ASSERT_EQUAL(0, r.buttons);
+	TEST_ASSERT_EQUAL(0, r.x);
+	TEST_ASSERT_FALSE(mm.take(r));
+	TEST_ASSERT_EQUAL(4, mm.packets());
+	TEST_ASSERT_EQUAL(3, mm.reports());
+}
+
+void
+test_sim_mouse_detects_wheel() {
+	sim::reset();
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	sim::Mouse mouse;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	a2u.begin_mouse(11, 12, 200);
+	run_until(a2u, 1000000);
+	TEST_ASSERT_TRUE(mouse.streaming());
+	TEST_ASSERT_EQUAL(3, mouse.id());
+	TEST_ASSERT_EQUAL(200, mouse.sample_rate());
+	auto st = a2u.mouse_stats();
+	TEST_ASSERT_TRUE(st.streaming);
+	TEST_ASSERT_TRUE(st.wheel);
+	TEST_ASSERT_EQUAL(0, st.restarts);
+}
+
+void
+test_sim_motion_does_not_delay_keys() {
+	sim::reset();
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	sim::Mouse mouse;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	a2u.begin_mouse(11, 12, 200);
+	run_until(a2u, 1000000);
+	sim::usb_reports().clear();
+	sim::heap_check_arm(true);
+
+	// 200回/秒の動きの間にキーを打つ
+	int sum_x = 0, sum_y = 0, sum_wheel = 0;
+	uint64_t t = 1000000;
+	for (int i = 0; i < 200; i++) {
+		t = std::max<uint64_t>(t + 5000, sim::now_us());
+		int wheel = i % 20 == 0 ? 1 : 0;
+		mouse.move(7, -3, wheel, t);
+		if (i % 10 == 5) {
+			kbd.press(0x1c, t + 1000);
+			kbd.release(0x1c, t + 3000);
+		}
+		run_until(a2u, t + 5000);
+	}
+	run_until(a2u, sim::now_us() + 20000);
+	// マウスの経路もヒープを使わない
+	TEST_ASSERT_TRUE(sim::heap_allocations() == 0);
+	sim::heap_check_arm(false);
+	for (auto& m : mouse_reports()) {
+		sum_x += m.x;
+		sum_y += m.y;
+		sum_wheel += m.wheel;
+	}
+	TEST_ASSERT_EQUAL(200 * 7, sum_x);
+	TEST_ASSERT_EQUAL(200 * -3, sum_y);
+	TEST_ASSERT_EQUAL(10, sum_wheel);
+	// キーボードレポートはマウスのレポートを1つ待つだけ(ポーリング2周期以内)
+	size_t keys = 0;
+	for (auto& r : sim::usb_reports()) {
+		if (r.report_id == AX2USB::REPORT_ID_MOUSE) {
+			continue;
+		}
+		keys++;
+		TEST_ASSERT_TRUE(r.sent_us - r.queued_us <= 4000);
+	}
+	TEST_ASSERT_EQUAL(40, keys);
+	auto st = a2u.mouse_stats();
+	TEST_ASSERT_EQUAL(200, st.packets);
+	TEST_ASSERT_TRUE(st.reports <= st.packets);
+}
+
+void
+test_sim_click_is_kept() {
+	sim::reset();
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	sim::Mouse mouse;
+	mouse.wheel = false;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	a2u.begin_mouse(11, 12);
+	run_until(a2u, 1000000);
+	TEST_ASSERT_FALSE(a2u.mouse_stats().wheel);
+	sim::usb_reports().clear();
+	mouse.press(MOUSE_BUTTON_LEFT, 1000000);
+	mouse.release(MOUSE_BUTTON_LEFT);
+	run_until(a2u, 1100000);
+	auto reports = mouse_reports();
+	TEST_ASSERT_EQUAL(2, reports.size());
+	TEST_ASSERT_EQUAL(MOUSE_BUTTON_LEFT, reports[0].buttons);
+	TEST_ASSERT_EQUAL(0, reports[1].buttons);
+}
+
+// 受信キューがあふれてパケットの途中で捨てても、次のパケットから区切りを合わせ直す
+void
+test_sim_rx_overflow_keeps_packet_framing() {
+	sim::reset();
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	sim::Mouse mouse;
+	mouse.wheel = false;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	a2u.begin_mouse(11, 12);
+	run_until(a2u, 1000000);
+	// メインループを止めている間に3バイトのパケットを11個(33バイト)受け取り、最後のパケットの3バイト目を捨てる
+	mouse.byte_us = 100;
+	uint64_t t = sim::now_us();
+	for (int i = 0; i < 11; i++) {
+		t = mouse.move(1, 1, 0, t);
+	}
+	sim::advance_us(t - sim::now_us());
+	sim::usb_reports().clear();
+	// パケットの期限が来る前に次のクリックが届く
+	mouse.press(MOUSE_BUTTON_LEFT, sim::now_us() + 1000);
+	run_until(a2u, mouse.release(MOUSE_BUTTON_LEFT) + 20000);
+	auto reports = mouse_reports();
+	TEST_ASSERT_TRUE(reports.size() >= 2);
+	TEST_ASSERT_EQUAL(0, reports.back().buttons);
+	TEST_ASSERT_EQUAL(MOUSE_BUTTON_LEFT, reports[reports.size() - 2].buttons);
+	int sum_x = 0, sum_y = 0;
+	for (auto& m : reports) {
+		sum_x += m.x;
+		sum_y += m.y;
+	}
+	TEST_ASSERT_EQUAL(10, sum_x);
+	TEST_ASSERT_EQUAL(10, sum_y);
+	TEST_ASSERT_EQUAL(1, a2u.mouse_stats().dropped);
+}
+
+void
+test_sim_absent_mouse_keeps_keyboard() {
+	sim::reset();
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	a2u.begin_mouse(11, 12);
+	kbd.press(0x1c, 500000);
+	kbd.release(0x1c);
+	run_until(a2u, 3000000);
+	auto st = a2u.mouse_stats();
+	TEST_ASSERT_FALSE(st.streaming);
+	TEST_ASSERT_TRUE(st.restarts > 0);
+	TEST_ASSERT_EQUAL(2, sim::usb_reports().size());
+	TEST_ASSERT_TRUE(sim::report_has_key(sim::usb_reports().front(), HID_KEY_A));
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_packet_decode);
+	RUN_TEST(test_packet_resync);
+	RUN_TEST(test_init_failure_retries);
+	RUN_TEST(test_motion_sum_and_clamp);
+	RUN_TEST(test_motion_keeps_clicks);
+	RUN_TEST(test_sim_mouse_detects_wheel);
+	RUN_TEST(test_sim_motion_does_not_delay_keys);
+	RUN_TEST(test_sim_click_is_kept);
+	RUN_TEST(test_sim_rx_overflow_keeps_packet_framing);
+	RUN_TEST(test_sim_absent_mouse_keeps_keyboard);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,216 @@
+#include <Adafruit_TinyUSB.h>
+#include <sim.h>
+#include <unity.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "log.hpp"
+#include "sim/log_decoder.hpp"
+#include "sim/replay.hpp"
+#include "sim/trace.hpp"
+
+using namespace ax2usb;
+
+namespace {
+
+// 再生して golden と比べるシナリオ(test/replay/NAME.scn と NAME.golden)
+constexpr const char* CORPUS[] = { "fn_media", "typing" };
+
+std::string
+corpus_path(const std::string& name) {
+	std::string dir = __FILE__;
+	return dir.substr(0, dir.rfind('/')) + "/../replay/" + name;
+}
+
+std::string
+read_text(const std::string& path) {
+	std::ifstream in(path);
+	std::stringstream ss;
+	ss << in.rdbuf();
+	return ss.str();
+}
+
+std::vector<std::string>
+read_lines(const std::string& path) {
+	std::ifstream in(path);
+	std::vector<std::string> lines;
+	for (std::string line; std::getline(in, line);) {
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+std::vector<trace::record_t>
+scenario(const std::string& text) {
+	std::vector<trace::record_t> records;
+	std::string error;
+	TEST_ASSERT_TRUE_MESSAGE(replay::parse_scenario(text, records, error), error.c_str());
+	return records;
+}
+
+}  // namespace
+
+void
+setUp(void) {
+	sim::reset();
+}
+
+void
+tearDown(void) {
+	sim::set_serial_sink(nullptr);
+	log::set_output(nullptr);
+}
+
+void
+test_trace_round_trip() {
+	std::vector<trace::record_t> records = {
+		{ 0, trace::kind_t::ps2, 0xaa },
+		{ 1000, trace::kind_t::ps2, 0xe0 },
+		{ 1000, trace::kind_t::led, 0x02 },
+		{ uint64_t{ 5 } << 32, trace::kind_t::ps2, 0x75 },
+	};
+	auto data = trace::encode(records);
+	// 1ms 間隔の記録は3バイト
+	TEST_ASSERT_EQUAL(sizeof(trace::MAGIC) + 2 + 3 + 2 + 7, data.size());
+	std::vector<trace::record_t> decoded;
+	TEST_ASSERT_TRUE(trace::decode(data.data(), data.size(), decoded));
+	TEST_ASSERT_EQUAL(records.size(), decoded.size());
+	for (size_t i = 0; i < records.size(); i++) {
+		TEST_ASSERT_TRUE(records[i].t_us == decoded[i].t_us);
+		TEST_ASSERT_TRUE(records[i].kind == decoded[i].kind);
+		TEST_ASSERT_EQUAL(records[i].value, decoded[i].value);
+	}
+	// 途中で切れたトレース
+	decoded.clear();
+	TEST_ASSERT_FALSE(trace::decode(data.data(), data.size() - 1, decoded));
+}
+
+void
+test_log_converter_unwraps_time() {
+	trace::LogConverter conv;
+	conv.add({ UINT32_MAX - 99, log::event_t::PS2_RECEIVED, 1, { 0xe0 } });
+	conv.add({ UINT32_MAX - 50, log::event_t::ECHO_SENT, 0, {} });
+	conv.add({ 900, log::event_t::PS2_RECEIVED, 1, { 0x75 } });
+	// 少し前の時刻の記録は同時刻にする
+	conv.add({ 800, log::event_t::USB_LED, 1, { 0x02 } });
+	auto& recs = conv.records();
+	TEST_ASSERT_EQUAL(3, recs.size());
+	TEST_ASSERT_TRUE(recs[1].t_us - recs[0].t_us == 1000);
+	TEST_ASSERT_TRUE(recs[2].t_us == recs[1].t_us);
+	TEST_ASSERT_TRUE(recs[2].kind == trace::kind_t::led);
+	TEST_ASSERT_EQUAL(0x02, recs[2].value);
+}
+
+void
+test_scenario_syntax() {
+	auto recs = scenario("Fn+Up hold 300ms  # Fn は E0 14\nwait 1s\nled caps num\nraw 00\n");
+	// E0 14, E0 75, E0 F0 75, E0 F0 14, LED, 00
+	TEST_ASSERT_EQUAL(12, recs.size());
+	TEST_ASSERT_EQUAL(0xe0, recs[0].value);
+	TEST_ASSERT_EQUAL(0x14, recs[1].value);
+	TEST_ASSERT_EQUAL(0x75, recs[6].value);
+	TEST_ASSERT_TRUE(recs[6].t_us - recs[0].t_us >= 300000);
+	TEST_ASSERT_TRUE(recs[10].kind == trace::kind_t::led);
+	TEST_ASSERT_EQUAL(0x03, recs[10].value);
+	TEST_ASSERT_TRUE(recs[10].t_us - recs[9].t_us >= 1000000);
+
+	std::vector<trace::record_t> bad;
+	std::string error;
+	TEST_ASSERT_FALSE(replay::parse_scenario("A\nFoo+B\n", bad, error));
+	TEST_ASSERT_EQUAL_STRING("line 2: unknown key in 'Foo+B'", error.c_str());
+	TEST_ASSERT_FALSE(replay::parse_scenario("wait 3 weeks\n", bad, error));
+}
+
+void
+test_corpus_matches_golden() {
+	for (auto name : CORPUS) {
+		auto result = replay::run(scenario(read_text(corpus_path(name) + ".scn")), true);
+		auto expected = read_lines(corpus_path(name) + ".golden");
+		TEST_ASSERT_FALSE_MESSAGE(expected.empty(), name);
+		auto d = replay::diff(expected, result.reports);
+		for (auto& line : d) {
+			TEST_MESSAGE(line.c_str());
+		}
+		TEST_ASSERT_TRUE_MESSAGE(d.empty(), name);
+		// キー入力の経路(受信割り込みからレポート送信まで)はヒープを使わない
+		TEST_ASSERT_TRUE_MESSAGE(result.allocations == 0, name);
+	}
+}
+
+void
+test_heap_check_counts_firmware_only() {
+	sim::heap_check_arm(true);
+	delete new int(1);
+	TEST_ASSERT_TRUE(sim::heap_allocations() == 1);
+	void* volatile p = malloc(16);  // 確保と解放の組を最適化で消されないように
+	free(p);
+	TEST_ASSERT_TRUE(sim::heap_allocations() == 2);
+	{
+		// sim 自身の確保は数えず、sim から呼ぶファームウェアのコールバックの中は数える
+		sim::SimScope in_sim;
+		std::vector<int> v(100);
+		TEST_ASSERT_TRUE(sim::heap_allocations() == 2);
+		sim::FirmwareScope callback;
+		delete new int(2);
+		TEST_ASSERT_TRUE(sim::heap_allocations() == 3);
+	}
+	sim::heap_check_arm(false);
+	delete new int(3);
+	TEST_ASSERT_TRUE(sim::heap_allocations() == 3);
+}
+
+void
+test_recorded_trace_replays_same() {
+	// ログの PS2_RECEIVED・USB_LED からトレースを取り出す(実機で記録するのと同じ経路)
+	trace::LogConverter conv;
+	log::Decoder decoder([](const std::string&) {}, [&conv](auto& rec) { conv.add(rec); });
+	log::set_output(&Serial1);
+	log::drain();
+	sim::set_serial_sink([&decoder](uint8_t b) { decoder.feed(b); });
+	auto recs = scenario(read_text(corpus_path("typing.scn")));
+	auto from_scenario = replay::run(recs, true);
+	sim::set_serial_sink(nullptr);
+	// キーボードの応答も記録されている
+	TEST_ASSERT_TRUE(conv.records().size() > recs.size());
+
+	auto data = trace::encode(conv.records());
+	std::vector<trace::record_t> decoded;
+	TEST_ASSERT_TRUE(trace::decode(data.data(), data.size(), decoded));
+	auto from_trace = replay::run(decoded, false);
+	TEST_ASSERT_TRUE(replay::diff(from_scenario.reports, from_trace.reports).empty());
+	// ログを出力していてもヒープを使わない
+	TEST_ASSERT_TRUE(from_scenario.allocations == 0);
+	TEST_ASSERT_TRUE(from_trace.allocations == 0);
+}
+
+void
+test_diff() {
+	std::vector<std::string> a = { "1", "2", "3", "4", "5", "6" };
+	std::vector<std::string> b = { "1", "2", "x", "4", "5", "6", "7" };
+	TEST_ASSERT_TRUE(replay::diff(a, a).empty());
+	std::string d;
+	for (auto& line : replay::diff(a, b)) {
+		d += line + "\n";
+	}
+	TEST_ASSERT_EQUAL_STRING("@@ -2 +2 @@\n 2\n-3\n+x\n 4\n@@ -6 +6 @@\n 6\n+7\n", d.c_str());
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_trace_round_trip);
+	RUN_TEST(test_log_converter_unwraps_time);
+	RUN_TEST(test_scenario_syntax);
+	RUN_TEST(test_corpus_matches_golden);
+	RUN_TEST(test_heap_check_counts_firmware_only);
+	RUN_TEST(test_recorded_trace_replays_same);
+	RUN_TEST(test_diff);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
@@ -0,0 +1,199 @@
+#include <Adafruit_TinyUSB.h>
+#include <sim.h>
+#include <unity.h>
+#include <random>
+#include <vector>
+#include "ax2usb.h"
+#include "ax2usbmap.hpp"
+
+// 受信キューがあふれたときの回復。pio test -e native_small_rx では受信キューを4バイトにして動かす
+
+using namespace ax2usb;
+
+void
+setUp(void) {
+	sim::reset();
+}
+
+void
+tearDown(void) {}
+
+namespace {
+
+constexpr uint8_t REPORT_ID_CONSUMER = 3;
+constexpr uint16_t CAPS = 0x58;
+constexpr uint16_t KEY_A = 0x1c;
+constexpr uint16_t UP = sim::Keyboard::E0 | 0x75;
+
+void
+run_until(AX2USB& a2u, uint64_t t_us) {
+	while (sim::now_us() < t_us) {
+		a2u.loop();
+		sim::advance_us(5);
+	}
+}
+
+sim::Report
+last_keyboard_report() {
+	for (auto it = sim::usb_reports().rbegin(); it != sim::usb_reports().rend(); ++it) {
+		if (it->report_id == AX2USB::REPORT_ID_NKRO || it->report_id == AX2USB::REPORT_ID_KBD) {
+			return *it;
+		}
+	}
+	return sim::Report{};
+}
+
+bool
+saw_key(uint8_t usb) {
+	for (auto& r : sim::usb_reports()) {
+		if (sim::report_has_key(r, usb)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<uint16_t>
+consumer_reports() {
+	std::vector<uint16_t> v;
+	for (auto& r : sim::usb_reports()) {
+		if (r.report_id == REPORT_ID_CONSUMER) {
+			v.push_back(r.data[0] | r.data[1] << 8);
+		}
+	}
+	return v;
+}
+
+}  // namespace
+
+// 受信キューがあふれるまでメインループを止めても、離したキーがホストに押されたまま残らず、
+// 押し続けているキーはキーボードが送り直した make で押し直す
+void
+test_rx_overflow_never_sticks_keys() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	// 1バイト100usで送る速いキーボード
+	kbd.byte_us = 100;
+	struct key_t {
+		uint16_t ps2;
+		uint8_t usb;
+		uint8_t mod;
+	};
+	const key_t keys[] = {
+		{ 0x1c, HID_KEY_A, 0 },
+		{ 0x32, HID_KEY_B, 0 },
+		{ 0x29, HID_KEY_SPACE, 0 },
+		{ sim::Keyboard::E0 | 0x75, HID_KEY_ARROW_UP, 0 },
+		{ sim::Keyboard::E0 | 0x70, HID_KEY_INSERT, 0 },
+		{ 0x12, 0, 0x02 },  // 左Shift
+		{ 0x14, 0, 0x01 },  // 左Ctrl(右Ctrl は AX の既定のキーマップでは Fn)
+	};
+	bool held[std::size(keys)] = {};
+	auto is_down = [](const sim::Report& r, const key_t& key) {
+		return key.usb ? sim::report_has_key(r, key.usb) : (sim::report_modifier(r) & key.mod) != 0;
+	};
+
+	std::mt19937 rng(1);
+	int overflowed = 0;
+	for (int round = 0; round < 300; round++) {
+		auto before = a2u.health();
+		// 続けていくつかのキーを押すか離す
+		uint64_t t = sim::now_us();
+		size_t last_pressed = std::size(keys);
+		for (uint32_t n = 1 + rng() % 12; n > 0; n--) {
+			size_t k = rng() % std::size(keys);
+			t = held[k] ? kbd.release(keys[k].ps2, t) : kbd.press(keys[k].ps2, t);
+			held[k] = !held[k];
+			last_pressed = held[k] ? k : last_pressed;
+		}
+		// すべてのバイトが届くまでメインループを止める(受信キューの深さを超えればあふれる)
+		sim::advance_us(t - sim::now_us());
+		run_until(a2u, t + 30000);
+		auto h = a2u.health();
+		if (h.rx_bytes - before.rx_bytes > AX2USB_RX_QUEUE_DEPTH) {
+			TEST_ASSERT_TRUE(h.rx_dropped > before.rx_dropped);
+			overflowed++;
+		}
+		auto r = last_keyboard_report();
+		for (size_t k = 0; k < std::size(keys); k++) {
+			if (!held[k]) {
+				TEST_ASSERT_FALSE(is_down(r, keys[k]));
+			}
+		}
+		// 最後に押したキーを押し続けていれば、キーボードはタイプマティックでその make を送り直す(実際は1秒後)
+		if (last_pressed < std::size(keys) && held[last_pressed]) {
+			run_until(a2u, kbd.press(keys[last_pressed].ps2, sim::now_us() + 100000) + 30000);
+			TEST_ASSERT_TRUE(is_down(last_keyboard_report(), keys[last_pressed]));
+		}
+	}
+	auto h = a2u.health();
+	TEST_ASSERT_TRUE(overflowed > 0);
+	TEST_ASSERT_TRUE(h.resync > 0);
+	TEST_ASSERT_EQUAL(AX2USB_RX_QUEUE_DEPTH, h.rx_high_watermark);
+
+	// 捨てている間が終われば、また取りこぼさずにキーを送る
+	for (size_t k = 0; k < std::size(keys); k++) {
+		if (held[k]) {
+			kbd.release(keys[k].ps2);
+		}
+	}
+	kbd.press(0x1c);
+	run_until(a2u, kbd.release(0x1c) + 30000);
+	uint32_t resyncs = a2u.ps2_errors().resync;
+	sim::usb_reports().clear();
+	kbd.press(0x32, sim::now_us());
+	run_until(a2u, kbd.release(0x32) + 30000);
+	TEST_ASSERT_TRUE(saw_key(HID_KEY_B));
+	TEST_ASSERT_EQUAL(0, sim::report_modifier(last_keyboard_report()));
+	TEST_ASSERT_FALSE(sim::report_has_key(last_keyboard_report(), HID_KEY_B));
+	TEST_ASSERT_EQUAL(resyncs, a2u.ps2_errors().resync);
+}
+
+// あふれる前から押し続けていた Fn は、キーボードが make を送り直したらタップ・ホールドを判定し直さずにホールドにする
+void
+test_fn_held_across_overflow_resumes_as_hold() {
+	AX2USB a2u;
+	sim::Keyboard kbd;
+	TEST_ASSERT_TRUE(a2u.begin(9, 10));
+	run_until(a2u, 1000000);
+	kbd.byte_us = 100;
+	uint64_t t = kbd.press(CAPS, sim::now_us());
+	run_until(a2u, t + TapHold::DEFAULT_TIMEOUT_US + 20000);
+	// Fn を押したまま A を何度も押して離す間、メインループを止める
+	t = sim::now_us();
+	for (int i = 0; i < 8; i++) {
+		t = kbd.release(KEY_A, kbd.press(KEY_A, t));
+	}
+	sim::advance_us(t - sim::now_us());
+	run_until(a2u, t + 30000);
+	TEST_ASSERT_TRUE(a2u.health().rx_dropped > 0);
+
+	// タイプマティックの Fn の make の直後に ↑ を押せば、↑ を離す前にボリューム+
+	sim::usb_reports().clear();
+	t = kbd.press(CAPS, sim::now_us() + 500000);
+	run_until(a2u, kbd.press(UP, t + 1000) + 5000);
+	auto v = consumer_reports();
+	TEST_ASSERT_EQUAL(1, v.size());
+	TEST_ASSERT_EQUAL(map::AUDIO_CONTROL_VOLUME_INCREMENT, v[0]);
+	// すぐに Fn を離してもタップ(Caps Lock)にならない
+	kbd.release(UP);
+	run_until(a2u, kbd.release(CAPS) + 20000);
+	TEST_ASSERT_FALSE(saw_key(HID_KEY_CAPS_LOCK));
+	TEST_ASSERT_EQUAL(0, consumer_reports().back());
+}
+
+void
+run_tests() {
+	UNITY_BEGIN();
+	RUN_TEST(test_rx_overflow_never_sticks_keys);
+	RUN_TEST(test_fn_held_across_overflow_resumes_as_hold);
+	UNITY_END();
+}
+
+int
+main(int argc, char** argv) {
+	run_tests();
+	return 0;
+}
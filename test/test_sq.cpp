@@ -2,7 +2,10 @@
 #include <Arduino.h>
 #endif
 #include <unity.h>
-#include "sq.hpp"
+#include "spscq.hpp"
+#ifndef ARDUINO
+#include <thread>
+#endif
 
 void
 setUp(void) {
@@ -15,43 +18,133 @@ tearDown(void) {
 }
 
 void
-test_basic() {
-	constexpr size_t size = 3;
-	ax2usb::SQ<uint8_t, size> q{};
+test_spscq_basic() {
+	constexpr size_t size = 4;
+	ax2usb::SPSCQ<uint8_t, size> q{};
 	uint8_t v;
 
 	// initial status
 	TEST_ASSERT_EQUAL(0, q.count());
 	TEST_ASSERT_EQUAL(size, q.capacity());
 	TEST_ASSERT_EQUAL(false, q.get(v));
+	TEST_ASSERT_EQUAL(false, q.peek(v));
 
-	// simple put, get
+	// simple put, peek, get
 	TEST_ASSERT_EQUAL(true, q.put(10));
+	TEST_ASSERT_EQUAL(true, q.peek(v));
+	TEST_ASSERT_EQUAL(10, v);
+	TEST_ASSERT_EQUAL(1, q.count());
 	TEST_ASSERT_EQUAL(true, q.get(v));
 	TEST_ASSERT_EQUAL(10, v);
-
-	// empty
 	TEST_ASSERT_EQUAL(false, q.get(v));
 
-	// full then emtpy
-	TEST_ASSERT_EQUAL(true, q.put(11));
-	TEST_ASSERT_EQUAL(1, q.count());
-	TEST_ASSERT_EQUAL(true, q.put(12));
-	TEST_ASSERT_EQUAL(true, q.put(13));
+	// full then empty, across the wrap point
+	for (uint8_t i = 11; i <= 14; i++) {
+		TEST_ASSERT_EQUAL(true, q.put(i));
+	}
 	TEST_ASSERT_EQUAL(false, q.put(99));
-	TEST_ASSERT_EQUAL(true, q.get(v));
-	TEST_ASSERT_EQUAL(11, v);
-	TEST_ASSERT_EQUAL(true, q.get(v));
-	TEST_ASSERT_EQUAL(12, v);
-	TEST_ASSERT_EQUAL(true, q.get(v));
-	TEST_ASSERT_EQUAL(13, v);
+	TEST_ASSERT_EQUAL(size, q.count());
+	for (uint8_t i = 11; i <= 14; i++) {
+		TEST_ASSERT_EQUAL(true, q.get(v));
+		TEST_ASSERT_EQUAL(i, v);
+	}
 	TEST_ASSERT_EQUAL(false, q.get(v));
 }
 
+void
+test_spscq_batch() {
+	ax2usb::SPSCQ<uint8_t, 8> q{};
+	uint8_t buf[8];
+
+	TEST_ASSERT_EQUAL(0, q.get(buf, sizeof(buf)));
+	for (uint8_t i = 0; i < 6; i++) {
+		q.put(i);
+	}
+	// peek does not consume
+	TEST_ASSERT_EQUAL(3, q.peek(buf, 3));
+	TEST_ASSERT_EQUAL(0, buf[0]);
+	TEST_ASSERT_EQUAL(2, buf[2]);
+	TEST_ASSERT_EQUAL(6, q.count());
+
+	TEST_ASSERT_EQUAL(4, q.get(buf, 4));
+	TEST_ASSERT_EQUAL(3, buf[3]);
+	// wrap around inside one batch
+	for (uint8_t i = 6; i < 12; i++) {
+		q.put(i);
+	}
+	TEST_ASSERT_EQUAL(8, q.get(buf, sizeof(buf)));
+	for (uint8_t i = 0; i < 8; i++) {
+		TEST_ASSERT_EQUAL(4 + i, buf[i]);
+	}
+	TEST_ASSERT_EQUAL(0, q.count());
+}
+
+void
+test_spscq_counters() {
+	ax2usb::SPSCQ<uint8_t, 4> q{};
+	uint8_t v;
+
+	TEST_ASSERT_EQUAL(0, q.overflow_count());
+	TEST_ASSERT_EQUAL(0, q.high_watermark());
+	q.put(1);
+	q.put(2);
+	q.put(3);
+	TEST_ASSERT_EQUAL(3, q.high_watermark());
+	q.get(v);
+	q.get(v);
+	TEST_ASSERT_EQUAL(3, q.high_watermark());
+	for (uint8_t i = 0; i < 5; i++) {
+		q.put(i);
+	}
+	TEST_ASSERT_EQUAL(4, q.high_watermark());
+	TEST_ASSERT_EQUAL(2, q.overflow_count());
+}
+
+#ifndef ARDUINO
+void
+test_spscq_stress() {
+	constexpr uint32_t total = 200000;
+	static ax2usb::SPSCQ<uint32_t, 16> q{};
+	uint32_t dropped = 0;
+
+	std::thread producer([&dropped]() {
+		for (uint32_t i = 0; i < total; i++) {
+			while (!q.put(i)) {
+				dropped++;
+				std::this_thread::yield();
+			}
+		}
+	});
+	uint32_t expected = 0;
+	bool in_order = true;
+	uint32_t buf[5];
+	while (expected < total) {
+		size_t n = q.get(buf, sizeof(buf) / sizeof(buf[0]));
+		if (n == 0) {
+			std::this_thread::yield();
+		}
+		for (size_t i = 0; i < n; i++) {
+			in_order &= buf[i] == expected++;
+		}
+	}
+	producer.join();
+
+	TEST_ASSERT_TRUE(in_order);
+	TEST_ASSERT_EQUAL(0, q.count());
+	TEST_ASSERT_EQUAL(dropped, q.overflow_count());
+	TEST_ASSERT_TRUE(q.high_watermark() <= q.capacity());
+}
+#endif
+
 void
 run_tests() {
 	UNITY_BEGIN();
-	RUN_TEST(test_basic);
+	RUN_TEST(test_spscq_basic);
+	RUN_TEST(test_spscq_batch);
+	RUN_TEST(test_spscq_counters);
+#ifndef ARDUINO
+	RUN_TEST(test_spscq_stress);
+#endif
 	UNITY_END();
 }
 
@@ -61,8 +154,7 @@ main(int argc, char** argv) {
 	run_tests();
 	return 0;
 }
-#endif
-
+#else
 void
 setup() {
 	Serial.begin(115200);
@@ -74,3 +166,4 @@ void
 loop() {
 	delay(100);
 }
+#endif
@@ -0,0 +1,161 @@
+// AX2USB の稼働状況をフィーチャーレポートで読み出す(Linux の hidraw)
+//   c++ -std=c++17 -O2 -I src tools/ax2usb_health.cpp -o ax2usb_health
+//   ./ax2usb_health                  # /dev/hidraw* から AX2USB を探してすべて読む
+//   ./ax2usb_health /dev/hidraw3     # 指定したデバイスを読む
+//   ./ax2usb_health --watch 10       # 10秒ごとに読み直す
+// 1行に1台、「デバイス 名前=値 ...」の形で出力する(集計スクリプトで読みやすいように)
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/hidraw.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "health.hpp"
+
+namespace {
+
+using ax2usb::health::health_report_t;
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "health_report_t is little endian");
+
+/**
+ * @brief 記述子にベンダー定義のページ(稼働状況のコレクション)があるか
+ */
+bool
+has_health_collection(int fd) {
+	int size = 0;
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0) {
+		return false;
+	}
+	hidraw_report_descriptor desc = {};
+	desc.size = size;
+	if (ioctl(fd, HIDIOCGRDESC, &desc) < 0) {
+		return false;
+	}
+	// Usage Page (2バイト)
+	const uint8_t page[] = { 0x06, ax2usb::health::USAGE_PAGE & 0xff, ax2usb::health::USAGE_PAGE >> 8 };
+	for (uint32_t i = 0; i + sizeof(page) <= desc.size; i++) {
+		if (memcmp(&desc.value[i], page, sizeof(page)) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<std::string>
+find_devices() {
+	std::vector<std::string> paths;
+	DIR* dir = opendir("/dev");
+	if (!dir) {
+		return paths;
+	}
+	while (dirent* e = readdir(dir)) {
+		if (strncmp(e->d_name, "hidraw", 6) != 0) {
+			continue;
+		}
+		std::string path = std::string("/dev/") + e->d_name;
+		int fd = open(path.c_str(), O_RDWR);
+		if (fd < 0) {
+			continue;
+		}
+		if (has_health_collection(fd)) {
+			paths.push_back(path);
+		}
+		close(fd);
+	}
+	closedir(dir);
+	return paths;
+}
+
+/**
+ * @return false 読めなかった(errno にエラー)
+ */
+bool
+read_health(const std::string& path, health_report_t& h) {
+	int fd = open(path.c_str(), O_RDWR);
+	if (fd < 0) {
+		return false;
+	}
+	// 先頭のレポートIDも返ってくる
+	uint8_t buf[1 + sizeof(health_report_t)] = { ax2usb::health::REPORT_ID };
+	int n = ioctl(fd, HIDIOCGFEATURE(sizeof(buf)), buf);
+	int err = errno;
+	close(fd);
+	if (n < 1 + 4) {
+		errno = n < 0 ? err : EPROTO;
+		return false;
+	}
+	// 古い版のファームウェアが返さなかったフィールドは 0 にしておく
+	h = {};
+	memcpy(&h, buf + 1, std::min<size_t>(n - 1, sizeof(h)));
+	return true;
+}
+
+void
+print_health(const std::string& path, const health_report_t& h) {
+	printf("%s version=%u uptime_s=%u scan_code_set=%u", path.c_str(), h.version, h.uptime_s, h.scan_code_set);
+	printf(" rx_bytes=%u rx_dropped=%u rx_high_watermark=%u", h.rx_bytes, h.rx_dropped, h.rx_high_watermark);
+	printf(" overrun=%u self_test=%u resend=%u unexpected=%u prefix_timeout=%u resync=%u", h.overrun, h.self_test, h.resend,
+	       h.unexpected, h.prefix_timeout, h.resync);
+	printf(" ack_timeout=%u led_timeout=%u", h.ack_timeout, h.led_timeout);
+	printf(" usb_reports=%u usb_dropped=%u usb_retries=%u tx_high_watermark=%u", h.usb_reports, h.usb_dropped, h.usb_retries,
+	       h.tx_high_watermark);
+	printf(" set3_unmapped=%u\n", h.set3_unmapped);
+}
+
+void
+usage(const char* prog) {
+	fprintf(stderr, "usage: %s [--watch SECONDS] [/dev/hidrawN ...]\n", prog);
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv) {
+	unsigned watch_s = 0;
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+			watch_s = strtoul(argv[++i], nullptr, 0);
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			return 2;
+		} else {
+			paths.push_back(argv[i]);
+		}
+	}
+	bool scan = paths.empty();
+	int rc = 0;
+	for (;;) {
+		if (scan) {
+			paths = find_devices();
+			if (paths.empty()) {
+				fprintf(stderr, "no AX2USB found (check the permissions of /dev/hidraw*)\n");
+				rc = 1;
+			}
+		}
+		for (const auto& path : paths) {
+			health_report_t h;
+			if (!read_health(path, h)) {
+				fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+				rc = 1;
+				continue;
+			}
+			if (h.version != ax2usb::health::VERSION) {
+				fprintf(stderr, "%s: report version %u (this tool knows %u)\n", path.c_str(), h.version, ax2usb::health::VERSION);
+			}
+			print_health(path, h);
+		}
+		if (!watch_s) {
+			return rc;
+		}
+		fflush(stdout);
+		sleep(watch_s);
+	}
+}